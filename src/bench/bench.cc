@@ -0,0 +1,232 @@
+#include "shared.hh"
+#include "eval.hh"
+#include "store-api.hh"
+#include "hash.hh"
+#include "compression.hh"
+#include "archive.hh"
+#include "references.hh"
+#include "json.hh"
+#include "util.hh"
+
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+
+using namespace nix;
+
+namespace {
+
+struct BenchResult
+{
+    std::string name;
+    uint64_t iterations;
+    double nsPerOp;
+    double mibPerSec; /* 0 if not a throughput benchmark */
+};
+
+std::vector<BenchResult> results;
+
+/* Run 'f' repeatedly, scaling the iteration count until a measurement
+   takes at least 0.2 s, and record ns per call (plus MiB/s if
+   'bytesPerOp' is non-zero). */
+template<typename F>
+void bench(const std::string & name, uint64_t bytesPerOp, F f)
+{
+    const double minTime = 0.2;
+
+    f(); /* warm up */
+
+    uint64_t iterations = 1;
+    double elapsed;
+
+    for (;;) {
+        auto start = std::chrono::steady_clock::now();
+        for (uint64_t i = 0; i < iterations; ++i) f();
+        elapsed = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+        if (elapsed >= minTime) break;
+        /* Aim a bit past the minimum, but grow at most 100x per
+           step so a bad first estimate doesn't overshoot wildly. */
+        auto factor = elapsed > 0 ? std::min(100.0, 1.2 * minTime / elapsed) : 100.0;
+        iterations = std::max(iterations + 1, (uint64_t) std::ceil(iterations * factor));
+    }
+
+    BenchResult res {
+        .name = name,
+        .iterations = iterations,
+        .nsPerOp = elapsed * 1e9 / iterations,
+        .mibPerSec = bytesPerOp
+            ? bytesPerOp * iterations / elapsed / (1024.0 * 1024.0)
+            : 0,
+    };
+    results.push_back(res);
+
+    if (res.mibPerSec)
+        std::cerr << fmt("%-32s %14.0f ns/op %10.1f MiB/s\n",
+            res.name, res.nsPerOp, res.mibPerSec);
+    else
+        std::cerr << fmt("%-32s %14.0f ns/op\n", res.name, res.nsPerOp);
+}
+
+/* Text-like data that compresses to roughly a third of its size,
+   which is about what NARs of source trees do. */
+std::string makeCompressibleData(size_t size)
+{
+    std::string s;
+    s.reserve(size + 64);
+    size_t n = 0;
+    while (s.size() < size)
+        s += fmt("line %d of a file that is mostly, but not entirely, the same\n", n++);
+    s.resize(size);
+    return s;
+}
+
+} // anonymous namespace
+
+int main(int argc, char * * argv)
+{
+    bool json = false;
+    for (int i = 1; i < argc; ++i)
+        if (std::string(argv[i]) == "--json") json = true;
+
+    initNix();
+    initGC();
+
+    /* Symbol interning. After the first pass every create() is a
+       hit, which is the common case during evaluation. */
+    {
+        SymbolTable symbols;
+        std::vector<std::string> names;
+        for (int i = 0; i < 1024; ++i)
+            names.push_back(fmt("attr%d", i));
+        for (auto & name : names)
+            symbols.create(name);
+        bench("symbol-table/create", 0, [&]() {
+            for (auto & name : names)
+                symbols.create(name);
+        });
+    }
+
+    auto store = openStore("dummy://");
+    EvalState state({}, store);
+
+    /* Attribute set lookup and construction. 128 attributes is big
+       enough to exercise the indexed lookup path. */
+    {
+        std::vector<Symbol> syms;
+        for (int i = 0; i < 128; ++i)
+            syms.push_back(state.symbols.create(fmt("attr%d", i)));
+
+        auto bindings = state.allocBindings(syms.size());
+        for (auto & sym : syms)
+            bindings->push_back(Attr(sym, nullptr));
+        bindings->sort();
+
+        bench("bindings/find", 0, [&]() {
+            for (auto & sym : syms)
+                if (bindings->find(sym) == bindings->end()) abort();
+        });
+
+        std::mt19937 rng(42);
+        bench("bindings/sort", 0, [&]() {
+            std::shuffle(syms.begin(), syms.end(), rng);
+            auto b = state.allocBindings(syms.size());
+            for (auto & sym : syms)
+                b->push_back(Attr(sym, nullptr));
+            b->sort();
+        });
+    }
+
+    auto data = makeCompressibleData(1 << 20);
+
+    /* Hashing throughput, both one-shot and streamed in the chunk
+       size the copy paths use. */
+    bench("hash/sha256", data.size(), [&]() {
+        hashString(htSHA256, data);
+    });
+
+    bench("hash-sink/sha256", data.size(), [&]() {
+        HashSink sink(htSHA256);
+        for (size_t i = 0; i < data.size(); i += 65536)
+            sink({data.data() + i, std::min<size_t>(65536, data.size() - i)});
+        sink.finish();
+    });
+
+    /* Compression codecs, as used for NARs and build logs. */
+    for (auto & method : {"none", "xz", "bzip2", "br"}) {
+        bench(fmt("compress/%s", method), data.size(), [&]() {
+            compress(method, data);
+        });
+        auto compressed = compress(method, data);
+        bench(fmt("decompress/%s", method), data.size(), [&]() {
+            decompress(method, *compressed);
+        });
+    }
+
+    /* A synthetic source tree: 4 directories of 16 files of 4 KiB,
+       a few of which contain references to synthetic store paths. */
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir, true);
+
+    StorePathSet refs;
+    std::vector<std::string> baseNames;
+    for (int i = 0; i < 16; ++i) {
+        auto baseName =
+            hashString(htSHA256, fmt("ref%d", i)).to_string(Base32, false).substr(0, 32)
+            + fmt("-ref%d", i);
+        refs.insert(StorePath(baseName));
+        baseNames.push_back(baseName);
+    }
+
+    auto filler = makeCompressibleData(4096);
+    for (int d = 0; d < 4; ++d) {
+        createDirs(tmpDir + fmt("/dir%d", d));
+        for (int f = 0; f < 16; ++f) {
+            auto contents = filler;
+            if (f == 0)
+                contents += std::string(StorePath(baseNames[d]).hashPart());
+            writeFile(tmpDir + fmt("/dir%d/file%d", d, f), contents);
+        }
+    }
+    createSymlink("dir0/file0", tmpDir + "/link");
+
+    StringSink narSink;
+    dumpPath(tmpDir, narSink);
+    auto nar = *narSink.s;
+
+    bench("nar/dump", nar.size(), [&]() {
+        NullSink sink;
+        dumpPath(tmpDir, sink);
+    });
+
+    bench("nar/parse", nar.size(), [&]() {
+        StringSource source(nar);
+        ParseSink sink;
+        parseDump(sink, source);
+    });
+
+    bench("store/scan-for-references", nar.size(), [&]() {
+        scanForReferences(tmpDir, refs);
+    });
+
+    bench("store-path/parse", 0, [&]() {
+        for (auto & baseName : baseNames)
+            StorePath parsed(baseName);
+    });
+
+    if (json) {
+        JSONList list(std::cout);
+        for (auto & res : results) {
+            auto obj = list.object();
+            obj.attr("name", res.name);
+            obj.attr("iterations", res.iterations);
+            obj.attr("ns_per_op", res.nsPerOp);
+            if (res.mibPerSec)
+                obj.attr("mib_per_sec", res.mibPerSec);
+        }
+        std::cout << "\n";
+    }
+
+    return 0;
+}
@@ -0,0 +1,32 @@
+# Module-system-style extensible fixpoints: a base attribute set
+# extended by a long stack of overlays, each reading from 'self' and
+# 'super' like nixpkgs overlays and module merges do.
+
+let
+
+  fix = f: let x = f x; in x;
+
+  extends = overlay: f: self:
+    let super = f self; in super // overlay self super;
+
+  base = self: {
+    a = 1;
+    b = self.a + 1;
+    c = self.b + 1;
+    layers = 0;
+  };
+
+  mkOverlay = n: self: super: {
+    "layer${toString n}" = self.c + n;
+    layers = super.layers + 1;
+  };
+
+  final = fix
+    (builtins.foldl'
+      (f: n: extends (mkOverlay (n + 1)) f)
+      base
+      (builtins.genList (n: n) 200));
+
+in
+
+  final.layers + final.layer200 + final.c
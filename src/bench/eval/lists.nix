@@ -0,0 +1,21 @@
+# Large list construction, transformation, sorting and folding.
+
+let
+
+  xs = builtins.genList (n: n * 7919) 100000;
+
+  ys = builtins.map (x: x + 1) xs;
+
+  evens = builtins.filter (x: builtins.bitAnd x 1 == 0) ys;
+
+  # A pseudo-random permutation, so the sort actually has to work.
+  shuffled = builtins.genList (n: builtins.bitAnd (n * 48271 + 11) 1048575) 20000;
+  sorted = builtins.sort (a: b: a < b) shuffled;
+
+  concatenated = builtins.concatLists (builtins.genList (n: [ n n n n ]) 20000);
+
+in
+
+  builtins.foldl' (a: b: a + b) 0 evens
+  + builtins.head sorted
+  + builtins.length concatenated
@@ -0,0 +1,38 @@
+# A synthetic stand-in for a nixpkgs slice: a fixpoint package set of
+# mkDerivation-style attribute sets with dependencies on earlier
+# packages. Forcing the fold evaluates every package's name and
+# dependency list, like `nix-env -qa` over a channel does.
+
+let
+
+  fix = f: let x = f x; in x;
+
+  count = 400;
+
+  mkPackage = self: n: {
+    pname = "package${toString n}";
+    version = "1.${toString n}.0";
+    name = "package${toString n}-1.${toString n}.0";
+    # Depend on strictly earlier packages, so the set is a DAG.
+    buildInputs =
+      if n == 0 then [ ]
+      else builtins.genList (i: self."package${toString (builtins.div n (i + 2))}") 6;
+    meta = {
+      description = "synthetic package number ${toString n}";
+      platforms = [ "x86_64-linux" "aarch64-linux" ];
+    };
+  };
+
+  pkgs = fix (self: builtins.listToAttrs
+    (builtins.genList
+      (n: { name = "package${toString n}"; value = mkPackage self n; })
+      count));
+
+in
+
+  builtins.foldl'
+    (acc: pname:
+      let p = pkgs.${pname};
+      in acc + builtins.stringLength p.name + builtins.length p.buildInputs)
+    0
+    (builtins.attrNames pkgs)
@@ -0,0 +1,19 @@
+# Deep chains of '//' updates over a wide base set, as produced by
+# module option merging. The result forces every attribute name, so
+# the whole chain has to be resolved.
+
+let
+
+  base = builtins.listToAttrs
+    (builtins.genList (n: { name = "attr${toString n}"; value = n; }) 512);
+
+  chain = builtins.foldl'
+    (acc: n: acc // { "extra${toString n}" = n; "attr${toString n}" = n * 2; })
+    base
+    (builtins.genList (n: n) 4000);
+
+in
+
+  builtins.length (builtins.attrNames chain)
+  + chain.attr0
+  + chain.extra3999
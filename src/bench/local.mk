@@ -0,0 +1,19 @@
+programs += nix-bench
+
+nix-bench_DIR := $(d)
+
+nix-bench_INSTALL_DIR :=
+
+nix-bench_SOURCES := $(wildcard $(d)/*.cc)
+
+nix-bench_CXXFLAGS += -I src/libutil -I src/libstore -I src/libfetchers -I src/libexpr -I src/libmain
+
+nix-bench_LIBS = libexpr libmain libfetchers libstore libutil
+
+nix-bench_LDFLAGS = -pthread $(SODIUM_LIBS) $(BOOST_LDFLAGS)
+
+# Run the microbenchmarks and leave a JSON report for trend tracking.
+bench: $(buildprefix)$(d)/nix-bench
+	$< --json > $(buildprefix)bench-results.json
+
+.PHONY: bench
@@ -1,10 +1,14 @@
+#include <chrono>
 #include <cstdlib>
+#include <limits>
 #include <cstring>
 #include <algorithm>
 #include <set>
 #include <memory>
 #include <tuple>
 #include <iomanip>
+
+#include <nlohmann/json.hpp>
 #if __APPLE__
 #include <sys/time.h>
 #endif
@@ -39,6 +43,79 @@ static AutoCloseFD openSlotLock(const Machine & m, uint64_t slot)
     return openLockFile(fmt("%s/%s-%d", currentLoad, escapeUri(m.storeUri), slot), true);
 }
 
+/* Per-machine connection state, persisted across build-remote
+   invocations so that a machine that was recently found to be
+   unreachable is not re-probed by every build, and so that the
+   observed connection latency survives as a dispatch tie-breaker. */
+struct MachineStatus
+{
+    time_t lastFailure = 0;
+    unsigned int consecutiveFailures = 0;
+    uint64_t lastConnectMillis = 0;
+};
+
+typedef std::map<std::string, MachineStatus> MachineStatuses;
+
+static Path machineStatusFile()
+{
+    return currentLoad + "/machine-status.json";
+}
+
+static MachineStatuses readMachineStatuses()
+{
+    MachineStatuses res;
+    try {
+        auto json = nlohmann::json::parse(readFile(machineStatusFile()));
+        for (auto & [uri, j] : json.items()) {
+            MachineStatus st;
+            st.lastFailure = j.value("lastFailure", 0);
+            st.consecutiveFailures = j.value("consecutiveFailures", 0);
+            st.lastConnectMillis = j.value("lastConnectMillis", 0);
+            res.emplace(uri, st);
+        }
+    } catch (SysError & e) {
+        if (e.errNo != ENOENT) throw;
+    } catch (std::exception & e) {
+        /* A corrupt status file is not fatal; it only contains
+           hints. */
+        debug("cannot read '%s': %s", machineStatusFile(), e.what());
+    }
+    return res;
+}
+
+static void updateMachineStatus(const std::string & storeUri,
+    std::function<void(MachineStatus &)> update)
+{
+    AutoCloseFD lock = openLockFile(currentLoad + "/machine-status.lock", true);
+    lockFile(lock.get(), ltWrite, true);
+
+    auto statuses = readMachineStatuses();
+    update(statuses[storeUri]);
+
+    auto json = nlohmann::json::object();
+    for (auto & [uri, st] : statuses)
+        json[uri] = {
+            {"lastFailure", st.lastFailure},
+            {"consecutiveFailures", st.consecutiveFailures},
+            {"lastConnectMillis", st.lastConnectMillis},
+        };
+
+    Path tmp = machineStatusFile() + ".tmp";
+    writeFile(tmp, json.dump());
+    if (rename(tmp.c_str(), machineStatusFile().c_str()) == -1)
+        throw SysError("renaming '%s' to '%s'", tmp, machineStatusFile());
+}
+
+/* Whether a machine is still in its backoff period after failed
+   connection attempts. */
+static bool backingOff(const MachineStatus & st)
+{
+    unsigned int backoff = settings.remoteMachineBackoff;
+    if (!st.consecutiveFailures || !backoff) return false;
+    uint64_t delay = (uint64_t) backoff << std::min(st.consecutiveFailures - 1, 6U);
+    return (uint64_t) time(0) < st.lastFailure + delay;
+}
+
 static bool allSupportedLocally(Store & store, const std::set<std::string>& requiredFeatures) {
     for (auto & feature : requiredFeatures)
         if (!store.systemFeatures.get().count(feature)) return false;
@@ -88,6 +165,10 @@ static int main_build_remote(int argc, char * * argv)
         std::shared_ptr<Store> sshStore;
         AutoCloseFD bestSlotLock;
 
+        /* Store connections to the build machines, kept open across
+           rounds so that load probes are cheap. */
+        std::map<std::string, std::shared_ptr<Store>> machineStores;
+
         auto machines = getMachines();
         debug("got %d remote builders", machines.size());
 
@@ -119,8 +200,67 @@ static int main_build_remote(int argc, char * * argv)
             /* Error ignored here, will be caught later */
             mkdir(currentLoad.c_str(), 0777);
 
+            auto isCandidate = [&](const Machine & m) {
+                return m.enabled
+                    && (neededSystem == "builtin"
+                        || std::find(m.systemTypes.begin(),
+                            m.systemTypes.end(),
+                            neededSystem) != m.systemTypes.end())
+                    && m.allSupported(requiredFeatures)
+                    && m.mandatoryMet(requiredFeatures);
+            };
+
             while (true) {
                 bestSlotLock = -1;
+
+                auto statuses = readMachineStatuses();
+
+                auto backedOff = [&](const Machine & m) {
+                    auto i = statuses.find(m.storeUri);
+                    if (i == statuses.end() || !backingOff(i->second)) return false;
+                    debug("skipping '%s': %d consecutive connection failures, last at %d",
+                        m.storeUri, i->second.consecutiveFailures, i->second.lastFailure);
+                    return true;
+                };
+
+                /* Last observed connection latency, used as a final
+                   dispatch tie-breaker. */
+                auto lastLatency = [&](const Machine & m) -> uint64_t {
+                    auto i = statuses.find(m.storeUri);
+                    return i != statuses.end() && i->second.lastConnectMillis
+                        ? i->second.lastConnectMillis
+                        : std::numeric_limits<uint64_t>::max();
+                };
+
+                /* Probe the live load of the candidate machines
+                   before taking the dispatch lock, so that slow
+                   connections don't stall other clients. */
+                std::map<std::string, std::pair<uint64_t, uint64_t>> liveLoads;
+                for (auto & m : machines) {
+                    if (!isCandidate(m) || backedOff(m)) continue;
+                    try {
+                        auto & machineStore = machineStores[m.storeUri];
+                        if (!machineStore)
+                            machineStore = m.openStore().get_ptr();
+                        if (auto load = machineStore->queryBuildLoad())
+                            liveLoads.insert_or_assign(m.storeUri, *load);
+                    } catch (std::exception & e) {
+                        /* Not fatal: selection falls back to the
+                           static configuration, and the connection
+                           attempt below decides whether to disable
+                           the machine. Record the failure so that
+                           subsequent rounds and invocations don't
+                           re-probe the machine during the backoff
+                           period. */
+                        debug("cannot query load of '%s': %s", m.storeUri, e.what());
+                        machineStores.erase(m.storeUri);
+                        updateMachineStatus(m.storeUri, [](MachineStatus & st) {
+                            st.lastFailure = time(0);
+                            st.consecutiveFailures++;
+                        });
+                    }
+                }
+
                 AutoCloseFD lock = openLockFile(currentLoad + "/main-lock", true);
                 lockFile(lock.get(), ltWrite, true);
 
@@ -128,18 +268,14 @@ static int main_build_remote(int argc, char * * argv)
 
                 Machine * bestMachine = nullptr;
                 uint64_t bestLoad = 0;
+                double bestScore = 0;
                 for (auto & m : machines) {
                     debug("considering building on remote machine '%s'", m.storeUri);
 
-                    if (m.enabled
-                        && (neededSystem == "builtin"
-                            || std::find(m.systemTypes.begin(),
-                                m.systemTypes.end(),
-                                neededSystem) != m.systemTypes.end()) &&
-                        m.allSupported(requiredFeatures) &&
-                        m.mandatoryMet(requiredFeatures))
+                    if (isCandidate(m))
                     {
                         rightType = true;
+                        if (backedOff(m)) continue;
                         AutoCloseFD free;
                         uint64_t load = 0;
                         for (uint64_t slot = 0; slot < m.maxJobs; ++slot) {
@@ -155,22 +291,45 @@ static int main_build_remote(int argc, char * * argv)
                         if (!free) {
                             continue;
                         }
+
+                        /* Blend our own dispatch count with the
+                           machine's self-reported load average,
+                           taking whichever is higher: other clients
+                           may be loading the machine too. */
+                        double effectiveLoad = load;
+                        if (auto i = liveLoads.find(m.storeUri); i != liveLoads.end()) {
+                            auto & [remoteMaxJobs, load100] = i->second;
+                            double remoteLoad = load100 / 100.0;
+                            /* Scale to our slot accounting if the
+                               remote's capacity differs from the
+                               configured maxJobs. */
+                            if (remoteMaxJobs > 0 && remoteMaxJobs != m.maxJobs)
+                                remoteLoad = remoteLoad * m.maxJobs / remoteMaxJobs;
+                            effectiveLoad = std::max(effectiveLoad, remoteLoad);
+                        }
+
+                        double score = effectiveLoad / m.speedFactor;
+
                         bool best = false;
                         if (!bestSlotLock) {
                             best = true;
-                        } else if (load / m.speedFactor < bestLoad / bestMachine->speedFactor) {
+                        } else if (score < bestScore) {
                             best = true;
-                        } else if (load / m.speedFactor == bestLoad / bestMachine->speedFactor) {
+                        } else if (score == bestScore) {
                             if (m.speedFactor > bestMachine->speedFactor) {
                                 best = true;
                             } else if (m.speedFactor == bestMachine->speedFactor) {
                                 if (load < bestLoad) {
                                     best = true;
+                                } else if (load == bestLoad
+                                    && lastLatency(m) < lastLatency(*bestMachine)) {
+                                    best = true;
                                 }
                             }
                         }
                         if (best) {
                             bestLoad = load;
+                            bestScore = score;
                             bestSlotLock = std::move(free);
                             bestMachine = &m;
                         }
@@ -232,7 +391,20 @@ static int main_build_remote(int argc, char * * argv)
 
                     Activity act(*logger, lvlTalkative, actUnknown, fmt("connecting to '%s'", bestMachine->storeUri));
 
-                    sshStore = bestMachine->openStore();
+                    auto & machineStore = machineStores[bestMachine->storeUri];
+                    if (!machineStore) {
+                        auto before = std::chrono::steady_clock::now();
+                        machineStore = bestMachine->openStore().get_ptr();
+                        machineStore->connect();
+                        auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            std::chrono::steady_clock::now() - before).count();
+                        updateMachineStatus(bestMachine->storeUri, [&](MachineStatus & st) {
+                            st.lastFailure = 0;
+                            st.consecutiveFailures = 0;
+                            st.lastConnectMillis = millis;
+                        });
+                    }
+                    sshStore = machineStore;
                     sshStore->connect();
                     storeUri = bestMachine->storeUri;
 
@@ -241,7 +413,12 @@ static int main_build_remote(int argc, char * * argv)
                     printError("cannot build on '%s': %s%s",
                         bestMachine->storeUri, e.what(),
                         msg.empty() ? "" : ": " + msg);
+                    machineStores.erase(bestMachine->storeUri);
                     bestMachine->enabled = false;
+                    updateMachineStatus(bestMachine->storeUri, [](MachineStatus & st) {
+                        st.lastFailure = time(0);
+                        st.consecutiveFailures++;
+                    });
                     continue;
                 }
 
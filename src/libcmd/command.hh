@@ -304,10 +304,31 @@ void completeFlakeRefWithFragment(
 
 std::string showVersions(const std::set<std::string> & versions);
 
+struct PackageInfo
+{
+    std::string outputName;
+};
+
+/* An index over a closure: package name -> version -> store paths. */
+typedef std::map<std::string, std::map<std::string, std::map<StorePath, PackageInfo>>> GroupedPaths;
+
+/* Compute the closure of 'toplevel' and group it by package name and
+   version. */
+GroupedPaths getClosureInfo(ref<Store> store, const StorePath & toplevel);
+
 void printClosureDiff(
     ref<Store> store,
     const StorePath & beforePath,
     const StorePath & afterPath,
     std::string_view indent);
 
+/* Like the above, but operating on precomputed closure indices, so
+   that callers diffing a chain of closures (such as successive profile
+   generations) can index each closure once and join the indices. */
+void printClosureDiff(
+    ref<Store> store,
+    const GroupedPaths & beforeClosure,
+    const GroupedPaths & afterClosure,
+    std::string_view indent);
+
 }
@@ -221,6 +221,40 @@ void SourceExprCommand::completeInstallable(std::string_view prefix)
     }
 }
 
+static Path completionIndexPath(const flake::LockedFlake & lockedFlake)
+{
+    return getCacheDir() + "/nix/flake-completion-v1/"
+        + lockedFlake.getFingerprint().to_string(Base32, false);
+}
+
+/* Enumerate the attribute paths of a flake's outputs into a flat
+   list, for the completion index. Recursion stops at derivations and
+   at the depth of 'packages.<system>.<name>', so e.g. legacyPackages
+   is enumerated one package deep but no further. */
+static void buildCompletionIndex(
+    std::vector<std::string> & index,
+    eval_cache::AttrCursor & cursor,
+    const std::string & attrPathPrefix,
+    unsigned int depth)
+{
+    for (auto & attrName : cursor.getAttrs()) {
+        auto attrPath = attrPathPrefix.empty()
+            ? std::string(attrName)
+            : attrPathPrefix + "." + std::string(attrName);
+        index.push_back(attrPath);
+        if (depth < 2) {
+            try {
+                auto attr = cursor.maybeGetAttr(attrName);
+                if (attr && !attr->isDerivation())
+                    buildCompletionIndex(index, *attr, attrPath, depth + 1);
+            } catch (EvalError &) {
+                /* Outputs that fail to evaluate (e.g. for another
+                   system) are still completed one level up. */
+            }
+        }
+    }
+}
+
 void completeFlakeRefWithFragment(
     ref<EvalState> evalState,
     flake::LockFlags lockFlags,
@@ -238,8 +272,67 @@ void completeFlakeRefWithFragment(
             // FIXME: do tilde expansion.
             auto flakeRef = parseFlakeRef(flakeRefS, absPath("."));
 
-            auto evalCache = openEvalCache(*evalState,
-                std::make_shared<flake::LockedFlake>(lockFlake(*evalState, flakeRef, lockFlags)));
+            auto lockedFlake = std::make_shared<flake::LockedFlake>(
+                lockFlake(*evalState, flakeRef, lockFlags));
+
+            /* Completion is latency-critical, so once we've seen a
+               flake we persist the names of its output attributes,
+               keyed by the flake fingerprint, and answer later
+               completions from that index without evaluating
+               anything. */
+            std::optional<std::vector<std::string>> index;
+
+            if (evalSettings.useEvalCache && evalSettings.pureEval) {
+                auto indexPath = completionIndexPath(*lockedFlake);
+                if (pathExists(indexPath))
+                    index = tokenizeString<std::vector<std::string>>(readFile(indexPath), "\n");
+                else {
+                    auto evalCache = openEvalCache(*evalState, lockedFlake);
+                    index = std::vector<std::string>();
+                    buildCompletionIndex(*index, *evalCache->getRoot(), "", 0);
+                    std::sort(index->begin(), index->end());
+                    index->erase(std::unique(index->begin(), index->end()), index->end());
+                    createDirs(dirOf(indexPath));
+                    writeFile(indexPath, concatStringsSep("\n", *index) + "\n");
+                }
+            }
+
+            if (index) {
+                /* Complete 'fragment' relative to all the attrpath
+                   prefixes as well as the root of the flake. */
+                attrPathPrefixes.push_back("");
+
+                for (auto & attrPathPrefixS : attrPathPrefixes) {
+                    auto attrPathS = attrPathPrefixS + std::string(fragment);
+                    for (auto i = std::lower_bound(index->begin(), index->end(), attrPathS);
+                         i != index->end() && hasPrefix(*i, attrPathS);
+                         ++i)
+                    {
+                        /* Like the evaluating path below, complete
+                           only one attribute beyond what was
+                           typed. */
+                        if (std::string_view(*i).substr(attrPathS.size()).find('.') != std::string_view::npos)
+                            continue;
+                        completions->add(flakeRefS + "#" + i->substr(attrPathPrefixS.size()));
+                    }
+                }
+
+                /* And add an empty completion for the default
+                   attrpaths. */
+                if (fragment.empty()) {
+                    for (auto & attrPath : defaultFlakeAttrPaths) {
+                        if (std::binary_search(index->begin(), index->end(), attrPath)) {
+                            completions->add(flakeRefS + "#");
+                            break;
+                        }
+                    }
+                }
+
+                completeFlakeRef(evalState->store, prefix);
+                return;
+            }
+
+            auto evalCache = openEvalCache(*evalState, lockedFlake);
 
             auto root = evalCache->getRoot();
 
@@ -470,7 +563,19 @@ ref<eval_cache::EvalCache> openEvalCache(
     std::shared_ptr<flake::LockedFlake> lockedFlake)
 {
     auto fingerprint = lockedFlake->getFingerprint();
-    return make_ref<nix::eval_cache::EvalCache>(
+
+    /* All installables of one command that refer to the same locked
+       flake share a single cache, so that e.g. `nix build .#a .#b`
+       evaluates the flake's outputs (and resolves prefixes like
+       'packages.<system>') once instead of once per installable. */
+    static std::map<std::pair<std::string, EvalState *>, std::shared_ptr<eval_cache::EvalCache>> evalCaches;
+
+    auto key = std::make_pair(fingerprint.to_string(Base32, true), &state);
+    auto i = evalCaches.find(key);
+    if (i != evalCaches.end())
+        return ref<eval_cache::EvalCache>(i->second);
+
+    auto cache = make_ref<nix::eval_cache::EvalCache>(
         evalSettings.useEvalCache && evalSettings.pureEval
             ? std::optional { std::cref(fingerprint) }
             : std::nullopt,
@@ -492,6 +597,10 @@ ref<eval_cache::EvalCache> openEvalCache(
 
             return aOutputs->value;
         });
+
+    evalCaches.emplace(key, cache.get_ptr());
+
+    return cache;
 }
 
 static std::string showAttrPaths(const std::vector<std::string> & paths)
@@ -585,8 +694,7 @@ std::pair<Value *, Pos> InstallableFlake::toValue(EvalState & state)
 std::vector<std::pair<std::shared_ptr<eval_cache::AttrCursor>, std::string>>
 InstallableFlake::getCursors(EvalState & state)
 {
-    auto evalCache = openEvalCache(state,
-        std::make_shared<flake::LockedFlake>(lockFlake(state, flakeRef, lockFlags)));
+    auto evalCache = openEvalCache(state, getLockedFlake());
 
     auto root = evalCache->getRoot();
 
@@ -602,10 +710,21 @@ InstallableFlake::getCursors(EvalState & state)
 
 std::shared_ptr<flake::LockedFlake> InstallableFlake::getLockedFlake() const
 {
-    flake::LockFlags lockFlagsApplyConfig = lockFlags;
-    lockFlagsApplyConfig.applyNixConfig = true;
     if (!_lockedFlake) {
-        _lockedFlake = std::make_shared<flake::LockedFlake>(lockFlake(*state, flakeRef, lockFlagsApplyConfig));
+        /* Shared across the installables of one command, so that
+           e.g. `nix build .#a .#b .#c` locks the flake once. */
+        static std::map<std::string, std::shared_ptr<flake::LockedFlake>> lockedFlakes;
+
+        auto key = flakeRef.to_string();
+        auto i = lockedFlakes.find(key);
+        if (i != lockedFlakes.end())
+            _lockedFlake = i->second;
+        else {
+            flake::LockFlags lockFlagsApplyConfig = lockFlags;
+            lockFlagsApplyConfig.applyNixConfig = true;
+            _lockedFlake = std::make_shared<flake::LockedFlake>(lockFlake(*state, flakeRef, lockFlagsApplyConfig));
+            lockedFlakes.emplace(key, _lockedFlake);
+        }
     }
     return _lockedFlake;
 }
@@ -14,10 +14,24 @@ Bindings * EvalState::allocBindings(size_t capacity)
 {
     if (capacity > std::numeric_limits<Bindings::size_t>::max())
         throw Error("attribute set of size %d is too big", capacity);
+    addAllocation(sizeof(Bindings) + sizeof(Attr) * capacity);
     return new (allocBytes(sizeof(Bindings) + sizeof(Attr) * capacity)) Bindings((Bindings::size_t) capacity);
 }
 
 
+/* Allocate an overlay over an existing attribute set: only the (at
+   most 'deltaCapacity') attributes added on top are stored, and
+   lookups for anything else fall through to 'base'. The merged flat
+   form is only built if the result is iterated (see
+   Bindings::materialise()). */
+Bindings * EvalState::allocLayeredBindings(size_t deltaCapacity, Bindings * base)
+{
+    addAllocation(sizeof(Bindings) + sizeof(Attr) * deltaCapacity);
+    return new (allocBytes(sizeof(Bindings) + sizeof(Attr) * deltaCapacity))
+        Bindings((Bindings::size_t) deltaCapacity, base);
+}
+
+
 void EvalState::mkAttrs(Value & v, size_t capacity)
 {
     if (capacity == 0) {
@@ -47,9 +61,89 @@ Value * EvalState::allocAttr(Value & vAttrs, const std::string & name)
 }
 
 
+void Bindings::finishLayer()
+{
+    /* The union size is exact, so that size() doesn't have to
+       materialise: count the delta attributes that merely shadow an
+       attribute of the base. */
+    size_t shadowed = 0;
+    for (size_t n = 0; n < capacity_; ++n)
+        if (base_->get(attrs[n].name)) shadowed++;
+    size_ = base_->size() + capacity_ - shadowed;
+}
+
+
+/* Build the flat merged form of an overlay. Called lazily on the
+   first iteration; by-name lookups never need it. As with
+   buildIndex(), racing threads may each build a copy and all but one
+   are reclaimed by the GC. */
+Bindings * Bindings::materialise()
+{
+    auto flat = flat_.load(std::memory_order_acquire);
+    if (flat) return flat;
+
+    flat = new (allocBytes(sizeof(Bindings) + sizeof(Attr) * size_)) Bindings(size_);
+    flat->pos = pos;
+
+    /* Merge, preferring the delta; begin() materialises a layered
+       base recursively. */
+    Attr * i = base_->begin(), * iEnd = base_->end();
+    Attr * j = attrs, * jEnd = attrs + capacity_;
+
+    while (i != iEnd && j != jEnd) {
+        if (i->name == j->name) {
+            flat->push_back(*j);
+            ++i; ++j;
+        }
+        else if (i->name < j->name)
+            flat->push_back(*i++);
+        else
+            flat->push_back(*j++);
+    }
+
+    while (i != iEnd) flat->push_back(*i++);
+    while (j != jEnd) flat->push_back(*j++);
+
+    assert(flat->size() == size_);
+
+    flat_.store(flat, std::memory_order_release);
+    return flat;
+}
+
+
 void Bindings::sort()
 {
     std::sort(begin(), end());
+    /* Positions have changed, so any index built earlier is stale.
+       The (GC-managed) table is simply dropped. */
+    index_.store(nullptr, std::memory_order_release);
+}
+
+
+/* Build the hash index for a large attribute set. Called lazily on
+   the first lookup, since many attribute sets are constructed but
+   never queried by name. If several threads race here (parallel deep
+   forcing), each builds a table and one of them wins; the others are
+   reclaimed by the GC. */
+void Bindings::buildIndex()
+{
+    uint32_t tableSize = 1;
+    while (tableSize < size_ * 2) tableSize <<= 1;
+    uint32_t mask = tableSize - 1;
+
+    /* allocBytes() returns zeroed memory, so all slots start out
+       empty. */
+    auto table = (uint32_t *) allocBytes((1 + tableSize) * sizeof(uint32_t));
+    table[0] = mask;
+    uint32_t * slots = table + 1;
+
+    for (size_t n = 0; n < size_; ++n) {
+        uint32_t h = hashSymbol(attrs[n].name) & mask;
+        while (slots[h]) h = (h + 1) & mask;
+        slots[h] = n + 1;
+    }
+
+    index_.store(table, std::memory_order_release);
 }
 
 
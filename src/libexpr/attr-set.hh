@@ -4,6 +4,8 @@
 #include "symbol-table.hh"
 
 #include <algorithm>
+#include <atomic>
+#include <functional>
 #include <optional>
 
 namespace nix {
@@ -39,11 +41,51 @@ public:
 
 private:
     size_t size_, capacity_;
+
+    /* For attribute sets with at least indexThreshold attributes, a
+       lazily built open-addressing hash table mapping symbols to
+       positions in 'attrs', so that lookups are O(1) instead of a
+       binary search over a cache-cold array. index_[0] holds the
+       table mask; the slots follow, each containing position + 1
+       (0 denotes an empty slot). */
+    std::atomic<uint32_t *> index_{nullptr};
+
+    /* For an overlay (the result of a small '//' update on a big
+       set), the set being updated: 'attrs' then holds only the
+       attributes added on top, and lookups for anything else fall
+       through to 'base_'. 'flat_' caches the merged flat form, built
+       lazily by materialise() when the overlay is iterated. */
+    Bindings * base_ = nullptr;
+    std::atomic<Bindings *> flat_{nullptr};
+
     Attr attrs[0];
 
     Bindings(size_t capacity) : pos(&noPos), size_(0), capacity_(capacity) { }
+    Bindings(size_t capacity, Bindings * base)
+        : pos(&noPos), size_(0), capacity_(capacity), base_(base) { }
     Bindings(const Bindings & bindings) = delete;
 
+    static constexpr size_t indexThreshold = 32;
+
+    static uint32_t hashSymbol(const Symbol & name)
+    {
+        return std::hash<const string *>()(&(const string &) name);
+    }
+
+    void buildIndex();
+
+    Attr * lookupIndexed(uint32_t * table, const Symbol & name)
+    {
+        uint32_t mask = table[0];
+        uint32_t * slots = table + 1;
+        for (uint32_t h = hashSymbol(name) & mask; ; h = (h + 1) & mask) {
+            uint32_t slot = slots[h];
+            if (!slot) return nullptr;
+            Attr & attr = attrs[slot - 1];
+            if (attr.name == name) return &attr;
+        }
+    }
+
 public:
     size_t size() const { return size_; }
 
@@ -59,14 +101,28 @@ public:
 
     iterator find(const Symbol & name)
     {
-        Attr key(name, 0);
-        iterator i = std::lower_bound(begin(), end(), key);
-        if (i != end() && i->name == name) return i;
-        return end();
+        auto a = get(name);
+        return a ? a : end();
     }
 
     Attr * get(const Symbol & name)
     {
+        if (base_) {
+            auto flat = flat_.load(std::memory_order_acquire);
+            if (flat) return flat->get(name);
+            Attr key(name, 0);
+            auto i = std::lower_bound(attrs, attrs + capacity_, key);
+            if (i != attrs + capacity_ && i->name == name) return &*i;
+            return base_->get(name);
+        }
+        if (size_ >= indexThreshold) {
+            auto table = index_.load(std::memory_order_acquire);
+            if (!table) {
+                buildIndex();
+                table = index_.load(std::memory_order_acquire);
+            }
+            return lookupIndexed(table, name);
+        }
         Attr key(name, 0);
         iterator i = std::lower_bound(begin(), end(), key);
         if (i != end() && i->name == name) return &*i;
@@ -85,25 +141,39 @@ public:
         return *a;
     }
 
-    iterator begin() { return &attrs[0]; }
-    iterator end() { return &attrs[size_]; }
+    iterator begin() { auto b = flatten(); return &b->attrs[0]; }
+    iterator end() { auto b = flatten(); return &b->attrs[b->size_]; }
 
     Attr & operator[](size_t pos)
     {
-        return attrs[pos];
+        return flatten()->attrs[pos];
     }
 
     void sort();
 
     size_t capacity() { return capacity_; }
 
+    /* If this is an overlay, return (building it if necessary) the
+       merged flat form; otherwise return this. */
+    Bindings * flatten()
+    {
+        return base_ ? materialise() : this;
+    }
+
+    Bindings * materialise();
+
+    /* Called after the delta attributes of an overlay have been
+       pushed: computes the size of the merged set. */
+    void finishLayer();
+
     /* Returns the attributes in lexicographically sorted order. */
-    std::vector<const Attr *> lexicographicOrder() const
+    std::vector<const Attr *> lexicographicOrder()
     {
+        auto b = flatten();
         std::vector<const Attr *> res;
-        res.reserve(size_);
-        for (size_t n = 0; n < size_; n++)
-            res.emplace_back(&attrs[n]);
+        res.reserve(b->size_);
+        for (size_t n = 0; n < b->size_; n++)
+            res.emplace_back(&b->attrs[n]);
         std::sort(res.begin(), res.end(), [](const Attr * a, const Attr * b) {
             return (const string &) a->name < (const string &) b->name;
         });
@@ -25,12 +25,18 @@ struct AttrDb
     {
         SQLite db;
         SQLiteStmt insertAttribute;
+        SQLiteStmt insertAttributes;
         SQLiteStmt insertAttributeWithContext;
         SQLiteStmt queryAttribute;
         SQLiteStmt queryAttributes;
+        SQLiteStmt queryChildren;
         std::unique_ptr<SQLiteTxn> txn;
     };
 
+    /* Number of rows written per exec of the multi-row placeholder
+       insert used by setAttrs(). */
+    constexpr static size_t attrsInsertBatchSize = 16;
+
     std::unique_ptr<Sync<State>> _state;
 
     AttrDb(const Hash & fingerprint)
@@ -50,6 +56,13 @@ struct AttrDb
         state->insertAttribute.create(state->db,
             "insert or replace into Attributes(parent, name, type, value) values (?, ?, ?, ?)");
 
+        {
+            std::string sql = "insert or replace into Attributes(parent, name, type, value) values ";
+            for (size_t n = 0; n < attrsInsertBatchSize; ++n)
+                sql += n == 0 ? "(?, ?, ?, null)" : ", (?, ?, ?, null)";
+            state->insertAttributes.create(state->db, sql);
+        }
+
         state->insertAttributeWithContext.create(state->db,
             "insert or replace into Attributes(parent, name, type, value, context) values (?, ?, ?, ?, ?)");
 
@@ -59,6 +72,9 @@ struct AttrDb
         state->queryAttributes.create(state->db,
             "select name from Attributes where parent = ?");
 
+        state->queryChildren.create(state->db,
+            "select name, rowid, type, value, context from Attributes where parent = ?");
+
         state->txn = std::make_unique<SQLiteTxn>(state->db);
     }
 
@@ -104,10 +120,21 @@ struct AttrDb
             AttrId rowId = state->db.getLastInsertedRowId();
             assert(rowId);
 
-            for (auto & attr : attrs)
+            /* Insert the placeholders in batches; executing one
+               multi-row statement is substantially cheaper than one
+               statement per attribute on nixpkgs-sized sets. */
+            size_t n = 0;
+            while (attrs.size() - n >= attrsInsertBatchSize) {
+                auto use(state->insertAttributes.use());
+                for (size_t i = 0; i < attrsInsertBatchSize; ++i, ++n)
+                    use(rowId)(attrs[n])(AttrType::Placeholder);
+                use.exec();
+            }
+
+            for (; n < attrs.size(); ++n)
                 state->insertAttribute.use()
                     (rowId)
-                    (attr)
+                    (attrs[n])
                     (AttrType::Placeholder)
                     (0, false).exec();
 
@@ -230,48 +257,89 @@ struct AttrDb
         });
     }
 
-    std::optional<std::pair<AttrId, AttrValue>> getAttr(
-        AttrKey key,
+    /* Decode one Attributes row, with 'col' the index of its 'type'
+       column (the 'value' and 'context' columns follow it). */
+    AttrValue parseValue(
+        State & state,
+        SQLiteStmt::Use & use,
+        int col,
+        AttrId rowId,
         SymbolTable & symbols)
     {
-        auto state(_state->lock());
-
-        auto queryAttribute(state->queryAttribute.use()(key.first)(key.second));
-        if (!queryAttribute.next()) return {};
-
-        auto rowId = (AttrType) queryAttribute.getInt(0);
-        auto type = (AttrType) queryAttribute.getInt(1);
+        auto type = (AttrType) use.getInt(col);
 
         switch (type) {
             case AttrType::Placeholder:
-                return {{rowId, placeholder_t()}};
+                return placeholder_t();
             case AttrType::FullAttrs: {
                 // FIXME: expensive, should separate this out.
                 std::vector<Symbol> attrs;
-                auto queryAttributes(state->queryAttributes.use()(rowId));
+                auto queryAttributes(state.queryAttributes.use()(rowId));
                 while (queryAttributes.next())
                     attrs.push_back(symbols.create(queryAttributes.getStr(0)));
-                return {{rowId, attrs}};
+                return attrs;
             }
             case AttrType::String: {
                 std::vector<std::pair<Path, std::string>> context;
-                if (!queryAttribute.isNull(3))
-                    for (auto & s : tokenizeString<std::vector<std::string>>(queryAttribute.getStr(3), ";"))
+                if (!use.isNull(col + 2))
+                    for (auto & s : tokenizeString<std::vector<std::string>>(use.getStr(col + 2), ";"))
                         context.push_back(decodeContext(s));
-                return {{rowId, string_t{queryAttribute.getStr(2), context}}};
+                return string_t{use.getStr(col + 1), context};
             }
             case AttrType::Bool:
-                return {{rowId, queryAttribute.getInt(2) != 0}};
+                return use.getInt(col + 1) != 0;
             case AttrType::Missing:
-                return {{rowId, missing_t()}};
+                return missing_t();
             case AttrType::Misc:
-                return {{rowId, misc_t()}};
+                return misc_t();
             case AttrType::Failed:
-                return {{rowId, failed_t()}};
+                return failed_t();
             default:
                 throw Error("unexpected type in evaluation cache");
         }
     }
+
+    std::optional<std::pair<AttrId, AttrValue>> getAttr(
+        AttrKey key,
+        SymbolTable & symbols)
+    {
+        auto state(_state->lock());
+
+        auto queryAttribute(state->queryAttribute.use()(key.first)(key.second));
+        if (!queryAttribute.next()) return {};
+
+        auto rowId = (AttrId) queryAttribute.getInt(0);
+
+        return {{rowId, parseValue(*state, queryAttribute, 1, rowId, symbols)}};
+    }
+
+    /* Fetch all children of 'parent' in one query, to serve
+       subsequent per-attribute lookups from memory. */
+    std::map<Symbol, std::pair<AttrId, AttrValue>> getChildren(
+        AttrId parent,
+        SymbolTable & symbols)
+    {
+        std::map<Symbol, std::pair<AttrId, AttrValue>> children;
+
+        if (failed) return children;
+
+        try {
+            auto state(_state->lock());
+
+            auto queryChildren(state->queryChildren.use()(parent));
+            while (queryChildren.next()) {
+                auto name = symbols.create(queryChildren.getStr(0));
+                auto rowId = (AttrId) queryChildren.getInt(1);
+                children.emplace(name,
+                    std::make_pair(rowId, parseValue(*state, queryChildren, 2, rowId, symbols)));
+            }
+        } catch (SQLiteError &) {
+            ignoreException();
+            failed = true;
+        }
+
+        return children;
+    }
 };
 
 static std::shared_ptr<AttrDb> makeAttrDb(const Hash & fingerprint)
@@ -415,11 +483,24 @@ std::shared_ptr<AttrCursor> AttrCursor::maybeGetAttr(Symbol name, bool forceErro
         if (cachedValue) {
             if (auto attrs = std::get_if<std::vector<Symbol>>(&cachedValue->second)) {
                 for (auto & attr : *attrs)
-                    if (attr == name)
-                        return std::make_shared<AttrCursor>(root, std::make_pair(shared_from_this(), name));
+                    if (attr == name) {
+                        std::optional<std::pair<AttrId, AttrValue>> cachedValue2;
+                        if (prefetchedChildren) {
+                            auto i = prefetchedChildren->find(name);
+                            if (i != prefetchedChildren->end())
+                                cachedValue2 = i->second;
+                        }
+                        return std::make_shared<AttrCursor>(root,
+                            std::make_pair(shared_from_this(), name), nullptr, std::move(cachedValue2));
+                    }
                 return nullptr;
             } else if (std::get_if<placeholder_t>(&cachedValue->second)) {
-                auto attr = root->db->getAttr({cachedValue->first, name}, root->state.symbols);
+                std::optional<std::pair<AttrId, AttrValue>> attr;
+                if (prefetchedChildren) {
+                    auto i = prefetchedChildren->find(name);
+                    if (i != prefetchedChildren->end()) attr = i->second;
+                } else
+                    attr = root->db->getAttr({cachedValue->first, name}, root->state.symbols);
                 if (attr) {
                     if (std::get_if<missing_t>(&attr->second))
                         return nullptr;
@@ -486,6 +567,29 @@ std::shared_ptr<AttrCursor> AttrCursor::getAttr(std::string_view name)
     return getAttr(root->state.symbols.create(name));
 }
 
+void AttrCursor::prefetchChildren()
+{
+    if (!root->db || prefetchedChildren) return;
+
+    if (!cachedValue)
+        cachedValue = root->db->getAttr(getKey(), root->state.symbols);
+    if (!cachedValue) return;
+
+    prefetchedChildren = root->db->getChildren(cachedValue->first, root->state.symbols);
+}
+
+std::vector<std::shared_ptr<AttrCursor>> AttrCursor::getAttrs(
+    const std::vector<Symbol> & names, bool forceErrors)
+{
+    prefetchChildren();
+
+    std::vector<std::shared_ptr<AttrCursor>> res;
+    res.reserve(names.size());
+    for (auto & name : names)
+        res.push_back(getAttr(name, forceErrors));
+    return res;
+}
+
 std::shared_ptr<AttrCursor> AttrCursor::findAlongAttrPath(const std::vector<Symbol> & attrPath, bool force)
 {
     auto res = shared_from_this();
@@ -74,6 +74,10 @@ class AttrCursor : public std::enable_shared_from_this<AttrCursor>
     RootValue _value;
     std::optional<std::pair<AttrId, AttrValue>> cachedValue;
 
+    /* All cached children of this cursor, loaded in one query by
+       prefetchChildren(). */
+    std::optional<std::map<Symbol, std::pair<AttrId, AttrValue>>> prefetchedChildren;
+
     AttrKey getKey();
 
     Value & getValue();
@@ -102,6 +106,16 @@ public:
 
     std::shared_ptr<AttrCursor> getAttr(std::string_view name);
 
+    /* Load all cached children of this cursor from the database in a
+       single query, so that subsequent attribute lookups are served
+       from memory instead of costing one SQLite round trip each. */
+    void prefetchChildren();
+
+    /* Batch variant of getAttr(): prefetch the children in one query,
+       then return one cursor per name. */
+    std::vector<std::shared_ptr<AttrCursor>> getAttrs(
+        const std::vector<Symbol> & names, bool forceErrors = false);
+
     std::shared_ptr<AttrCursor> findAlongAttrPath(const std::vector<Symbol> & attrPath, bool force = false);
 
     std::string getString();
@@ -32,6 +32,10 @@ LocalNoInlineNoReturn(void throwTypeError(const Pos & pos, const char * s, const
 
 void EvalState::forceValue(Value & v, const Pos & pos)
 {
+    if (parallelForcingActive.load(std::memory_order_relaxed)) {
+        forceValueParallel(v, pos);
+        return;
+    }
     if (v.isThunk()) {
         Env * env = v.thunk.env;
         Expr * expr = v.thunk.expr;
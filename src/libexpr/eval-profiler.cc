@@ -0,0 +1,77 @@
+#include "eval-profiler.hh"
+#include "nixexpr.hh"
+#include "eval.hh"
+#include "util.hh"
+
+#include <algorithm>
+#include <chrono>
+
+namespace nix {
+
+thread_local std::vector<EvalProfiler::Frame> EvalProfiler::stack;
+
+EvalProfiler::EvalProfiler(unsigned int frequency, const Path & outPath)
+    : outPath(outPath)
+    , period(1000000 / std::max(frequency, 1U))
+{
+    ticker = std::thread([this]() {
+        std::unique_lock lock(tickerMutex);
+        while (!quit) {
+            tickerQuit.wait_for(lock, std::chrono::microseconds(period));
+            sampleRequested.store(true, std::memory_order_relaxed);
+        }
+    });
+}
+
+/* Render a frame in a way flamegraph.pl groups usefully: the function
+   name (or "anonymous") plus the position of its definition, with the
+   separator characters of the folded format filtered out. */
+static std::string showFrame(const ExprLambda * lambda, const PrimOp * primOp)
+{
+    std::string s;
+    if (primOp)
+        s = "primop " + (const std::string &) primOp->name;
+    else {
+        s = lambda->name.set() ? (const std::string &) lambda->name : "anonymous";
+        if (*lambda->pos)
+            s += fmt("@%s:%d", (const std::string &) lambda->pos->file, lambda->pos->line);
+    }
+    std::replace(s.begin(), s.end(), ';', ':');
+    return s;
+}
+
+void EvalProfiler::takeSample()
+{
+    sampleRequested.store(false, std::memory_order_relaxed);
+
+    std::string folded;
+    for (auto & frame : stack) {
+        if (!folded.empty()) folded += ';';
+        folded += showFrame(frame.lambda, frame.primOp);
+    }
+
+    std::lock_guard guard(samplesMutex);
+    samples[folded]++;
+}
+
+EvalProfiler::~EvalProfiler()
+{
+    {
+        std::lock_guard guard(tickerMutex);
+        quit = true;
+    }
+    tickerQuit.notify_all();
+    ticker.join();
+
+    try {
+        std::string contents;
+        for (auto & [stack, count] : samples)
+            contents += fmt("%s %d\n", stack, count);
+        writeFile(outPath, contents);
+        printInfo("wrote eval profile with %d distinct stacks to '%s'", samples.size(), outPath);
+    } catch (...) {
+        ignoreException();
+    }
+}
+
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "types.hh"
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace nix {
+
+struct ExprLambda;
+struct PrimOp;
+
+/* Sampling profiler for the evaluator. Unlike trace-function-calls,
+   which logs every function entry and exit, this only maintains a
+   shadow stack of the functions currently being applied: a ticker
+   thread raises a flag at the configured frequency, and the next
+   function entry folds the stack into a sample count. The stack is
+   thus only ever read by the thread that owns it, which keeps the
+   per-call overhead to a push, a pop and a relaxed load.
+
+   The output is one folded stack per line ("outer;inner 42"), the
+   input format of flamegraph.pl and speedscope. */
+class EvalProfiler
+{
+    struct Frame
+    {
+        const ExprLambda * lambda;
+        const PrimOp * primOp;
+    };
+
+    /* Per-thread so that parallel deep forcing doesn't interleave
+       frames of different threads. */
+    static thread_local std::vector<Frame> stack;
+
+    std::atomic<bool> sampleRequested{false};
+
+    std::mutex samplesMutex;
+    std::map<std::string, uint64_t> samples;
+
+    Path outPath;
+    uint64_t period;
+
+    std::thread ticker;
+    std::mutex tickerMutex;
+    std::condition_variable tickerQuit;
+    bool quit = false;
+
+    void takeSample();
+
+public:
+
+    EvalProfiler(unsigned int frequency, const Path & outPath);
+    ~EvalProfiler();
+
+    void push(const ExprLambda * lambda, const PrimOp * primOp)
+    {
+        stack.push_back({lambda, primOp});
+        if (sampleRequested.load(std::memory_order_relaxed))
+            takeSample();
+    }
+
+    void pop()
+    {
+        stack.pop_back();
+    }
+};
+
+/* RAII helper marking a function application on the profiler's
+   shadow stack. A null profiler makes it a no-op. */
+struct EvalProfilerFrame
+{
+    EvalProfiler * profiler;
+    EvalProfilerFrame(EvalProfiler * profiler, const ExprLambda * lambda, const PrimOp * primOp)
+        : profiler(profiler)
+    {
+        if (profiler) profiler->push(lambda, primOp);
+    }
+    ~EvalProfilerFrame()
+    {
+        if (profiler) profiler->pop();
+    }
+};
+
+}
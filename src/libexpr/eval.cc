@@ -8,15 +8,21 @@
 #include "filetransfer.hh"
 #include "json.hh"
 #include "function-trace.hh"
+#include "eval-profiler.hh"
+#include "thread-pool.hh"
+#include "finally.hh"
 
 #include <algorithm>
+#include <array>
 #include <chrono>
+#include <condition_variable>
 #include <cstring>
 #include <unistd.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <iostream>
 #include <fstream>
+#include <unordered_map>
 
 #include <sys/resource.h>
 
@@ -62,6 +68,144 @@ static char * dupStringWithLen(const char * s, size_t size)
 }
 
 
+/* Nixpkgs evaluation creates millions of string values that are
+   duplicates of a few short strings (system types, version strings,
+   store paths), so small strings are hash-consed: identical contents
+   share one allocation, and equal interned strings compare equal by
+   pointer in eqValues(). The table's payloads are allocated
+   uncollectable since the table itself lives outside the GC heap;
+   they are bounded in number and useful for the whole process anyway.
+   The table is guarded by a mutex, since mkString() is reached from
+   worker threads when eval-cores > 1 (see forceValueDeep()). */
+
+constexpr size_t maxInternedStringSize = 64;
+constexpr size_t maxInternedStrings = 65536;
+
+static const char * internString(const char * s, size_t size)
+{
+    static std::unordered_map<std::string_view, const char *> internedStrings;
+    static std::mutex internedStringsMutex;
+
+    std::lock_guard<std::mutex> guard(internedStringsMutex);
+
+    auto i = internedStrings.find(std::string_view(s, size));
+    if (i != internedStrings.end()) return i->second;
+
+    if (internedStrings.size() >= maxInternedStrings)
+        return dupStringWithLen(s, size);
+
+    char * t;
+#if HAVE_BOEHMGC
+    t = (char *) GC_MALLOC_ATOMIC_UNCOLLECTABLE(size + 1);
+#else
+    t = (char *) malloc(size + 1);
+#endif
+    if (!t) throw std::bad_alloc();
+    memcpy(t, s, size);
+    t[size] = 0;
+    internedStrings.emplace(std::string_view(t, size), t);
+    return t;
+}
+
+
+/* String contexts are drawn from a small set of elements per
+   evaluation ("!out!/nix/store/..."), but a copy of every element
+   used to be allocated into every string value carrying it, and
+   nixpkgs drags enormous context sets through concatenation and
+   derivation construction. Intern the elements (separately from
+   internString(), whose size cap store paths exceed) and hash-cons
+   complete context arrays, so all strings with the same context share
+   one immutable array. Both tables are capped; past the cap we fall
+   back to per-value allocation. Like the string-interning table
+   above, both are guarded by mutexes for eval-cores > 1. */
+
+constexpr size_t maxInternedContexts = 65536;
+
+/* Returns null once the table is full; the caller then falls back to
+   a per-value copy. */
+static const char * internContextElem(const std::string & s)
+{
+    static std::unordered_map<std::string_view, const char *> internedElems;
+    static std::mutex internedElemsMutex;
+
+    std::lock_guard<std::mutex> guard(internedElemsMutex);
+
+    auto i = internedElems.find(std::string_view(s));
+    if (i != internedElems.end()) return i->second;
+
+    if (internedElems.size() >= maxInternedContexts)
+        return nullptr;
+
+    char * t;
+#if HAVE_BOEHMGC
+    t = (char *) GC_MALLOC_ATOMIC_UNCOLLECTABLE(s.size() + 1);
+#else
+    t = (char *) malloc(s.size() + 1);
+#endif
+    if (!t) throw std::bad_alloc();
+    memcpy(t, s.data(), s.size());
+    t[s.size()] = 0;
+    internedElems.emplace(std::string_view(t, s.size()), t);
+    return t;
+}
+
+static const char * * internContext(const PathSet & context)
+{
+    static std::map<std::vector<const char *>, const char * *> internedContexts;
+    static std::mutex internedContextsMutex;
+
+    /* PathSet iteration yields the elements in sorted order, which
+       the context array format requires. */
+    std::vector<const char *> elems;
+    elems.reserve(context.size());
+    bool shareable = true;
+    for (auto & i : context) {
+        auto p = internContextElem(i);
+        if (!p) {
+            p = dupStringWithLen(i.data(), i.size());
+            shareable = false;
+        }
+        elems.push_back(p);
+    }
+
+    /* Hold the lock across the lookup and the insertion, so two
+       threads interning the same context can't both allocate a shared
+       array for it. */
+    std::lock_guard<std::mutex> guard(internedContextsMutex);
+
+    if (shareable) {
+        auto i = internedContexts.find(elems);
+        if (i != internedContexts.end()) return i->second;
+    }
+
+    /* A shared array lives in the table, outside the GC's view, so it
+       must be uncollectable (its interned elements already are). A
+       non-shared array is referenced from the value and allocated
+       normally. */
+    bool share = shareable && internedContexts.size() < maxInternedContexts;
+
+    const char * * arr;
+    if (share) {
+#if HAVE_BOEHMGC
+        arr = (const char * *) GC_MALLOC_UNCOLLECTABLE((elems.size() + 1) * sizeof(char *));
+#else
+        arr = (const char * *) malloc((elems.size() + 1) * sizeof(char *));
+#endif
+        if (!arr) throw std::bad_alloc();
+    } else
+        arr = (const char * *) allocBytes((elems.size() + 1) * sizeof(char *));
+
+    for (size_t n = 0; n < elems.size(); ++n)
+        arr[n] = elems[n];
+    arr[elems.size()] = 0;
+
+    if (share)
+        internedContexts.emplace(std::move(elems), arr);
+
+    return arr;
+}
+
+
 RootValue allocRootValue(Value * v)
 {
 #if HAVE_BOEHMGC
@@ -209,7 +353,7 @@ Pos Value::determinePos(const Pos &pos) const
 {
     switch (internalType) {
         case tAttrs: return *attrs->pos;
-        case tLambda: return lambda.fun->pos;
+        case tLambda: return *lambda.fun->pos;
         case tApp: return app.left->determinePos(pos);
         default: return pos;
     }
@@ -305,8 +449,26 @@ void initGC()
        there. */
     GC_set_no_dls(1);
 
+    /* Mark the heap in parallel if requested. This has to be
+       communicated through the environment because the marker thread
+       count is fixed at GC_INIT() time. */
+    if (evalSettings.gcMarkers && !getEnv("GC_MARKERS"))
+        setenv("GC_MARKERS", std::to_string(evalSettings.gcMarkers).c_str(), 1);
+
+    if (evalSettings.gcFreeSpaceDivisor != 3)
+        GC_set_free_space_divisor(evalSettings.gcFreeSpaceDivisor);
+
     GC_INIT();
 
+    if (evalSettings.gcIncremental)
+        GC_enable_incremental();
+
+#if defined(GC_VERSION_MAJOR) && GC_VERSION_MAJOR >= 8
+    /* Ask libgc to keep track of the total time spent in the
+       collector, for NIX_SHOW_STATS. */
+    GC_start_performance_measurement();
+#endif
+
     GC_set_oom_fn(oomHandler);
 
     StackAllocator::defaultAllocator = &boehmGCStackAllocator;
@@ -421,6 +583,10 @@ EvalState::EvalState(
 {
     countCalls = getEnv("NIX_COUNT_CALLS").value_or("0") != "0";
 
+    if (evalSettings.evalProfilerFrequency != 0U)
+        evalProfiler = std::make_unique<EvalProfiler>(
+            evalSettings.evalProfilerFrequency, evalSettings.evalProfilerFile);
+
     assert(gcInitialised);
 
     static_assert(sizeof(Env) <= 16, "environment must be <= 16 bytes");
@@ -454,12 +620,24 @@ EvalState::EvalState(
         }
     }
 
+    maxEvalMemory = evalSettings.maxEvalMemory;
+
     vEmptySet.mkAttrs(allocBindings(0));
 
     createBaseEnv();
 }
 
 
+void EvalState::throwEvalMemoryLimitError()
+{
+    /* Disable further enforcement so that unwinding and error
+       reporting cannot hit the limit again. */
+    size_t limit = maxEvalMemory;
+    maxEvalMemory = 0;
+    throw EvalMemoryLimitError("evaluation exceeded the memory limit of %d bytes ('eval-max-memory')", limit);
+}
+
+
 EvalState::~EvalState()
 {
 }
@@ -482,27 +660,90 @@ void EvalState::requireExperimentalFeatureOnEvaluation(
     }
 }
 
+/* A trie over the components of the allowed paths. A node marked
+   'allowed' admits the corresponding path and everything below it,
+   matching the isDirOrInDir() semantics of the old linear scan. */
+struct EvalState::AllowedPathsTrie
+{
+    struct Node
+    {
+        std::map<std::string, Node, std::less<>> children;
+        bool allowed = false;
+    };
+
+    Node root;
+
+    void insert(std::string_view path)
+    {
+        /* A relative entry can never match a canonicalised absolute
+           path, just as in the old scan. */
+        if (path.empty() || path[0] != '/') return;
+        auto node = &root;
+        size_t pos = 1;
+        while (pos < path.size()) {
+            auto slash = path.find('/', pos);
+            auto component = path.substr(pos,
+                slash == path.npos ? path.npos : slash - pos);
+            node = &node->children.try_emplace(std::string(component)).first->second;
+            if (slash == path.npos) break;
+            pos = slash + 1;
+        }
+        node->allowed = true;
+    }
+
+    bool contains(std::string_view path) const
+    {
+        auto node = &root;
+        if (node->allowed) return true;
+        size_t pos = 1;
+        while (pos < path.size()) {
+            auto slash = path.find('/', pos);
+            auto component = path.substr(pos,
+                slash == path.npos ? path.npos : slash - pos);
+            auto i = node->children.find(component);
+            if (i == node->children.end()) return false;
+            node = &i->second;
+            if (node->allowed) return true;
+            if (slash == path.npos) break;
+            pos = slash + 1;
+        }
+        return node->allowed;
+    }
+};
+
 void EvalState::allowPath(const Path & path)
 {
-    if (allowedPaths)
+    if (allowedPaths) {
+        std::lock_guard<std::mutex> guard(resolvedPathsMutex);
         allowedPaths->insert(path);
+        if (allowedPathsTrie)
+            allowedPathsTrie->insert(path);
+    }
 }
 
 void EvalState::allowPath(const StorePath & storePath)
 {
     if (allowedPaths)
-        allowedPaths->insert(store->toRealPath(storePath));
+        allowPath(store->toRealPath(storePath));
 }
 
 Path EvalState::checkSourcePath(const Path & path_)
 {
     if (!allowedPaths) return path_;
 
+    /* Also protects allowedPaths and the trie, which allowPath()
+       mutates concurrently. */
+    std::lock_guard<std::mutex> guard(resolvedPathsMutex);
+
     auto i = resolvedPaths.find(path_);
     if (i != resolvedPaths.end())
         return i->second;
 
-    bool found = false;
+    if (!allowedPathsTrie) {
+        allowedPathsTrie = std::make_unique<AllowedPathsTrie>();
+        for (auto & i : *allowedPaths)
+            allowedPathsTrie->insert(i);
+    }
 
     /* First canonicalize the path without symlinks, so we make sure an
      * attacker can't append ../../... to a path that would be in allowedPaths
@@ -512,25 +753,16 @@ Path EvalState::checkSourcePath(const Path & path_)
 
     if (hasPrefix(abspath, corepkgsPrefix)) return abspath;
 
-    for (auto & i : *allowedPaths) {
-        if (isDirOrInDir(abspath, i)) {
-            found = true;
-            break;
-        }
-    }
-
-    if (!found)
+    if (!allowedPathsTrie->contains(abspath))
         throw RestrictedPathError("access to path '%1%' is forbidden in restricted mode", abspath);
 
     /* Resolve symlinks. */
     debug(format("checking access to '%s'") % abspath);
     Path path = canonPath(abspath, true);
 
-    for (auto & i : *allowedPaths) {
-        if (isDirOrInDir(path, i)) {
-            resolvedPaths[path_] = path;
-            return path;
-        }
+    if (allowedPathsTrie->contains(path)) {
+        resolvedPaths[path_] = path;
+        return path;
     }
 
     throw RestrictedPathError("access to path '%1%' is forbidden in restricted mode", path);
@@ -764,21 +996,18 @@ LocalNoInline(void addErrorTrace(Error & e, const Pos & pos, const char * s, con
 
 void mkString(Value & v, const char * s)
 {
-    v.mkString(dupString(s));
+    auto size = strlen(s);
+    v.mkString(size <= maxInternedStringSize ? internString(s, size) : dupString(s));
 }
 
 
 Value & mkString(Value & v, std::string_view s, const PathSet & context)
 {
-    v.mkString(dupStringWithLen(s.data(), s.size()));
-    if (!context.empty()) {
-        size_t n = 0;
-        v.string.context = (const char * *)
-            allocBytes((context.size() + 1) * sizeof(char *));
-        for (auto & i : context)
-            v.string.context[n++] = dupString(i.c_str());
-        v.string.context[n] = 0;
-    }
+    v.mkString(s.size() <= maxInternedStringSize
+        ? internString(s.data(), s.size())
+        : dupStringWithLen(s.data(), s.size()));
+    if (!context.empty())
+        v.string.context = internContext(context);
     return v;
 }
 
@@ -805,11 +1034,14 @@ inline Value * EvalState::lookupVar(Env * env, const ExprVar & var, bool noEval)
         }
         Bindings::iterator j = env->values[0]->attrs->find(var.name);
         if (j != env->values[0]->attrs->end()) {
-            if (countCalls) attrSelects[*j->pos]++;
+            if (countCalls) {
+                std::lock_guard<std::mutex> guard(countCallsMutex);
+                attrSelects[*j->pos]++;
+            }
             return j->value;
         }
         if (!env->prevWith)
-            throwUndefinedVarError(var.pos, "undefined variable '%1%'", var.name);
+            throwUndefinedVarError(*var.pos, "undefined variable '%1%'", var.name);
         for (size_t l = env->prevWith; l; --l, env = env->up) ;
     }
 }
@@ -817,17 +1049,74 @@ inline Value * EvalState::lookupVar(Env * env, const ExprVar & var, bool noEval)
 
 Value * EvalState::allocValue()
 {
+    addAllocation(sizeof(Value));
+
+#if HAVE_BOEHMGC
+    /* We use the boehm batch allocator to speed up allocations of
+       Values (of which there are many). GC_malloc_many() returns a
+       linked list of objects of the given size, where the first word
+       of each object is also the pointer to the next object in the
+       list. This also means that we have to explicitly clear the
+       first word of every object we take. */
+    thread_local static void * valueAllocCache = nullptr;
+
+    if (!valueAllocCache) {
+        valueAllocCache = GC_malloc_many(sizeof(Value));
+        if (!valueAllocCache) throw std::bad_alloc();
+    }
+
+    /* GC_NEXT is a convenience macro for accessing the first word of
+       an object. Take the first list item, advance the list to the
+       next item, and clear the next pointer. */
+    void * p = valueAllocCache;
+    valueAllocCache = GC_NEXT(p);
+    GC_NEXT(p) = nullptr;
+
     nrValues++;
-    auto v = (Value *) allocBytes(sizeof(Value));
-    return v;
+    return (Value *) p;
+#else
+    nrValues++;
+    return (Value *) allocBytes(sizeof(Value));
+#endif
 }
 
 
 Env & EvalState::allocEnv(size_t size)
 {
+    addAllocation(sizeof(Env) + size * sizeof(Value *));
+
     nrEnvs++;
     nrValuesInEnvs += size;
-    Env * env = (Env *) allocBytes(sizeof(Env) + size * sizeof(Value *));
+
+    Env * env;
+
+#if HAVE_BOEHMGC
+    /* Environments up to this size are allocated from per-size free
+       lists replenished with GC_malloc_many(), like allocValue().
+       Besides saving the allocator lock, this hands out consecutive
+       frames from the same GC block, so the env->up walks done by
+       lookupVar() in deep call chains stay mostly within a few cache
+       lines instead of chasing pointers across the whole heap. */
+    static const size_t maxBatchedEnvSize = 8;
+
+    if (size <= maxBatchedEnvSize) {
+        thread_local static void * envAllocCache[maxBatchedEnvSize + 1] = {};
+
+        auto & cache = envAllocCache[size];
+        if (!cache) {
+            cache = GC_malloc_many(sizeof(Env) + size * sizeof(Value *));
+            if (!cache) throw std::bad_alloc();
+        }
+
+        void * p = cache;
+        cache = GC_NEXT(p);
+        GC_NEXT(p) = nullptr;
+
+        env = (Env *) p;
+    } else
+#endif
+        env = (Env *) allocBytes(sizeof(Env) + size * sizeof(Value *));
+
     env->type = Env::Plain;
 
     /* We assume that env->values has been cleared by the allocator; maybeThunk() and lookupVar fromWith expect this. */
@@ -839,8 +1128,10 @@ Env & EvalState::allocEnv(size_t size)
 void EvalState::mkList(Value & v, size_t size)
 {
     v.mkList(size);
-    if (size > 2)
+    if (size > 2) {
+        addAllocation(size * sizeof(Value *));
         v.bigList.elems = (Value * *) allocBytes(size * sizeof(Value *));
+    }
     nrListElems += size;
 }
 
@@ -924,24 +1215,30 @@ void EvalState::evalFile(const Path & path_, Value & v, bool mustBeTrivial)
 {
     auto path = checkSourcePath(path_);
 
-    FileEvalCache::iterator i;
-    if ((i = fileEvalCache.find(path)) != fileEvalCache.end()) {
-        v = i->second;
-        return;
-    }
+    Path resolvedPath;
+    Expr * e = nullptr;
 
-    Path resolvedPath = resolveExprPath(path);
-    if ((i = fileEvalCache.find(resolvedPath)) != fileEvalCache.end()) {
-        v = i->second;
-        return;
+    {
+        std::lock_guard<std::mutex> guard(fileCacheMutex);
+
+        FileEvalCache::iterator i;
+        if ((i = fileEvalCache.find(path)) != fileEvalCache.end()) {
+            v = i->second;
+            return;
+        }
+
+        resolvedPath = resolveExprPath(path);
+        if ((i = fileEvalCache.find(resolvedPath)) != fileEvalCache.end()) {
+            v = i->second;
+            return;
+        }
+
+        auto j = fileParseCache.find(resolvedPath);
+        if (j != fileParseCache.end())
+            e = j->second;
     }
 
     printTalkative("evaluating file '%1%'", resolvedPath);
-    Expr * e = nullptr;
-
-    auto j = fileParseCache.find(resolvedPath);
-    if (j != fileParseCache.end())
-        e = j->second;
 
     if (!e)
         e = parseExprFromFile(checkSourcePath(resolvedPath));
@@ -952,6 +1249,7 @@ void EvalState::evalFile(const Path & path_, Value & v, bool mustBeTrivial)
 
 void EvalState::resetFileCache()
 {
+    std::lock_guard<std::mutex> guard(fileCacheMutex);
     fileEvalCache.clear();
     fileParseCache.clear();
 }
@@ -964,7 +1262,10 @@ void EvalState::cacheFile(
     Value & v,
     bool mustBeTrivial)
 {
-    fileParseCache[resolvedPath] = e;
+    {
+        std::lock_guard<std::mutex> guard(fileCacheMutex);
+        fileParseCache[resolvedPath] = e;
+    }
 
     try {
         // Enforce that 'flake.nix' is a direct attrset, not a
@@ -978,6 +1279,7 @@ void EvalState::cacheFile(
         throw;
     }
 
+    std::lock_guard<std::mutex> guard(fileCacheMutex);
     fileEvalCache[resolvedPath] = v;
     if (path != resolvedPath) fileEvalCache[path] = v;
 }
@@ -1073,7 +1375,7 @@ void ExprAttrs::eval(EvalState & state, Env & env, Value & v)
             } else
                 vAttr = i.second.e->maybeThunk(state, i.second.inherited ? env : env2);
             env2.values[displ++] = vAttr;
-            v.attrs->push_back(Attr(i.first, vAttr, ptr(&i.second.pos)));
+            v.attrs->push_back(Attr(i.first, vAttr, i.second.pos));
         }
 
         /* If the rec contains an attribute called `__overrides', then
@@ -1105,28 +1407,47 @@ void ExprAttrs::eval(EvalState & state, Env & env, Value & v)
 
     else
         for (auto & i : attrs)
-            v.attrs->push_back(Attr(i.first, i.second.e->maybeThunk(state, env), ptr(&i.second.pos)));
+            v.attrs->push_back(Attr(i.first, i.second.e->maybeThunk(state, env), i.second.pos));
 
     /* Dynamic attrs apply *after* rec and __overrides. */
-    for (auto & i : dynamicAttrs) {
-        Value nameVal;
-        i.nameExpr->eval(state, *dynamicEnv, nameVal);
-        state.forceValue(nameVal, i.pos);
-        if (nameVal.type() == nNull)
-            continue;
-        state.forceStringNoCtx(nameVal);
-        Symbol nameSym = state.symbols.create(nameVal.string.s);
-        Bindings::iterator j = v.attrs->find(nameSym);
-        if (j != v.attrs->end())
-            throwEvalError(i.pos, "dynamic attribute '%1%' already defined at %2%", nameSym, *j->pos);
+    if (!dynamicAttrs.empty()) {
+        /* Everything emitted so far is already sorted: AttrDefs is
+           keyed by Symbol, whose '<' is the order Bindings uses, and
+           the __overrides result was sorted above. */
+        auto sortedSize = v.attrs->size();
+
+        for (auto & i : dynamicAttrs) {
+            Value nameVal;
+            i.nameExpr->eval(state, *dynamicEnv, nameVal);
+            state.forceValue(nameVal, *i.pos);
+            if (nameVal.type() == nNull)
+                continue;
+            state.forceStringNoCtx(nameVal);
+            Symbol nameSym = state.symbols.create(nameVal.string.s);
+
+            /* Check for duplicates by binary search over the sorted
+               prefix and a linear scan over the (typically few)
+               dynamic attrs added after it. */
+            Attr * dup = nullptr;
+            Attr key(nameSym, 0);
+            auto j = std::lower_bound(v.attrs->begin(), v.attrs->begin() + sortedSize, key);
+            if (j != v.attrs->begin() + sortedSize && j->name == nameSym)
+                dup = j;
+            else
+                for (auto k = v.attrs->begin() + sortedSize; k != v.attrs->end(); ++k)
+                    if (k->name == nameSym) { dup = k; break; }
+            if (dup)
+                throwEvalError(*i.pos, "dynamic attribute '%1%' already defined at %2%", nameSym, *dup->pos);
+
+            i.valueExpr->setName(nameSym);
+            v.attrs->push_back(Attr(nameSym, i.valueExpr->maybeThunk(state, *dynamicEnv), i.pos));
+        }
 
-        i.valueExpr->setName(nameSym);
-        /* Keep sorted order so find can catch duplicates */
-        v.attrs->push_back(Attr(nameSym, i.valueExpr->maybeThunk(state, *dynamicEnv), ptr(&i.pos)));
-        v.attrs->sort(); // FIXME: inefficient
+        /* A single sort at the end instead of one per dynamic attr. */
+        v.attrs->sort();
     }
 
-    v.attrs->pos = ptr(&pos);
+    v.attrs->pos = pos;
 }
 
 
@@ -1159,7 +1480,7 @@ void ExprList::eval(EvalState & state, Env & env, Value & v)
 void ExprVar::eval(EvalState & state, Env & env, Value & v)
 {
     Value * v2 = state.lookupVar(&env, *this, false);
-    state.forceValue(*v2, pos);
+    state.forceValue(*v2, *pos);
     v = *v2;
 }
 
@@ -1196,7 +1517,7 @@ void ExprSelect::eval(EvalState & state, Env & env, Value & v)
             Bindings::iterator j;
             Symbol name = getName(i, state, env);
             if (def) {
-                state.forceValue(*vAttrs, pos);
+                state.forceValue(*vAttrs, *pos);
                 if (vAttrs->type() != nAttrs ||
                     (j = vAttrs->attrs->find(name)) == vAttrs->attrs->end())
                 {
@@ -1204,16 +1525,19 @@ void ExprSelect::eval(EvalState & state, Env & env, Value & v)
                     return;
                 }
             } else {
-                state.forceAttrs(*vAttrs, pos);
+                state.forceAttrs(*vAttrs, *pos);
                 if ((j = vAttrs->attrs->find(name)) == vAttrs->attrs->end())
-                    throwEvalError(pos, "attribute '%1%' missing", name);
+                    throwEvalError(*pos, "attribute '%1%' missing", name);
             }
             vAttrs = j->value;
             pos2 = j->pos;
-            if (state.countCalls) state.attrSelects[*pos2]++;
+            if (state.countCalls) {
+                std::lock_guard<std::mutex> guard(state.countCallsMutex);
+                state.attrSelects[*pos2]++;
+            }
         }
 
-        state.forceValue(*vAttrs, (*pos2 != noPos ? *pos2 : this->pos ) );
+        state.forceValue(*vAttrs, (*pos2 != noPos ? *pos2 : *this->pos ) );
 
     } catch (Error & e) {
         if (*pos2 != noPos && pos2->file != state.sDerivationNix)
@@ -1329,12 +1653,27 @@ void EvalState::callFunction(Value & fun, size_t nrArgs, Value * * args, Value &
             nrFunctionCalls++;
             if (countCalls) incrFunctionCall(&lambda);
 
+            EvalProfilerFrame profFrame(evalProfiler.get(), &lambda, nullptr);
+
             /* Evaluate the body. */
             try {
-                lambda.body->eval(*this, env2, vCur);
+                if (countCalls && *lambda.pos) {
+                    auto startTime = std::chrono::steady_clock::now();
+                    #if HAVE_BOEHMGC
+                    auto startBytes = GC_get_total_bytes();
+                    #endif
+                    lambda.body->eval(*this, env2, vCur);
+                    auto & cost = fileCosts[lambda.pos->file];
+                    cost.time += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - startTime).count();
+                    #if HAVE_BOEHMGC
+                    cost.allocBytes += GC_get_total_bytes() - startBytes;
+                    #endif
+                } else
+                    lambda.body->eval(*this, env2, vCur);
             } catch (Error & e) {
                 if (loggerSettings.showTrace.get()) {
-                    addErrorTrace(e, lambda.pos, "while evaluating %s",
+                    addErrorTrace(e, *lambda.pos, "while evaluating %s",
                         (lambda.name.set()
                             ? "'" + (string) lambda.name + "'"
                             : "anonymous lambda"));
@@ -1358,8 +1697,22 @@ void EvalState::callFunction(Value & fun, size_t nrArgs, Value * * args, Value &
             } else {
                 /* We have all the arguments, so call the primop. */
                 nrPrimOpCalls++;
-                if (countCalls) primOpCalls[vCur.primOp->name]++;
-                vCur.primOp->fun(*this, pos, args, vCur);
+                {
+                    EvalProfilerFrame profFrame(evalProfiler.get(), nullptr, vCur.primOp);
+                    if (countCalls) {
+                        {
+                            std::lock_guard<std::mutex> guard(countCallsMutex);
+                            primOpCalls[vCur.primOp->name]++;
+                        }
+                        auto startTime = std::chrono::steady_clock::now();
+                        vCur.primOp->fun(*this, pos, args, vCur);
+                        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - startTime).count();
+                        std::lock_guard<std::mutex> guard(countCallsMutex);
+                        primOpTimes[vCur.primOp->name] += elapsed;
+                    } else
+                        vCur.primOp->fun(*this, pos, args, vCur);
+                }
 
                 nrArgs -= argsLeft;
                 args += argsLeft;
@@ -1395,8 +1748,22 @@ void EvalState::callFunction(Value & fun, size_t nrArgs, Value * * args, Value &
                     vArgs[argsDone + i] = args[i];
 
                 nrPrimOpCalls++;
-                if (countCalls) primOpCalls[primOp->primOp->name]++;
-                primOp->primOp->fun(*this, pos, vArgs, vCur);
+                {
+                    EvalProfilerFrame profFrame(evalProfiler.get(), nullptr, primOp->primOp);
+                    if (countCalls) {
+                        {
+                            std::lock_guard<std::mutex> guard(countCallsMutex);
+                            primOpCalls[primOp->primOp->name]++;
+                        }
+                        auto startTime = std::chrono::steady_clock::now();
+                        primOp->primOp->fun(*this, pos, vArgs, vCur);
+                        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - startTime).count();
+                        std::lock_guard<std::mutex> guard(countCallsMutex);
+                        primOpTimes[primOp->primOp->name] += elapsed;
+                    } else
+                        primOp->primOp->fun(*this, pos, vArgs, vCur);
+                }
 
                 nrArgs -= argsLeft;
                 args += argsLeft;
@@ -1432,7 +1799,7 @@ void ExprCall::eval(EvalState & state, Env & env, Value & v)
     for (size_t i = 0; i < args.size(); ++i)
         vArgs[i] = args[i]->maybeThunk(state, env);
 
-    state.callFunction(vFun, args.size(), vArgs, v, pos);
+    state.callFunction(vFun, args.size(), vArgs, v, *pos);
 }
 
 
@@ -1440,6 +1807,7 @@ void ExprCall::eval(EvalState & state, Env & env, Value & v)
 // prevents tail-call optimisation.
 void EvalState::incrFunctionCall(ExprLambda * fun)
 {
+    std::lock_guard<std::mutex> guard(countCallsMutex);
     functionCalls[fun]++;
 }
 
@@ -1480,7 +1848,7 @@ void EvalState::autoCallFunction(Bindings & args, Value & fun, Value & res)
             if (j != args.end()) {
                 actualArgs->attrs->push_back(*j);
             } else if (!i.def) {
-                throwMissingArgumentError(i.pos, R"(cannot evaluate a function that has an argument without a value ('%1%')
+                throwMissingArgumentError(*i.pos, R"(cannot evaluate a function that has an argument without a value ('%1%')
 
 Nix attempted to evaluate a function as a top level expression; in
 this case it must have its arguments supplied either by default
@@ -1511,16 +1879,16 @@ void ExprWith::eval(EvalState & state, Env & env, Value & v)
 
 void ExprIf::eval(EvalState & state, Env & env, Value & v)
 {
-    (state.evalBool(env, cond, pos) ? then : else_)->eval(state, env, v);
+    (state.evalBool(env, cond, *pos) ? then : else_)->eval(state, env, v);
 }
 
 
 void ExprAssert::eval(EvalState & state, Env & env, Value & v)
 {
-    if (!state.evalBool(env, cond, pos)) {
+    if (!state.evalBool(env, cond, *pos)) {
         std::ostringstream out;
         cond->show(out);
-        throwAssertionError(pos, "assertion '%1%' failed", out.str());
+        throwAssertionError(*pos, "assertion '%1%' failed", out.str());
     }
     body->eval(state, env, v);
 }
@@ -1550,19 +1918,19 @@ void ExprOpNEq::eval(EvalState & state, Env & env, Value & v)
 
 void ExprOpAnd::eval(EvalState & state, Env & env, Value & v)
 {
-    mkBool(v, state.evalBool(env, e1, pos) && state.evalBool(env, e2, pos));
+    mkBool(v, state.evalBool(env, e1, *pos) && state.evalBool(env, e2, *pos));
 }
 
 
 void ExprOpOr::eval(EvalState & state, Env & env, Value & v)
 {
-    mkBool(v, state.evalBool(env, e1, pos) || state.evalBool(env, e2, pos));
+    mkBool(v, state.evalBool(env, e1, *pos) || state.evalBool(env, e2, *pos));
 }
 
 
 void ExprOpImpl::eval(EvalState & state, Env & env, Value & v)
 {
-    mkBool(v, !state.evalBool(env, e1, pos) || state.evalBool(env, e2, pos));
+    mkBool(v, !state.evalBool(env, e1, *pos) || state.evalBool(env, e2, *pos));
 }
 
 
@@ -1577,6 +1945,22 @@ void ExprOpUpdate::eval(EvalState & state, Env & env, Value & v)
     if (v1.attrs->size() == 0) { v = v2; return; }
     if (v2.attrs->size() == 0) { v = v1; return; }
 
+    /* A small update of a big set is the common case (nixpkgs
+       overlays and .override chains), so don't merge-copy the big
+       set eagerly: layer the right-hand side over it and let lookups
+       fall through. The flat form is built only if the result is
+       iterated. */
+    if (v1.attrs->size() >= 16 && v2.attrs->size() * 4 <= v1.attrs->size()) {
+        auto overlay = state.allocLayeredBindings(v2.attrs->size(), v1.attrs);
+        for (auto & attr : *v2.attrs)
+            overlay->push_back(attr);
+        overlay->finishLayer();
+        v.mkAttrs(overlay);
+        state.nrAttrsets++;
+        state.nrAttrsInAttrsets += v2.attrs->size();
+        return;
+    }
+
     state.mkAttrs(v, v1.attrs->size() + v2.attrs->size());
 
     /* Merge the sets, preferring values from the second set.  Make
@@ -1607,7 +1991,7 @@ void ExprOpConcatLists::eval(EvalState & state, Env & env, Value & v)
     Value v1; e1->eval(state, env, v1);
     Value v2; e2->eval(state, env, v2);
     Value * lists[2] = { &v1, &v2 };
-    state.concatLists(v, 2, lists, pos);
+    state.concatLists(v, 2, lists, *pos);
 }
 
 
@@ -1643,7 +2027,21 @@ void EvalState::concatLists(Value & v, size_t nrLists, Value * * lists, const Po
 void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
 {
     PathSet context;
-    std::ostringstream s;
+
+    /* The parts are collected as views and concatenated with a
+       single, exactly sized allocation at the end; values that are
+       already strings are referenced in place rather than copied.
+       The view vector is allocated traceably so the conservative GC
+       sees the references to string data whose Value has already
+       been overwritten. */
+#if HAVE_BOEHMGC
+    std::vector<std::string_view, traceable_allocator<std::string_view>> parts;
+#else
+    std::vector<std::string_view> parts;
+#endif
+    std::list<std::string> owned;
+    size_t size = 0;
+
     NixInt n = 0;
     NixFloat nf = 0;
 
@@ -1671,19 +2069,28 @@ void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
                 nf = n;
                 nf += vTmp.fpoint;
             } else
-                throwEvalError(pos, "cannot add %1% to an integer", showType(vTmp));
+                throwEvalError(*pos, "cannot add %1% to an integer", showType(vTmp));
         } else if (firstType == nFloat) {
             if (vTmp.type() == nInt) {
                 nf += vTmp.integer;
             } else if (vTmp.type() == nFloat) {
                 nf += vTmp.fpoint;
             } else
-                throwEvalError(pos, "cannot add %1% to a float", showType(vTmp));
-        } else
+                throwEvalError(*pos, "cannot add %1% to a float", showType(vTmp));
+        } else if (vTmp.type() == nString) {
+            /* Fast path: the value is already a string, so reference
+               its data in place instead of copying it. */
+            copyContext(vTmp, context);
+            parts.emplace_back(vTmp.string.s);
+            size += parts.back().size();
+        } else {
             /* skip canonization of first path, which would only be not
             canonized in the first place if it's coming from a ./${foo} type
             path */
-            s << state.coerceToString(pos, vTmp, context, false, firstType == nString, !first);
+            owned.push_back(state.coerceToString(*pos, vTmp, context, false, firstType == nString, !first));
+            parts.emplace_back(owned.back());
+            size += owned.back().size();
+        }
 
         first = false;
     }
@@ -1692,23 +2099,30 @@ void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
         mkInt(v, n);
     else if (firstType == nFloat)
         mkFloat(v, nf);
-    else if (firstType == nPath) {
-        if (!context.empty())
-            throwEvalError(pos, "a string that refers to a store path cannot be appended to a path");
-        auto path = canonPath(s.str());
-        mkPath(v, path.c_str());
-    } else
-        mkString(v, s.str(), context);
+    else {
+        std::string s;
+        s.reserve(size);
+        for (auto & part : parts)
+            s += part;
+
+        if (firstType == nPath) {
+            if (!context.empty())
+                throwEvalError(*pos, "a string that refers to a store path cannot be appended to a path");
+            auto path = canonPath(s);
+            mkPath(v, path.c_str());
+        } else
+            mkString(v, s, context);
+    }
 }
 
 
 void ExprPos::eval(EvalState & state, Env & env, Value & v)
 {
-    state.mkPos(v, ptr(&pos));
+    state.mkPos(v, pos);
 }
 
 
-void EvalState::forceValueDeep(Value & v)
+static void forceValueDeepSeq(EvalState & state, Value & v)
 {
     std::set<const Value *> seen;
 
@@ -1717,7 +2131,7 @@ void EvalState::forceValueDeep(Value & v)
     recurse = [&](Value & v) {
         if (!seen.insert(&v).second) return;
 
-        forceValue(v);
+        state.forceValue(v);
 
         if (v.type() == nAttrs) {
             for (auto & i : *v.attrs)
@@ -1739,6 +2153,195 @@ void EvalState::forceValueDeep(Value & v)
 }
 
 
+std::atomic<bool> EvalState::parallelForcingActive{false};
+
+/* Striped locks serialising access to values that are being forced
+   concurrently. A thunk in the blackhole state is owned by the thread
+   that claimed it; other threads wait on the stripe's condition
+   variable until the result has been written back. */
+struct ForceStripe
+{
+    std::mutex mutex;
+    std::condition_variable wakeup;
+};
+
+static constexpr size_t nrForceStripes = 64;
+static std::array<ForceStripe, nrForceStripes> forceStripes;
+
+static ForceStripe & stripeFor(const Value * v)
+{
+    return forceStripes[std::hash<const Value *>()(v) % nrForceStripes];
+}
+
+/* The thunks claimed by this thread, used to distinguish infinite
+   recursion from a thunk being forced by another thread. */
+static thread_local std::set<const Value *> thunksClaimedByThisThread;
+
+void EvalState::forceValueParallel(Value & v, const Pos & pos)
+{
+    auto & stripe = stripeFor(&v);
+    std::unique_lock lock(stripe.mutex);
+
+    while (true) {
+
+        if (v.isThunk()) {
+            Env * env = v.thunk.env;
+            Expr * expr = v.thunk.expr;
+            v.mkBlackhole();
+            thunksClaimedByThisThread.insert(&v);
+            lock.unlock();
+            Value vTmp;
+            try {
+                expr->eval(*this, *env, vTmp);
+            } catch (...) {
+                lock.lock();
+                v.mkThunk(env, expr);
+                thunksClaimedByThisThread.erase(&v);
+                stripe.wakeup.notify_all();
+                throw;
+            }
+            lock.lock();
+            v = vTmp;
+            thunksClaimedByThisThread.erase(&v);
+            stripe.wakeup.notify_all();
+            return;
+        }
+
+        else if (v.isApp()) {
+            Value * left = v.app.left;
+            Value * right = v.app.right;
+            v.mkBlackhole();
+            thunksClaimedByThisThread.insert(&v);
+            lock.unlock();
+            Value vTmp;
+            try {
+                callFunction(*left, *right, vTmp, noPos);
+            } catch (...) {
+                lock.lock();
+                v.mkApp(left, right);
+                thunksClaimedByThisThread.erase(&v);
+                stripe.wakeup.notify_all();
+                throw;
+            }
+            lock.lock();
+            v = vTmp;
+            thunksClaimedByThisThread.erase(&v);
+            stripe.wakeup.notify_all();
+            return;
+        }
+
+        else if (v.isBlackhole()) {
+            if (thunksClaimedByThisThread.count(&v))
+                throwEvalError(pos, "infinite recursion encountered");
+            /* Another thread is forcing this value; wait for it. */
+            stripe.wakeup.wait(lock);
+        }
+
+        else return;
+    }
+}
+
+
+bool EvalState::forceValueTry(Value & v, const Pos & pos)
+{
+    if (parallelForcingActive.load(std::memory_order_relaxed) || !v.isThunk()) {
+        try {
+            forceValue(v, pos);
+            return true;
+        } catch (AssertionError &) {
+            return false;
+        }
+    }
+
+    Env * env = v.thunk.env;
+    Expr * expr = v.thunk.expr;
+
+    try {
+        v.mkBlackhole();
+
+        /* Peel off leading `assert' and `if' nodes without relying on
+           exception unwinding: a failing assertion is an anticipated
+           outcome here, not an exceptional one, and unwinding through
+           a deep evaluation stack is expensive. */
+        Expr * e2 = expr;
+        while (true) {
+            if (auto e = dynamic_cast<ExprAssert *>(e2)) {
+                if (!evalBool(*env, e->cond, *e->pos)) {
+                    v.mkThunk(env, expr);
+                    return false;
+                }
+                e2 = e->body;
+            } else if (auto e = dynamic_cast<ExprIf *>(e2))
+                e2 = evalBool(*env, e->cond, *e->pos) ? e->then : e->else_;
+            else
+                break;
+        }
+
+        e2->eval(*this, *env, v);
+        return true;
+    } catch (AssertionError &) {
+        v.mkThunk(env, expr);
+        return false;
+    } catch (...) {
+        v.mkThunk(env, expr);
+        throw;
+    }
+}
+
+
+void EvalState::forceValueDeep(Value & v)
+{
+    /* In parallel mode (eval-cores > 1), fan out over the top-level
+       attributes. This is coarse-grained: each worker sequentially
+       forces the subtree of one attribute, and thunks reachable from
+       several attributes are claimed atomically via
+       forceValueParallel(). */
+    size_t cores = evalSettings.evalCores;
+    if (cores > 1 && !parallelForcingActive) {
+        forceValue(v);
+        if (v.type() == nAttrs && v.attrs->size() > 1) {
+            ThreadPool pool(std::min(cores, (size_t) v.attrs->size()));
+            parallelForcingActive = true;
+            Finally restore([]() { parallelForcingActive = false; });
+            for (auto & i : *v.attrs)
+                pool.enqueue([this, &i]() {
+                    #if HAVE_BOEHMGC
+                    GC_stack_base sb;
+                    GC_get_stack_base(&sb);
+                    GC_register_my_thread(&sb);
+                    #endif
+                    try {
+                        forceValueDeepSeq(*this, *i.value);
+                    } catch (Error & e) {
+                        addErrorTrace(e, *i.pos, "while evaluating the attribute '%1%'", i.name);
+                        throw;
+                    }
+                });
+            pool.process();
+            return;
+        }
+        if (v.isList() && v.listSize() > 1) {
+            ThreadPool pool(std::min(cores, (size_t) v.listSize()));
+            parallelForcingActive = true;
+            Finally restore([]() { parallelForcingActive = false; });
+            for (size_t n = 0; n < v.listSize(); ++n)
+                pool.enqueue([this, &v, n]() {
+                    #if HAVE_BOEHMGC
+                    GC_stack_base sb;
+                    GC_get_stack_base(&sb);
+                    GC_register_my_thread(&sb);
+                    #endif
+                    forceValueDeepSeq(*this, *v.listElems()[n]);
+                });
+            pool.process();
+            return;
+        }
+    }
+
+    forceValueDeepSeq(*this, v);
+}
+
+
 NixInt EvalState::forceInt(Value & v, const Pos & pos)
 {
     forceValue(v, pos);
@@ -1937,16 +2540,26 @@ string EvalState::copyPathToStore(PathSet & context, const Path & path)
         throwEvalError("file names are not allowed to end in '%1%'", drvExtension);
 
     Path dstPath;
-    auto i = srcToStore.find(path);
-    if (i != srcToStore.end())
-        dstPath = store->printStorePath(i->second);
-    else {
+
+    {
+        std::lock_guard<std::mutex> guard(srcToStoreMutex);
+        auto i = srcToStore.find(path);
+        if (i != srcToStore.end())
+            dstPath = store->printStorePath(i->second);
+    }
+
+    /* Don't hold the lock while copying: at worst two threads copy
+       the same source, yielding the same store path. */
+    if (dstPath.empty()) {
         auto p = settings.readOnlyMode
             ? store->computeStorePathForPath(std::string(baseNameOf(path)), checkSourcePath(path)).first
             : store->addToStore(std::string(baseNameOf(path)), checkSourcePath(path), FileIngestionMethod::Recursive, htSHA256, defaultPathFilter, repair);
         dstPath = store->printStorePath(p);
         allowPath(p);
-        srcToStore.insert_or_assign(path, std::move(p));
+        {
+            std::lock_guard<std::mutex> guard(srcToStoreMutex);
+            srcToStore.insert_or_assign(path, std::move(p));
+        }
         printMsg(lvlChatty, "copied source '%1%' -> '%2%'", path, dstPath);
     }
 
@@ -1992,7 +2605,9 @@ bool EvalState::eqValues(Value & v1, Value & v2)
             return v1.boolean == v2.boolean;
 
         case nString:
-            return strcmp(v1.string.s, v2.string.s) == 0;
+            /* Interned strings make the common case a pointer
+               compare. */
+            return v1.string.s == v2.string.s || strcmp(v1.string.s, v2.string.s) == 0;
 
         case nPath:
             return strcmp(v1.path, v2.path) == 0;
@@ -2113,6 +2728,12 @@ void EvalState::printStats()
             auto gc = topObj.object("gc");
             gc.attr("heapSize", heapSize);
             gc.attr("totalBytes", totalBytes);
+            gc.attr("cycles", (uint64_t) GC_get_gc_no());
+#if defined(GC_VERSION_MAJOR) && GC_VERSION_MAJOR >= 8
+            /* Cumulative wall time spent in full collections, in
+               milliseconds. */
+            gc.attr("totalTime", GC_get_full_gc_total_time());
+#endif
         }
 #endif
 
@@ -2122,6 +2743,24 @@ void EvalState::printStats()
                 for (auto & i : primOpCalls)
                     obj.attr(i.first, i.second);
             }
+            {
+                /* Wall time per primop, in nanoseconds. */
+                auto obj = topObj.object("primopTimes");
+                for (auto & i : primOpTimes)
+                    obj.attr(i.first, i.second);
+            }
+            {
+                /* Wall time (nanoseconds) and allocation volume per
+                   file, attributed to the file defining the executing
+                   function and inclusive of callees. */
+                auto list = topObj.list("files");
+                for (auto & i : fileCosts) {
+                    auto obj = list.object();
+                    obj.attr("file", (const string &) i.first);
+                    obj.attr("time", i.second.time);
+                    obj.attr("allocBytes", i.second.allocBytes);
+                }
+            }
             {
                 auto list = topObj.list("functions");
                 for (auto & i : functionCalls) {
@@ -2130,10 +2769,10 @@ void EvalState::printStats()
                         obj.attr("name", (const string &) i.first->name);
                     else
                         obj.attr("name", nullptr);
-                    if (i.first->pos) {
-                        obj.attr("file", (const string &) i.first->pos.file);
-                        obj.attr("line", i.first->pos.line);
-                        obj.attr("column", i.first->pos.column);
+                    if (*i.first->pos) {
+                        obj.attr("file", (const string &) i.first->pos->file);
+                        obj.attr("line", i.first->pos->line);
+                        obj.attr("column", i.first->pos->column);
                     }
                     obj.attr("count", i.second);
                 }
@@ -7,6 +7,7 @@
 #include "config.hh"
 #include "experimental-features.hh"
 
+#include <atomic>
 #include <map>
 #include <optional>
 #include <unordered_map>
@@ -66,6 +67,7 @@ void initGC();
 
 
 struct RegexCache;
+class EvalProfiler;
 
 std::shared_ptr<RegexCache> makeRegexCache();
 
@@ -93,6 +95,13 @@ public:
        mode. */
     std::optional<PathSet> allowedPaths;
 
+    /* Prefix trie over allowedPaths, compiled lazily by
+       checkSourcePath() and kept up to date by allowPath(), so each
+       access check is a walk over the path's components rather than a
+       scan over all allowed roots. */
+    struct AllowedPathsTrie;
+    std::unique_ptr<AllowedPathsTrie> allowedPathsTrie;
+
     Value vEmptySet;
 
     /* Store used to materialise .drv files. */
@@ -127,12 +136,31 @@ private:
 
     std::map<std::string, std::pair<bool, std::string>> searchPathResolved;
 
+    /* State for speculative pre-building of import-from-derivation
+       targets; see realiseContext(). */
+    bool ifdHistoryLoaded = false;
+    std::optional<Path> ifdHistoryFile;
+    StringSet ifdHistory;
+
     /* Cache used by checkSourcePath(). */
     std::unordered_map<Path, Path> resolvedPaths;
 
-    /* Cache used by prim_match(). */
+    /* Cache used by prim_match() and prim_split(). */
     std::shared_ptr<RegexCache> regexCache;
 
+    /* Mutexes guarding the caches above, which are shared between
+       worker threads when eval-cores > 1 (see forceValueDeep()).
+       Each lock is held only around lookups and insertions, never
+       across evaluation, so at worst two threads compute the same
+       cache entry. */
+    std::mutex fileCacheMutex;
+    std::mutex srcToStoreMutex;
+    std::mutex resolvedPathsMutex;
+    std::mutex countCallsMutex;
+
+    /* Sampling profiler, active when eval-profiler-frequency > 0. */
+    std::unique_ptr<EvalProfiler> evalProfiler;
+
 public:
 
     EvalState(
@@ -221,6 +249,24 @@ public:
        result.  Otherwise, this is a no-op. */
     inline void forceValue(Value & v, const Pos & pos = noPos);
 
+    /* Like forceValue(), but used while forceValueDeep() is fanning
+       out over a thread pool. Thunks are claimed by exactly one
+       thread; other threads needing the same thunk block until its
+       result is available. */
+    void forceValueParallel(Value & v, const Pos & pos = noPos);
+
+    /* Whether a parallel forceValueDeep() is in progress, in which
+       case forceValue() routes through forceValueParallel(). */
+    static std::atomic<bool> parallelForcingActive;
+
+    /* Like forceValue(), but returns false instead of throwing when
+       evaluation fails with an AssertionError (which includes
+       ThrownError). A chain of `assert' and `if' nodes at the head of
+       a thunk is evaluated without exception-based control flow, so
+       `builtins.tryEval' applied to the common nixpkgs pattern of
+       assertion-guarded values does not pay for stack unwinding. */
+    bool forceValueTry(Value & v, const Pos & pos = noPos);
+
     /* Force a value, then recursively force list elements and
        attributes. */
     void forceValueDeep(Value & v);
@@ -307,7 +353,9 @@ private:
     friend struct ExprAttrs;
     friend struct ExprLet;
 
-    Expr * parse(const char * text, FileOrigin origin, const Path & path,
+    /* Parse the buffer 'text', which the lexer scans in place and
+       which must end in two NUL bytes ('length' includes them). */
+    Expr * parse(char * text, size_t length, FileOrigin origin, const Path & path,
         const Path & basePath, StaticEnv & staticEnv);
 
 public:
@@ -339,6 +387,7 @@ public:
     Value * allocAttr(Value & vAttrs, const std::string & name);
 
     Bindings * allocBindings(size_t capacity);
+    Bindings * allocLayeredBindings(size_t deltaCapacity, Bindings * base);
 
     void mkList(Value & v, size_t length);
     void mkAttrs(Value & v, size_t capacity);
@@ -350,29 +399,82 @@ public:
     /* Print statistics. */
     void printStats();
 
+    /* Snapshot of the allocation/call counters, for the evaluation
+       benchmark driver ('nix internal benchmark-eval'). */
+    struct Counters
+    {
+        unsigned long nrValues;
+        unsigned long nrEnvs;
+        unsigned long nrAttrsets;
+        unsigned long nrListElems;
+        unsigned long nrFunctionCalls;
+        unsigned long nrOpUpdates;
+    };
+
+    Counters getCounters() const
+    {
+        return { nrValues, nrEnvs, nrAttrsets, nrListElems, nrFunctionCalls, nrOpUpdates };
+    }
+
     void realiseContext(const PathSet & context);
 
 private:
 
-    unsigned long nrEnvs = 0;
-    unsigned long nrValuesInEnvs = 0;
-    unsigned long nrValues = 0;
-    unsigned long nrListElems = 0;
-    unsigned long nrLookups = 0;
-    unsigned long nrAttrsets = 0;
-    unsigned long nrAttrsInAttrsets = 0;
-    unsigned long nrAvoided = 0;
-    unsigned long nrOpUpdates = 0;
-    unsigned long nrOpUpdateValuesCopied = 0;
-    unsigned long nrListConcats = 0;
-    unsigned long nrPrimOpCalls = 0;
-    unsigned long nrFunctionCalls = 0;
+    /* Atomic because they are bumped from worker threads when
+       eval-cores > 1. */
+    std::atomic<unsigned long> nrEnvs{0};
+    std::atomic<unsigned long> nrValuesInEnvs{0};
+    std::atomic<unsigned long> nrValues{0};
+    std::atomic<unsigned long> nrListElems{0};
+    std::atomic<unsigned long> nrLookups{0};
+    std::atomic<unsigned long> nrAttrsets{0};
+    std::atomic<unsigned long> nrAttrsInAttrsets{0};
+    std::atomic<unsigned long> nrAvoided{0};
+    std::atomic<unsigned long> nrOpUpdates{0};
+    std::atomic<unsigned long> nrOpUpdateValuesCopied{0};
+    std::atomic<unsigned long> nrListConcats{0};
+    std::atomic<unsigned long> nrPrimOpCalls{0};
+    std::atomic<unsigned long> nrFunctionCalls{0};
+
+    /* Approximate number of bytes allocated for values, environments,
+       attribute sets and lists, for enforcing 'eval-max-memory'. */
+    std::atomic<size_t> evalAllocBytes{0};
+
+    /* Cached copy of evalSettings.maxEvalMemory (0 = no limit). Set
+       to 0 when the limit fires, so that unwinding and error
+       reporting cannot hit it again. */
+    std::atomic<size_t> maxEvalMemory{0};
+
+    /* Account for 'n' bytes allocated by the evaluator. */
+    inline void addAllocation(size_t n)
+    {
+        evalAllocBytes += n;
+        if (maxEvalMemory && evalAllocBytes > maxEvalMemory)
+            throwEvalMemoryLimitError();
+    }
+
+    [[noreturn]] void throwEvalMemoryLimitError();
 
     bool countCalls;
 
     typedef std::map<Symbol, size_t> PrimOpCalls;
     PrimOpCalls primOpCalls;
 
+    /* Cumulative wall time (in nanoseconds) spent in each primop. */
+    typedef std::map<Symbol, uint64_t> PrimOpTimes;
+    PrimOpTimes primOpTimes;
+
+    /* Cumulative wall time and allocation volume attributed to the
+       file defining the function being executed, inclusive of
+       callees. */
+    struct FileCost
+    {
+        uint64_t time = 0;
+        uint64_t allocBytes = 0;
+    };
+    typedef std::map<Symbol, FileCost> FileCosts;
+    FileCosts fileCosts;
+
     typedef std::map<ExprLambda *, size_t> FunctionCalls;
     FunctionCalls functionCalls;
 
@@ -391,6 +493,7 @@ private:
     friend struct ExprSelect;
     friend void prim_getAttr(EvalState & state, const Pos & pos, Value * * args, Value & v);
     friend void prim_match(EvalState & state, const Pos & pos, Value * * args, Value & v);
+    friend void prim_split(EvalState & state, const Pos & pos, Value * * args, Value & v);
 };
 
 
@@ -475,8 +578,82 @@ struct EvalSettings : Config
           `flamegraph.pl`.
         )"};
 
+    Setting<unsigned int> evalProfilerFrequency{this, 0, "eval-profiler-frequency",
+        R"(
+          If set to a value greater than 0, sample the evaluator's
+          call stack that many times per second. Unlike
+          `trace-function-calls` this has negligible overhead, so it
+          can be used to find evaluation hot spots in production. The
+          profile is written when evaluation finishes, in the folded
+          stack format consumed by `flamegraph.pl` and speedscope. The
+          default is 0 (disabled).
+        )"};
+
+    Setting<Path> evalProfilerFile{this, "nix-eval.folded", "eval-profiler-file",
+        "The file to which the evaluation profiler writes its folded-stack output."};
+
     Setting<bool> useEvalCache{this, true, "eval-cache",
         "Whether to use the flake evaluation cache."};
+
+    Setting<bool> useParseCache{this, false, "parse-cache",
+        R"(
+          Whether to cache parsed .nix files on disk (in
+          `~/.cache/nix/parse-cache-v1`), keyed by their content hash,
+          so that subsequent evaluator invocations can skip the parsing
+          phase entirely.
+        )"};
+
+    Setting<uint64_t> maxEvalMemory{this, 0, "eval-max-memory",
+        R"(
+          The maximum number of bytes that a single evaluation may
+          allocate for values, environments, attribute sets and
+          lists. When the limit is exceeded, the evaluation throws a
+          catchable `EvalMemoryLimitError` instead of running the
+          machine out of memory, and enforcement is disabled so that
+          the error can be reported. Note that this is a cumulative
+          allocation budget rather than a measurement of the live
+          heap, and that it does not cover memory allocated outside
+          the evaluator proper (e.g. by `builtins.readFile`). The
+          default is 0 (no limit).
+        )"};
+
+    Setting<unsigned int> gcMarkers{this, 0, "eval-gc-markers",
+        R"(
+          The number of threads used by the Boehm garbage collector to
+          mark the heap in parallel. If set to 0 (the default), the
+          collector picks a value based on the number of CPU cores.
+          Equivalent to setting the `GC_MARKERS` environment variable,
+          which takes precedence.
+        )"};
+
+    Setting<unsigned int> gcFreeSpaceDivisor{this, 3, "eval-gc-free-space-divisor",
+        R"(
+          The free space divisor of the Boehm garbage collector. The
+          collector tries to keep roughly 1/N of the heap free after
+          each collection; larger values trade evaluation speed for a
+          smaller heap, smaller values the reverse. The default is 3,
+          which is also libgc's default.
+        )"};
+
+    Setting<bool> gcIncremental{this, false, "eval-gc-incremental",
+        R"(
+          Whether to enable incremental (generational) collection in
+          the Boehm garbage collector. This reduces the length of
+          individual collection pauses at some cost in total
+          throughput. The default is false.
+        )"};
+
+    Setting<unsigned int> evalCores{this, 1, "eval-cores",
+        R"(
+          The number of threads used to force values deeply (e.g. by
+          `nix search` and `nix-env -qa`). If set to a value greater
+          than 1, the top-level attributes of an attribute set are
+          forced in parallel on a thread pool, at the granularity of
+          one attribute per work item. The default is 1 (no
+          parallelism). This feature is experimental; evaluation
+          statistics reported via `NIX_SHOW_STATS` may be slightly
+          inaccurate when it is enabled.
+        )"};
 };
 
 extern EvalSettings evalSettings;
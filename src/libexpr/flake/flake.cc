@@ -6,6 +6,7 @@
 #include "store-api.hh"
 #include "fetchers.hh"
 #include "finally.hh"
+#include "thread-pool.hh"
 
 namespace nix {
 
@@ -290,6 +291,46 @@ Flake getFlake(EvalState & state, const FlakeRef & originalRef, bool allowLookup
     return getFlake(state, originalRef, allowLookup, flakeCache);
 }
 
+/* Fetch all locked inputs of a lock file in the background. The lock
+   file fully determines the inputs, so we can start the fetches as
+   soon as it has been parsed and overlap them with evaluation,
+   instead of fetching one by one as the evaluator forces each input.
+   The results land in the fetcher cache and the store, where the
+   evaluator's own fetchTree calls will find them. */
+static void prefetchLockedInputs(ref<Store> store, const LockFile & lockFile)
+{
+    std::vector<FlakeRef> lockedRefs;
+    StringSet seen;
+
+    for (auto & [inputPath, edge] : lockFile.getAllInputs()) {
+        auto lockedNode = std::get_if<0>(&edge);
+        if (!lockedNode || !(*lockedNode)->lockedRef.input.isImmutable()) continue;
+        if (!seen.insert((*lockedNode)->lockedRef.to_string()).second) continue;
+        lockedRefs.push_back((*lockedNode)->lockedRef);
+    }
+
+    if (lockedRefs.empty()) return;
+
+    std::thread([store, lockedRefs{std::move(lockedRefs)}]() {
+        try {
+            ThreadPool pool(std::min<size_t>(lockedRefs.size(), 8));
+            for (auto & lockedRef : lockedRefs)
+                pool.enqueue([store, lockedRef]() {
+                    try {
+                        lockedRef.input.fetch(store);
+                    } catch (...) {
+                        /* Ignore errors: if the input is actually
+                           needed, the evaluator will fetch it again
+                           and report the failure in context. */
+                    }
+                });
+            pool.process();
+        } catch (...) {
+            ignoreException();
+        }
+    }).detach();
+}
+
 /* Compute an in-memory lock file for the specified top-level flake,
    and optionally write it to file, if the flake is writable. */
 LockedFlake lockFlake(
@@ -318,6 +359,12 @@ LockedFlake lockFlake(
 
         debug("old lock file: %s", oldLockFile);
 
+        /* Start fetching the locked inputs while we compute the new
+           locks and the caller evaluates. If the lock file is being
+           recreated its contents are not a useful prediction. */
+        if (!lockFlags.recreateLockFile)
+            prefetchLockedInputs(state.store, oldLockFile);
+
         // FIXME: check whether all overrides are used.
         std::map<InputPath, FlakeInput> overrides;
         std::set<InputPath> overridesUsed, updatesUsed;
@@ -369,6 +416,54 @@ LockedFlake lockFlake(
                 }
             }
 
+            /* Warm the fetcher cache for the inputs at this level
+               that will have to be fetched anyway, in parallel. The
+               lock file itself is still assembled by the sequential
+               loop below, which finds the trees in the cache, so the
+               result is deterministic; a wrong guess here merely
+               costs an unneeded fetch. */
+            {
+                std::vector<fetchers::Input> toPrefetch;
+
+                for (auto & [id, input2] : flakeInputs) {
+                    auto inputPath(inputPathPrefix);
+                    inputPath.push_back(id);
+                    auto i = overrides.find(inputPath);
+                    bool hasOverride = i != overrides.end();
+                    auto & input = hasOverride ? i->second : input2;
+                    if (input.follows || !input.ref) continue;
+                    /* Indirect refs require a registry lookup and
+                       path refs are resolved relative to the parent
+                       flake, so leave those to the loop below. */
+                    auto type = input.ref->input.getType();
+                    if (type == "indirect" || type == "path") continue;
+                    /* Inputs that can be copied unchanged from the
+                       old lock file aren't fetched at all. */
+                    bool reusable = false;
+                    if (oldNode && !lockFlags.inputUpdates.count(inputPath))
+                        if (auto oldLock2 = get(oldNode->inputs, id))
+                            if (auto oldLock3 = std::get_if<0>(&*oldLock2))
+                                if ((*oldLock3)->originalRef == *input.ref && !hasOverride)
+                                    reusable = true;
+                    if (!reusable)
+                        toPrefetch.push_back(input.ref->input);
+                }
+
+                if (toPrefetch.size() > 1) {
+                    ThreadPool pool(std::min(toPrefetch.size(), (size_t) 8));
+                    for (auto & input : toPrefetch)
+                        pool.enqueue([input, &state]() {
+                            try {
+                                input.fetch(state.store);
+                            } catch (...) {
+                                /* Ignore; the loop below will report
+                                   the error with proper context. */
+                            }
+                        });
+                    pool.process();
+                }
+            }
+
             /* Go over the flake inputs, resolve/fetch them if
                necessary (i.e. if they're new or the flakeref changed
                from what's in the lock file). */
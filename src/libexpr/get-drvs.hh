@@ -61,8 +61,16 @@ public:
     */
 
     void setName(const string & s) { name = s; }
+    void setSystem(const string & s) { system = s; }
     void setDrvPath(const string & s) { drvPath = s; }
     void setOutPath(const string & s) { outPath = s; }
+    void setOutputName(const string & s) { outputName = s; }
+    void setOutputs(const Outputs & os) { outputs = os; }
+
+    /* Whether this element is backed by an evaluated attribute set,
+       as opposed to having been reconstructed from stored strings
+       (e.g. from a store path or the nix-env query index). */
+    bool hasAttrs() const { return attrs != nullptr; }
 
     void setFailed() { failed = true; };
     bool hasFailed() { return failed; };
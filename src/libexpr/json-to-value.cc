@@ -34,20 +34,38 @@ class JSONSax : nlohmann::json_sax<json> {
 
     class JSONObjectState : public JSONState {
         using JSONState::JSONState;
-        ValueMap attrs;
+
+        /* The attributes are collected in a flat vector rather than a
+           map: one sort at the end is much cheaper than a tree node
+           allocation per key when streaming very large documents. */
+        std::vector<std::pair<Symbol, Value *>> attrs;
+
         std::unique_ptr<JSONState> resolve(EvalState & state) override
         {
+            std::stable_sort(attrs.begin(), attrs.end(),
+                [](const auto & a, const auto & b) { return a.first < b.first; });
+
+            /* For duplicate keys, the last occurrence wins (as with
+               the previous map-based implementation). */
+            size_t unique = 0;
+            for (size_t n = 0; n < attrs.size(); ++n) {
+                if (unique > 0 && attrs[unique - 1].first == attrs[n].first)
+                    attrs[unique - 1].second = attrs[n].second;
+                else
+                    attrs[unique++] = attrs[n];
+            }
+
             Value & v = parent->value(state);
-            state.mkAttrs(v, attrs.size());
-            for (auto & i : attrs)
-                v.attrs->push_back(Attr(i.first, i.second));
+            state.mkAttrs(v, unique);
+            for (size_t n = 0; n < unique; ++n)
+                v.attrs->push_back(Attr(attrs[n].first, attrs[n].second));
             return std::move(parent);
         }
         void add() override { v = nullptr; }
     public:
         void key(string_t & name, EvalState & state)
         {
-            attrs.insert_or_assign(state.symbols.create(name), &value(state));
+            attrs.emplace_back(state.symbols.create(name), &value(state));
         }
     };
 
@@ -2,12 +2,41 @@
 #include "derivations.hh"
 #include "util.hh"
 
+#include <algorithm>
 #include <cstdlib>
+#include <new>
 
 
 namespace nix {
 
 
+/* Parsing a big expression tree allocates millions of small Expr
+   nodes. They come out of per-thread bump arenas; a fresh chunk is
+   fetched from malloc when the current one is exhausted. Alignment
+   is rounded up to max_align_t, like malloc guarantees. */
+static constexpr size_t exprArenaChunkSize = 1 << 18;
+
+void * Expr::operator new(size_t size)
+{
+    thread_local static char * cur = nullptr;
+    thread_local static size_t left = 0;
+
+    size = (size + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+
+    if (size > left) {
+        auto chunkSize = std::max(exprArenaChunkSize, size);
+        cur = (char *) std::malloc(chunkSize);
+        if (!cur) throw std::bad_alloc();
+        left = chunkSize;
+    }
+
+    auto p = cur;
+    cur += size;
+    left -= size;
+    return p;
+}
+
+
 /* Displaying abstract syntax trees. */
 
 std::ostream & operator << (std::ostream & str, const Expr & e)
@@ -244,6 +273,22 @@ string showAttrPath(const AttrPath & attrPath)
 
 Pos noPos;
 
+PosTable posTable;
+
+ptr<Pos> PosTable::intern(const Pos & pos)
+{
+    if (!pos) return ptr(&noPos);
+
+    std::lock_guard<std::mutex> guard(lock);
+
+    auto i = interned.find(pos);
+    if (i != interned.end()) return ptr(i->second);
+
+    auto & pos2 = arena.emplace_back(pos);
+    interned.emplace(pos2, &pos2);
+    return ptr(&pos2);
+}
+
 
 /* Computing levels/displacements for variables. */
 
@@ -295,7 +340,7 @@ void ExprVar::bindVars(const StaticEnv & env)
     if (withLevel == -1)
         throw UndefinedVarError({
             .msg = hintfmt("undefined variable '%1%'", name),
-            .errPos = pos
+            .errPos = *pos
         });
     fromWith = true;
     this->level = withLevel;
@@ -447,6 +492,130 @@ void ExprPos::bindVars(const StaticEnv & env)
 }
 
 
+/* Constant folding, applied after parsing (and thus before
+   bindVars()). The pass is deliberately conservative: it only folds
+   expressions whose value is fully determined by the text, so the
+   result is indistinguishable from the unfolded AST apart from doing
+   less work at runtime. */
+
+Expr * ExprSelect::simplify(SymbolTable & symbols)
+{
+    e = e->simplify(symbols);
+    if (def) def = def->simplify(symbols);
+    for (auto & i : attrPath)
+        if (!i.symbol.set()) i.expr = i.expr->simplify(symbols);
+
+    /* Fold a static selection from a literal, non-recursive attribute
+       set without dynamic attributes: '{ a = e; }.a' evaluates to
+       'e' in the same environment. */
+    if (auto attrs = dynamic_cast<ExprAttrs *>(e)) {
+        if (!attrs->recursive && attrs->dynamicAttrs.empty()
+            && attrPath.size() == 1 && attrPath[0].symbol.set())
+        {
+            auto j = attrs->attrs.find(attrPath[0].symbol);
+            if (j != attrs->attrs.end())
+                return j->second.e;
+            if (def)
+                return def;
+        }
+    }
+
+    return this;
+}
+
+Expr * ExprOpHasAttr::simplify(SymbolTable & symbols)
+{
+    e = e->simplify(symbols);
+    for (auto & i : attrPath)
+        if (!i.symbol.set()) i.expr = i.expr->simplify(symbols);
+    return this;
+}
+
+Expr * ExprAttrs::simplify(SymbolTable & symbols)
+{
+    for (auto & i : attrs)
+        i.second.e = i.second.e->simplify(symbols);
+    for (auto & i : dynamicAttrs) {
+        i.nameExpr = i.nameExpr->simplify(symbols);
+        i.valueExpr = i.valueExpr->simplify(symbols);
+    }
+    return this;
+}
+
+Expr * ExprList::simplify(SymbolTable & symbols)
+{
+    for (auto & i : elems)
+        i = i->simplify(symbols);
+    return this;
+}
+
+Expr * ExprLambda::simplify(SymbolTable & symbols)
+{
+    if (hasFormals())
+        for (auto & i : formals->formals)
+            if (i.def) i.def = i.def->simplify(symbols);
+    body = body->simplify(symbols);
+    return this;
+}
+
+Expr * ExprCall::simplify(SymbolTable & symbols)
+{
+    fun = fun->simplify(symbols);
+    for (auto & i : args)
+        i = i->simplify(symbols);
+    return this;
+}
+
+Expr * ExprLet::simplify(SymbolTable & symbols)
+{
+    attrs->simplify(symbols);
+    body = body->simplify(symbols);
+    return this;
+}
+
+Expr * ExprWith::simplify(SymbolTable & symbols)
+{
+    attrs = attrs->simplify(symbols);
+    body = body->simplify(symbols);
+    return this;
+}
+
+Expr * ExprIf::simplify(SymbolTable & symbols)
+{
+    cond = cond->simplify(symbols);
+    then = then->simplify(symbols);
+    else_ = else_->simplify(symbols);
+    return this;
+}
+
+Expr * ExprAssert::simplify(SymbolTable & symbols)
+{
+    cond = cond->simplify(symbols);
+    body = body->simplify(symbols);
+    return this;
+}
+
+Expr * ExprConcatStrings::simplify(SymbolTable & symbols)
+{
+    bool allStrings = true;
+    for (auto & i : *es) {
+        i = i->simplify(symbols);
+        if (!dynamic_cast<ExprString *>(i)) allStrings = false;
+    }
+
+    /* Fold a concatenation of string literals ("a${"b"}c") into a
+       single literal. */
+    if (allStrings) {
+        string s;
+        for (auto & i : *es)
+            s += (const string &) dynamic_cast<ExprString *>(i)->s;
+        return new ExprString(symbols.create(s));
+    }
+
+    return this;
+}
+
+
 /* Storing function names. */
 
 void Expr::setName(Symbol & name)
@@ -463,7 +632,7 @@ void ExprLambda::setName(Symbol & name)
 
 string ExprLambda::showNamePos() const
 {
-    return (format("%1% at %2%") % (name.set() ? "'" + (string) name + "'" : "anonymous function") % pos).str();
+    return (format("%1% at %2%") % (name.set() ? "'" + (string) name + "'" : "anonymous function") % *pos).str();
 }
 
 
@@ -473,7 +642,7 @@ string ExprLambda::showNamePos() const
 size_t SymbolTable::totalSize() const
 {
     size_t n = 0;
-    for (auto & i : symbols)
+    for (auto & i : arena)
         n += i.size();
     return n;
 }
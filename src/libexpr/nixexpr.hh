@@ -17,6 +17,7 @@ MakeError(TypeError, EvalError);
 MakeError(UndefinedVarError, Error);
 MakeError(MissingArgumentError, EvalError);
 MakeError(RestrictedPathError, Error);
+MakeError(EvalMemoryLimitError, EvalError);
 
 
 /* Position objects. */
@@ -51,6 +52,36 @@ extern Pos noPos;
 std::ostream & operator << (std::ostream & str, const Pos & pos);
 
 
+/* Position table used by the parser and evaluator. Positions are
+   interned so that each AST node and attribute stores only a pointer
+   to a shared Pos instead of a full Pos by value; expressions from
+   the same line (and copies of the same position, which the parser
+   produces in abundance) all point to one entry. */
+class PosTable
+{
+private:
+    /* The positions themselves live in a deque, which never moves
+       its elements, so handing out pointers into it is safe. */
+    std::deque<Pos> arena;
+
+    std::map<Pos, Pos *> interned;
+
+    /* intern() may be called concurrently when imports are parsed
+       during parallel deep forcing (see the 'eval-cores' setting). */
+    std::mutex lock;
+
+public:
+    ptr<Pos> intern(const Pos & pos);
+
+    size_t size() const
+    {
+        return arena.size();
+    }
+};
+
+extern PosTable posTable;
+
+
 struct Env;
 struct Value;
 class EvalState;
@@ -75,12 +106,26 @@ string showAttrPath(const AttrPath & attrPath);
 
 struct Expr
 {
+    /* AST nodes are immortal (the parse cache keeps them alive for
+       the lifetime of the process), so they are carved out of a bump
+       arena instead of being individually malloc()ed: allocation is
+       a pointer increment and consecutively parsed nodes share
+       pages, which helps traversal locality. 'delete' runs the
+       destructor but the memory is never returned. */
+    void * operator new(size_t size);
+    void operator delete(void * ptr) { }
+    void operator delete(void * ptr, size_t size) { }
+
     virtual ~Expr() { };
     virtual void show(std::ostream & str) const;
     virtual void bindVars(const StaticEnv & env);
     virtual void eval(EvalState & state, Env & env, Value & v);
     virtual Value * maybeThunk(EvalState & state, Env & env);
     virtual void setName(Symbol & name);
+    /* Constant folding, applied after parsing: simplify the children
+       of this expression and return a (possibly different) folded
+       expression. */
+    virtual Expr * simplify(SymbolTable & symbols) { return this; };
 };
 
 std::ostream & operator << (std::ostream & str, const Expr & e);
@@ -138,7 +183,7 @@ typedef uint32_t Displacement;
 
 struct ExprVar : Expr
 {
-    Pos pos;
+    ptr<Pos> pos;
     Symbol name;
 
     /* Whether the variable comes from an environment (e.g. a rec, let
@@ -154,19 +199,20 @@ struct ExprVar : Expr
     Level level;
     Displacement displ;
 
-    ExprVar(const Symbol & name) : name(name) { };
-    ExprVar(const Pos & pos, const Symbol & name) : pos(pos), name(name) { };
+    ExprVar(const Symbol & name) : pos(&noPos), name(name) { };
+    ExprVar(const Pos & pos, const Symbol & name) : pos(posTable.intern(pos)), name(name) { };
     COMMON_METHODS
     Value * maybeThunk(EvalState & state, Env & env);
 };
 
 struct ExprSelect : Expr
 {
-    Pos pos;
+    ptr<Pos> pos;
     Expr * e, * def;
     AttrPath attrPath;
-    ExprSelect(const Pos & pos, Expr * e, const AttrPath & attrPath, Expr * def) : pos(pos), e(e), def(def), attrPath(attrPath) { };
-    ExprSelect(const Pos & pos, Expr * e, const Symbol & name) : pos(pos), e(e), def(0) { attrPath.push_back(AttrName(name)); };
+    ExprSelect(const Pos & pos, Expr * e, const AttrPath & attrPath, Expr * def) : pos(posTable.intern(pos)), e(e), def(def), attrPath(attrPath) { };
+    ExprSelect(const Pos & pos, Expr * e, const Symbol & name) : pos(posTable.intern(pos)), e(e), def(0) { attrPath.push_back(AttrName(name)); };
+    Expr * simplify(SymbolTable & symbols);
     COMMON_METHODS
 };
 
@@ -175,34 +221,40 @@ struct ExprOpHasAttr : Expr
     Expr * e;
     AttrPath attrPath;
     ExprOpHasAttr(Expr * e, const AttrPath & attrPath) : e(e), attrPath(attrPath) { };
+    Expr * simplify(SymbolTable & symbols);
     COMMON_METHODS
 };
 
 struct ExprAttrs : Expr
 {
     bool recursive;
-    Pos pos;
+    ptr<Pos> pos;
     struct AttrDef {
         bool inherited;
         Expr * e;
-        Pos pos;
+        ptr<Pos> pos;
         Displacement displ; // displacement
         AttrDef(Expr * e, const Pos & pos, bool inherited=false)
-            : inherited(inherited), e(e), pos(pos) { };
-        AttrDef() { };
+            : inherited(inherited), e(e), pos(posTable.intern(pos)) { };
+        AttrDef() : pos(&noPos) { };
     };
+    /* Keyed by Symbol, whose '<' is the same order that
+       Bindings::sort() uses, so iterating over this map yields the
+       attrs pre-sorted and ExprAttrs::eval never needs to sort the
+       dynamic-attr-free common case. */
     typedef std::map<Symbol, AttrDef> AttrDefs;
     AttrDefs attrs;
     struct DynamicAttrDef {
         Expr * nameExpr, * valueExpr;
-        Pos pos;
+        ptr<Pos> pos;
         DynamicAttrDef(Expr * nameExpr, Expr * valueExpr, const Pos & pos)
-            : nameExpr(nameExpr), valueExpr(valueExpr), pos(pos) { };
+            : nameExpr(nameExpr), valueExpr(valueExpr), pos(posTable.intern(pos)) { };
     };
     typedef std::vector<DynamicAttrDef> DynamicAttrDefs;
     DynamicAttrDefs dynamicAttrs;
-    ExprAttrs(const Pos &pos) : recursive(false), pos(pos) { };
-    ExprAttrs() : recursive(false), pos(noPos) { };
+    ExprAttrs(const Pos &pos) : recursive(false), pos(posTable.intern(pos)) { };
+    ExprAttrs() : recursive(false), pos(&noPos) { };
+    Expr * simplify(SymbolTable & symbols);
     COMMON_METHODS
 };
 
@@ -210,15 +262,16 @@ struct ExprList : Expr
 {
     std::vector<Expr *> elems;
     ExprList() { };
+    Expr * simplify(SymbolTable & symbols);
     COMMON_METHODS
 };
 
 struct Formal
 {
-    Pos pos;
+    ptr<Pos> pos;
     Symbol name;
     Expr * def;
-    Formal(const Pos & pos, const Symbol & name, Expr * def) : pos(pos), name(name), def(def) { };
+    Formal(const Pos & pos, const Symbol & name, Expr * def) : pos(posTable.intern(pos)), name(name), def(def) { };
 };
 
 struct Formals
@@ -231,13 +284,13 @@ struct Formals
 
 struct ExprLambda : Expr
 {
-    Pos pos;
+    ptr<Pos> pos;
     Symbol name;
     Symbol arg;
     Formals * formals;
     Expr * body;
     ExprLambda(const Pos & pos, const Symbol & arg, Formals * formals, Expr * body)
-        : pos(pos), arg(arg), formals(formals), body(body)
+        : pos(posTable.intern(pos)), arg(arg), formals(formals), body(body)
     {
         if (!arg.empty() && formals && formals->argNames.find(arg) != formals->argNames.end())
             throw ParseError({
@@ -248,6 +301,7 @@ struct ExprLambda : Expr
     void setName(Symbol & name);
     string showNamePos() const;
     inline bool hasFormals() const { return formals != nullptr; }
+    Expr * simplify(SymbolTable & symbols);
     COMMON_METHODS
 };
 
@@ -255,10 +309,11 @@ struct ExprCall : Expr
 {
     Expr * fun;
     std::vector<Expr *> args;
-    Pos pos;
+    ptr<Pos> pos;
     ExprCall(const Pos & pos, Expr * fun, std::vector<Expr *> && args)
-        : fun(fun), args(args), pos(pos)
+        : fun(fun), args(args), pos(posTable.intern(pos))
     { }
+    Expr * simplify(SymbolTable & symbols);
     COMMON_METHODS
 };
 
@@ -267,31 +322,35 @@ struct ExprLet : Expr
     ExprAttrs * attrs;
     Expr * body;
     ExprLet(ExprAttrs * attrs, Expr * body) : attrs(attrs), body(body) { };
+    Expr * simplify(SymbolTable & symbols);
     COMMON_METHODS
 };
 
 struct ExprWith : Expr
 {
-    Pos pos;
+    ptr<Pos> pos;
     Expr * attrs, * body;
     size_t prevWith;
-    ExprWith(const Pos & pos, Expr * attrs, Expr * body) : pos(pos), attrs(attrs), body(body) { };
+    ExprWith(const Pos & pos, Expr * attrs, Expr * body) : pos(posTable.intern(pos)), attrs(attrs), body(body) { };
+    Expr * simplify(SymbolTable & symbols);
     COMMON_METHODS
 };
 
 struct ExprIf : Expr
 {
-    Pos pos;
+    ptr<Pos> pos;
     Expr * cond, * then, * else_;
-    ExprIf(const Pos & pos, Expr * cond, Expr * then, Expr * else_) : pos(pos), cond(cond), then(then), else_(else_) { };
+    ExprIf(const Pos & pos, Expr * cond, Expr * then, Expr * else_) : pos(posTable.intern(pos)), cond(cond), then(then), else_(else_) { };
+    Expr * simplify(SymbolTable & symbols);
     COMMON_METHODS
 };
 
 struct ExprAssert : Expr
 {
-    Pos pos;
+    ptr<Pos> pos;
     Expr * cond, * body;
-    ExprAssert(const Pos & pos, Expr * cond, Expr * body) : pos(pos), cond(cond), body(body) { };
+    ExprAssert(const Pos & pos, Expr * cond, Expr * body) : pos(posTable.intern(pos)), cond(cond), body(body) { };
+    Expr * simplify(SymbolTable & symbols);
     COMMON_METHODS
 };
 
@@ -299,16 +358,17 @@ struct ExprOpNot : Expr
 {
     Expr * e;
     ExprOpNot(Expr * e) : e(e) { };
+    Expr * simplify(SymbolTable & symbols) { e = e->simplify(symbols); return this; }
     COMMON_METHODS
 };
 
 #define MakeBinOp(name, s) \
     struct name : Expr \
     { \
-        Pos pos; \
+        ptr<Pos> pos; \
         Expr * e1, * e2; \
-        name(Expr * e1, Expr * e2) : e1(e1), e2(e2) { }; \
-        name(const Pos & pos, Expr * e1, Expr * e2) : pos(pos), e1(e1), e2(e2) { }; \
+        name(Expr * e1, Expr * e2) : pos(&noPos), e1(e1), e2(e2) { }; \
+        name(const Pos & pos, Expr * e1, Expr * e2) : pos(posTable.intern(pos)), e1(e1), e2(e2) { }; \
         void show(std::ostream & str) const \
         { \
             str << "(" << *e1 << " " s " " << *e2 << ")";   \
@@ -317,6 +377,10 @@ struct ExprOpNot : Expr
         { \
             e1->bindVars(env); e2->bindVars(env); \
         } \
+        Expr * simplify(SymbolTable & symbols) \
+        { \
+            e1 = e1->simplify(symbols); e2 = e2->simplify(symbols); return this; \
+        } \
         void eval(EvalState & state, Env & env, Value & v); \
     };
 
@@ -330,18 +394,19 @@ MakeBinOp(ExprOpConcatLists, "++")
 
 struct ExprConcatStrings : Expr
 {
-    Pos pos;
+    ptr<Pos> pos;
     bool forceString;
     vector<Expr *> * es;
     ExprConcatStrings(const Pos & pos, bool forceString, vector<Expr *> * es)
-        : pos(pos), forceString(forceString), es(es) { };
+        : pos(posTable.intern(pos)), forceString(forceString), es(es) { };
+    Expr * simplify(SymbolTable & symbols);
     COMMON_METHODS
 };
 
 struct ExprPos : Expr
 {
-    Pos pos;
-    ExprPos(const Pos & pos) : pos(pos) { };
+    ptr<Pos> pos;
+    ExprPos(const Pos & pos) : pos(posTable.intern(pos)) { };
     COMMON_METHODS
 };
 
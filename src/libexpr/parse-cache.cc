@@ -0,0 +1,454 @@
+#include "parse-cache.hh"
+#include "nixexpr.hh"
+#include "serialise.hh"
+#include "util.hh"
+
+#include <cstring>
+
+namespace nix {
+
+/* Bump this when the format or the AST representation changes. */
+static const uint64_t parseCacheVersion = 1;
+
+static Path parseCacheDir()
+{
+    return getCacheDir() + "/nix/parse-cache-v" + std::to_string(parseCacheVersion);
+}
+
+static Path parseCacheFile(const Hash & key)
+{
+    return parseCacheDir() + "/" + key.to_string(Base32, false) + ".ast";
+}
+
+/* Node tags. 0 is reserved for null expression pointers (e.g. the
+   default of an ExprSelect). */
+enum ExprTag : uint8_t {
+    etNull = 0,
+    etInt, etFloat, etString, etPath, etVar, etSelect, etOpHasAttr, etAttrs,
+    etList, etLambda, etCall, etLet, etWith, etIf, etAssert, etOpNot,
+    etOpEq, etOpNEq, etOpAnd, etOpOr, etOpImpl, etOpUpdate, etOpConcatLists,
+    etConcatStrings, etPos,
+};
+
+static void writePos(Sink & sink, const Pos & pos)
+{
+    /* The file is implied by the cache key; only line/column are
+       stored. */
+    sink << (uint64_t) pos.line << (uint64_t) pos.column;
+}
+
+static void writeExpr(Sink & sink, const Expr * e);
+
+static void writeAttrPath(Sink & sink, const AttrPath & attrPath)
+{
+    sink << (uint64_t) attrPath.size();
+    for (auto & i : attrPath) {
+        if (i.symbol.set()) {
+            sink << (uint64_t) 1;
+            sink << (const string &) i.symbol;
+        } else {
+            sink << (uint64_t) 0;
+            writeExpr(sink, i.expr);
+        }
+    }
+}
+
+static void writeExpr(Sink & sink, const Expr * e)
+{
+    if (!e) {
+        sink << (uint64_t) etNull;
+        return;
+    }
+
+    if (auto e2 = dynamic_cast<const ExprInt *>(e)) {
+        sink << (uint64_t) etInt << (uint64_t) e2->n;
+    }
+
+    else if (auto e2 = dynamic_cast<const ExprFloat *>(e)) {
+        uint64_t bits;
+        static_assert(sizeof(bits) == sizeof(e2->nf));
+        memcpy(&bits, &e2->nf, sizeof(bits));
+        sink << (uint64_t) etFloat << bits;
+    }
+
+    else if (auto e2 = dynamic_cast<const ExprString *>(e)) {
+        sink << (uint64_t) etString << (const string &) e2->s;
+    }
+
+    else if (auto e2 = dynamic_cast<const ExprPath *>(e)) {
+        sink << (uint64_t) etPath << e2->s;
+    }
+
+    else if (auto e2 = dynamic_cast<const ExprVar *>(e)) {
+        sink << (uint64_t) etVar;
+        writePos(sink, *e2->pos);
+        sink << (const string &) e2->name;
+    }
+
+    else if (auto e2 = dynamic_cast<const ExprSelect *>(e)) {
+        sink << (uint64_t) etSelect;
+        writePos(sink, *e2->pos);
+        writeExpr(sink, e2->e);
+        writeExpr(sink, e2->def);
+        writeAttrPath(sink, e2->attrPath);
+    }
+
+    else if (auto e2 = dynamic_cast<const ExprOpHasAttr *>(e)) {
+        sink << (uint64_t) etOpHasAttr;
+        writeExpr(sink, e2->e);
+        writeAttrPath(sink, e2->attrPath);
+    }
+
+    else if (auto e2 = dynamic_cast<const ExprAttrs *>(e)) {
+        sink << (uint64_t) etAttrs << (uint64_t) e2->recursive;
+        writePos(sink, *e2->pos);
+        sink << (uint64_t) e2->attrs.size();
+        for (auto & i : e2->attrs) {
+            sink << (const string &) i.first << (uint64_t) i.second.inherited;
+            writeExpr(sink, i.second.e);
+            writePos(sink, *i.second.pos);
+        }
+        sink << (uint64_t) e2->dynamicAttrs.size();
+        for (auto & i : e2->dynamicAttrs) {
+            writeExpr(sink, i.nameExpr);
+            writeExpr(sink, i.valueExpr);
+            writePos(sink, *i.pos);
+        }
+    }
+
+    else if (auto e2 = dynamic_cast<const ExprList *>(e)) {
+        sink << (uint64_t) etList << (uint64_t) e2->elems.size();
+        for (auto & i : e2->elems)
+            writeExpr(sink, i);
+    }
+
+    else if (auto e2 = dynamic_cast<const ExprLambda *>(e)) {
+        sink << (uint64_t) etLambda;
+        writePos(sink, *e2->pos);
+        sink << (e2->arg.set() ? (const string &) e2->arg : "");
+        if (e2->formals) {
+            sink << (uint64_t) 1 << (uint64_t) e2->formals->ellipsis
+                 << (uint64_t) e2->formals->formals.size();
+            for (auto & i : e2->formals->formals) {
+                writePos(sink, *i.pos);
+                sink << (const string &) i.name;
+                writeExpr(sink, i.def);
+            }
+        } else
+            sink << (uint64_t) 0;
+        writeExpr(sink, e2->body);
+    }
+
+    else if (auto e2 = dynamic_cast<const ExprCall *>(e)) {
+        sink << (uint64_t) etCall;
+        writePos(sink, *e2->pos);
+        writeExpr(sink, e2->fun);
+        sink << (uint64_t) e2->args.size();
+        for (auto & i : e2->args)
+            writeExpr(sink, i);
+    }
+
+    else if (auto e2 = dynamic_cast<const ExprLet *>(e)) {
+        sink << (uint64_t) etLet;
+        writeExpr(sink, e2->attrs);
+        writeExpr(sink, e2->body);
+    }
+
+    else if (auto e2 = dynamic_cast<const ExprWith *>(e)) {
+        sink << (uint64_t) etWith;
+        writePos(sink, *e2->pos);
+        writeExpr(sink, e2->attrs);
+        writeExpr(sink, e2->body);
+    }
+
+    else if (auto e2 = dynamic_cast<const ExprIf *>(e)) {
+        sink << (uint64_t) etIf;
+        writePos(sink, *e2->pos);
+        writeExpr(sink, e2->cond);
+        writeExpr(sink, e2->then);
+        writeExpr(sink, e2->else_);
+    }
+
+    else if (auto e2 = dynamic_cast<const ExprAssert *>(e)) {
+        sink << (uint64_t) etAssert;
+        writePos(sink, *e2->pos);
+        writeExpr(sink, e2->cond);
+        writeExpr(sink, e2->body);
+    }
+
+    else if (auto e2 = dynamic_cast<const ExprOpNot *>(e)) {
+        sink << (uint64_t) etOpNot;
+        writeExpr(sink, e2->e);
+    }
+
+    #define WRITE_BINOP(type, tag) \
+    else if (auto e2 = dynamic_cast<const type *>(e)) { \
+        sink << (uint64_t) tag; \
+        writePos(sink, *e2->pos); \
+        writeExpr(sink, e2->e1); \
+        writeExpr(sink, e2->e2); \
+    }
+
+    WRITE_BINOP(ExprOpEq, etOpEq)
+    WRITE_BINOP(ExprOpNEq, etOpNEq)
+    WRITE_BINOP(ExprOpAnd, etOpAnd)
+    WRITE_BINOP(ExprOpOr, etOpOr)
+    WRITE_BINOP(ExprOpImpl, etOpImpl)
+    WRITE_BINOP(ExprOpUpdate, etOpUpdate)
+    WRITE_BINOP(ExprOpConcatLists, etOpConcatLists)
+
+    #undef WRITE_BINOP
+
+    else if (auto e2 = dynamic_cast<const ExprConcatStrings *>(e)) {
+        sink << (uint64_t) etConcatStrings;
+        writePos(sink, *e2->pos);
+        sink << (uint64_t) e2->forceString << (uint64_t) e2->es->size();
+        for (auto & i : *e2->es)
+            writeExpr(sink, i);
+    }
+
+    else if (auto e2 = dynamic_cast<const ExprPos *>(e)) {
+        sink << (uint64_t) etPos;
+        writePos(sink, *e2->pos);
+    }
+
+    else
+        /* ExprIndStr and other parse-time-only nodes never appear in
+           a final AST. */
+        throw Error("cannot serialise Nix expression");
+}
+
+struct ParseCacheReader
+{
+    Source & source;
+    SymbolTable & symbols;
+    Symbol file;
+
+    Pos readPos()
+    {
+        auto line = readNum<uint64_t>(source);
+        auto column = readNum<uint64_t>(source);
+        return Pos(foFile, file, line, column);
+    }
+
+    Symbol readSymbol()
+    {
+        return symbols.create(readString(source));
+    }
+
+    AttrPath readAttrPath()
+    {
+        AttrPath attrPath;
+        auto n = readNum<uint64_t>(source);
+        for (uint64_t i = 0; i < n; ++i) {
+            if (readNum<uint64_t>(source))
+                attrPath.push_back(AttrName(readSymbol()));
+            else
+                attrPath.push_back(AttrName(readExpr()));
+        }
+        return attrPath;
+    }
+
+    Expr * readExpr()
+    {
+        auto tag = readNum<uint64_t>(source);
+
+        switch (tag) {
+
+        case etNull:
+            return nullptr;
+
+        case etInt:
+            return new ExprInt(readNum<uint64_t>(source));
+
+        case etFloat: {
+            auto bits = readNum<uint64_t>(source);
+            NixFloat nf;
+            memcpy(&nf, &bits, sizeof(nf));
+            return new ExprFloat(nf);
+        }
+
+        case etString:
+            return new ExprString(readSymbol());
+
+        case etPath:
+            return new ExprPath(readString(source));
+
+        case etVar: {
+            auto pos = readPos();
+            return new ExprVar(pos, readSymbol());
+        }
+
+        case etSelect: {
+            auto pos = readPos();
+            auto e = readExpr();
+            auto def = readExpr();
+            return new ExprSelect(pos, e, readAttrPath(), def);
+        }
+
+        case etOpHasAttr: {
+            auto e = readExpr();
+            return new ExprOpHasAttr(e, readAttrPath());
+        }
+
+        case etAttrs: {
+            auto recursive = readNum<uint64_t>(source);
+            auto e = new ExprAttrs(readPos());
+            e->recursive = recursive;
+            auto nrAttrs = readNum<uint64_t>(source);
+            for (uint64_t i = 0; i < nrAttrs; ++i) {
+                auto name = readSymbol();
+                auto inherited = readNum<uint64_t>(source);
+                auto def = readExpr();
+                e->attrs.emplace(name, ExprAttrs::AttrDef(def, readPos(), inherited));
+            }
+            auto nrDynamic = readNum<uint64_t>(source);
+            for (uint64_t i = 0; i < nrDynamic; ++i) {
+                auto nameExpr = readExpr();
+                auto valueExpr = readExpr();
+                e->dynamicAttrs.push_back(ExprAttrs::DynamicAttrDef(nameExpr, valueExpr, readPos()));
+            }
+            return e;
+        }
+
+        case etList: {
+            auto e = new ExprList;
+            auto n = readNum<uint64_t>(source);
+            e->elems.reserve(n);
+            for (uint64_t i = 0; i < n; ++i)
+                e->elems.push_back(readExpr());
+            return e;
+        }
+
+        case etLambda: {
+            auto pos = readPos();
+            auto arg = readString(source);
+            Formals * formals = nullptr;
+            if (readNum<uint64_t>(source)) {
+                formals = new Formals;
+                formals->ellipsis = readNum<uint64_t>(source);
+                auto n = readNum<uint64_t>(source);
+                for (uint64_t i = 0; i < n; ++i) {
+                    auto fPos = readPos();
+                    auto fName = readSymbol();
+                    formals->formals.push_back(Formal(fPos, fName, readExpr()));
+                    formals->argNames.insert(fName);
+                }
+            }
+            auto body = readExpr();
+            return new ExprLambda(pos,
+                arg.empty() ? Symbol() : symbols.create(arg), formals, body);
+        }
+
+        case etCall: {
+            auto pos = readPos();
+            auto fun = readExpr();
+            auto n = readNum<uint64_t>(source);
+            std::vector<Expr *> args;
+            args.reserve(n);
+            for (uint64_t i = 0; i < n; ++i)
+                args.push_back(readExpr());
+            return new ExprCall(pos, fun, std::move(args));
+        }
+
+        case etLet: {
+            auto attrs = dynamic_cast<ExprAttrs *>(readExpr());
+            if (!attrs) throw Error("corrupt parse cache entry");
+            return new ExprLet(attrs, readExpr());
+        }
+
+        case etWith: {
+            auto pos = readPos();
+            auto attrs = readExpr();
+            return new ExprWith(pos, attrs, readExpr());
+        }
+
+        case etIf: {
+            auto pos = readPos();
+            auto cond = readExpr();
+            auto then = readExpr();
+            return new ExprIf(pos, cond, then, readExpr());
+        }
+
+        case etAssert: {
+            auto pos = readPos();
+            auto cond = readExpr();
+            return new ExprAssert(pos, cond, readExpr());
+        }
+
+        case etOpNot:
+            return new ExprOpNot(readExpr());
+
+        #define READ_BINOP(tag, type) \
+        case tag: { \
+            auto pos = readPos(); \
+            auto e1 = readExpr(); \
+            return new type(pos, e1, readExpr()); \
+        }
+
+        READ_BINOP(etOpEq, ExprOpEq)
+        READ_BINOP(etOpNEq, ExprOpNEq)
+        READ_BINOP(etOpAnd, ExprOpAnd)
+        READ_BINOP(etOpOr, ExprOpOr)
+        READ_BINOP(etOpImpl, ExprOpImpl)
+        READ_BINOP(etOpUpdate, ExprOpUpdate)
+        READ_BINOP(etOpConcatLists, ExprOpConcatLists)
+
+        #undef READ_BINOP
+
+        case etConcatStrings: {
+            auto pos = readPos();
+            auto forceString = readNum<uint64_t>(source);
+            auto n = readNum<uint64_t>(source);
+            auto es = new std::vector<Expr *>;
+            es->reserve(n);
+            for (uint64_t i = 0; i < n; ++i)
+                es->push_back(readExpr());
+            return new ExprConcatStrings(pos, forceString, es);
+        }
+
+        case etPos:
+            return new ExprPos(readPos());
+
+        default:
+            throw Error("corrupt parse cache entry");
+        }
+    }
+};
+
+Expr * readCachedParse(EvalState & state, const Hash & key, const Path & path)
+{
+    try {
+        auto cacheFile = parseCacheFile(key);
+        if (!pathExists(cacheFile)) return nullptr;
+        auto s = readFile(cacheFile);
+        StringSource source(s);
+        if (readNum<uint64_t>(source) != parseCacheVersion) return nullptr;
+        ParseCacheReader reader{source, state.symbols, state.symbols.create(path)};
+        return reader.readExpr();
+    } catch (Error & e) {
+        debug("ignoring corrupt parse cache entry for '%s': %s", path, e.what());
+        return nullptr;
+    }
+}
+
+void writeCachedParse(const Hash & key, const Expr & e)
+{
+    try {
+        createDirs(parseCacheDir());
+        StringSink sink;
+        sink << parseCacheVersion;
+        writeExpr(sink, &e);
+        auto cacheFile = parseCacheFile(key);
+        /* Write atomically so concurrent evaluators never see a
+           partial entry. */
+        auto tmpFile = cacheFile + "." + std::to_string(getpid());
+        writeFile(tmpFile, *sink.s);
+        if (rename(tmpFile.c_str(), cacheFile.c_str()) == -1)
+            throw SysError("renaming '%s' to '%s'", tmpFile, cacheFile);
+    } catch (Error & e) {
+        debug("ignoring error writing the parse cache: %s", e.what());
+    }
+}
+
+}
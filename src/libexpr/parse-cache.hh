@@ -0,0 +1,24 @@
+#pragma once
+
+#include "eval.hh"
+#include "hash.hh"
+
+namespace nix {
+
+/* On-disk cache of parsed .nix files (see the 'parse-cache'
+   setting). Parsed ASTs are serialised to a compact binary format
+   keyed by the content hash of the source file (and its directory,
+   since relative path literals are resolved at parse time), so
+   subsequent evaluator invocations can skip lexing/parsing
+   entirely. */
+
+/* Return the AST cached under 'key', or null if there is no usable
+   cache entry. Positions in the returned AST refer to 'path'. The
+   caller is responsible for running bindVars() on the result. */
+Expr * readCachedParse(EvalState & state, const Hash & key, const Path & path);
+
+/* Serialise 'e' to the parse cache under 'key'. Failures are
+   ignored; the cache is strictly an optimisation. */
+void writeCachedParse(const Hash & key, const Expr & e);
+
+}
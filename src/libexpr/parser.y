@@ -99,10 +99,10 @@ static void addAttr(ExprAttrs * attrs, AttrPath & attrPath,
             if (j != attrs->attrs.end()) {
                 if (!j->second.inherited) {
                     ExprAttrs * attrs2 = dynamic_cast<ExprAttrs *>(j->second.e);
-                    if (!attrs2) dupAttr(attrPath, pos, j->second.pos);
+                    if (!attrs2) dupAttr(attrPath, pos, *j->second.pos);
                     attrs = attrs2;
                 } else
-                    dupAttr(attrPath, pos, j->second.pos);
+                    dupAttr(attrPath, pos, *j->second.pos);
             } else {
                 ExprAttrs * nested = new ExprAttrs;
                 attrs->attrs[i->symbol] = ExprAttrs::AttrDef(nested, pos);
@@ -129,11 +129,11 @@ static void addAttr(ExprAttrs * attrs, AttrPath & attrPath,
                 for (auto & ad : ae->attrs) {
                     auto j2 = jAttrs->attrs.find(ad.first);
                     if (j2 != jAttrs->attrs.end()) // Attr already defined in iAttrs, error.
-                        dupAttr(ad.first, j2->second.pos, ad.second.pos);
+                        dupAttr(ad.first, *j2->second.pos, *ad.second.pos);
                     jAttrs->attrs.emplace(ad.first, ad.second);
                 }
             } else {
-                dupAttr(attrPath, pos, j->second.pos);
+                dupAttr(attrPath, pos, *j->second.pos);
             }
         } else {
             // This attr path is not defined. Let's create it.
@@ -494,7 +494,7 @@ binds
     { $$ = $1;
       for (auto & i : *$3) {
           if ($$->attrs.find(i.symbol) != $$->attrs.end())
-              dupAttr(i.symbol, makeCurPos(@3, data), $$->attrs[i.symbol].pos);
+              dupAttr(i.symbol, makeCurPos(@3, data), *$$->attrs[i.symbol].pos);
           Pos pos = makeCurPos(@3, data);
           $$->attrs.emplace(i.symbol, ExprAttrs::AttrDef(new ExprVar(CUR_POS, i.symbol), pos, true));
       }
@@ -504,7 +504,7 @@ binds
       /* !!! Should ensure sharing of the expression in $4. */
       for (auto & i : *$6) {
           if ($$->attrs.find(i.symbol) != $$->attrs.end())
-              dupAttr(i.symbol, makeCurPos(@6, data), $$->attrs[i.symbol].pos);
+              dupAttr(i.symbol, makeCurPos(@6, data), *$$->attrs[i.symbol].pos);
           $$->attrs.emplace(i.symbol, ExprAttrs::AttrDef(new ExprSelect(CUR_POS, $4, i.symbol), makeCurPos(@6, data)));
       }
     }
@@ -587,6 +587,7 @@ formal
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 
@@ -594,12 +595,13 @@ formal
 #include "filetransfer.hh"
 #include "fetchers.hh"
 #include "store-api.hh"
+#include "parse-cache.hh"
 
 
 namespace nix {
 
 
-Expr * EvalState::parse(const char * text, FileOrigin origin,
+Expr * EvalState::parse(char * text, size_t length, FileOrigin origin,
     const Path & path, const Path & basePath, StaticEnv & staticEnv)
 {
     yyscan_t scanner;
@@ -619,12 +621,14 @@ Expr * EvalState::parse(const char * text, FileOrigin origin,
     data.basePath = basePath;
 
     yylex_init(&scanner);
-    yy_scan_string(text, scanner);
+    yy_scan_buffer(text, length, scanner);
     int res = yyparse(scanner, &data);
     yylex_destroy(scanner);
 
     if (res) throw ParseError(data.error.value());
 
+    data.result = data.result->simplify(symbols);
+
     data.result->bindVars(staticEnv);
 
     return data.result;
@@ -665,13 +669,80 @@ Expr * EvalState::parseExprFromFile(const Path & path)
 
 Expr * EvalState::parseExprFromFile(const Path & path, StaticEnv & staticEnv)
 {
-    return parse(readFile(path).c_str(), foFile, path, dirOf(path), staticEnv);
+    AutoCloseFD fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd)
+        throw SysError("opening file '%1%'", path);
+
+    struct stat st;
+    if (fstat(fd.get(), &st) == -1)
+        throw SysError("statting file '%1%'", path);
+
+    /* Scan regular files in place through a private mapping, which
+       saves copying the source text onto the heap. The mapping must
+       be writable because the lexer temporarily NUL-terminates
+       tokens, and the final page must have room for the two NUL
+       bytes the lexer requires, so files whose size is too close to
+       a page multiple fall back to readFile(). */
+    void * mapped = MAP_FAILED;
+    size_t mappedSize = 0;
+
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    if (S_ISREG(st.st_mode)
+        && st.st_size > 0
+        && (uint64_t) st.st_size % pageSize != 0
+        && (uint64_t) st.st_size % pageSize != pageSize - 1)
+    {
+        mappedSize = st.st_size + 2;
+        mapped = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd.get(), 0);
+    }
+
+    Finally unmap([&]() {
+        if (mapped != MAP_FAILED) munmap(mapped, mappedSize);
+    });
+
+    std::string contents;
+    char * buffer;
+    size_t bufferSize;
+    std::string_view source;
+
+    if (mapped != MAP_FAILED) {
+        buffer = (char *) mapped;
+        bufferSize = mappedSize;
+        source = {buffer, (size_t) st.st_size};
+    } else {
+        contents = readFile(fd.get());
+        source = contents;
+        contents.append("\0\0", 2);
+        buffer = contents.data();
+        bufferSize = contents.size();
+    }
+
+    if (evalSettings.useParseCache) {
+        /* The key includes the parent directory because relative
+           path literals are resolved at parse time. */
+        HashSink keySink(htSHA256);
+        keySink(dirOf(path));
+        keySink({"\0", 1});
+        keySink(source);
+        auto key = keySink.finish().first;
+        if (auto e = readCachedParse(*this, key, path)) {
+            e->bindVars(staticEnv);
+            return e;
+        }
+        auto e = parse(buffer, bufferSize, foFile, path, dirOf(path), staticEnv);
+        writeCachedParse(key, *e);
+        return e;
+    }
+
+    return parse(buffer, bufferSize, foFile, path, dirOf(path), staticEnv);
 }
 
 
 Expr * EvalState::parseExprFromString(std::string_view s, const Path & basePath, StaticEnv & staticEnv)
 {
-    return parse(s.data(), foString, "", basePath, staticEnv);
+    auto buffer = std::string(s);
+    buffer.append("\0\0", 2);
+    return parse(buffer.data(), buffer.size(), foString, "", basePath, staticEnv);
 }
 
 
@@ -684,7 +755,9 @@ Expr * EvalState::parseExprFromString(std::string_view s, const Path & basePath)
 Expr * EvalState::parseStdin()
 {
     //Activity act(*logger, lvlTalkative, format("parsing standard input"));
-    return parse(drainFD(0).data(), foStdin, "", absPath("."), staticBaseEnv);
+    auto buffer = drainFD(0);
+    buffer.append("\0\0", 2);
+    return parse(buffer.data(), buffer.size(), foStdin, "", absPath("."), staticBaseEnv);
 }
 
 
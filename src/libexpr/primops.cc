@@ -1,5 +1,7 @@
 #include "archive.hh"
+#include "cache.hh"
 #include "derivations.hh"
+#include "fetchers.hh"
 #include "eval-inline.hh"
 #include "eval.hh"
 #include "globals.hh"
@@ -11,14 +13,17 @@
 #include "value-to-json.hh"
 #include "value-to-xml.hh"
 #include "primops.hh"
+#include "thread-pool.hh"
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 #include <algorithm>
 #include <cstring>
-#include <regex>
+#include <boost/regex.hpp>
 #include <dlfcn.h>
 
 #include <cmath>
@@ -56,6 +61,63 @@ void EvalState::realiseContext(const PathSet & context)
             "cannot build '%1%' during evaluation because the option 'allow-import-from-derivation' is disabled",
             store->printStorePath(drvs.begin()->drvPath));
 
+    /* The evaluator is strictly sequential, so independent IFDs
+       can't be reordered or batched within one evaluation. Instead,
+       remember which derivations an evaluation built, keyed by the
+       first one, and on the next run speculatively submit the
+       remembered set in the background as soon as the first IFD
+       shows up. Re-runs of an IFD-heavy evaluation then overlap
+       their builds instead of paying for them one at a time. */
+    bool historyChanged = false;
+    for (auto & d : drvs)
+        historyChanged |= ifdHistory.insert(d.to_string(*store)).second;
+
+    std::vector<DerivedPath> speculate;
+
+    if (!ifdHistoryLoaded) {
+        ifdHistoryLoaded = true;
+        try {
+            auto dir = getCacheDir() + "/nix/ifd-history-v1";
+            createDirs(dir);
+            ifdHistoryFile = dir + "/" + std::string(drvs.begin()->drvPath.hashPart());
+            if (pathExists(*ifdHistoryFile))
+                for (auto & line : tokenizeString<Strings>(readFile(*ifdHistoryFile), "\n")) {
+                    if (ifdHistory.count(line)) continue; /* being built right now */
+                    try {
+                        auto req = DerivedPath::parse(*store, line);
+                        if (auto built = std::get_if<DerivedPath::Built>(&req))
+                            if (store->isValidPath(built->drvPath))
+                                speculate.push_back(std::move(req));
+                    } catch (Error &) {
+                        /* Stale or corrupt entry; it will be dropped
+                           when the history is rewritten. */
+                    }
+                }
+        } catch (Error &) {
+            ifdHistoryFile.reset();
+        }
+    }
+
+    if (historyChanged && ifdHistoryFile)
+        try {
+            writeFile(*ifdHistoryFile, concatStringsSep("\n", ifdHistory) + "\n");
+        } catch (Error &) {
+            ignoreException();
+        }
+
+    if (!speculate.empty()) {
+        debug("speculatively building %d derivations remembered from a previous evaluation", speculate.size());
+        auto buildStore = this->store;
+        std::thread([buildStore, speculate{std::move(speculate)}]() {
+            try {
+                buildStore->buildPaths(speculate);
+            } catch (...) {
+                /* Ignore failures: the evaluation builds and reports
+                   anything it actually needs. */
+            }
+        }).detach();
+    }
+
     /* Build/substitute the context. */
     std::vector<DerivedPath> buildReqs;
     for (auto & d : drvs) buildReqs.emplace_back(DerivedPath { d });
@@ -585,6 +647,52 @@ static Bindings::iterator getAttr(
     return value;
 }
 
+/* Hashing and equality for genericClosure keys, consistent with
+   CompareValues: an integer and a float with the same value are the
+   same key, so both hash as doubles. */
+struct HashClosureKey
+{
+    size_t operator () (const Value * v) const
+    {
+        switch (v->type()) {
+            case nInt:
+                return std::hash<double>()(v->integer);
+            case nFloat:
+                return std::hash<double>()(v->fpoint);
+            case nString:
+                return std::hash<std::string_view>()(v->string.s);
+            case nPath:
+                return std::hash<std::string_view>()(v->path);
+            default:
+                throw EvalError("cannot compare %1% with %2%", showType(*v), showType(*v));
+        }
+    }
+};
+
+struct EqualClosureKey
+{
+    bool operator () (const Value * v1, const Value * v2) const
+    {
+        if (v1->type() == nFloat && v2->type() == nInt)
+            return v1->fpoint == v2->integer;
+        if (v1->type() == nInt && v2->type() == nFloat)
+            return v1->integer == v2->fpoint;
+        if (v1->type() != v2->type()) return false;
+        switch (v1->type()) {
+            case nInt:
+                return v1->integer == v2->integer;
+            case nFloat:
+                return v1->fpoint == v2->fpoint;
+            case nString:
+                return strcmp(v1->string.s, v2->string.s) == 0;
+            case nPath:
+                return strcmp(v1->path, v2->path) == 0;
+            default:
+                throw EvalError("cannot compare %1% with %2%", showType(*v1), showType(*v2));
+        }
+    }
+};
+
 static void prim_genericClosure(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     state.forceAttrs(*args[0], pos);
@@ -600,7 +708,14 @@ static void prim_genericClosure(EvalState & state, const Pos & pos, Value * * ar
 
     state.forceList(*startSet->value, pos);
 
-    ValueList workSet;
+    /* Flat vectors with a head index instead of linked lists, to
+       avoid a node allocation per work item. */
+#if HAVE_BOEHMGC
+    std::vector<Value *, traceable_allocator<Value *>> workSet, res;
+#else
+    std::vector<Value *> workSet, res;
+#endif
+    workSet.reserve(startSet->value->listSize());
     for (unsigned int n = 0; n < startSet->value->listSize(); ++n)
         workSet.push_back(startSet->value->listElems()[n]);
 
@@ -615,21 +730,22 @@ static void prim_genericClosure(EvalState & state, const Pos & pos, Value * * ar
 
     state.forceValue(*op->value, pos);
 
+    auto sKey = state.symbols.create("key");
+
     /* Construct the closure by applying the operator to element of
        `workSet', adding the result to `workSet', continuing until
-       no new elements are found. */
-    ValueList res;
+       no new elements are found. Membership checks hash the key
+       instead of comparing it against every key seen so far. */
     // `doneKeys' doesn't need to be a GC root, because its values are
     // reachable from res.
-    set<Value *, CompareValues> doneKeys;
-    while (!workSet.empty()) {
-        Value * e = *(workSet.begin());
-        workSet.pop_front();
+    std::unordered_set<Value *, HashClosureKey, EqualClosureKey> doneKeys;
+    size_t head = 0;
+    while (head < workSet.size()) {
+        Value * e = workSet[head++];
 
         state.forceAttrs(*e, pos);
 
-        Bindings::iterator key =
-            e->attrs->find(state.symbols.create("key"));
+        Bindings::iterator key = e->attrs->find(sKey);
         if (key == e->attrs->end())
             throw EvalError({
                 .msg = hintfmt("attribute 'key' required"),
@@ -654,9 +770,8 @@ static void prim_genericClosure(EvalState & state, const Pos & pos, Value * * ar
 
     /* Create the result list. */
     state.mkList(v, res.size());
-    unsigned int n = 0;
-    for (auto & i : res)
-        v.listElems()[n++] = i;
+    for (size_t n = 0; n < res.size(); ++n)
+        v.listElems()[n] = res[n];
 }
 
 static RegisterPrimOp primop_genericClosure(RegisterPrimOp::Info {
@@ -758,11 +873,10 @@ static RegisterPrimOp primop_floor({
 static void prim_tryEval(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     state.mkAttrs(v, 2);
-    try {
-        state.forceValue(*args[0], pos);
+    if (state.forceValueTry(*args[0], pos)) {
         v.attrs->push_back(Attr(state.sValue, args[0]));
         mkBool(*state.allocAttr(v, state.symbols.create("success")), true);
-    } catch (AssertionError & e) {
+    } else {
         mkBool(*state.allocAttr(v, state.sValue), false);
         mkBool(*state.allocAttr(v, state.symbols.create("success")), false);
     }
@@ -1409,6 +1523,56 @@ static RegisterPrimOp primop_dirOf({
 });
 
 /* Return the contents of a file as a string. */
+/* Make 'v' a string holding the contents of the regular file 'path',
+   read directly into the value's buffer instead of through a
+   std::string that is then copied again. Large files are mmapped
+   read-only: the mapping lives outside the GC heap and is simply
+   never unmapped, so a multi-hundred-MB file read during evaluation
+   occupies page cache rather than eval RSS. */
+static void readFileValue(const Path & path, const string & displayPath, Value & v)
+{
+    AutoCloseFD fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd)
+        throw SysError("opening file '%1%'", path);
+
+    struct stat st;
+    if (fstat(fd.get(), &st) == -1)
+        throw SysError("statting file '%1%'", path);
+
+    auto size = (size_t) st.st_size;
+
+    constexpr size_t mmapThreshold = 1024 * 1024;
+    auto pageSize = (size_t) sysconf(_SC_PAGESIZE);
+
+    char * buf = nullptr;
+
+    /* The kernel zero-fills the remainder of the last page, which
+       provides the string's terminating NUL — unless the size is an
+       exact multiple of the page size, in which case we fall back to
+       a regular read. */
+    if (S_ISREG(st.st_mode) && size >= mmapThreshold && size % pageSize != 0) {
+        void * p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd.get(), 0);
+        if (p != MAP_FAILED)
+            buf = (char *) p;
+    }
+
+    if (!buf) {
+#if HAVE_BOEHMGC
+        buf = (char *) GC_MALLOC_ATOMIC(size + 1);
+#else
+        buf = (char *) malloc(size + 1);
+#endif
+        if (!buf) throw std::bad_alloc();
+        readFull(fd.get(), buf, size);
+        buf[size] = 0;
+    }
+
+    if (memchr(buf, 0, size))
+        throw Error("the contents of the file '%1%' cannot be represented as a Nix string", displayPath);
+
+    v.mkString(buf);
+}
+
 static void prim_readFile(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     PathSet context;
@@ -1421,10 +1585,18 @@ static void prim_readFile(EvalState & state, const Pos & pos, Value * * args, Va
             .errPos = pos
         });
     }
-    string s = readFile(state.checkSourcePath(state.toRealPath(path, context)));
-    if (s.find((char) 0) != string::npos)
-        throw Error("the contents of the file '%1%' cannot be represented as a Nix string", path);
-    mkString(v, s.c_str());
+    auto realPath = state.checkSourcePath(state.toRealPath(path, context));
+    struct stat st;
+    if (stat(realPath.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+        readFileValue(realPath, path, v);
+    else {
+        /* Non-regular files (and dangling paths, for error parity)
+           go through the generic reader. */
+        string s = readFile(realPath);
+        if (s.find((char) 0) != string::npos)
+            throw Error("the contents of the file '%1%' cannot be represented as a Nix string", path);
+        mkString(v, s.c_str());
+    }
 }
 
 static RegisterPrimOp primop_readFile({
@@ -1902,11 +2074,58 @@ static void addPath(
         if (expectedHash)
             expectedStorePath = state.store->makeFixedOutputPath(method, *expectedHash, name);
 
+        /* Memoise the filter so that the fingerprint walk below and
+           the dump see identical decisions, and each entry is
+           filtered only once even when both walks run. */
+        std::map<Path, bool> filterMemo;
+        PathFilter memoFilter = [&](const Path & p) {
+            auto i = filterMemo.find(p);
+            if (i != filterMemo.end()) return i->second;
+            bool res = filter(p);
+            filterMemo.emplace(p, res);
+            return res;
+        };
+
         Path dstPath;
         if (!expectedHash || !state.store->isValidPath(*expectedStorePath)) {
-            dstPath = state.store->printStorePath(settings.readOnlyMode
-                ? state.store->computeStorePathForPath(name, path, method, htSHA256, filter).first
-                : state.store->addToStore(name, path, method, htSHA256, filter, state.repair, refs));
+
+            /* Unchanged sources short-circuit to the store path
+               computed by an earlier evaluation, skipping the
+               content hashing and copying. The fingerprint covers
+               the accepted entries' metadata and the filter's
+               decisions, so both a changed tree and a changed filter
+               miss. Sources already inside the store carry
+               references and are not cached this way. */
+            std::optional<fetchers::Attrs> cacheKey;
+            if (refs.empty() && !state.repair) {
+                try {
+                    HashSink sink(htSHA256);
+                    fetchers::fingerprintSourceTree(sink, path, memoFilter);
+                    cacheKey = fetchers::Attrs({
+                        {"type", std::string("sourceFingerprint")},
+                        {"name", name},
+                        {"recursive", method == FileIngestionMethod::Recursive ? (uint64_t) 1 : (uint64_t) 0},
+                        {"fingerprint", sink.finish().first.to_string(Base32, true)},
+                    });
+                } catch (Error &) {
+                    /* E.g. the tree changed underneath the walk;
+                       fall through to the uncached dump. */
+                }
+            }
+
+            if (cacheKey)
+                if (auto res = fetchers::getCache()->lookup(state.store, *cacheKey))
+                    dstPath = state.store->printStorePath(res->second);
+
+            if (dstPath.empty()) {
+                dstPath = state.store->printStorePath(settings.readOnlyMode
+                    ? state.store->computeStorePathForPath(name, path, method, htSHA256, memoFilter).first
+                    : state.store->addToStore(name, path, method, htSHA256, memoFilter, state.repair, refs));
+                if (cacheKey && !settings.readOnlyMode)
+                    fetchers::getCache()->add(state.store, *cacheKey, {},
+                        state.store->parseStorePath(dstPath), true);
+            }
+
             if (expectedHash && expectedStorePath != state.store->parseStorePath(dstPath))
                 throw Error("store path mismatch in (possibly filtered) path added from '%s'", path);
         } else
@@ -2146,7 +2365,10 @@ void prim_getAttr(EvalState & state, const Pos & pos, Value * * args, Value & v)
         pos
     );
     // !!! add to stack trace?
-    if (state.countCalls && *i->pos != noPos) state.attrSelects[*i->pos]++;
+    if (state.countCalls && *i->pos != noPos) {
+        std::lock_guard<std::mutex> guard(state.countCallsMutex);
+        state.attrSelects[*i->pos]++;
+    }
     state.forceValue(*i->value, pos);
     v = *i->value;
 }
@@ -2406,7 +2628,7 @@ static void prim_functionArgs(EvalState & state, const Pos & pos, Value * * args
     for (auto & i : args[0]->lambda.fun->formals->formals) {
         // !!! should optimise booleans (allocate only once)
         Value * value = state.allocValue();
-        v.attrs->push_back(Attr(i.name, value, ptr(&i.pos)));
+        v.attrs->push_back(Attr(i.name, value, i.pos));
         mkBool(*value, i.def);
     }
     v.attrs->sort();
@@ -2817,12 +3039,45 @@ static void prim_sort(EvalState & state, const Pos & pos, Value * * args, Value
         v.listElems()[n] = args[1]->listElems()[n];
     }
 
-    auto comparator = [&](Value * a, Value * b) {
-        /* Optimization: if the comparator is lessThan, bypass
-           callFunction. */
-        if (args[0]->isPrimOp() && args[0]->primOp->fun == prim_lessThan)
-            return CompareValues()(a, b);
+    /* Optimization: if the comparator is lessThan, bypass
+       callFunction entirely. Decided once here rather than on every
+       comparison. */
+    if (args[0]->isPrimOp() && args[0]->primOp->fun == prim_lessThan) {
+
+        auto begin = v.listElems(), end = v.listElems() + len;
+
+        /* A native comparator doesn't re-enter the evaluator, so
+           large lists (all elements are already forced above) can be
+           sorted in parallel: sort equal chunks on a thread pool,
+           then merge them stably. The elements stay reachable
+           through the original list while worker threads shuffle
+           this one. */
+        size_t chunks = std::thread::hardware_concurrency();
+        if (len >= 8192 && chunks >= 2) {
+            chunks = std::min(chunks, (size_t) 8);
+            size_t chunkSize = (len + chunks - 1) / chunks;
+
+            ThreadPool pool(chunks);
+            for (size_t i = 0; i < len; i += chunkSize)
+                pool.enqueue([=]() {
+                    std::stable_sort(begin + i, begin + std::min(i + chunkSize, len), CompareValues());
+                });
+            pool.process();
+
+            for (size_t width = chunkSize; width < len; width *= 2)
+                for (size_t i = 0; i + width < len; i += 2 * width)
+                    std::inplace_merge(
+                        begin + i,
+                        begin + i + width,
+                        begin + std::min(i + 2 * width, len),
+                        CompareValues());
+        } else
+            std::stable_sort(begin, end, CompareValues());
 
+        return;
+    }
+
+    auto comparator = [&](Value * a, Value * b) {
         Value * vs[] = {a, b};
         Value vBool;
         state.callFunction(*args[0], 2, vs, vBool, pos);
@@ -3245,7 +3500,22 @@ static RegisterPrimOp primop_hashString({
 
 struct RegexCache
 {
-    std::unordered_map<std::string, std::regex> cache;
+    std::unordered_map<std::string, boost::regex> cache;
+
+    /* prim_match() and prim_split() run on worker threads when
+       eval-cores > 1, so the cache needs locking. */
+    std::mutex mutex;
+
+    /* References into the map remain valid when other threads insert,
+       so the result can be used after the lock is released. */
+    const boost::regex & get(const std::string & re)
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        auto i = cache.find(re);
+        if (i == cache.end())
+            i = cache.emplace(re, boost::regex(re, boost::regex::extended)).first;
+        return i->second;
+    }
 };
 
 std::shared_ptr<RegexCache> makeRegexCache()
@@ -3259,15 +3529,13 @@ void prim_match(EvalState & state, const Pos & pos, Value * * args, Value & v)
 
     try {
 
-        auto regex = state.regexCache->cache.find(re);
-        if (regex == state.regexCache->cache.end())
-            regex = state.regexCache->cache.emplace(re, std::regex(re, std::regex::extended)).first;
+        auto & regex = state.regexCache->get(re);
 
         PathSet context;
         const std::string str = state.forceString(*args[1], context, pos);
 
-        std::smatch match;
-        if (!std::regex_match(str, match, regex->second)) {
+        boost::smatch match;
+        if (!boost::regex_match(str, match, regex)) {
             mkNull(v);
             return;
         }
@@ -3282,9 +3550,8 @@ void prim_match(EvalState & state, const Pos & pos, Value * * args, Value & v)
                 mkString(*(v.listElems()[i] = state.allocValue()), match[i + 1].str().c_str());
         }
 
-    } catch (std::regex_error &e) {
-        if (e.code() == std::regex_constants::error_space) {
-            // limit is _GLIBCXX_REGEX_STATE_LIMIT for libstdc++
+    } catch (boost::regex_error &e) {
+        if (e.code() == boost::regex_constants::error_space) {
             throw EvalError({
                 .msg = hintfmt("memory limit exceeded by regular expression '%s'", re),
                 .errPos = pos
@@ -3336,19 +3603,19 @@ static RegisterPrimOp primop_match({
 
 /* Split a string with a regular expression, and return a list of the
    non-matching parts interleaved by the lists of the matching groups. */
-static void prim_split(EvalState & state, const Pos & pos, Value * * args, Value & v)
+void prim_split(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     auto re = state.forceStringNoCtx(*args[0], pos);
 
     try {
 
-        std::regex regex(re, std::regex::extended);
+        auto & regex = state.regexCache->get(re);
 
         PathSet context;
         const std::string str = state.forceString(*args[1], context, pos);
 
-        auto begin = std::sregex_iterator(str.begin(), str.end(), regex);
-        auto end = std::sregex_iterator();
+        auto begin = boost::sregex_iterator(str.begin(), str.end(), regex);
+        auto end = boost::sregex_iterator();
 
         // Any matches results are surrounded by non-matching results.
         const size_t len = std::distance(begin, end);
@@ -3361,9 +3628,9 @@ static void prim_split(EvalState & state, const Pos & pos, Value * * args, Value
             return;
         }
 
-        for (std::sregex_iterator i = begin; i != end; ++i) {
+        for (boost::sregex_iterator i = begin; i != end; ++i) {
             assert(idx <= 2 * len + 1 - 3);
-            std::smatch match = *i;
+            boost::smatch match = *i;
 
             // Add a string for non-matched characters.
             elem = v.listElems()[idx++] = state.allocValue();
@@ -3390,9 +3657,8 @@ static void prim_split(EvalState & state, const Pos & pos, Value * * args, Value
         }
         assert(idx == 2 * len + 1);
 
-    } catch (std::regex_error &e) {
-        if (e.code() == std::regex_constants::error_space) {
-            // limit is _GLIBCXX_REGEX_STATE_LIMIT for libstdc++
+    } catch (boost::regex_error &e) {
+        if (e.code() == boost::regex_constants::error_space) {
             throw EvalError({
                 .msg = hintfmt("memory limit exceeded by regular expression '%s'", re),
                 .errPos = pos
@@ -3737,10 +4003,16 @@ void EvalState::createBaseEnv()
     staticBaseEnv.sort();
 
     /* Note: we have to initialize the 'derivation' constant *after*
-       building baseEnv/staticBaseEnv because it uses 'builtins'. */
-    eval(parse(
+       building baseEnv/staticBaseEnv because it uses 'builtins'. The
+       constant is initialised lazily: evaluating the wrapper is pure
+       startup cost for the many invocations that never instantiate a
+       derivation. */
+    std::string drvSource =
         #include "primops/derivation.nix.gen.hh"
-        , foFile, sDerivationNix, "/", staticBaseEnv), *vDerivation);
+        ;
+    drvSource.append("\0\0", 2);
+    mkThunk_(*vDerivation, parse(drvSource.data(), drvSource.size(),
+        foFile, sDerivationNix, "/", staticBaseEnv));
 }
 
 
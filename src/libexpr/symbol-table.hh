@@ -1,7 +1,9 @@
 #pragma once
 
+#include <deque>
 #include <map>
-#include <unordered_set>
+#include <mutex>
+#include <vector>
 
 #include "types.hh"
 
@@ -70,20 +72,63 @@ public:
 class SymbolTable
 {
 private:
-    typedef std::unordered_set<string> Symbols;
-    Symbols symbols;
+    /* The strings themselves live in a deque, which allocates them in
+       large contiguous blocks and never moves them, so handing out
+       `const string *`s is safe. Thanks to the small-string
+       optimisation, most symbols involve no heap allocation beyond
+       the block itself. */
+    std::deque<string> arena;
+
+    /* Open-addressing table with linear probing mapping precomputed
+       string hashes to interned strings. Grown at 3/4 load. */
+    struct Slot
+    {
+        size_t hash;
+        const string * s = nullptr;
+    };
+    std::vector<Slot> table = std::vector<Slot>(1 << 10);
+
+    /* create() may be called concurrently during parallel deep
+       forcing (see the 'eval-cores' setting). */
+    std::mutex lock;
+
+    void grow()
+    {
+        std::vector<Slot> table2(table.size() * 2);
+        size_t mask = table2.size() - 1;
+        for (auto & slot : table) {
+            if (!slot.s) continue;
+            size_t h = slot.hash & mask;
+            while (table2[h].s) h = (h + 1) & mask;
+            table2[h] = slot;
+        }
+        table = std::move(table2);
+    }
 
 public:
     Symbol create(std::string_view s)
     {
-        // FIXME: avoid allocation if 's' already exists in the symbol table.
-        std::pair<Symbols::iterator, bool> res = symbols.emplace(std::string(s));
-        return Symbol(&*res.first);
+        std::lock_guard<std::mutex> guard(lock);
+
+        if (arena.size() * 4 >= table.size() * 3) grow();
+
+        size_t hash = std::hash<std::string_view>()(s);
+        size_t mask = table.size() - 1;
+        size_t h = hash & mask;
+        while (table[h].s) {
+            if (table[h].hash == hash && *table[h].s == s)
+                return Symbol(table[h].s);
+            h = (h + 1) & mask;
+        }
+
+        auto & s2 = arena.emplace_back(s);
+        table[h] = {hash, &s2};
+        return Symbol(&s2);
     }
 
     size_t size() const
     {
-        return symbols.size();
+        return arena.size();
     }
 
     size_t totalSize() const;
@@ -91,7 +136,7 @@ public:
     template<typename T>
     void dump(T callback)
     {
-        for (auto & s : symbols)
+        for (auto & s : arena)
             callback(s);
     }
 };
@@ -0,0 +1,262 @@
+#include "value-snapshot.hh"
+#include "eval-inline.hh"
+#include "primops.hh"
+#include "serialise.hh"
+#include "util.hh"
+
+#include <cstring>
+#include <unordered_map>
+
+namespace nix {
+
+/* Bump this when the format changes. */
+static const uint64_t snapshotVersion = 1;
+
+static const std::string snapshotMagic = "nix-value-snapshot";
+
+/* Value tags. Only thunk-free data appears in a snapshot; thunks are
+   eliminated by forcing during the write and functions and external
+   values are rejected. */
+enum ValueTag : uint8_t {
+    vtNull = 0,
+    vtInt, vtFloat, vtBool, vtString, vtPath, vtAttrs, vtList,
+    /* Back-reference to a previously written attribute set or
+       list, identified by the order in which they were first
+       written. This preserves sharing (and cycles, e.g. through
+       'rec' attribute sets). */
+    vtRef,
+};
+
+struct SnapshotWriter
+{
+    Sink & sink;
+    EvalState & state;
+    const Pos & pos;
+    std::unordered_map<const Value *, uint64_t> seen;
+
+    void write(Value & v)
+    {
+        state.forceValue(v, pos);
+
+        switch (v.type()) {
+
+            case nInt:
+                sink << (uint64_t) vtInt << (uint64_t) v.integer;
+                break;
+
+            case nFloat: {
+                uint64_t bits;
+                static_assert(sizeof(bits) == sizeof(v.fpoint));
+                memcpy(&bits, &v.fpoint, sizeof(bits));
+                sink << (uint64_t) vtFloat << bits;
+                break;
+            }
+
+            case nBool:
+                sink << (uint64_t) vtBool << (uint64_t) (v.boolean ? 1 : 0);
+                break;
+
+            case nNull:
+                sink << (uint64_t) vtNull;
+                break;
+
+            case nString: {
+                sink << (uint64_t) vtString << std::string(v.string.s);
+                uint64_t n = 0;
+                if (v.string.context)
+                    for (auto p = v.string.context; *p; ++p) n++;
+                sink << n;
+                if (v.string.context)
+                    for (auto p = v.string.context; *p; ++p)
+                        sink << std::string(*p);
+                break;
+            }
+
+            case nPath:
+                sink << (uint64_t) vtPath << std::string(v.path);
+                break;
+
+            case nAttrs: {
+                auto i = seen.find(&v);
+                if (i != seen.end()) {
+                    sink << (uint64_t) vtRef << i->second;
+                    return;
+                }
+                seen.emplace(&v, seen.size());
+                sink << (uint64_t) vtAttrs << (uint64_t) v.attrs->size();
+                for (auto & attr : *v.attrs) {
+                    sink << std::string(attr.name);
+                    write(*attr.value);
+                }
+                break;
+            }
+
+            case nList: {
+                auto i = seen.find(&v);
+                if (i != seen.end()) {
+                    sink << (uint64_t) vtRef << i->second;
+                    return;
+                }
+                seen.emplace(&v, seen.size());
+                sink << (uint64_t) vtList << (uint64_t) v.listSize();
+                for (size_t n = 0; n < v.listSize(); ++n)
+                    write(*v.listElems()[n]);
+                break;
+            }
+
+            default:
+                throw TypeError({
+                    .msg = hintfmt("cannot write %1% to a value snapshot", showType(v)),
+                    .errPos = pos
+                });
+        }
+    }
+};
+
+struct SnapshotReader
+{
+    Source & source;
+    EvalState & state;
+
+    /* Attribute sets and lists in the order they were first read,
+       i.e. using the same numbering as the writer. */
+    std::vector<Value *> seen;
+
+    Value * read()
+    {
+        auto tag = readNum<uint64_t>(source);
+
+        switch (tag) {
+
+            case vtNull: {
+                auto v = state.allocValue();
+                mkNull(*v);
+                return v;
+            }
+
+            case vtInt: {
+                auto v = state.allocValue();
+                mkInt(*v, readNum<uint64_t>(source));
+                return v;
+            }
+
+            case vtFloat: {
+                auto bits = readNum<uint64_t>(source);
+                NixFloat f;
+                static_assert(sizeof(bits) == sizeof(f));
+                memcpy(&f, &bits, sizeof(f));
+                auto v = state.allocValue();
+                mkFloat(*v, f);
+                return v;
+            }
+
+            case vtBool: {
+                auto v = state.allocValue();
+                mkBool(*v, readNum<uint64_t>(source) != 0);
+                return v;
+            }
+
+            case vtString: {
+                auto s = readString(source);
+                PathSet context;
+                auto n = readNum<uint64_t>(source);
+                for (uint64_t i = 0; i < n; ++i)
+                    context.insert(readString(source));
+                auto v = state.allocValue();
+                mkString(*v, s, context);
+                return v;
+            }
+
+            case vtPath: {
+                auto v = state.allocValue();
+                mkPath(*v, readString(source).c_str());
+                return v;
+            }
+
+            case vtAttrs: {
+                auto v = state.allocValue();
+                /* Register the value before reading its contents so
+                   that back-references to it (i.e. cycles) resolve. */
+                seen.push_back(v);
+                auto n = readNum<uint64_t>(source);
+                auto bindings = state.allocBindings(n);
+                for (uint64_t i = 0; i < n; ++i) {
+                    auto name = state.symbols.create(readString(source));
+                    bindings->push_back(Attr(name, read()));
+                }
+                /* Symbol order is not stable across processes, so
+                   re-sort rather than trusting the stored order. */
+                bindings->sort();
+                v->mkAttrs(bindings);
+                return v;
+            }
+
+            case vtList: {
+                auto v = state.allocValue();
+                seen.push_back(v);
+                auto n = readNum<uint64_t>(source);
+                state.mkList(*v, n);
+                for (uint64_t i = 0; i < n; ++i)
+                    v->listElems()[i] = read();
+                return v;
+            }
+
+            case vtRef: {
+                auto n = readNum<uint64_t>(source);
+                if (n >= seen.size())
+                    throw Error("invalid back-reference in value snapshot");
+                return seen[n];
+            }
+
+            default:
+                throw Error("unsupported tag %d in value snapshot", tag);
+        }
+    }
+};
+
+void writeValueSnapshot(EvalState & state, Value & v, const Pos & pos, const Path & path)
+{
+    StringSink sink;
+    sink << snapshotMagic << snapshotVersion;
+    SnapshotWriter writer{sink, state, pos};
+    writer.write(v);
+    writeFile(path, *sink.s);
+}
+
+void readValueSnapshot(EvalState & state, const Path & path, Value & v)
+{
+    auto s = readFile(path);
+    StringSource source(s);
+    if (readString(source) != snapshotMagic)
+        throw Error("'%s' is not a Nix value snapshot", path);
+    if (readNum<uint64_t>(source) != snapshotVersion)
+        throw Error("value snapshot '%s' has an unsupported version", path);
+    SnapshotReader reader{source, state};
+    v = *reader.read();
+}
+
+static void prim_readSnapshot(EvalState & state, const Pos & pos, Value * * args, Value & v)
+{
+    PathSet context;
+    auto path = state.coerceToPath(pos, *args[0], context);
+    if (!context.empty())
+        throw EvalError({
+            .msg = hintfmt("string '%1%' cannot refer to other paths", path),
+            .errPos = pos
+        });
+    readValueSnapshot(state, state.checkSourcePath(path), v);
+}
+
+static RegisterPrimOp primop_readSnapshot({
+    .name = "__readSnapshot",
+    .args = {"path"},
+    .doc = R"(
+      Read a value snapshot previously written with `nix eval
+      --write-snapshot` and return the value stored in it. The result
+      contains no thunks, so this is much cheaper than re-evaluating
+      the expressions that produced the snapshot.
+    )",
+    .fun = prim_readSnapshot,
+});
+
+}
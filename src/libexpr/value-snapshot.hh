@@ -0,0 +1,22 @@
+#pragma once
+
+#include "eval.hh"
+
+namespace nix {
+
+/* Write a snapshot of 'v' to 'path'. The value is forced deeply
+   while being written, so the snapshot only ever contains data
+   (attribute sets, lists, strings with their context, numbers,
+   booleans, paths and null); a value containing a function or an
+   external value cannot be snapshotted. Sharing between values is
+   preserved via back-references, so snapshotting a structure with
+   heavily shared substructure doesn't explode its size. */
+void writeValueSnapshot(EvalState & state, Value & v, const Pos & pos, const Path & path);
+
+/* Reconstruct a snapshotted value. This is much cheaper than
+   re-evaluating the expressions that produced it: the result is
+   thunk-free, so repeated consumers (e.g. CI jobs evaluating the
+   same pinned package set) skip evaluation entirely. */
+void readValueSnapshot(EvalState & state, const Path & path, Value & v);
+
+}
@@ -2,6 +2,7 @@
 #include "json.hh"
 #include "eval-inline.hh"
 #include "util.hh"
+#include "serialise.hh"
 
 #include <cstdlib>
 #include <iomanip>
@@ -95,6 +96,102 @@ void printValueAsJSON(EvalState & state, bool strict,
     printValueAsJSON(state, strict, v, pos, out, context);
 }
 
+static void toJSON(Sink & sink, const char * s)
+{
+    std::ostringstream str;
+    toJSON(str, s);
+    sink(str.str());
+}
+
+void printValueAsJSON(EvalState & state, bool strict,
+    Value & v, const Pos & pos, Sink & sink, PathSet & context)
+{
+    checkInterrupt();
+
+    if (strict) state.forceValue(v, pos);
+
+    switch (v.type()) {
+
+        case nInt:
+            sink(std::to_string(v.integer));
+            break;
+
+        case nBool:
+            sink(v.boolean ? "true" : "false");
+            break;
+
+        case nString:
+            copyContext(v, context);
+            toJSON(sink, v.string.s);
+            break;
+
+        case nPath:
+            toJSON(sink, state.copyPathToStore(context, v.path).c_str());
+            break;
+
+        case nNull:
+            sink("null");
+            break;
+
+        case nAttrs: {
+            auto maybeString = state.tryAttrsToString(pos, v, context, false, false);
+            if (maybeString) {
+                toJSON(sink, maybeString->c_str());
+                break;
+            }
+            auto i = v.attrs->find(state.sOutPath);
+            if (i == v.attrs->end()) {
+                sink("{");
+                bool first = true;
+                for (auto & a : v.attrs->lexicographicOrder()) {
+                    if (!first) sink(",");
+                    first = false;
+                    toJSON(sink, ((const string &) a->name).c_str());
+                    sink(":");
+                    printValueAsJSON(state, strict, *a->value, *a->pos, sink, context);
+                }
+                sink("}");
+            } else
+                printValueAsJSON(state, strict, *i->value, *i->pos, sink, context);
+            break;
+        }
+
+        case nList: {
+            sink("[");
+            for (unsigned int n = 0; n < v.listSize(); ++n) {
+                if (n) sink(",");
+                printValueAsJSON(state, strict, *v.listElems()[n], pos, sink, context);
+            }
+            sink("]");
+            break;
+        }
+
+        case nExternal: {
+            /* External values don't have a streaming serialiser; they
+               are small, so buffering just this one is fine. */
+            std::ostringstream str;
+            JSONPlaceholder out(str);
+            v.external->printValueAsJSON(state, strict, out, context);
+            sink(str.str());
+            break;
+        }
+
+        case nFloat: {
+            std::ostringstream str;
+            toJSON(str, v.fpoint);
+            sink(str.str());
+            break;
+        }
+
+        case nThunk:
+        case nFunction:
+            throw TypeError({
+                .msg = hintfmt("cannot convert %1% to JSON", showType(v)),
+                .errPos = v.determinePos(pos)
+            });
+    }
+}
+
 void ExternalValueBase::printValueAsJSON(EvalState & state, bool strict,
     JSONPlaceholder & out, PathSet & context) const
 {
@@ -9,6 +9,7 @@
 namespace nix {
 
 class JSONPlaceholder;
+struct Sink;
 
 void printValueAsJSON(EvalState & state, bool strict,
     Value & v, const Pos & pos, JSONPlaceholder & out, PathSet & context);
@@ -16,4 +17,10 @@ void printValueAsJSON(EvalState & state, bool strict,
 void printValueAsJSON(EvalState & state, bool strict,
     Value & v, const Pos & pos, std::ostream & str, PathSet & context);
 
+/* Streaming variant: serialise directly to a sink. Each value is
+   forced and written out before its sibling is forced, so memory use
+   is independent of the size of the output. */
+void printValueAsJSON(EvalState & state, bool strict,
+    Value & v, const Pos & pos, Sink & sink, PathSet & context);
+
 }
@@ -21,10 +21,25 @@ create table if not exists Cache (
 
 struct CacheImpl : Cache
 {
+    /* An in-memory mirror of a row in the Cache table. Store paths
+       are kept as strings because parsing them requires a Store. */
+    struct Row
+    {
+        std::string infoJSON;
+        std::string path;
+        bool immutable = false;
+        int64_t timestamp = 0;
+    };
+
     struct State
     {
         SQLite db;
         SQLiteStmt add, lookup;
+
+        /* Write-through copy of the rows seen by this process, so
+           that repeated lookups of the same input don't go to SQLite
+           every time. */
+        std::map<std::string, Row> mem;
     };
 
     Sync<State> _state;
@@ -45,6 +60,20 @@ struct CacheImpl : Cache
 
         state->lookup.create(state->db,
             "select info, path, immutable, timestamp from Cache where input = ?");
+
+        /* Warm the in-memory layer with the most recently used rows,
+           which are overwhelmingly the ones a new evaluation will ask
+           for again. */
+        SQLiteStmt preload(state->db,
+            "select input, info, path, immutable, timestamp from Cache order by timestamp desc limit 1000");
+        auto use(preload.use());
+        while (use.next())
+            state->mem.emplace(use.getStr(0), Row {
+                .infoJSON = use.getStr(1),
+                .path = use.getStr(2),
+                .immutable = use.getInt(3) != 0,
+                .timestamp = use.getInt(4),
+            });
     }
 
     void add(
@@ -54,12 +83,26 @@ struct CacheImpl : Cache
         const StorePath & storePath,
         bool immutable) override
     {
-        _state.lock()->add.use()
-            (attrsToJSON(inAttrs).dump())
-            (attrsToJSON(infoAttrs).dump())
-            (store->printStorePath(storePath))
+        auto inAttrsJSON = attrsToJSON(inAttrs).dump();
+        auto infoJSON = attrsToJSON(infoAttrs).dump();
+        auto path = store->printStorePath(storePath);
+        auto timestamp = time(0);
+
+        auto state(_state.lock());
+
+        state->add.use()
+            (inAttrsJSON)
+            (infoJSON)
+            (path)
             (immutable)
-            (time(0)).exec();
+            (timestamp).exec();
+
+        state->mem.insert_or_assign(inAttrsJSON, Row {
+            .infoJSON = infoJSON,
+            .path = path,
+            .immutable = immutable,
+            .timestamp = timestamp,
+        });
     }
 
     std::optional<std::pair<Attrs, StorePath>> lookup(
@@ -79,20 +122,37 @@ struct CacheImpl : Cache
         ref<Store> store,
         const Attrs & inAttrs) override
     {
-        auto state(_state.lock());
-
         auto inAttrsJSON = attrsToJSON(inAttrs).dump();
 
-        auto stmt(state->lookup.use()(inAttrsJSON));
-        if (!stmt.next()) {
-            debug("did not find cache entry for '%s'", inAttrsJSON);
-            return {};
+        Row row;
+
+        {
+            auto state(_state.lock());
+
+            auto i = state->mem.find(inAttrsJSON);
+            if (i != state->mem.end())
+                row = i->second;
+            else {
+                auto stmt(state->lookup.use()(inAttrsJSON));
+                if (!stmt.next()) {
+                    debug("did not find cache entry for '%s'", inAttrsJSON);
+                    return {};
+                }
+
+                row = Row {
+                    .infoJSON = stmt.getStr(0),
+                    .path = stmt.getStr(1),
+                    .immutable = stmt.getInt(2) != 0,
+                    .timestamp = stmt.getInt(3),
+                };
+
+                state->mem.emplace(inAttrsJSON, row);
+            }
         }
 
-        auto infoJSON = stmt.getStr(0);
-        auto storePath = store->parseStorePath(stmt.getStr(1));
-        auto immutable = stmt.getInt(2) != 0;
-        auto timestamp = stmt.getInt(3);
+        /* Note: the store accesses happen outside the lock, since
+           they may involve daemon round-trips. */
+        auto storePath = store->parseStorePath(row.path);
 
         store->addTempRoot(storePath);
         if (!store->isValidPath(storePath)) {
@@ -102,11 +162,11 @@ struct CacheImpl : Cache
         }
 
         debug("using cache entry '%s' -> '%s', '%s'",
-            inAttrsJSON, infoJSON, store->printStorePath(storePath));
+            inAttrsJSON, row.infoJSON, store->printStorePath(storePath));
 
         return Result {
-            .expired = !immutable && (settings.tarballTtl.get() == 0 || timestamp + settings.tarballTtl < time(0)),
-            .infoAttrs = jsonToAttrs(nlohmann::json::parse(infoJSON)),
+            .expired = !row.immutable && (settings.tarballTtl.get() == 0 || row.timestamp + settings.tarballTtl < time(0)),
+            .infoAttrs = jsonToAttrs(nlohmann::json::parse(row.infoJSON)),
             .storePath = std::move(storePath)
         };
     }
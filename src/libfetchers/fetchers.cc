@@ -289,4 +289,24 @@ void InputScheme::clone(const Input & input, const Path & destDir)
     throw Error("do not know how to clone input '%s'", input.to_string());
 }
 
+void fingerprintSourceTree(HashSink & sink, const Path & path,
+    PathFilter & filter, bool isRoot)
+{
+    auto st = lstat(path);
+
+    if (!isRoot && !filter(path)) return;
+
+    if (S_ISREG(st.st_mode))
+        sink << "f" << path << (uint64_t) (st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH))
+             << (uint64_t) st.st_size << (uint64_t) st.st_mtime;
+    else if (S_ISDIR(st.st_mode)) {
+        sink << "d" << path;
+        for (auto & i : readDirectory(path))
+            fingerprintSourceTree(sink, path + "/" + i.name, filter, false);
+    } else if (S_ISLNK(st.st_mode))
+        sink << "l" << path << readLink(path);
+    else
+        sink << "u" << path;
+}
+
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "types.hh"
+#include "archive.hh"
 #include "hash.hh"
 #include "path.hh"
 #include "attrs.hh"
@@ -157,4 +158,13 @@ std::pair<Tree, time_t> downloadTarball(
     bool immutable,
     const Headers & headers = {});
 
+/* Compute a fingerprint of everything that determines the result of
+   filtering and dumping a source tree: the names, types, permissions,
+   sizes and mtimes of all accepted entries, and symlink targets.
+   Rejected entries are left out entirely, so touching an ignored file
+   doesn't invalidate the fingerprint. The filter is invoked exactly
+   as the dump would invoke it. */
+void fingerprintSourceTree(HashSink & sink, const Path & path,
+    PathFilter & filter, bool isRoot = true);
+
 }
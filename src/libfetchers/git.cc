@@ -5,10 +5,16 @@
 #include "store-api.hh"
 #include "url-parts.hh"
 #include "pathlocks.hh"
+#include "finally.hh"
+#include "sync.hh"
 
 #include <sys/time.h>
 #include <sys/wait.h>
 
+#if HAVE_LIBGIT2
+#include <git2.h>
+#endif
+
 using namespace std::string_literals;
 
 namespace nix::fetchers {
@@ -24,6 +30,144 @@ static std::string readHead(const Path & path)
     return chomp(runProgram("git", true, { "-C", path, "rev-parse", "--abbrev-ref", "HEAD" }));
 }
 
+#if HAVE_LIBGIT2
+
+[[noreturn]] static void throwGitError(const std::string & msg)
+{
+    auto err = git_error_last();
+    throw Error("%s: %s", msg, err && err->message ? err->message : "unknown libgit2 error");
+}
+
+/* Return the (bare) repository at 'path', opening it on first
+   use. Repositories are shared between all inputs, so they also
+   share libgit2's object cache. Note: only read-only operations on
+   specific revisions may be performed through these handles. */
+static git_repository * openGitRepo(const Path & path)
+{
+    static Sync<std::map<Path, git_repository *>> repos_;
+
+    auto repos(repos_.lock());
+
+    auto i = repos->find(path);
+    if (i != repos->end()) return i->second;
+
+    if (repos->empty())
+        git_libgit2_init();
+
+    git_repository * repo = nullptr;
+    if (git_repository_open(&repo, path.c_str()))
+        throwGitError(fmt("opening Git repository '%s'", path));
+    (*repos)[path] = repo;
+    return repo;
+}
+
+/* Equivalent of 'git rev-parse <spec>'. Returns std::nullopt if the
+   spec doesn't resolve. */
+static std::optional<Hash> resolveGitRev(const Path & repoDir, const std::string & spec)
+{
+    git_object * obj = nullptr;
+    if (git_revparse_single(&obj, openGitRepo(repoDir), spec.c_str()))
+        return std::nullopt;
+    Finally freeObj([&]() { git_object_free(obj); });
+    return Hash::parseAny(git_oid_tostr_s(git_object_id(obj)), htSHA1);
+}
+
+/* Return the commit time of 'rev', or std::nullopt if the repository
+   doesn't have that commit. */
+static std::optional<uint64_t> getGitCommitTime(const Path & repoDir, const Hash & rev)
+{
+    git_oid oid;
+    if (git_oid_fromstr(&oid, rev.gitRev().c_str()))
+        throwGitError(fmt("parsing Git revision '%s'", rev.gitRev()));
+    git_commit * commit = nullptr;
+    if (git_commit_lookup(&commit, openGitRepo(repoDir), &oid))
+        return std::nullopt;
+    Finally freeCommit([&]() { git_commit_free(commit); });
+    return (uint64_t) git_commit_time(commit);
+}
+
+/* Equivalent of 'git rev-list --count <rev>'. */
+static uint64_t getGitRevCount(const Path & repoDir, const Hash & rev)
+{
+    git_oid oid;
+    git_oid_fromstr(&oid, rev.gitRev().c_str());
+    git_revwalk * walk = nullptr;
+    if (git_revwalk_new(&walk, openGitRepo(repoDir)))
+        throwGitError("creating Git revision walker");
+    Finally freeWalk([&]() { git_revwalk_free(walk); });
+    if (git_revwalk_push(walk, &oid))
+        throwGitError(fmt("counting ancestors of Git revision '%s'", rev.gitRev()));
+    uint64_t count = 0;
+    git_oid cur;
+    while (!git_revwalk_next(&cur, walk))
+        count++;
+    return count;
+}
+
+/* Write the given tree to 'destDir', reading the blobs directly from
+   the object database. */
+static void exportGitTree(git_repository * repo, const git_tree * tree, const Path & destDir)
+{
+    createDirs(destDir);
+
+    for (size_t n = 0; n < git_tree_entrycount(tree); ++n) {
+        auto entry = git_tree_entry_byindex(tree, n);
+        auto mode = git_tree_entry_filemode(entry);
+        Path p = destDir + "/" + git_tree_entry_name(entry);
+
+        if (mode == GIT_FILEMODE_TREE) {
+            git_object * obj = nullptr;
+            if (git_tree_entry_to_object(&obj, repo, entry))
+                throwGitError(fmt("looking up tree entry '%s'", p));
+            Finally freeObj([&]() { git_object_free(obj); });
+            exportGitTree(repo, (const git_tree *) obj, p);
+        }
+
+        else if (mode == GIT_FILEMODE_COMMIT)
+            /* Submodule; materialised as an empty directory, like
+               'git archive' does. */
+            createDirs(p);
+
+        else {
+            git_blob * blob = nullptr;
+            if (git_blob_lookup(&blob, repo, git_tree_entry_id(entry)))
+                throwGitError(fmt("looking up blob '%s'", p));
+            Finally freeBlob([&]() { git_blob_free(blob); });
+
+            std::string_view data((const char *) git_blob_rawcontent(blob), git_blob_rawsize(blob));
+
+            if (mode == GIT_FILEMODE_LINK)
+                createSymlink(std::string(data), p);
+            else
+                writeFile(p, data, mode == GIT_FILEMODE_BLOB_EXECUTABLE ? 0777 : 0666);
+        }
+    }
+}
+
+/* Materialise the tree of the given commit at 'destDir', without
+   going through 'git archive' and a tar pipe. */
+static void exportGitRev(const Path & repoDir, const Hash & rev, const Path & destDir)
+{
+    auto repo = openGitRepo(repoDir);
+
+    git_oid oid;
+    git_oid_fromstr(&oid, rev.gitRev().c_str());
+
+    git_commit * commit = nullptr;
+    if (git_commit_lookup(&commit, repo, &oid))
+        throwGitError(fmt("looking up Git revision '%s'", rev.gitRev()));
+    Finally freeCommit([&]() { git_commit_free(commit); });
+
+    git_tree * tree = nullptr;
+    if (git_commit_tree(&tree, commit))
+        throwGitError(fmt("looking up tree of Git revision '%s'", rev.gitRev()));
+    Finally freeTree([&]() { git_tree_free(tree); });
+
+    exportGitTree(repo, tree, destDir);
+}
+
+#endif
+
 static bool isNotDotGitDirectory(const Path & path)
 {
     static const std::regex gitDirRegex("^(?:.*/)?\\.git$");
@@ -277,7 +421,35 @@ struct GitInputScheme : InputScheme
                     return files.count(file);
                 };
 
-                auto storePath = store->addToStore(input.getName(), actualUrl, FileIngestionMethod::Recursive, htSHA256, filter);
+                /* Memoise the copy on a metadata fingerprint of the
+                   tracked files, so an unchanged working tree isn't
+                   re-hashed and re-copied on every evaluation. */
+                std::optional<Attrs> fingerprintKey;
+                try {
+                    HashSink fingerprintSink(htSHA256);
+                    fingerprintSourceTree(fingerprintSink, actualUrl, filter);
+                    fingerprintKey = Attrs({
+                        {"type", std::string("gitWorkdirFingerprint")},
+                        {"name", name},
+                        {"url", actualUrl},
+                        {"submodules", submodules ? (uint64_t) 1 : (uint64_t) 0},
+                        {"fingerprint", fingerprintSink.finish().first.to_string(Base32, true)},
+                    });
+                } catch (Error &) {
+                    /* E.g. the tree changed underneath the walk. */
+                }
+
+                std::optional<StorePath> storePath;
+
+                if (fingerprintKey)
+                    if (auto res = getCache()->lookup(store, *fingerprintKey))
+                        storePath = res->second;
+
+                if (!storePath) {
+                    storePath = store->addToStore(input.getName(), actualUrl, FileIngestionMethod::Recursive, htSHA256, filter);
+                    if (fingerprintKey)
+                        getCache()->add(store, *fingerprintKey, {}, *storePath, true);
+                }
 
                 // FIXME: maybe we should use the timestamp of the last
                 // modified dirty file?
@@ -286,7 +458,7 @@ struct GitInputScheme : InputScheme
                     haveCommits ? std::stoull(runProgram("git", true, { "-C", actualUrl, "log", "-1", "--format=%ct", "--no-show-signature", "HEAD" })) : 0);
 
                 return {
-                    Tree(store->toRealPath(storePath), std::move(storePath)),
+                    Tree(store->toRealPath(*storePath), std::move(*storePath)),
                     input
                 };
             }
@@ -305,9 +477,17 @@ struct GitInputScheme : InputScheme
 
         if (isLocal) {
 
-            if (!input.getRev())
+            if (!input.getRev()) {
+#if HAVE_LIBGIT2
+                auto rev = resolveGitRev(actualUrl, *input.getRef());
+                if (!rev)
+                    throw Error("ref '%s' not found in Git repository '%s'", *input.getRef(), actualUrl);
+                input.attrs.insert_or_assign("rev", rev->gitRev());
+#else
                 input.attrs.insert_or_assign("rev",
                     Hash::parseAny(chomp(runProgram("git", true, { "-C", actualUrl, "rev-parse", *input.getRef() })), htSHA1).gitRev());
+#endif
+            }
 
             repoDir = actualUrl;
 
@@ -342,6 +522,9 @@ struct GitInputScheme : InputScheme
             /* If a rev was specified, we need to fetch if it's not in the
                repo. */
             if (input.getRev()) {
+#if HAVE_LIBGIT2
+                doFetch = !getGitCommitTime(repoDir, *input.getRev());
+#else
                 try {
                     runProgram("git", true, { "-C", repoDir, "cat-file", "-e", input.getRev()->gitRev() });
                     doFetch = false;
@@ -352,6 +535,7 @@ struct GitInputScheme : InputScheme
                         throw;
                     }
                 }
+#endif
             } else {
                 if (allRefs) {
                     doFetch = true;
@@ -399,7 +583,11 @@ struct GitInputScheme : InputScheme
             // cache dir lock is removed at scope end; we will only use read-only operations on specific revisions in the remainder
         }
 
+#if HAVE_LIBGIT2
+        bool isShallow = git_repository_is_shallow(openGitRepo(repoDir));
+#else
         bool isShallow = chomp(runProgram("git", true, { "-C", repoDir, "rev-parse", "--is-shallow-repository" })) == "true";
+#endif
 
         if (isShallow && !shallow)
             throw Error("'%s' is a shallow Git repository, but a non-shallow repository is needed", actualUrl);
@@ -417,6 +605,10 @@ struct GitInputScheme : InputScheme
         AutoDelete delTmpDir(tmpDir, true);
         PathFilter filter = defaultPathFilter;
 
+#if HAVE_LIBGIT2
+        auto commitTime = getGitCommitTime(repoDir, *input.getRev());
+        if (!commitTime)
+#else
         auto result = runProgram(RunOptions {
             .program = "git",
             .args = { "-C", repoDir, "cat-file", "commit", input.getRev()->gitRev() },
@@ -424,6 +616,7 @@ struct GitInputScheme : InputScheme
         });
         if (WEXITSTATUS(result.first) == 128
             && result.second.find("bad file") != std::string::npos)
+#endif
         {
             throw Error(
                 "Cannot find Git revision '%s' in ref '%s' of repository '%s'! "
@@ -453,6 +646,12 @@ struct GitInputScheme : InputScheme
 
             filter = isNotDotGitDirectory;
         } else {
+#if HAVE_LIBGIT2
+            /* Materialise the commit straight from the object
+               database instead of copying it through 'git archive'
+               and a tar pipe. */
+            exportGitRev(repoDir, *input.getRev(), tmpDir);
+#else
             // FIXME: should pipe this, or find some better way to extract a
             // revision.
             auto source = sinkToSource([&](Sink & sink) {
@@ -464,11 +663,16 @@ struct GitInputScheme : InputScheme
             });
 
             unpackTarfile(*source, tmpDir);
+#endif
         }
 
         auto storePath = store->addToStore(name, tmpDir, FileIngestionMethod::Recursive, htSHA256, filter);
 
+#if HAVE_LIBGIT2
+        auto lastModified = *commitTime;
+#else
         auto lastModified = std::stoull(runProgram("git", true, { "-C", repoDir, "log", "-1", "--format=%ct", "--no-show-signature", input.getRev()->gitRev() }));
+#endif
 
         Attrs infoAttrs({
             {"rev", input.getRev()->gitRev()},
@@ -477,7 +681,11 @@ struct GitInputScheme : InputScheme
 
         if (!shallow)
             infoAttrs.insert_or_assign("revCount",
+#if HAVE_LIBGIT2
+                getGitRevCount(repoDir, *input.getRev()));
+#else
                 std::stoull(runProgram("git", true, { "-C", repoDir, "rev-list", "--count", input.getRev()->gitRev() })));
+#endif
 
         if (!_input.getRev())
             getCache()->add(
@@ -247,12 +247,20 @@ struct GitHubInputScheme : GitArchiveInputScheme
             host, getStrAttr(input.attrs, "owner"), getStrAttr(input.attrs, "repo"), *input.getRef());
 
         Headers headers = makeHeadersWithAuthTokens(host);
-
-        auto json = nlohmann::json::parse(
-            readFile(
-                store->toRealPath(
-                    downloadFile(store, url, "source", false, headers).storePath)));
-        auto rev = Hash::parseAny(std::string { json["sha"] }, htSHA1);
+        /* Ask for the bare revision instead of the full commit JSON;
+           the response is a few dozen bytes, and downloadFile()'s
+           ETag revalidation turns the common unchanged-ref case into
+           a 304, which doesn't count against the API rate limit. */
+        headers.push_back({"Accept", "application/vnd.github.v3.sha"});
+
+        auto contents = readFile(
+            store->toRealPath(
+                downloadFile(store, url, "source", false, headers).storePath));
+        /* Entries cached before the Accept header was sent contain
+           the full commit JSON. */
+        auto rev = contents.size() && contents[0] == '{'
+            ? Hash::parseAny(std::string(nlohmann::json::parse(contents)["sha"]), htSHA1)
+            : Hash::parseAny(trim(contents), htSHA1);
         debug("HEAD revision for '%s' is %s", url, rev.gitRev());
         return rev;
     }
@@ -307,7 +315,7 @@ struct GitLabInputScheme : GitArchiveInputScheme
     {
         auto host = maybeGetStrAttr(input.attrs, "host").value_or("gitlab.com");
         // See rate limiting note below
-        auto url = fmt("https://%s/api/v4/projects/%s%%2F%s/repository/commits?ref_name=%s",
+        auto url = fmt("https://%s/api/v4/projects/%s%%2F%s/repository/commits?ref_name=%s&per_page=1",
             host, getStrAttr(input.attrs, "owner"), getStrAttr(input.attrs, "repo"), *input.getRef());
 
         Headers headers = makeHeadersWithAuthTokens(host);
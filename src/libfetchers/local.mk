@@ -10,4 +10,8 @@ libfetchers_CXXFLAGS += -I src/libutil -I src/libstore
 
 libfetchers_LDFLAGS += -pthread
 
+ifeq ($(HAVE_LIBGIT2), 1)
+  libfetchers_LDFLAGS += $(LIBGIT2_LIBS)
+endif
+
 libfetchers_LIBS = libutil libstore
@@ -1,4 +1,5 @@
 #include "fetchers.hh"
+#include "cache.hh"
 #include "store-api.hh"
 
 namespace nix::fetchers {
@@ -111,9 +112,37 @@ struct PathInputScheme : InputScheme
         if (storePath)
             store->addTempRoot(*storePath);
 
-        if (!storePath || storePath->name() != "source" || !store->isValidPath(*storePath))
-            // FIXME: try to substitute storePath.
-            storePath = store->addToStore("source", absPath);
+        if (!storePath || storePath->name() != "source" || !store->isValidPath(*storePath)) {
+            /* Re-hashing and re-copying a large unchanged tree on
+               every evaluation is expensive, so memoise the copy on a
+               metadata fingerprint of the tree; only a changed tree
+               gets dumped again. */
+            std::optional<Attrs> cacheKey;
+            try {
+                HashSink sink(htSHA256);
+                fingerprintSourceTree(sink, absPath, defaultPathFilter);
+                cacheKey = Attrs({
+                    {"type", std::string("pathFingerprint")},
+                    {"path", absPath},
+                    {"fingerprint", sink.finish().first.to_string(Base32, true)},
+                });
+            } catch (Error &) {
+                /* E.g. the tree changed underneath the walk. */
+            }
+
+            storePath.reset();
+
+            if (cacheKey)
+                if (auto res = getCache()->lookup(store, *cacheKey))
+                    storePath = res->second;
+
+            if (!storePath) {
+                // FIXME: try to substitute storePath.
+                storePath = store->addToStore("source", absPath);
+                if (cacheKey)
+                    getCache()->add(store, *cacheKey, {}, *storePath, true);
+            }
+        }
 
         return {
             Tree(store->toRealPath(*storePath), std::move(*storePath)),
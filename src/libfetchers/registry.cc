@@ -7,6 +7,8 @@
 
 #include <nlohmann/json.hpp>
 
+#include <thread>
+
 namespace nix::fetchers {
 
 std::shared_ptr<Registry> Registry::read(
@@ -153,10 +155,31 @@ static std::shared_ptr<Registry> getGlobalRegistry(ref<Store> store)
         auto path = settings.flakeRegistry.get();
 
         if (!hasPrefix(path, "/")) {
-            auto storePath = downloadFile(store, path, "flake-registry.json", false).storePath;
-            if (auto store2 = store.dynamic_pointer_cast<LocalFSStore>())
-                store2->addPermRoot(storePath, getCacheDir() + "/nix/flake-registry.json");
-            path = store->toRealPath(storePath);
+            auto pinnedPath = getCacheDir() + "/nix/flake-registry.json";
+
+            auto update = [store, path, pinnedPath]() {
+                auto storePath = downloadFile(store, path, "flake-registry.json", false).storePath;
+                if (auto store2 = store.dynamic_pointer_cast<LocalFSStore>())
+                    store2->addPermRoot(storePath, pinnedPath);
+                return store->toRealPath(storePath);
+            };
+
+            /* Offline-first: use the snapshot pinned by a previous run
+               and refresh it in the background, so the freshness check
+               (and, past the tarball TTL, the download) is never on
+               the critical path. Only the very first use, when no
+               snapshot exists yet, downloads synchronously. */
+            if (pathExists(pinnedPath)) {
+                std::thread([update]() {
+                    try {
+                        update();
+                    } catch (...) {
+                        ignoreException();
+                    }
+                }).detach();
+                path = pinnedPath;
+            } else
+                path = update();
         }
 
         return Registry::read(path, Registry::Global);
@@ -130,29 +130,70 @@ std::pair<Tree, time_t> downloadTarball(
             getIntAttr(cached->infoAttrs, "lastModified")
         };
 
-    auto res = downloadFile(store, url, name, immutable, headers);
-
     std::optional<StorePath> unpackedStorePath;
     time_t lastModified;
+    std::string etag;
 
-    if (cached && res.etag != "" && getStrAttr(cached->infoAttrs, "etag") == res.etag) {
-        unpackedStorePath = std::move(cached->storePath);
-        lastModified = getIntAttr(cached->infoAttrs, "lastModified");
-    } else {
-        Path tmpDir = createTempDir();
-        AutoDelete autoDelete(tmpDir, true);
-        unpackTarfile(store->toRealPath(res.storePath), tmpDir);
+    auto addUnpacked = [&](const Path & tmpDir) {
         auto members = readDirectory(tmpDir);
         if (members.size() != 1)
             throw nix::Error("tarball '%s' contains an unexpected number of top-level files", url);
         auto topDir = tmpDir + "/" + members.begin()->name;
         lastModified = lstat(topDir).st_mtime;
         unpackedStorePath = store->addToStore(name, topDir, FileIngestionMethod::Recursive, htSHA256, defaultPathFilter, NoRepair);
+    };
+
+    if (cached) {
+        /* We have an expired cache entry, so fetch the tarball via
+           downloadFile(), which sends the ETag and lets us reuse the
+           unpacked tree if the server replies '304 Not Modified'. */
+        auto res = downloadFile(store, url, name, immutable, headers);
+        etag = res.etag;
+
+        if (res.etag != "" && getStrAttr(cached->infoAttrs, "etag") == res.etag) {
+            unpackedStorePath = std::move(cached->storePath);
+            lastModified = getIntAttr(cached->infoAttrs, "lastModified");
+        } else {
+            Path tmpDir = createTempDir();
+            AutoDelete autoDelete(tmpDir, true);
+            unpackTarfile(store->toRealPath(res.storePath), tmpDir, true);
+            addUnpacked(tmpDir);
+        }
+    } else {
+        /* No previous download: feed the transfer straight into
+           libarchive, so decompression and unpacking overlap with
+           the download and the tarball itself never touches the
+           disk or the store. */
+        Path tmpDir = createTempDir();
+        AutoDelete autoDelete(tmpDir, true);
+
+        FileTransferRequest request(url);
+        request.headers = headers;
+
+        FileTransferResult res;
+
+        auto source = sinkToSource([&](Sink & sink) {
+            res = getFileTransfer()->download(std::move(request), sink);
+        });
+
+        unpackTarfile(*source, tmpDir, true);
+
+        /* Drain any trailing padding that libarchive didn't consume
+           so the transfer finishes and 'res' is filled in. */
+        try {
+            std::vector<char> buf(8192);
+            while (true) source->read(buf.data(), buf.size());
+        } catch (EndOfFile &) {
+        }
+
+        etag = res.etag;
+
+        addUnpacked(tmpDir);
     }
 
     Attrs infoAttrs({
         {"lastModified", uint64_t(lastModified)},
-        {"etag", res.etag},
+        {"etag", etag},
     });
 
     getCache()->add(
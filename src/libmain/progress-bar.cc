@@ -5,12 +5,23 @@
 #include "names.hh"
 
 #include <atomic>
+#include <chrono>
 #include <map>
 #include <thread>
 #include <iostream>
 
 namespace nix {
 
+static std::string renderDuration(uint64_t seconds)
+{
+    if (seconds >= 3600)
+        return fmt("%dh%02dm", seconds / 3600, (seconds % 3600) / 60);
+    else if (seconds >= 60)
+        return fmt("%dm%02ds", seconds / 60, seconds % 60);
+    else
+        return fmt("%ds", seconds);
+}
+
 static std::string getS(const std::vector<Logger::Field> & fields, size_t n)
 {
     assert(n < fields.size());
@@ -48,6 +59,10 @@ private:
         bool visible = true;
         ActivityId parent;
         std::optional<std::string> name;
+        /* Expected duration in seconds (0 if unknown) and start time,
+           for remaining-time estimates. */
+        uint64_t estimatedDuration = 0;
+        std::chrono::time_point<std::chrono::steady_clock> startTime;
     };
 
     struct ActivitiesByType
@@ -56,6 +71,14 @@ private:
         uint64_t done = 0;
         uint64_t expected = 0;
         uint64_t failed = 0;
+
+        /* Aggregates over the live activities in 'its', maintained
+           incrementally so that rendering is O(1) per type instead
+           of a walk over every running activity. */
+        uint64_t doneLive = 0;
+        uint64_t expectedLive = 0;
+        uint64_t runningLive = 0;
+        uint64_t failedLive = 0;
     };
 
     struct State
@@ -143,7 +166,10 @@ public:
     {
         if (state.active) {
             writeToStderr("\r\e[K" + filterANSIEscapes(s, !isTTY) + ANSI_NORMAL "\n");
-            draw(state);
+            /* Repainting the status line is left to the update
+               thread's next tick: with verbose build output a draw
+               per log line dominates the client's CPU time. */
+            update(state);
         } else {
             auto s2 = s + ANSI_NORMAL "\n";
             if (!isTTY) s2 = filterANSIEscapes(s2, true);
@@ -180,6 +206,10 @@ public:
             if (nrRounds != 1)
                 i->s += fmt(" (round %d/%d)", curRound, nrRounds);
             i->name = DrvName(name).name;
+            if (fields.size() >= 5) {
+                i->estimatedDuration = getI(fields, 4);
+                i->startTime = std::chrono::steady_clock::now();
+            }
         }
 
         if (type == actSubstitute) {
@@ -236,6 +266,10 @@ public:
             auto & actByType = state->activitiesByType[i->second->type];
             actByType.done += i->second->done;
             actByType.failed += i->second->failed;
+            actByType.doneLive -= i->second->done;
+            actByType.expectedLive -= i->second->expected;
+            actByType.runningLive -= i->second->running;
+            actByType.failedLive -= i->second->failed;
 
             for (auto & j : i->second->expectedByType)
                 state->activitiesByType[j.first].expected -= j.second;
@@ -301,10 +335,21 @@ public:
             auto i = state->its.find(act);
             assert(i != state->its.end());
             ActInfo & actInfo = *i->second;
-            actInfo.done = getI(fields, 0);
-            actInfo.expected = getI(fields, 1);
-            actInfo.running = getI(fields, 2);
-            actInfo.failed = getI(fields, 3);
+            auto & actByType = state->activitiesByType[actInfo.type];
+            auto done = getI(fields, 0);
+            auto expected = getI(fields, 1);
+            auto running = getI(fields, 2);
+            auto failed = getI(fields, 3);
+            /* The deltas may be "negative"; unsigned wraparound
+               still keeps the sums correct. */
+            actByType.doneLive += done - actInfo.done;
+            actByType.expectedLive += expected - actInfo.expected;
+            actByType.runningLive += running - actInfo.running;
+            actByType.failedLive += failed - actInfo.failed;
+            actInfo.done = done;
+            actInfo.expected = expected;
+            actInfo.running = running;
+            actInfo.failed = failed;
             update(*state);
         }
 
@@ -350,6 +395,12 @@ public:
 
             if (i != state.activities.rend()) {
                 line += i->s;
+                if (i->estimatedDuration) {
+                    auto elapsed = (uint64_t) std::chrono::duration_cast<std::chrono::seconds>(
+                        std::chrono::steady_clock::now() - i->startTime).count();
+                    if (elapsed < i->estimatedDuration)
+                        line += fmt(" (~%s left)", renderDuration(i->estimatedDuration - elapsed));
+                }
                 if (!i->phase.empty()) {
                     line += " (";
                     line += i->phase;
@@ -376,13 +427,10 @@ public:
 
         auto renderActivity = [&](ActivityType type, const std::string & itemFmt, const std::string & numberFmt = "%d", double unit = 1) {
             auto & act = state.activitiesByType[type];
-            uint64_t done = act.done, expected = act.done, running = 0, failed = act.failed;
-            for (auto & j : act.its) {
-                done += j.second->done;
-                expected += j.second->expected;
-                running += j.second->running;
-                failed += j.second->failed;
-            }
+            uint64_t done = act.done + act.doneLive;
+            uint64_t expected = act.done + act.expectedLive;
+            uint64_t running = act.runningLive;
+            uint64_t failed = act.failed + act.failedLive;
 
             expected = std::max(expected, act.expected);
 
@@ -113,32 +113,6 @@ static void opensslLockCallback(int mode, int type, const char * file, int line)
 }
 #endif
 
-static std::once_flag dns_resolve_flag;
-
-static void preloadNSS() {
-    /* builtin:fetchurl can trigger a DNS lookup, which with glibc can trigger a dynamic library load of
-       one of the glibc NSS libraries in a sandboxed child, which will fail unless the library's already
-       been loaded in the parent. So we force a lookup of an invalid domain to force the NSS machinery to
-       load its lookup libraries in the parent before any child gets a chance to. */
-    std::call_once(dns_resolve_flag, []() {
-        struct addrinfo *res = NULL;
-
-        /* nss will only force the "local" (not through nscd) dns resolution if its on the LOCALDOMAIN.
-           We need the resolution to be done locally, as nscd socket will not be accessible in the
-           sandbox. */
-        char * previous_env = getenv("LOCALDOMAIN");
-        setenv("LOCALDOMAIN", "invalid", 1);
-        if (getaddrinfo("this.pre-initializes.the.dns.resolvers.invalid.", "http", NULL, &res) == 0) {
-            if (res) freeaddrinfo(res);
-        }
-        if (previous_env) {
-             setenv("LOCALDOMAIN", previous_env, 1);
-        } else {
-             unsetenv("LOCALDOMAIN");
-        }
-    });
-}
-
 static void sigHandler(int signo) { }
 
 
@@ -205,7 +179,10 @@ void initNix()
         unsetenv("TMPDIR");
 #endif
 
-    preloadNSS();
+    /* preloadNSS() used to be called here; it is now done right
+       before the first build is forked (see startBuilder()), since
+       the dummy resolver lookup it performs can block and most
+       invocations never build anything. */
 }
 
 
@@ -343,7 +320,7 @@ void showManPage(const string & name)
     restoreProcessContext();
     setenv("MANPATH", settings.nixManDir.c_str(), 1);
     execlp("man", "man", name.c_str(), nullptr);
-    throw SysError("command 'man %1%' failed", name.c_str());
+    throw SysError("command 'man %1%' failed", name);
 }
 
 
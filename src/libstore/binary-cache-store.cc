@@ -4,6 +4,8 @@
 #include "derivations.hh"
 #include "fs-accessor.hh"
 #include "globals.hh"
+#include "nar-chunks.hh"
+#include "nar-delta.hh"
 #include "nar-info.hh"
 #include "sync.hh"
 #include "remote-fs-accessor.hh"
@@ -22,6 +24,55 @@
 
 namespace nix {
 
+/* A Bloom filter of the hash parts of the store paths a binary cache
+   contains, which a cache may publish so that clients can skip
+   .narinfo lookups that are bound to produce a 404. The format of the
+   'nix-cache-contents.bloom' file is a header line
+
+     NixCacheBloomFilter 1 <nbits> <nhashes>
+
+   followed by the raw bitmap ((nbits + 7) / 8 bytes, bit n being bit
+   n % 8 of byte n / 8). The bit positions for a path are derived by
+   double hashing from the SHA-256 of its hash part. */
+struct CacheContentsFilter
+{
+    uint64_t nbits;
+    uint64_t nhashes;
+    std::string bits;
+
+    bool mayContain(std::string_view hashPart) const
+    {
+        auto h = hashString(htSHA256, hashPart);
+        uint64_t h1, h2;
+        memcpy(&h1, h.hash, sizeof(h1));
+        memcpy(&h2, h.hash + sizeof(h1), sizeof(h2));
+        for (uint64_t i = 0; i < nhashes; ++i) {
+            auto bit = (h1 + i * h2) % nbits;
+            if (!(bits[bit / 8] & (1 << (bit % 8))))
+                return false;
+        }
+        return true;
+    }
+};
+
+static std::shared_ptr<const CacheContentsFilter> parseCacheContentsFilter(const std::string & data)
+{
+    auto eol = data.find('\n');
+    if (eol == std::string::npos) return nullptr;
+    auto tokens = tokenizeString<std::vector<std::string>>(std::string(data, 0, eol));
+    if (tokens.size() != 4 || tokens[0] != "NixCacheBloomFilter" || tokens[1] != "1")
+        return nullptr;
+    auto filter = std::make_shared<CacheContentsFilter>();
+    filter->nbits = std::stoull(tokens[2]);
+    filter->nhashes = std::stoull(tokens[3]);
+    if (filter->nbits == 0 || filter->nhashes == 0 || filter->nhashes > 64)
+        return nullptr;
+    filter->bits = std::string(data, eol + 1);
+    if (filter->bits.size() != (filter->nbits + 7) / 8)
+        return nullptr;
+    return filter;
+}
+
 BinaryCacheStore::BinaryCacheStore(const Params & params)
     : BinaryCacheStoreConfig(params)
     , Store(params)
@@ -111,17 +162,26 @@ void BinaryCacheStore::writeNarInfo(ref<NarInfo> narInfo)
 
     upsertFile(narInfoFile, narInfo->to_string(*this), "text/x-nix-narinfo");
 
-    {
-        auto state_(state.lock());
-        state_->pathInfoCache.upsert(
-            std::string(narInfo->path.to_string()),
-            PathInfoCacheValue { .value = std::shared_ptr<NarInfo>(narInfo) });
-    }
+    pathInfoCache.upsert(
+        std::string(narInfo->path.to_string()),
+        PathInfoCacheValue { .value = std::shared_ptr<NarInfo>(narInfo) });
 
     if (diskCache)
         diskCache->upsertNarInfo(getUri(), std::string(narInfo->path.hashPart()), std::shared_ptr<NarInfo>(narInfo));
 }
 
+static std::string compressionExtension(const std::string & method)
+{
+    return
+        method == "xz" ? ".xz" :
+        method == "bzip2" ? ".bz2" :
+        method == "zstd" ? ".zst" :
+        method == "lzip" ? ".lzip" :
+        method == "lz4" ? ".lz4" :
+        method == "br" ? ".br" :
+        "";
+}
+
 AutoCloseFD openFile(const Path & path)
 {
     auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
@@ -146,14 +206,38 @@ ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
     HashSink fileHashSink { htSHA256 };
     std::shared_ptr<FSAccessor> narAccessor;
     HashSink narHashSink { htSHA256 };
+
+    /* With 'chunked-nars', split the uncompressed NAR into
+       content-defined chunks as it streams by, and upload each chunk
+       the cache doesn't already have under its (uncompressed)
+       hash. */
+    NarChunkManifest manifest;
+    manifest.compression = compression;
+    std::unique_ptr<ChunkingSink> chunkingSink;
+    if (chunkedNars)
+        chunkingSink = std::make_unique<ChunkingSink>(chunkAverageSize,
+            [&](std::string_view chunk) {
+                auto chunkHash = hashString(htSHA256, chunk);
+                manifest.chunks.emplace_back(chunkHash, chunk.size());
+                auto chunkFile = "nar-chunks/" + chunkHash.to_string(Base32, false)
+                    + ".chunk" + compressionExtension(compression);
+                if (repair || !fileExists(chunkFile))
+                    upsertFile(chunkFile,
+                        std::string(*compress(compression, std::string(chunk), false, compressionLevel)),
+                        "application/x-nix-nar-chunk");
+            });
+
     {
     FdSink fileSink(fdTemp.get());
     TeeSink teeSinkCompressed { fileSink, fileHashSink };
     auto compressionSink = makeCompressionSink(compression, teeSinkCompressed, parallelCompression, compressionLevel);
     TeeSink teeSinkUncompressed { *compressionSink, narHashSink };
-    TeeSource teeSource { narSource, teeSinkUncompressed };
+    std::optional<TeeSink> teeSinkChunks;
+    if (chunkingSink) teeSinkChunks.emplace(teeSinkUncompressed, *chunkingSink);
+    TeeSource teeSource { narSource, teeSinkChunks ? (Sink &) *teeSinkChunks : teeSinkUncompressed };
     narAccessor = makeNarAccessor(teeSource);
     compressionSink->finish();
+    if (chunkingSink) chunkingSink->finish();
     fileSink.flush();
     }
 
@@ -166,13 +250,7 @@ ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
     narInfo->fileHash = fileHash;
     narInfo->fileSize = fileSize;
     narInfo->url = "nar/" + narInfo->fileHash->to_string(Base32, false) + ".nar"
-        + (compression == "xz" ? ".xz" :
-           compression == "bzip2" ? ".bz2" :
-           compression == "zstd" ? ".zst" :
-           compression == "lzip" ? ".lzip" :
-           compression == "lz4" ? ".lz4" :
-           compression == "br" ? ".br" :
-           "");
+        + compressionExtension(compression);
 
     auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(now2 - now1).count();
     printMsg(lvlTalkative, "copying path '%1%' (%2% bytes, compressed %3$.1f%% in %4% ms) to binary cache",
@@ -207,6 +285,12 @@ ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
         }
 
         upsertFile(std::string(info.path.hashPart()) + ".ls", jsonOut.str(), "application/json");
+
+        /* Also write the listing in the compact binary format, which
+           clients prefer; the JSON file is kept for older clients
+           and external consumers. */
+        upsertFile(std::string(info.path.hashPart()) + ".lsb",
+            listNarBinary(ref<FSAccessor>(narAccessor)), "application/octet-stream");
     }
 
     /* Optionally maintain an index of DWARF debug info files
@@ -267,7 +351,18 @@ ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
     }
 
     /* Atomically write the NAR file. */
-    if (repair || !fileExists(narInfo->url)) {
+    if (chunkedNars) {
+        /* The chunks were uploaded while the NAR streamed by; only
+           the manifest remains. The whole-NAR URL is still recorded
+           in the narinfo but not uploaded, so clients without chunk
+           support fail with a clean 'substituter went away' error. */
+        manifest.narSize = info.narSize;
+        auto manifestFile = "nar-chunks/" + info.narHash.to_string(Base32, false) + ".manifest";
+        if (repair || !fileExists(manifestFile))
+            upsertFile(manifestFile, manifest.to_string(), "application/x-nix-nar-chunks");
+        narInfo->chunksUrl = manifestFile;
+        stats.narWrite++;
+    } else if (repair || !fileExists(narInfo->url)) {
         stats.narWrite++;
         upsertFile(narInfo->url,
             std::make_shared<std::fstream>(fnTemp, std::ios_base::in | std::ios_base::binary),
@@ -323,8 +418,42 @@ StorePath BinaryCacheStore::addToStoreFromDump(Source & dump, const string & nam
     })->path;
 }
 
+bool BinaryCacheStore::definitelyMissing(const StorePath & storePath)
+{
+    if (!useBloomFilter) return false;
+
+    std::shared_ptr<const CacheContentsFilter> filter;
+
+    {
+        auto contentsFilter(this->contentsFilter.lock());
+        if (!*contentsFilter) {
+            /* Not fetched yet. A missing or malformed filter is
+               cached as a null pointer so we only try once. */
+            std::shared_ptr<const CacheContentsFilter> parsed;
+            try {
+                if (auto data = getFile("nix-cache-contents.bloom")) {
+                    parsed = parseCacheContentsFilter(*data);
+                    if (parsed)
+                        debug("using contents filter of '%s' (%d bits, %d hash functions)",
+                            getUri(), parsed->nbits, parsed->nhashes);
+                    else
+                        debug("ignoring malformed contents filter of '%s'", getUri());
+                }
+            } catch (...) {
+                ignoreException();
+            }
+            *contentsFilter = parsed;
+        }
+        filter = **contentsFilter;
+    }
+
+    return filter && !filter->mayContain(storePath.hashPart());
+}
+
 bool BinaryCacheStore::isValidPathUncached(const StorePath & storePath)
 {
+    if (definitelyMissing(storePath)) return false;
+
     // FIXME: this only checks whether a .narinfo with a matching hash
     // part exists. So ‘f4kb...-foo’ matches ‘f4kb...-bar’, even
     // though they shouldn't. Not easily fixed.
@@ -338,15 +467,42 @@ void BinaryCacheStore::narFromPath(const StorePath & storePath, Sink & sink)
     LengthSink narSize;
     TeeSink tee { sink, narSize };
 
-    auto decompressor = makeDecompressionSink(info->compression, tee);
+    if (!info->chunksUrl.empty()) {
+        /* Reassemble the NAR from its chunks. Every chunk is
+           verified against the hash it is stored under, since that
+           hash is what deduplication trusts. */
+        try {
+            auto manifestData = getFile(info->chunksUrl);
+            if (!manifestData)
+                throw SubstituteGone("chunk manifest '%s' is missing from binary cache '%s'",
+                    info->chunksUrl, getUri());
+            auto manifest = NarChunkManifest::parse(*manifestData);
+            for (auto & [chunkHash, chunkSize] : manifest.chunks) {
+                auto chunkFile = "nar-chunks/" + chunkHash.to_string(Base32, false)
+                    + ".chunk" + compressionExtension(manifest.compression);
+                StringSink chunkData;
+                auto decompressor = makeDecompressionSink(manifest.compression, chunkData, true);
+                getFile(chunkFile, *decompressor);
+                decompressor->finish();
+                if (hashString(htSHA256, *chunkData.s) != chunkHash)
+                    throw Error("hash mismatch in NAR chunk '%s' from binary cache '%s'",
+                        chunkFile, getUri());
+                tee(*chunkData.s);
+            }
+        } catch (NoSuchBinaryCacheFile & e) {
+            throw SubstituteGone(e.info());
+        }
+    } else {
+        auto decompressor = makeDecompressionSink(info->compression, tee, true);
 
-    try {
-        getFile(info->url, *decompressor);
-    } catch (NoSuchBinaryCacheFile & e) {
-        throw SubstituteGone(e.info());
-    }
+        try {
+            getFile(info->url, *decompressor);
+        } catch (NoSuchBinaryCacheFile & e) {
+            throw SubstituteGone(e.info());
+        }
 
-    decompressor->finish();
+        decompressor->finish();
+    }
 
     stats.narRead++;
     //stats.narReadCompressedBytes += nar->size(); // FIXME
@@ -356,6 +512,11 @@ void BinaryCacheStore::narFromPath(const StorePath & storePath, Sink & sink)
 void BinaryCacheStore::queryPathInfoUncached(const StorePath & storePath,
     Callback<std::shared_ptr<const ValidPathInfo>> callback) noexcept
 {
+    if (definitelyMissing(storePath)) {
+        callback(nullptr);
+        return;
+    }
+
     auto uri = getUri();
     auto storePathS = printStorePath(storePath);
     auto act = std::make_shared<Activity>(*logger, lvlTalkative, actQueryPathInfo,
@@ -464,6 +625,45 @@ void BinaryCacheStore::queryRealisationUncached(const DrvOutput & id,
     getFile(outputInfoFilePath, std::move(newCallback));
 }
 
+std::map<DrvOutput, std::shared_ptr<const Realisation>> BinaryCacheStore::queryRealisationsUncached(
+    const std::set<DrvOutput> & ids)
+{
+    /* Issue all the fetches at once; for HTTP caches they then
+       proceed in parallel on the transfer thread instead of paying
+       one round trip per output. */
+    struct State
+    {
+        size_t left;
+        std::map<DrvOutput, std::shared_ptr<const Realisation>> res;
+        std::exception_ptr ex;
+    };
+
+    auto state = std::make_shared<Sync<State>>(State { ids.size(), {}, nullptr });
+    auto wakeup = std::make_shared<std::condition_variable>();
+
+    for (auto & id : ids)
+        queryRealisationUncached(id,
+            {[state, wakeup, id](std::future<std::shared_ptr<const Realisation>> fut) {
+                auto state_(state->lock());
+                try {
+                    if (auto info = fut.get())
+                        state_->res.emplace(id, info);
+                } catch (...) {
+                    state_->ex = std::current_exception();
+                }
+                assert(state_->left);
+                state_->left--;
+                wakeup->notify_one();
+            }});
+
+    auto state_(state->lock());
+    while (state_->left)
+        state_.wait(*wakeup);
+    if (state_->ex)
+        std::rethrow_exception(state_->ex);
+    return std::move(state_->res);
+}
+
 void BinaryCacheStore::registerDrvOutput(const Realisation& info) {
     if (diskCache)
         diskCache->upsertRealisation(getUri(), info);
@@ -490,6 +690,34 @@ void BinaryCacheStore::addSignatures(const StorePath & storePath, const StringSe
     writeNarInfo(narInfo);
 }
 
+void BinaryCacheStore::writeNarDelta(const StorePath & path, const StorePath & basePath,
+    std::string_view baseNar, std::string_view nar)
+{
+    auto narInfo = make_ref<NarInfo>((NarInfo &) *queryPathInfo(path));
+
+    StringSink delta;
+    makeNarDelta(baseNar, nar, delta);
+
+    /* Only advertise the delta if it's substantially smaller than
+       the compressed NAR; otherwise the extra round trip isn't worth
+       it. */
+    if (delta.s->size() * 4 > narInfo->fileSize * 3) return;
+
+    auto deltaFile = "nar/" + std::string(path.hashPart()) + "-from-"
+        + std::string(basePath.hashPart()) + ".nar-delta";
+
+    upsertFile(deltaFile, std::string(*delta.s), "application/x-nix-nar-delta");
+
+    narInfo->deltaUrl = deltaFile;
+    narInfo->deltaSize = delta.s->size();
+    narInfo->deltaBase = basePath;
+
+    writeNarInfo(narInfo);
+
+    printMsg(lvlTalkative, "wrote %d byte delta for '%s' against '%s'",
+        delta.s->size(), printStorePath(path), printStorePath(basePath));
+}
+
 std::shared_ptr<std::string> BinaryCacheStore::getBuildLog(const StorePath & path)
 {
     auto drvPath = path;
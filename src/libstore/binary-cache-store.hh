@@ -10,6 +10,7 @@
 namespace nix {
 
 struct NarInfo;
+struct CacheContentsFilter;
 
 struct BinaryCacheStoreConfig : virtual StoreConfig
 {
@@ -22,6 +23,20 @@ struct BinaryCacheStoreConfig : virtual StoreConfig
     const Setting<Path> localNarCache{(StoreConfig*) this, "", "local-nar-cache", "path to a local cache of NARs"};
     const Setting<bool> parallelCompression{(StoreConfig*) this, false, "parallel-compression",
         "enable multi-threading compression for NARs, available for xz and zstd only currently"};
+    const Setting<bool> useBloomFilter{(StoreConfig*) this, false, "use-bloom-filter",
+        "whether to fetch a Bloom filter of the cache's contents ('nix-cache-contents.bloom') and skip lookups for paths that are definitely not in the cache"};
+    const Setting<bool> writeNARDeltas{(StoreConfig*) this, false, "write-nar-deltas",
+        "whether to publish binary deltas against older versions of the same package when copying to this cache"};
+    const Setting<uint64_t> narDeltaMaxSize{(StoreConfig*) this, 256 * 1024 * 1024, "nar-delta-max-size",
+        "maximum uncompressed NAR size for which binary deltas are computed or applied "
+        "(delta processing needs random access to the base NAR in memory)"};
+    const Setting<bool> chunkedNars{(StoreConfig*) this, false, "chunked-nars",
+        "whether to store NARs as content-defined chunks plus a per-path manifest, "
+        "so that data shared between paths is stored and uploaded only once "
+        "(clients without chunk support cannot substitute from such paths)"};
+    const Setting<uint64_t> chunkAverageSize{(StoreConfig*) this, 1024 * 1024, "chunk-average-size",
+        "target average chunk size in bytes for 'chunked-nars' "
+        "(the minimum and maximum chunk sizes are a quarter and four times this)"};
     const Setting<int> compressionLevel{(StoreConfig*) this, -1, "compression-level",
         "specify 'preset level' of compression to be used with NARs: "
         "meaning and accepted range of values depends on compression method selected, "
@@ -35,6 +50,16 @@ private:
 
     std::unique_ptr<SecretKey> secretKey;
 
+    /* Lazily fetched Bloom filter of the cache's contents, if
+       enabled. std::nullopt means it hasn't been fetched yet; a null
+       pointer means the cache doesn't publish one (or it was
+       unusable). */
+    Sync<std::optional<std::shared_ptr<const CacheContentsFilter>>> contentsFilter;
+
+    /* Whether the contents filter is enabled, present and proves that
+       the given path is not in the cache. */
+    bool definitelyMissing(const StorePath & storePath);
+
 protected:
 
     // The prefix under which realisation infos will be stored
@@ -67,6 +92,18 @@ public:
 
     std::shared_ptr<std::string> getFile(const std::string & path);
 
+    /* Whether getFileRange() can fetch byte ranges. */
+    virtual bool supportsFileRanges()
+    { return false; }
+
+    /* Fetch a byte range of the specified file. Returns std::nullopt
+       if the range could not be served (e.g. the server ignores range
+       requests), in which case the caller should fall back to
+       fetching the whole file. */
+    virtual std::optional<std::string> getFileRange(
+        const std::string & path, uint64_t offset, uint64_t size)
+    { return std::nullopt; }
+
 public:
 
     virtual void init() override;
@@ -111,12 +148,23 @@ public:
     void queryRealisationUncached(const DrvOutput &,
         Callback<std::shared_ptr<const Realisation>> callback) noexcept override;
 
+    std::map<DrvOutput, std::shared_ptr<const Realisation>> queryRealisationsUncached(
+        const std::set<DrvOutput> & ids) override;
+
     void narFromPath(const StorePath & path, Sink & sink) override;
 
     ref<FSAccessor> getFSAccessor() override;
 
     void addSignatures(const StorePath & storePath, const StringSet & sigs) override;
 
+    /* Publish a binary delta that transforms 'baseNar' (the NAR of
+       'basePath', which must already be in this cache) into 'nar'
+       (the NAR of 'path'), and advertise it in the narinfo of
+       'path'. Does nothing if the delta wouldn't save a meaningful
+       amount of traffic. */
+    void writeNarDelta(const StorePath & path, const StorePath & basePath,
+        std::string_view baseNar, std::string_view nar);
+
     std::shared_ptr<std::string> getBuildLog(const StorePath & path) override;
 
 };
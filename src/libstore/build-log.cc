@@ -0,0 +1,243 @@
+#include "build-log.hh"
+#include "util.hh"
+#include "sync.hh"
+
+#include <condition_variable>
+#include <cstring>
+#include <queue>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace nix {
+
+/* The index is the payload of a zstd skippable frame appended after
+   the data frames: for every frame its compressed and uncompressed
+   size as 64-bit little-endian integers, then the number of frames,
+   then the magic. It's parsed backwards from the end of the file. */
+
+static const std::string logIndexMagic = "NIXLOGI1";
+
+static constexpr uint32_t skippableFrameMagic = 0x184d2a5e;
+
+/* Maximum uncompressed size of a frame. Smaller frames give finer
+   random access at some cost in compression ratio. */
+static constexpr size_t logChunkSize = 1 << 20;
+
+static void addLE32(std::string & s, uint32_t n)
+{
+    for (int i = 0; i < 4; i++)
+        s.push_back((n >> (8 * i)) & 0xff);
+}
+
+static void addLE64(std::string & s, uint64_t n)
+{
+    for (int i = 0; i < 8; i++)
+        s.push_back((n >> (8 * i)) & 0xff);
+}
+
+static uint32_t readLE32(const char * p)
+{
+    uint32_t n = 0;
+    for (int i = 3; i >= 0; i--)
+        n = (n << 8) | (unsigned char) p[i];
+    return n;
+}
+
+static uint64_t readLE64(const char * p)
+{
+    uint64_t n = 0;
+    for (int i = 7; i >= 0; i--)
+        n = (n << 8) | (unsigned char) p[i];
+    return n;
+}
+
+/* Don't let a builder that logs faster than zstd compresses queue up
+   more than this many uncompressed chunks. */
+static constexpr size_t maxPendingChunks = 8;
+
+struct SeekableLogSink : CompressionSink
+{
+    Sink & nextSink;
+    std::string chunk;
+    /* (compressed size, uncompressed size) of each emitted frame.
+       Only touched by the writer thread until it is joined. */
+    std::vector<std::pair<uint64_t, uint64_t>> frames;
+
+    struct State
+    {
+        std::queue<std::string> pending;
+        bool quit = false;
+        std::exception_ptr exc;
+    };
+
+    /* Compression and file writes happen on a dedicated writer
+       thread, so that the thread feeding us (e.g. the Worker loop
+       pumping builder output) isn't throttled by them. */
+    Sync<State> state_;
+    std::condition_variable wakeup;
+    std::thread writerThread;
+
+    SeekableLogSink(Sink & nextSink)
+        : nextSink(nextSink)
+        , writerThread([this]() { writerThreadEntry(); })
+    { }
+
+    ~SeekableLogSink()
+    {
+        if (writerThread.joinable()) {
+            state_.lock()->quit = true;
+            wakeup.notify_all();
+            writerThread.join();
+        }
+    }
+
+    void writerThreadEntry()
+    {
+        try {
+            while (true) {
+                std::string data;
+                {
+                    auto state(state_.lock());
+                    while (state->pending.empty()) {
+                        if (state->quit) return;
+                        state.wait(wakeup);
+                    }
+                    data = std::move(state->pending.front());
+                    state->pending.pop();
+                }
+                wakeup.notify_all();
+                auto compressed = compress("zstd", data);
+                frames.emplace_back(compressed->size(), data.size());
+                nextSink(*compressed);
+            }
+        } catch (...) {
+            state_.lock()->exc = std::current_exception();
+            wakeup.notify_all();
+        }
+    }
+
+    void pushChunk()
+    {
+        if (chunk.empty()) return;
+        {
+            auto state(state_.lock());
+            while (state->pending.size() >= maxPendingChunks && !state->exc)
+                state.wait(wakeup);
+            if (state->exc) std::rethrow_exception(state->exc);
+            state->pending.push(std::move(chunk));
+        }
+        wakeup.notify_all();
+        chunk.clear();
+    }
+
+    void write(std::string_view data) override
+    {
+        while (!data.empty()) {
+            size_t n = std::min(logChunkSize - chunk.size(), data.size());
+            chunk.append(data.substr(0, n));
+            data.remove_prefix(n);
+            if (chunk.size() == logChunkSize) pushChunk();
+        }
+    }
+
+    void finish() override
+    {
+        flush();
+        pushChunk();
+        state_.lock()->quit = true;
+        wakeup.notify_all();
+        writerThread.join();
+
+        if (auto exc = state_.lock()->exc)
+            std::rethrow_exception(exc);
+
+        std::string index;
+        for (auto & [c, u] : frames) {
+            addLE64(index, c);
+            addLE64(index, u);
+        }
+        addLE64(index, frames.size());
+        index += logIndexMagic;
+        std::string footer;
+        addLE32(footer, skippableFrameMagic);
+        addLE32(footer, index.size());
+        nextSink(footer + index);
+    }
+};
+
+ref<CompressionSink> makeSeekableLogSink(Sink & nextSink)
+{
+    return make_ref<SeekableLogSink>(nextSink);
+}
+
+std::optional<std::string> readCompressedLogTail(const Path & path, size_t bytes)
+{
+    AutoCloseFD fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd) throw SysError("opening log file '%1%'", path);
+
+    struct stat st;
+    if (fstat(fd.get(), &st)) throw SysError("statting log file '%1%'", path);
+    uint64_t fileSize = st.st_size;
+
+    auto readAt = [&](uint64_t offset, size_t len) {
+        std::string buf(len, 0);
+        size_t done = 0;
+        while (done < len) {
+            ssize_t r = pread(fd.get(), buf.data() + done, len - done, offset + done);
+            if (r == -1) {
+                if (errno == EINTR) continue;
+                throw SysError("reading log file '%1%'", path);
+            }
+            if (r == 0) throw Error("log file '%1%' is truncated", path);
+            done += r;
+        }
+        return buf;
+    };
+
+    if (fileSize < 8 + 16) return std::nullopt;
+
+    auto trailer = readAt(fileSize - 16, 16);
+    if (std::string_view(trailer).substr(8) != logIndexMagic) return std::nullopt;
+    uint64_t numFrames = readLE64(trailer.data());
+
+    if (numFrames > fileSize / 16) return std::nullopt;
+    uint64_t indexSize = numFrames * 16 + 16;
+    if (fileSize < indexSize + 8) return std::nullopt;
+
+    auto header = readAt(fileSize - indexSize - 8, 8);
+    if (readLE32(header.data()) != skippableFrameMagic
+        || readLE32(header.data() + 4) != indexSize)
+        return std::nullopt;
+
+    auto table = readAt(fileSize - indexSize, numFrames * 16);
+    std::vector<std::pair<uint64_t, uint64_t>> frames(numFrames);
+    uint64_t compressedTotal = 0;
+    for (uint64_t i = 0; i < numFrames; i++) {
+        frames[i] = {readLE64(table.data() + i * 16), readLE64(table.data() + i * 16 + 8)};
+        compressedTotal += frames[i].first;
+    }
+    if (compressedTotal + indexSize + 8 != fileSize) return std::nullopt;
+
+    /* Walk backwards until the frames cover the requested range. */
+    size_t first = numFrames;
+    uint64_t uncompressed = 0;
+    while (first > 0 && uncompressed < bytes)
+        uncompressed += frames[--first].second;
+
+    uint64_t offset = 0;
+    for (size_t i = 0; i < first; i++)
+        offset += frames[i].first;
+
+    if (offset == compressedTotal) return std::string();
+
+    auto res = decompress("zstd", readAt(offset, compressedTotal - offset));
+
+    return res->size() > bytes
+        ? std::string(*res, res->size() - bytes)
+        : *res;
+}
+
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "compression.hh"
+#include "types.hh"
+
+namespace nix {
+
+/* Return a sink that stores a build log as a sequence of
+   independently compressed zstd frames of bounded uncompressed size,
+   followed by an index inside a zstd skippable frame. Stock zstd
+   decompressors ignore the skippable frame, so the result is an
+   ordinary zstd stream, but the index allows decompressing an
+   arbitrary range of the log without starting from the beginning. */
+ref<CompressionSink> makeSeekableLogSink(Sink & nextSink);
+
+/* Return the last 'bytes' uncompressed bytes of the log at 'path',
+   decompressing only the frames that overlap the requested range.
+   Returns std::nullopt if the file has no usable index (e.g. it was
+   written by an older Nix or the build was interrupted), in which
+   case the caller should fall back to decompressing the whole log. */
+std::optional<std::string> readCompressedLogTail(const Path & path, size_t bytes);
+
+}
@@ -5,9 +5,11 @@
 #include "builtins/buildenv.hh"
 #include "references.hh"
 #include "finally.hh"
+#include "tracepoints.hh"
 #include "util.hh"
 #include "archive.hh"
 #include "json.hh"
+#include "build-log.hh"
 #include "compression.hh"
 #include "worker-protocol.hh"
 #include "topo-sort.hh"
@@ -117,11 +119,26 @@ DerivationGoal::~DerivationGoal()
 
 string DerivationGoal::key()
 {
-    /* Ensure that derivations get built in order of their name,
-       i.e. a derivation named "aardvark" always comes before
-       "baboon". And substitution goals always happen before
-       derivation goals (due to "b$"). */
-    return "b$" + std::string(drvPath.name()) + "$" + worker.store.printStorePath(drvPath);
+    /* Ensure that derivations on the longest remaining dependency
+       chain get built first, so that the critical path is not left
+       for last, then in order of their name (i.e. a derivation named
+       "aardvark" always comes before "baboon"). And substitution
+       goals always happen before derivation goals (due to "b$"). The
+       weight is inverted so that heavier goals sort earlier, and
+       baked into the key on first use because goal sets are ordered
+       by key. */
+    if (cachedKey.empty())
+        cachedKey = fmt("b$%016x$%s$%s",
+            ~std::max(criticalPathWeight, estimatedDuration()),
+            std::string(drvPath.name()),
+            worker.store.printStorePath(drvPath));
+    return cachedKey;
+}
+
+
+uint64_t DerivationGoal::estimatedDuration()
+{
+    return worker.getExpectedBuildDuration(drvPath);
 }
 
 
@@ -202,6 +219,7 @@ void DerivationGoal::loadDerivation()
 void DerivationGoal::haveDerivation()
 {
     trace("have derivation");
+    NIX_PROBE2(derivation_goal_state, worker.store.printStorePath(drvPath).c_str(), "haveDerivation");
 
     if (drv->type() == DerivationType::CAFloating)
         settings.requireExperimentalFeature(Xp::CaDerivations);
@@ -429,6 +447,7 @@ void DerivationGoal::closureRepaired()
 void DerivationGoal::inputsRealised()
 {
     trace("all inputs realised");
+    NIX_PROBE2(derivation_goal_state, worker.store.printStorePath(drvPath).c_str(), "inputsRealised");
 
     if (nrFailed != 0) {
         if (!useDerivation)
@@ -534,8 +553,12 @@ void DerivationGoal::started() {
         "building '%s'", worker.store.printStorePath(drvPath), curRound, nrRounds);
     fmt("building '%s'", worker.store.printStorePath(drvPath));
     if (hook) msg += fmt(" on '%s'", machineName);
+    /* The expected duration (0 if unknown) lets the progress bar
+       show a remaining-time estimate. */
+    auto expected = worker.getExpectedBuildDuration(drvPath);
     act = std::make_unique<Activity>(*logger, lvlInfo, actBuild, msg,
-        Logger::Fields{worker.store.printStorePath(drvPath), hook ? machineName : "", curRound, nrRounds});
+        Logger::Fields{worker.store.printStorePath(drvPath), hook ? machineName : "", curRound, nrRounds,
+            expected > 1 ? expected : 0});
     mcRunningBuilds = std::make_unique<MaintainCount<uint64_t>>(worker.runningBuilds);
     worker.updateProgress();
 }
@@ -543,6 +566,7 @@ void DerivationGoal::started() {
 void DerivationGoal::tryToBuild()
 {
     trace("trying to build");
+    NIX_PROBE2(derivation_goal_state, worker.store.printStorePath(drvPath).c_str(), "tryToBuild");
 
     /* Obtain locks on all output paths, if the paths are known a priori.
 
@@ -817,6 +841,7 @@ void runPostBuildHook(
 void DerivationGoal::buildDone()
 {
     trace("build done");
+    NIX_PROBE2(derivation_goal_state, worker.store.printStorePath(drvPath).c_str(), "buildDone");
 
     Finally releaseBuildUser([&](){ this->cleanupHookFinally(); });
 
@@ -1135,7 +1160,7 @@ Path DerivationGoal::openLogFile()
     createDirs(dir);
 
     Path logFileName = fmt("%s/%s%s", dir, string(baseName, 2),
-        settings.compressLog ? ".bz2" : "");
+        settings.compressLog ? ".zst" : "");
 
     fdLogFile = open(logFileName.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0666);
     if (!fdLogFile) throw SysError("creating log file '%1%'", logFileName);
@@ -1143,7 +1168,7 @@ Path DerivationGoal::openLogFile()
     logFileSink = std::make_shared<FdSink>(fdLogFile.get());
 
     if (settings.compressLog)
-        logSink = std::shared_ptr<CompressionSink>(makeCompressionSink("bzip2", *logFileSink));
+        logSink = std::shared_ptr<CompressionSink>(makeSeekableLogSink(*logFileSink));
     else
         logSink = logFileSink;
 
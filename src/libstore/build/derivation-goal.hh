@@ -47,6 +47,10 @@ struct DerivationGoal : public Goal
     /* Whether to use an on-disk .drv file. */
     bool useDerivation;
 
+    /* Cached result of key(); the scheduling weight baked into the
+       key must not change while the goal is in a set. */
+    string cachedKey;
+
     /* The path of the derivation. */
     StorePath drvPath;
 
@@ -147,6 +151,8 @@ struct DerivationGoal : public Goal
 
     string key() override;
 
+    uint64_t estimatedDuration() override;
+
     void work() override;
 
     /* Add wanted outputs to an already existing derivation goal. */
@@ -173,6 +179,11 @@ struct DerivationGoal : public Goal
 
     virtual int getChildStatus();
 
+    /* The resource usage of the builder process, if known. Only
+       available for local builds, after the builder has exited. */
+    virtual std::optional<struct rusage> getBuildRusage()
+    { return std::nullopt; }
+
     /* Check that the derivation outputs all exist and register them
        as valid. */
     virtual void registerOutputs();
@@ -21,6 +21,12 @@ void addToWeakGoals(WeakGoals & goals, GoalPtr p)
 
 void Goal::addWaitee(GoalPtr waitee)
 {
+    /* The longest chain through the waitee is at least the longest
+       chain through us plus the waitee's own duration. Update this
+       before inserting: the insertion orders the set by key(), which
+       freezes the weight on first use. */
+    waitee->criticalPathWeight = std::max(waitee->criticalPathWeight,
+        criticalPathWeight + waitee->estimatedDuration());
     waitees.insert(waitee);
     addToWeakGoals(waitee->waiters, shared_from_this());
 }
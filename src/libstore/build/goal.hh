@@ -55,6 +55,15 @@ struct Goal : public std::enable_shared_from_this<Goal>
     /* Whether the goal is finished. */
     ExitCode exitCode;
 
+    /* Estimated length, in seconds, of the longest chain of goals
+       that runs through this one, i.e. its distance from the top of
+       the goal graph weighted by expected durations. Goals on the
+       critical path get a high weight and are scheduled first (see
+       DerivationGoal::key()). Updated by addWaitee() as the graph is
+       discovered; key() snapshots it on first use, since goal sets
+       are ordered by key. */
+    uint64_t criticalPathWeight = 0;
+
     /* Exception containing an error message, if any. */
     std::optional<Error> ex;
 
@@ -99,6 +108,15 @@ struct Goal : public std::enable_shared_from_this<Goal>
 
     virtual string key() = 0;
 
+    /* The expected duration of this goal itself, in seconds, used to
+       compute criticalPathWeight. Substitutions and other cheap goals
+       count for one second so that chain depth still matters in the
+       absence of any history. */
+    virtual uint64_t estimatedDuration()
+    {
+        return 1;
+    }
+
     void amDone(ExitCode result, std::optional<Error> ex = {});
 
     virtual void cleanup() { }
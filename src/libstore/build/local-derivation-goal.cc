@@ -13,9 +13,11 @@
 #include "worker-protocol.hh"
 #include "topo-sort.hh"
 #include "callback.hh"
+#include "sync.hh"
 
 #include <regex>
 #include <queue>
+#include <thread>
 
 #include <sys/un.h>
 #include <fcntl.h>
@@ -129,6 +131,20 @@ void LocalDerivationGoal::killChild()
     if (pid != -1) {
         worker.childTerminated(this);
 
+#if __linux__
+        /* If the build has its own cgroup, let the kernel kill every
+           process in it, including grandchildren that escaped our
+           process group. */
+        if (buildCgroup) {
+            try {
+                writeFile(*buildCgroup + "/cgroup.kill", "1");
+            } catch (SysError &) {
+                /* Missing on kernels < 5.14; fall through to the
+                   conventional kills below. */
+            }
+        }
+#endif
+
         if (buildUser) {
             /* If we're using a build user, then there is a tricky
                race condition: if we kill the build user before the
@@ -145,10 +161,33 @@ void LocalDerivationGoal::killChild()
         assert(pid == -1);
     }
 
+    destroyCgroup();
+
     DerivationGoal::killChild();
 }
 
 
+void LocalDerivationGoal::destroyCgroup()
+{
+    if (!buildCgroup) return;
+
+    /* The cgroup can't be removed until the kernel has reaped all
+       its processes, which may take a moment after they've been
+       killed. */
+    for (unsigned int i = 0; i < 10; i++) {
+        if (rmdir(buildCgroup->c_str()) == 0 || errno == ENOENT) {
+            buildCgroup.reset();
+            return;
+        }
+        if (errno != EBUSY) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    debug("cannot remove cgroup '%s': %s", *buildCgroup, strerror(errno));
+    buildCgroup.reset();
+}
+
+
 void LocalDerivationGoal::tryLocalBuild() {
     unsigned int curBuilds = worker.getNrLocalBuilds();
     if (curBuilds >= settings.maxBuildJobs) {
@@ -234,9 +273,90 @@ static void movePath(const Path & src, const Path & dst)
 extern void replaceValidPath(const Path & storePath, const Path & tmpPath);
 
 
+#if __linux__
+/* A pool of pre-created sandbox skeletons (the chroot directory with
+   its invariant substructure: /tmp, /etc and the fake store
+   directory). Claiming one is a cheap rename(); scrubbing a used
+   chroot back to a pristine skeleton happens on a background thread,
+   so that neither setting up nor tearing down the chroot is on the
+   critical path between builds. The skeletons live in the real store
+   directory (under their original '<drv>.chroot' names), which
+   guarantees that rename() stays on one filesystem. */
+struct SandboxPool
+{
+    struct Skeleton
+    {
+        Path dir;
+        Path storeDir;
+    };
+
+    struct State
+    {
+        std::vector<Skeleton> free;
+        /* Number of chroots currently being scrubbed. */
+        size_t pending = 0;
+    };
+
+    Sync<State> state_;
+
+    std::optional<Path> claim(const Path & storeDir)
+    {
+        auto state(state_.lock());
+        for (auto i = state->free.begin(); i != state->free.end(); ++i)
+            if (i->storeDir == storeDir) {
+                auto dir = i->dir;
+                state->free.erase(i);
+                return dir;
+            }
+        return std::nullopt;
+    }
+
+    bool recycle(const Path & dir, const Path & storeDir)
+    {
+        {
+            auto state(state_.lock());
+            if (state->free.size() + state->pending >= settings.sandboxPoolSize)
+                return false;
+            state->pending++;
+        }
+        std::thread([this, dir, storeDir]() {
+            try {
+                /* Scrub the chroot back to a pristine skeleton:
+                   remove everything the build left behind, then
+                   recreate the invariant substructure. */
+                for (auto & entry : readDirectory(dir))
+                    deletePath(dir + "/" + entry.name);
+                Path tmpDir = dir + "/tmp";
+                createDirs(tmpDir);
+                chmod_(tmpDir, 01777);
+                createDirs(dir + "/etc");
+                Path chrootStoreDir = dir + storeDir;
+                createDirs(chrootStoreDir);
+                chmod_(chrootStoreDir, 01775);
+                auto state(state_.lock());
+                state->pending--;
+                state->free.push_back({dir, storeDir});
+            } catch (...) {
+                ignoreException();
+                try { deletePath(dir); } catch (...) { ignoreException(); }
+                state_.lock()->pending--;
+            }
+        }).detach();
+        return true;
+    }
+};
+
+static SandboxPool sandboxPool;
+#endif
+
+
 int LocalDerivationGoal::getChildStatus()
 {
-    return hook ? DerivationGoal::getChildStatus() : pid.kill();
+    if (hook) return DerivationGoal::getChildStatus();
+    struct rusage usage;
+    int status = pid.kill(&usage);
+    buildRusage = usage;
+    return status;
 }
 
 void LocalDerivationGoal::closeReadPipes()
@@ -272,6 +392,8 @@ void LocalDerivationGoal::cleanupPostChildKill()
        root. */
     if (buildUser) buildUser->kill();
 
+    destroyCgroup();
+
     /* Terminate the recursive Nix daemon. */
     stopDaemon();
 }
@@ -329,7 +451,12 @@ void LocalDerivationGoal::cleanupPostOutputsRegisteredModeNonCheck()
     for (auto & i : redirectedOutputs)
         deletePath(worker.store.Store::toRealPath(i.second));
 
-    /* Delete the chroot (if we were using one). */
+    /* Delete the chroot (if we were using one), unless the sandbox
+       pool takes it to scrub and re-use for a later build. */
+#if __linux__
+    if (autoDelChroot && sandboxPool.recycle(chrootRootDir, worker.store.storeDir))
+        autoDelChroot->cancel();
+#endif
     autoDelChroot.reset(); /* this runs the destructor */
 
     cleanupPostOutputsRegisteredModeCheck();
@@ -362,6 +489,10 @@ static void linkOrCopy(const Path & from, const Path & to)
 
 void LocalDerivationGoal::startBuilder()
 {
+    /* Make sure the NSS libraries are loaded before we fork: loading
+       them inside the (possibly sandboxed) child would fail. */
+    preloadNSS();
+
     /* Right platform? */
     if (!parsedDrv->canBuildLocally(worker.store))
         throw Error("a '%s' with features {%s} is required to build '%s', but I am a '%s' with features {%s}",
@@ -375,6 +506,36 @@ void LocalDerivationGoal::startBuilder()
     additionalSandboxProfile = parsedDrv->getStringAttr("__sandboxProfile").value_or("");
 #endif
 
+#if __linux__
+    /* Create a cgroup for the build. All build cgroups get the same
+       cpu.weight, so the kernel gives a lone build the whole machine
+       and divides the CPUs fairly when several run concurrently. */
+    if (settings.useCgroups) {
+        try {
+            std::optional<std::string> ownCgroup;
+            for (auto & line : tokenizeString<Strings>(readFile("/proc/self/cgroup"), "\n"))
+                if (hasPrefix(line, "0::"))
+                    ownCgroup = line.substr(3);
+            if (ownCgroup && pathExists("/sys/fs/cgroup/cgroup.controllers")) {
+                Path dir = "/sys/fs/cgroup" + *ownCgroup + "/nix-build-" + std::string(drvPath.hashPart());
+                if (pathExists(dir))
+                    rmdir(dir.c_str());
+                createDirs(dir);
+                try {
+                    /* Absent when the cpu controller isn't delegated
+                       to our subtree; membership is still useful for
+                       cgroup.kill and accounting. */
+                    writeFile(dir + "/cpu.weight", "100");
+                } catch (SysError &) { }
+                buildCgroup = dir;
+            }
+        } catch (SysError & e) {
+            debug("cannot create cgroup for '%s': %s",
+                worker.store.printStorePath(drvPath), e.what());
+        }
+    }
+#endif
+
     /* Are we doing a chroot build? */
     {
         auto noChroot = parsedDrv->getBoolAttr("__noChroot");
@@ -522,6 +683,16 @@ void LocalDerivationGoal::startBuilder()
         }
         dirsInChroot[tmpDirInSandbox] = tmpDir;
 
+#if __linux__
+        /* Keep scratch files of I/O-heavy builds out of page-cache
+           writeback by mounting a tmpfs on the build directory.
+           Skipped with keep-failed, since the tmpfs (and the failed
+           build's scratch files) disappear with the sandbox. */
+        tmpfsBuildDir =
+            parsedDrv->getRequiredSystemFeatures().count("tmpfs-build-dir")
+            && !settings.keepFailed;
+#endif
+
         /* Add the closure of store paths to the chroot. */
         StorePathSet closure;
         for (auto & i : dirsInChroot)
@@ -579,7 +750,17 @@ void LocalDerivationGoal::startBuilder()
 
         printMsg(lvlChatty, format("setting up chroot environment in '%1%'") % chrootRootDir);
 
-        if (mkdir(chrootRootDir.c_str(), 0750) == -1)
+        /* Claim a pre-created skeleton from the pool if one is
+           available; the steps below are no-ops on a skeleton. */
+        bool haveSkeleton = false;
+        if (auto skeleton = sandboxPool.claim(worker.store.storeDir)) {
+            if (*skeleton == chrootRootDir || rename(skeleton->c_str(), chrootRootDir.c_str()) == 0)
+                haveSkeleton = true;
+            else
+                deletePath(*skeleton);
+        }
+
+        if (!haveSkeleton && mkdir(chrootRootDir.c_str(), 0750) == -1)
             throw SysError("cannot create '%1%'", chrootRootDir);
 
         if (buildUser && chown(chrootRootDir.c_str(), 0, buildUser->getGID()) == -1)
@@ -911,6 +1092,18 @@ void LocalDerivationGoal::startBuilder()
         if (sandboxMountNamespace.get() == -1)
             throw SysError("getting sandbox mount namespace");
 
+        /* Move the child into its cgroup. It's still waiting on the
+           user namespace sync pipe, so there's no race with it
+           forking grandchildren. */
+        if (buildCgroup) {
+            try {
+                writeFile(*buildCgroup + "/cgroup.procs", fmt("%d", (pid_t) pid));
+            } catch (SysError & e) {
+                debug("cannot move build of '%s' into its cgroup: %s",
+                    worker.store.printStorePath(drvPath), e.what());
+            }
+        }
+
         /* Signal the builder that we've updated its user namespace. */
         writeFull(userNamespaceSync.writeSide.get(), "1");
 
@@ -921,6 +1114,19 @@ void LocalDerivationGoal::startBuilder()
         pid = startProcess([&]() {
             runChild();
         });
+#if __linux__
+        /* There is a small window during which the child runs
+           outside its cgroup, but it's still setting up the build
+           environment at that point. */
+        if (buildCgroup) {
+            try {
+                writeFile(*buildCgroup + "/cgroup.procs", fmt("%d", (pid_t) pid));
+            } catch (SysError & e) {
+                debug("cannot move build of '%s' into its cgroup: %s",
+                    worker.store.printStorePath(drvPath), e.what());
+            }
+        }
+#endif
     }
 
     /* parent */
@@ -1028,8 +1234,17 @@ void LocalDerivationGoal::initEnv()
        in the store or in the build directory). */
     env["NIX_STORE"] = worker.store.storeDir;
 
-    /* The maximum number of cores to utilize for parallel building. */
-    env["NIX_BUILD_CORES"] = (format("%d") % settings.buildCores).str();
+    /* The maximum number of cores to utilize for parallel building.
+       With cgroups enabled and 'cores = 0', advertise this build's
+       fair share of the CPUs instead of all of them, since the
+       kernel will divide the CPUs between the concurrent builds. The
+       '+ 1' accounts for this build, which isn't counted by the
+       worker until it has started. */
+    auto cores = settings.buildCores.get();
+    if (buildCgroup && cores == 0)
+        cores = std::max(1U, std::thread::hardware_concurrency()
+            / std::max(1U, worker.getNrLocalBuilds() + 1));
+    env["NIX_BUILD_CORES"] = (format("%d") % cores).str();
 
     initTmpDir();
 
@@ -1067,21 +1282,22 @@ void LocalDerivationGoal::writeStructuredAttrs()
 {
     if (auto structAttrsJson = parsedDrv->prepareStructuredAttrs(worker.store, inputPaths)) {
         auto json = structAttrsJson.value();
+        StringRewriter rewriter(inputRewrites);
         nlohmann::json rewritten;
         for (auto & [i, v] : json["outputs"].get<nlohmann::json::object_t>()) {
             /* The placeholder must have a rewrite, so we use it to cover both the
                cases where we know or don't know the output path ahead of time. */
-            rewritten[i] = rewriteStrings(v, inputRewrites);
+            rewritten[i] = rewriter(v.get<std::string>());
         }
 
         json["outputs"] = rewritten;
 
         auto jsonSh = writeStructuredAttrsShell(json);
 
-        writeFile(tmpDir + "/.attrs.sh", rewriteStrings(jsonSh, inputRewrites));
+        writeFile(tmpDir + "/.attrs.sh", rewriter(jsonSh));
         chownToBuilder(tmpDir + "/.attrs.sh");
         env["NIX_ATTRS_SH_FILE"] = tmpDir + "/.attrs.sh";
-        writeFile(tmpDir + "/.attrs.json", rewriteStrings(json.dump(), inputRewrites));
+        writeFile(tmpDir + "/.attrs.json", rewriter(json.dump()));
         chownToBuilder(tmpDir + "/.attrs.json");
         env["NIX_ATTRS_JSON_FILE"] = tmpDir + "/.attrs.json";
     }
@@ -1698,6 +1914,29 @@ void LocalDerivationGoal::runChild()
                     fmt("size=%s", settings.sandboxShmSize).c_str()) == -1)
                 throw SysError("mounting /dev/shm");
 
+            /* Mount a tmpfs over the build directory if the
+               derivation asked for one, so its scratch files never
+               hit disk writeback; tmpfs pages are swappable, so the
+               kernel spills to disk under memory pressure rather
+               than failing outright. The parent pre-seeded the build
+               directory (e.g. passAsFile attributes), so re-create
+               its contents inside the tmpfs. */
+            if (tmpfsBuildDir) {
+                auto target = chrootRootDir + tmpDirInSandbox;
+                auto size = parsedDrv->getStringAttr("tmpfsBuildDirSize")
+                    .value_or(settings.sandboxBuildDirSize);
+                if (mount("none", target.c_str(), "tmpfs", 0,
+                        fmt("size=%s,mode=0700,uid=%d,gid=%d", size, sandboxUid(), sandboxGid()).c_str()) == -1)
+                    throw SysError("mounting tmpfs on '%1%'", target);
+                for (auto & entry : readDirectory(tmpDir)) {
+                    auto source = tmpDir + "/" + entry.name;
+                    auto st = lstat(source);
+                    if (!S_ISREG(st.st_mode))
+                        throw Error("cannot copy '%1%' into the build directory tmpfs", source);
+                    writeFile(target + "/" + entry.name, readFile(source));
+                }
+            }
+
             /* Mount a new devpts on /dev/pts.  Note that this
                requires the kernel to be compiled with
                CONFIG_DEVPTS_MULTIPLE_INSTANCES=y (which is the case
@@ -1803,9 +2042,10 @@ void LocalDerivationGoal::runChild()
         // FIXME: set other limits to deterministic values?
 
         /* Fill in the environment. */
+        StringRewriter rewriter(inputRewrites);
         Strings envStrs;
         for (auto & i : env)
-            envStrs.push_back(rewriteStrings(i.first + "=" + i.second, inputRewrites));
+            envStrs.push_back(rewriter(i.first + "=" + i.second));
 
         /* If we are running in `build-users' mode, then switch to the
            user we allocated above.  Make sure that we drop all root
@@ -2054,6 +2294,16 @@ void LocalDerivationGoal::registerOutputs()
         return;
     }
 
+    /* Output registration (reference scanning in particular) can
+       dominate the tail of a build; give it its own span in the
+       build schedule trace. */
+    auto traceStart = worker.traceTimeUs();
+    Finally traceSpan([&]() {
+        worker.addTraceEvent(
+            "registerOutputs " + worker.store.printStorePath(drvPath),
+            "post-build", 0, traceStart, worker.traceTimeUs() - traceStart);
+    });
+
     std::map<std::string, ValidPathInfo> infos;
 
     /* Set of inodes seen during calls to canonicalisePathMetaData()
@@ -2092,6 +2342,7 @@ void LocalDerivationGoal::registerOutputs()
     struct PerhapsNeedToRegister { StorePathSet refs; };
     std::map<std::string, std::variant<AlreadyRegistered, PerhapsNeedToRegister>> outputReferencesIfUnregistered;
     std::map<std::string, struct stat> outputStats;
+    std::map<std::string, Hash> selfRefHashes;
     for (auto & [outputName, _] : drv->outputs) {
         auto actualPath = toRealPathChroot(worker.store.printStorePath(scratchOutputs.at(outputName)));
 
@@ -2321,7 +2572,18 @@ void LocalDerivationGoal::registerOutputs()
                         std::string { scratchPath.hashPart() },
                         std::string { requiredFinalPath.hashPart() });
                 rewriteOutput();
-                auto narHashAndSize = hashPath(htSHA256, actualPath);
+                /* Compute the NAR hash, and, in the same pass, the
+                   hash with the self-references zeroed out. The
+                   latter is stable across rebuilds of this
+                   derivation at different output paths, and is
+                   recorded to detect rebuilds that produced
+                   unchanged output. */
+                HashSink narSink { htSHA256 };
+                HashModuloSink moduloSink { htSHA256, std::string(requiredFinalPath.hashPart()) };
+                TeeSink tee { narSink, moduloSink };
+                dumpPath(actualPath, tee);
+                auto narHashAndSize = narSink.finish();
+                selfRefHashes.insert_or_assign(outputName, moduloSink.finish().first);
                 ValidPathInfo newInfo0 { requiredFinalPath, narHashAndSize.first };
                 newInfo0.narSize = narHashAndSize.second;
                 auto refs = rewriteRefs();
@@ -2574,6 +2836,30 @@ void LocalDerivationGoal::registerOutputs()
             worker.store.registerDrvOutput(thisRealisation);
         }
     }
+
+    /* Record the self-reference-independent output hashes in the
+       build statistics, and point out rebuilds whose output came out
+       unchanged. For input-addressed derivations the dependents
+       still have to be rebuilt (their references to this output path
+       change regardless of its contents), so this mainly shows what
+       enabling 'ca-derivations' would have cut off. */
+    if (!selfRefHashes.empty()) {
+        try {
+            std::string s;
+            for (auto & [outputName, hash] : selfRefHashes) {
+                if (!s.empty()) s += ' ';
+                s += outputName;
+                s += ':';
+                s += hash.to_string(Base32, true);
+            }
+            auto prev = getLocalStore().addBuildOutputHashes(std::string(drvPath.name()), s);
+            if (prev && *prev == s)
+                printInfo("note: outputs of '%s' are identical to those of the previous build",
+                    worker.store.printStorePath(drvPath));
+        } catch (...) {
+            ignoreException();
+        }
+    }
 }
 
 void LocalDerivationGoal::signRealisation(Realisation & realisation)
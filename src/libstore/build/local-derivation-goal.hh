@@ -38,6 +38,15 @@ struct LocalDerivationGoal : public DerivationGoal
     /* Whether we're currently doing a chroot build. */
     bool useChroot = false;
 
+    /* Whether to mount a tmpfs on the build directory in the sandbox
+       (Linux only; requested via the 'tmpfs-build-dir' system
+       feature). */
+    bool tmpfsBuildDir = false;
+
+    /* The cgroup of the build, if 'use-cgroups' is enabled (Linux
+       only). */
+    std::optional<Path> buildCgroup;
+
     Path chrootRootDir;
 
     /* RAII object to delete the chroot directory. */
@@ -163,6 +172,13 @@ struct LocalDerivationGoal : public DerivationGoal
 
     int getChildStatus() override;
 
+    /* Resource usage of the builder, filled in by getChildStatus()
+       when the builder is reaped. */
+    std::optional<struct rusage> buildRusage;
+
+    std::optional<struct rusage> getBuildRusage() override
+    { return buildRusage; }
+
     /* Run the builder's process. */
     void runChild();
 
@@ -193,6 +209,9 @@ struct LocalDerivationGoal : public DerivationGoal
     /* Delete the temporary directory, if we have one. */
     void deleteTmpDir(bool force);
 
+    /* Remove the build's cgroup, if we have one. */
+    void destroyCgroup();
+
     /* Forcibly kill the child process, if any. */
     void killChild() override;
 
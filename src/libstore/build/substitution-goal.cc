@@ -47,6 +47,33 @@ void PathSubstitutionGoal::init()
 
     subs = settings.useSubstitutes ? getDefaultSubstituters() : std::list<ref<Store>>();
 
+    /* Demote substituters that are currently degraded (high error
+       rate, or a p95 request latency far above the best of the
+       others), so a cache having a bad day stops stalling every
+       query after a few requests instead of timing out on each one.
+       The static priority order is kept within each group. */
+    uint64_t bestP95 = 0;
+    for (auto & sub : subs) {
+        auto health = sub->getSubstituterHealth();
+        if (health.nrSamples >= 5 && (bestP95 == 0 || health.p95LatencyUs < bestP95))
+            bestP95 = health.p95LatencyUs;
+    }
+
+    std::list<ref<Store>> degraded;
+    for (auto i = subs.begin(); i != subs.end(); ) {
+        auto health = (*i)->getSubstituterHealth();
+        if (health.nrSamples >= 5
+            && (health.errorRate >= 0.5
+                || (bestP95 && health.p95LatencyUs > 10 * bestP95)))
+        {
+            debug("demoting degraded substituter '%s' (p95 %d µs, error rate %d%%)",
+                (*i)->getUri(), health.p95LatencyUs, (int) (health.errorRate * 100));
+            degraded.push_back(*i);
+            i = subs.erase(i);
+        } else ++i;
+    }
+    subs.splice(subs.end(), degraded);
+
     tryNext();
 }
 
@@ -87,10 +114,20 @@ void PathSubstitutionGoal::tryNext()
         return;
     }
 
+    auto queryStart = std::chrono::steady_clock::now();
+    auto recordQuery = [&](bool failed) {
+        sub->recordSubstituterRequest(
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - queryStart).count(), failed);
+    };
+
     try {
         // FIXME: make async
         info = sub->queryPathInfo(subPath ? *subPath : storePath);
+        recordQuery(false);
     } catch (InvalidPath &) {
+        /* A fast miss is a healthy response. */
+        recordQuery(false);
         tryNext();
         return;
     } catch (SubstituterDisabled &) {
@@ -100,6 +137,7 @@ void PathSubstitutionGoal::tryNext()
         }
         throw;
     } catch (Error & e) {
+        recordQuery(true);
         if (settings.tryFallback) {
             logError(e.info());
             tryNext();
@@ -176,10 +214,44 @@ void PathSubstitutionGoal::referencesValid()
 }
 
 
+/* Paths up to this NAR size are fetched in batches; above it the
+   transfer itself dominates and a dedicated goal is fine. */
+static const uint64_t batchMaxNarSize = 256 * 1024;
+
+/* Upper bound on the number of paths per batch, to keep individual
+   batch fetches (and the damage of a failed one) bounded. */
+static const size_t batchMaxPaths = 64;
+
+
 void PathSubstitutionGoal::tryToRun()
 {
     trace("trying to run");
 
+    /* Batch small paths destined for the same substituter into a
+       single fetch (see Worker::flushSubstitutionBatches()): for
+       closures of many small paths the per-goal and per-request
+       overhead dominates the actual transfer. */
+    if (repair == NoRepair && !ca && info->narSize && info->narSize <= batchMaxNarSize) {
+        auto & batch = worker.substitutionBatches[sub->getUri()];
+        batch.paths.insert(storePath);
+        if (!batch.leader) {
+            /* We're the first to join: fetch the batch once the
+               worker flushes it. */
+            batch.leader = std::static_pointer_cast<PathSubstitutionGoal>(shared_from_this());
+            state = &PathSubstitutionGoal::runBatch;
+        } else {
+            addWaitee(batch.leader);
+            state = &PathSubstitutionGoal::batchDone;
+        }
+        if (batch.paths.size() >= batchMaxPaths) {
+            auto leader = batch.leader;
+            leader->batchPaths = std::move(batch.paths);
+            worker.substitutionBatches.erase(sub->getUri());
+            worker.wakeUp(leader);
+        }
+        return;
+    }
+
     /* Make sure that we are allowed to start a build.  Note that even
        if maxBuildJobs == 0 (no local builds allowed), we still allow
        a substituter to run.  This is because substitutions cannot be
@@ -219,6 +291,82 @@ void PathSubstitutionGoal::tryToRun()
 }
 
 
+void PathSubstitutionGoal::runBatch()
+{
+    trace("running batched substitution");
+
+    assert(batchPaths);
+
+    /* See tryToRun() for the build slot rationale. */
+    if (worker.getNrLocalBuilds() >= std::max(1U, (unsigned int) settings.maxBuildJobs)) {
+        worker.waitForBuildSlot(shared_from_this());
+        return;
+    }
+
+    maintainRunningSubstitutions = std::make_unique<MaintainCount<uint64_t>>(worker.runningSubstitutions);
+    worker.updateProgress();
+
+    outPipe.create();
+
+    promise = std::promise<void>();
+
+    thr = std::thread([this]() {
+        try {
+            /* Wake up the worker loop when we're done. */
+            Finally updateStats([this]() { outPipe.writeSide.close(); });
+
+            Activity act(*logger, actSubstitute, Logger::Fields{worker.store.printStorePath(storePath), sub->getUri()});
+            PushActivity pact(act.id);
+
+            copyPaths(*sub, worker.store, *batchPaths, repair,
+                sub->isTrusted ? NoCheckSigs : CheckSigs);
+
+            promise.set_value();
+        } catch (...) {
+            promise.set_exception(std::current_exception());
+        }
+    });
+
+    worker.childStarted(shared_from_this(), {outPipe.readSide.get()}, true, false);
+
+    state = &PathSubstitutionGoal::finished;
+}
+
+
+void PathSubstitutionGoal::batchDone()
+{
+    trace("batched substitution done");
+
+    if (!worker.store.isValidPath(storePath)) {
+        /* The batch (or at least our path) failed; fall back to
+           fetching just this path from the remaining
+           substituters. */
+        tryNext();
+        return;
+    }
+
+    worker.markContentsGood(storePath);
+
+    printMsg(lvlChatty, "substitution of path '%s' succeeded", worker.store.printStorePath(storePath));
+
+    maintainExpectedSubstitutions.reset();
+    worker.doneSubstitutions++;
+
+    if (maintainExpectedDownload) {
+        auto fileSize = maintainExpectedDownload->delta;
+        maintainExpectedDownload.reset();
+        worker.doneDownloadSize += fileSize;
+    }
+
+    worker.doneNarSize += maintainExpectedNar->delta;
+    maintainExpectedNar.reset();
+
+    worker.updateProgress();
+
+    amDone(ecSuccess);
+}
+
+
 void PathSubstitutionGoal::finished()
 {
     trace("substitute finished");
@@ -53,6 +53,11 @@ struct PathSubstitutionGoal : public Goal
     /* Content address for recomputing store path */
     std::optional<ContentAddress> ca;
 
+    /* When this goal is the leader of a substitution batch, the
+       paths to fetch in one go (including our own). Set by
+       Worker::flushSubstitutionBatches(). */
+    std::optional<StorePathSet> batchPaths;
+
 public:
     PathSubstitutionGoal(const StorePath & storePath, Worker & worker, RepairFlag repair = NoRepair, std::optional<ContentAddress> ca = std::nullopt);
     ~PathSubstitutionGoal();
@@ -74,6 +79,8 @@ public:
     void gotInfo();
     void referencesValid();
     void tryToRun();
+    void runBatch();
+    void batchDone();
     void finished();
 
     /* Callback used by the worker to write to the log. */
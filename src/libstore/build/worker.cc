@@ -1,5 +1,8 @@
 #include "machines.hh"
+#include "json.hh"
+#include "tracepoints.hh"
 #include "worker.hh"
+#include "local-store.hh"
 #include "substitution-goal.hh"
 #include "drv-output-substitution-goal.hh"
 #include "local-derivation-goal.hh"
@@ -7,8 +10,19 @@
 
 #include <poll.h>
 
+#if __linux__
+#include <sys/epoll.h>
+#endif
+
 namespace nix {
 
+/* File in which observed build durations are persisted across
+   runs. */
+static Path buildDurationsFile()
+{
+    return getCacheDir() + "/nix/build-durations-v1";
+}
+
 Worker::Worker(Store & store, Store & evalStore)
     : act(*logger, actRealise)
     , actDerivations(*logger, actBuilds)
@@ -23,6 +37,33 @@ Worker::Worker(Store & store, Store & evalStore)
     timedOut = false;
     hashMismatch = false;
     checkMismatch = false;
+#if __linux__
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (!epollFd)
+        throw SysError("creating epoll instance");
+#endif
+
+    if (settings.buildTraceFile != "") {
+        trace.emplace();
+        trace->start = steady_time_point::clock::now();
+    }
+
+    /* Load the build durations observed in previous runs. A missing
+       or corrupt file just means we schedule without history. */
+    try {
+        if (auto localStore = dynamic_cast<LocalStore *>(&store)) {
+            buildDurations = localStore->queryBuildDurations();
+            buildDurationsInDb = true;
+        }
+        else if (pathExists(buildDurationsFile()))
+            for (auto & line : tokenizeString<Strings>(readFile(buildDurationsFile()), "\n")) {
+                auto tab = line.find('\t');
+                if (tab == string::npos) continue;
+                buildDurations[line.substr(0, tab)] = std::stoull(line.substr(tab + 1));
+            }
+    } catch (...) {
+        ignoreException();
+    }
 }
 
 
@@ -37,6 +78,21 @@ Worker::~Worker()
     assert(expectedSubstitutions == 0);
     assert(expectedDownloadSize == 0);
     assert(expectedNarSize == 0);
+
+    if (buildDurationsDirty && !buildDurationsInDb) {
+        try {
+            std::string s;
+            for (auto & [name, seconds] : buildDurations)
+                s += fmt("%s\t%d\n", name, seconds);
+            createDirs(dirOf(buildDurationsFile()));
+            auto tmp = buildDurationsFile() + ".tmp." + std::to_string(getpid());
+            writeFile(tmp, s);
+            if (rename(tmp.c_str(), buildDurationsFile().c_str()) == -1)
+                throw SysError("renaming '%s' to '%s'", tmp, buildDurationsFile());
+        } catch (...) {
+            ignoreException();
+        }
+    }
 }
 
 
@@ -130,6 +186,16 @@ void Worker::removeGoal(GoalPtr goal)
     else
         assert(false);
 
+    if (trace) {
+        auto i = trace->waitingForSlotSince.find(goal.get());
+        if (i != trace->waitingForSlotSince.end()) {
+            addTraceEvent(goal->name + " (waiting for build slot)", "wait", 0,
+                i->second, traceTimeUs() - i->second);
+            trace->waitingForSlotSince.erase(i);
+        }
+        trace->lanes.erase(goal.get());
+    }
+
     if (topGoals.find(goal) != topGoals.end()) {
         topGoals.erase(goal);
         /* If a top-level goal failed, then kill all other goals
@@ -148,6 +214,17 @@ void Worker::removeGoal(GoalPtr goal)
 }
 
 
+void Worker::flushSubstitutionBatches()
+{
+    for (auto & [uri, batch] : substitutionBatches) {
+        debug("flushing batch of %d substitutions for '%s'", batch.paths.size(), uri);
+        batch.leader->batchPaths = std::move(batch.paths);
+        wakeUp(batch.leader);
+    }
+    substitutionBatches.clear();
+}
+
+
 void Worker::wakeUp(GoalPtr goal)
 {
     goal->trace("woken up");
@@ -172,7 +249,38 @@ void Worker::childStarted(GoalPtr goal, const set<int> & fds,
     child.inBuildSlot = inBuildSlot;
     child.respectTimeouts = respectTimeouts;
     children.emplace_back(child);
+#if __linux__
+    for (auto & fd : children.back().fds) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(epollFd.get(), EPOLL_CTL_ADD, fd, &ev) == -1)
+            throw SysError("registering fd %d with epoll", fd);
+        childFds[fd] = &children.back();
+    }
+#endif
     if (inBuildSlot) nrLocalBuilds++;
+
+    NIX_PROBE2(child_started, goal->name.c_str(), nrLocalBuilds);
+
+    if (trace) {
+        int lane;
+        if (!trace->freeLanes.empty()) {
+            lane = *trace->freeLanes.begin();
+            trace->freeLanes.erase(trace->freeLanes.begin());
+        } else
+            lane = ++trace->nrLanes;
+        trace->lanes[goal.get()] = lane;
+
+        /* If this goal was waiting for a build slot, close that
+           span. */
+        auto i = trace->waitingForSlotSince.find(goal.get());
+        if (i != trace->waitingForSlotSince.end()) {
+            addTraceEvent(goal->name + " (waiting for build slot)", "wait",
+                lane, i->second, traceTimeUs() - i->second);
+            trace->waitingForSlotSince.erase(i);
+        }
+    }
 }
 
 
@@ -182,11 +290,53 @@ void Worker::childTerminated(Goal * goal, bool wakeSleepers)
         [&](const Child & child) { return child.goal2 == goal; });
     if (i == children.end()) return;
 
+    NIX_PROBE2(child_terminated, goal->name.c_str(), nrLocalBuilds);
+
+    if (trace) {
+        auto l = trace->lanes.find(goal);
+        if (l != trace->lanes.end()) {
+            auto startUs = std::chrono::duration_cast<std::chrono::microseconds>(
+                i->timeStarted - trace->start).count();
+            addTraceEvent(goal->name,
+                dynamic_cast<DerivationGoal *>(goal) ? "build" : "substitution",
+                l->second, startUs, traceTimeUs() - startUs);
+            trace->freeLanes.insert(l->second);
+            trace->lanes.erase(l);
+        }
+    }
+
     if (i->inBuildSlot) {
         assert(nrLocalBuilds > 0);
         nrLocalBuilds--;
     }
 
+    /* Remember roughly how long this derivation took, for
+       critical-path scheduling of future builds. Failed builds are
+       recorded too; they are still a better cost estimate than
+       nothing. */
+    if (auto dg = dynamic_cast<DerivationGoal *>(goal)) {
+        auto seconds = std::chrono::duration_cast<std::chrono::seconds>(
+            steady_time_point::clock::now() - i->timeStarted).count();
+        if (seconds > 0) {
+            std::optional<uint64_t> cpuTime, peakRSS;
+            if (auto usage = dg->getBuildRusage()) {
+                cpuTime = usage->ru_utime.tv_sec + usage->ru_stime.tv_sec;
+                /* ru_maxrss is in KiB on Linux and bytes on Darwin. */
+#if __APPLE__
+                peakRSS = usage->ru_maxrss / 1024;
+#else
+                peakRSS = usage->ru_maxrss;
+#endif
+            }
+            recordBuildDuration(dg->drvPath, seconds, cpuTime, peakRSS);
+        }
+    }
+
+#if __linux__
+    for (auto & fd : i->fds)
+        unregisterChildFd(fd);
+#endif
+
     children.erase(i);
 
     if (wakeSleepers) {
@@ -202,13 +352,54 @@ void Worker::childTerminated(Goal * goal, bool wakeSleepers)
 }
 
 
+uint64_t Worker::getExpectedBuildDuration(const StorePath & drvPath)
+{
+    auto i = buildDurations.find(std::string(drvPath.name()));
+    /* Unknown derivations count for one second, so that chain depth
+       still matters in the absence of history. */
+    return i == buildDurations.end() ? 1 : std::max((uint64_t) 1, i->second);
+}
+
+
+void Worker::recordBuildDuration(const StorePath & drvPath, uint64_t seconds,
+    std::optional<uint64_t> cpuTime, std::optional<uint64_t> peakRSS)
+{
+    buildDurations[std::string(drvPath.name())] = seconds;
+    buildDurationsDirty = true;
+
+    if (buildDurationsInDb)
+        try {
+            dynamic_cast<LocalStore &>(store).addBuildStats(
+                std::string(drvPath.name()), time(0), seconds, cpuTime, peakRSS);
+        } catch (...) {
+            ignoreException();
+        }
+}
+
+
+#if __linux__
+void Worker::unregisterChildFd(int fd)
+{
+    childFds.erase(fd);
+    /* The fd may already have been closed (and thus removed from the
+       epoll set) by the goal. */
+    if (epoll_ctl(epollFd.get(), EPOLL_CTL_DEL, fd, nullptr) == -1
+        && errno != EBADF && errno != ENOENT)
+        throw SysError("unregistering fd %d from epoll", fd);
+}
+#endif
+
+
 void Worker::waitForBuildSlot(GoalPtr goal)
 {
     debug("wait for build slot");
     if (getNrLocalBuilds() < settings.maxBuildJobs)
         wakeUp(goal); /* we can do it right away */
-    else
+    else {
+        if (trace)
+            trace->waitingForSlotSince.emplace(goal.get(), traceTimeUs());
         addToWeakGoals(wantingToBuild, goal);
+    }
 }
 
 
@@ -222,6 +413,7 @@ void Worker::waitForAnyGoal(GoalPtr goal)
 void Worker::waitForAWhile(GoalPtr goal)
 {
     debug("wait for a while");
+    addTraceEvent(goal->name + " (waiting a while)", "wait", 0, traceTimeUs(), 0);
     addToWeakGoals(waitingForAWhile, goal);
 }
 
@@ -272,6 +464,14 @@ void Worker::run(const Goals & _topGoals)
 
         if (topGoals.empty()) break;
 
+        /* No goal is runnable at this point, so the pending
+           substitution batches can't grow any further; hand them to
+           their leader goals. */
+        if (!substitutionBatches.empty()) {
+            flushSubstitutionBatches();
+            continue;
+        }
+
         /* Wait for input. */
         if (!children.empty() || !waitingForAWhile.empty())
             waitForInput();
@@ -298,6 +498,65 @@ void Worker::run(const Goals & _topGoals)
     assert(!settings.keepGoing || awake.empty());
     assert(!settings.keepGoing || wantingToBuild.empty());
     assert(!settings.keepGoing || children.empty());
+
+    if (trace) writeTraceFile();
+}
+
+
+uint64_t Worker::traceTimeUs() const
+{
+    if (!trace) return 0;
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        steady_time_point::clock::now() - trace->start).count();
+}
+
+
+void Worker::addTraceEvent(std::string name, std::string cat, int tid,
+    uint64_t startUs, uint64_t durUs)
+{
+    if (!trace) return;
+    trace->events.push_back({std::move(name), std::move(cat), tid, startUs, durUs});
+}
+
+
+void Worker::writeTraceFile()
+{
+    try {
+        std::ostringstream str;
+
+        {
+            JSONList list(str);
+
+            /* Name the tracks, so the viewer shows "slot N" instead
+               of bare thread ids. */
+            for (int lane = 0; lane <= trace->nrLanes; ++lane) {
+                auto obj = list.object();
+                obj.attr("name", "thread_name");
+                obj.attr("ph", "M");
+                obj.attr("pid", 1);
+                obj.attr("tid", lane);
+                auto args = obj.object("args");
+                args.attr("name", lane == 0 ? "main" : fmt("slot %d", lane));
+            }
+
+            for (auto & event : trace->events) {
+                auto obj = list.object();
+                obj.attr("name", event.name);
+                obj.attr("cat", event.cat);
+                obj.attr("ph", "X");
+                obj.attr("ts", event.startUs);
+                obj.attr("dur", event.durUs);
+                obj.attr("pid", 1);
+                obj.attr("tid", event.tid);
+            }
+        }
+
+        writeFile(settings.buildTraceFile, str.str());
+
+        printInfo("wrote build schedule trace to '%s'", settings.buildTraceFile.get());
+    } catch (...) {
+        ignoreException();
+    }
 }
 
 void Worker::waitForInput()
@@ -346,6 +605,93 @@ void Worker::waitForInput()
     if (useTimeout)
         vomit("sleeping %d seconds", timeout);
 
+#if __linux__
+
+    /* Wait for the input side of any logger pipe to become
+       `available'.  Note that `available' (i.e., non-blocking)
+       includes EOF.  The fds were registered with the epoll set in
+       childStarted(), so unlike the poll() fallback below there is no
+       fd set to rebuild here, and each event maps directly to the
+       child that owns it. */
+    struct epoll_event events[64];
+    int count = epoll_wait(epollFd.get(), events, 64,
+        useTimeout ? timeout * 1000 : -1);
+    if (count == -1) {
+        if (errno == EINTR) return;
+        throw SysError("waiting for input");
+    }
+
+    auto after = steady_time_point::clock::now();
+
+    /* Use a read buffer comparable to the kernel pty/pipe buffer, so
+       that heavily logging builders don't need a wakeup per 4 KiB. */
+    std::vector<unsigned char> buffer(64 * 1024);
+    for (int n = 0; n < count; ++n) {
+        checkInterrupt();
+
+        /* Look the fd up afresh for every event: handling a previous
+           event may have terminated the child this one belongs to. */
+        int k = events[n].data.fd;
+        auto c = childFds.find(k);
+        if (c == childFds.end()) continue;
+        auto j = c->second;
+
+        GoalPtr goal = j->goal.lock();
+        assert(goal);
+
+        ssize_t rd = ::read(k, buffer.data(), buffer.size());
+        // FIXME: is there a cleaner way to handle pt close
+        // than EIO? Is this even standard?
+        if (rd == 0 || (rd == -1 && errno == EIO)) {
+            debug("%1%: got EOF", goal->getName());
+            unregisterChildFd(k);
+            j->fds.erase(k);
+            goal->handleEOF(k);
+        } else if (rd == -1) {
+            if (errno != EINTR)
+                throw SysError("%s: read failed", goal->getName());
+        } else {
+            printMsg(lvlVomit, "%1%: read %2% bytes",
+                goal->getName(), rd);
+            string data((char *) buffer.data(), rd);
+            j->lastOutput = after;
+            goal->handleChildOutput(k, data);
+        }
+    }
+
+    /* Check for children that have exceeded their timeouts. */
+    if (0 != settings.maxSilentTime || 0 != settings.buildTimeout) {
+        decltype(children)::iterator i;
+        for (auto j = children.begin(); j != children.end(); j = i) {
+            i = std::next(j);
+
+            GoalPtr goal = j->goal.lock();
+            assert(goal);
+
+            if (goal->exitCode == Goal::ecBusy &&
+                0 != settings.maxSilentTime &&
+                j->respectTimeouts &&
+                after - j->lastOutput >= std::chrono::seconds(settings.maxSilentTime))
+            {
+                goal->timedOut(Error(
+                        "%1% timed out after %2% seconds of silence",
+                        goal->getName(), settings.maxSilentTime));
+            }
+
+            else if (goal->exitCode == Goal::ecBusy &&
+                0 != settings.buildTimeout &&
+                j->respectTimeouts &&
+                after - j->timeStarted >= std::chrono::seconds(settings.buildTimeout))
+            {
+                goal->timedOut(Error(
+                        "%1% timed out after %2% seconds",
+                        goal->getName(), settings.buildTimeout));
+            }
+        }
+    }
+
+#else
+
     /* Use select() to wait for the input side of any logger pipe to
        become `available'.  Note that `available' (i.e., non-blocking)
        includes EOF. */
@@ -378,7 +724,7 @@ void Worker::waitForInput()
         assert(goal);
 
         set<int> fds2(j->fds);
-        std::vector<unsigned char> buffer(4096);
+        std::vector<unsigned char> buffer(64 * 1024);
         for (auto & k : fds2) {
             if (pollStatus.at(fdToPollStatus.at(k)).revents) {
                 ssize_t rd = ::read(k, buffer.data(), buffer.size());
@@ -422,6 +768,8 @@ void Worker::waitForInput()
         }
     }
 
+#endif
+
     if (!waitingForAWhile.empty() && lastWokenUp + std::chrono::seconds(settings.pollInterval) <= after) {
         lastWokenUp = after;
         for (auto & i : waitingForAWhile) {
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "types.hh"
+#include "util.hh"
 #include "lock.hh"
 #include "store-api.hh"
 #include "goal.hh"
@@ -68,6 +69,23 @@ private:
     /* Child processes currently running. */
     std::list<Child> children;
 
+#if __linux__
+    /* The epoll instance used by waitForInput(). Child fds are
+       registered once when the child is started instead of a poll set
+       being rebuilt on every iteration of the main loop, and events
+       map back to the owning child in O(log n) instead of a scan over
+       all children and their fds. */
+    AutoCloseFD epollFd;
+
+    /* Maps the fds registered with 'epollFd' to the children that own
+       them. Entries point into 'children', which is a list, so they
+       remain valid until the child is removed. */
+    std::map<int, Child *> childFds;
+
+    /* Remove a child fd from 'epollFd' and 'childFds'. */
+    void unregisterChildFd(int fd);
+#endif
+
     /* Number of build slots occupied.  This includes local builds and
        substitutions but not remote builds via the build hook. */
     unsigned int nrLocalBuilds;
@@ -90,8 +108,67 @@ private:
     /* Cache for pathContentsGood(). */
     std::map<StorePath, bool> pathContentsGoodCache;
 
+    /* Build durations observed in previous runs, in seconds, keyed by
+       derivation name. Loaded from the store's BuildStats table when
+       building on a local store, from the user's cache directory
+       otherwise, and used to weight critical-path scheduling (see
+       Goal::criticalPathWeight). */
+    std::map<std::string, uint64_t> buildDurations;
+
+    /* Whether 'buildDurations' has changed and needs to be written
+       back. */
+    bool buildDurationsDirty = false;
+
+    /* Whether 'buildDurations' is backed by the store database, in
+       which case builds are recorded there as they finish and the
+       flat file is left alone. */
+    bool buildDurationsInDb = false;
+
+    /* State for the build schedule trace (the 'trace-file' setting):
+       a Chrome trace-event timeline with one track per concurrently
+       occupied build/substitution slot. */
+    struct TraceEvent
+    {
+        std::string name;
+        std::string cat;
+        int tid;
+        uint64_t startUs, durUs;
+    };
+
+    struct TraceState
+    {
+        steady_time_point start;
+        std::vector<TraceEvent> events;
+        /* Track ("lane") assignment of the currently running
+           children; freed lanes are reused so the timeline stays as
+           narrow as the actual parallelism. */
+        std::map<Goal *, int> lanes;
+        std::set<int> freeLanes;
+        int nrLanes = 0;
+        /* Goals currently waiting for a build slot, and since
+           when. */
+        std::map<Goal *, uint64_t> waitingForSlotSince;
+    };
+
+    std::optional<TraceState> trace;
+
+    /* Write the accumulated trace events to the configured file. */
+    void writeTraceFile();
+
 public:
 
+    /* Whether build schedule tracing is enabled. */
+    bool tracing() const { return (bool) trace; }
+
+    /* Microseconds since the worker started, the time base of the
+       trace. */
+    uint64_t traceTimeUs() const;
+
+    /* Record a completed span on the given trace track (track 0 is
+       the main loop). No-op unless tracing() is true. */
+    void addTraceEvent(std::string name, std::string cat, int tid,
+        uint64_t startUs, uint64_t durUs);
+
     const Activity act;
     const Activity actDerivations;
     const Activity actSubstitutions;
@@ -154,6 +231,22 @@ public:
     std::shared_ptr<PathSubstitutionGoal> makePathSubstitutionGoal(const StorePath & storePath, RepairFlag repair = NoRepair, std::optional<ContentAddress> ca = std::nullopt);
     std::shared_ptr<DrvOutputSubstitutionGoal> makeDrvOutputSubstitutionGoal(const DrvOutput & id, RepairFlag repair = NoRepair, std::optional<ContentAddress> ca = std::nullopt);
 
+    /* Pending batches of small-path substitutions, keyed by
+       substituter URI. Goals join a batch in
+       PathSubstitutionGoal::tryToRun(); the first goal to join
+       becomes the leader and fetches the whole batch. */
+    struct SubstitutionBatch
+    {
+        std::shared_ptr<PathSubstitutionGoal> leader;
+        StorePathSet paths;
+    };
+    std::map<std::string, SubstitutionBatch> substitutionBatches;
+
+    /* Hand any pending substitution batches to their leader goals.
+       Called from the main loop when no goal is runnable, i.e. when
+       no more paths can join the batches. */
+    void flushSubstitutionBatches();
+
     /* Remove a dead goal. */
     void removeGoal(GoalPtr goal);
 
@@ -176,6 +269,17 @@ public:
        or the hook would still say `postpone'). */
     void childTerminated(Goal * goal, bool wakeSleepers = true);
 
+    /* Return the expected duration of building the given derivation,
+       in seconds, based on previous builds. Returns 1 if nothing is
+       known about it. */
+    uint64_t getExpectedBuildDuration(const StorePath & drvPath);
+
+    /* Record the observed duration and resource usage of building
+       the given derivation. */
+    void recordBuildDuration(const StorePath & drvPath, uint64_t seconds,
+        std::optional<uint64_t> cpuTime = std::nullopt,
+        std::optional<uint64_t> peakRSS = std::nullopt);
+
     /* Put `goal' to sleep until a build slot becomes available (which
        might be right away). */
     void waitForBuildSlot(GoalPtr goal);
@@ -1,20 +1,87 @@
 #include "buildenv.hh"
+#include "thread-pool.hh"
 
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <algorithm>
+#include <atomic>
 
 namespace nix {
 
-struct State
+/* A node in the planned contents of the profile. Planning the whole
+   tree in memory before touching the filesystem means that resolving
+   a collision between packages never has to unlink and re-create
+   symlinks on disk, and that the final tree can be realised with the
+   minimal number of syscalls, in parallel. */
+struct Node
 {
-    std::map<Path, int> priorities;
-    unsigned long symlinks = 0;
+    /* For a leaf, the symlink target and the priority of the package
+       providing it. */
+    Path target;
+    int priority = 0;
+    bool isDir = false;
+
+    /* Set for a directory node, i.e. a path where the trees of
+       several packages are merged. */
+    bool expanded = false;
+    std::map<std::string, Node> children;
 };
 
-/* For each activated package, create symlinks */
-static void createLinks(State & state, const Path & srcDir, const Path & dstDir, int priority)
+static void planDir(Node & dir, const Path & srcDir, const Path & dstDir, int priority);
+
+/* Merge one file or directory of a package into the planned tree. */
+static void planEntry(Node & dir, const std::string & name,
+    const Path & srcFile, const Path & dstFile, bool isDir, int priority)
+{
+    auto i = dir.children.find(name);
+
+    if (i == dir.children.end()) {
+        dir.children.emplace(name, Node{srcFile, priority, isDir});
+        return;
+    }
+
+    auto & node = i->second;
+
+    if (node.expanded) {
+        if (isDir) {
+            planDir(node, srcFile, dstFile, priority);
+            return;
+        }
+        throw Error("collision between non-directory '%1%' and directory '%2%'", srcFile, dstFile);
+    }
+
+    if (isDir) {
+        auto target = canonPath(node.target, true);
+        if (!node.isDir)
+            throw Error("collision between '%1%' and non-directory '%2%'", srcFile, target);
+        /* Two packages provide the same directory: expand the link
+           planned earlier into a directory node and merge both trees
+           into it. */
+        auto prevPriority = node.priority;
+        node = Node();
+        node.expanded = true;
+        planDir(node, target, dstFile, prevPriority);
+        planDir(node, srcFile, dstFile, priority);
+        return;
+    }
+
+    /* A non-directory colliding with an earlier link is resolved by
+       priority. */
+    if (node.priority == priority)
+        throw Error(
+                "packages '%1%' and '%2%' have the same priority %3%; "
+                "use 'nix-env --set-flag priority NUMBER INSTALLED_PKGNAME' "
+                "to change the priority of one of the conflicting packages"
+                " (0 being the highest priority)",
+                srcFile, node.target, priority);
+    if (node.priority < priority)
+        return;
+    node = Node{srcFile, priority, isDir};
+}
+
+/* Merge each entry of 'srcDir' into the planned directory 'dir'. */
+static void planDir(Node & dir, const Path & srcDir, const Path & dstDir, int priority)
 {
     DirEntries srcFiles;
 
@@ -60,67 +127,36 @@ static void createLinks(State & state, const Path & srcDir, const Path & dstDir,
             hasSuffix(srcFile, "/log"))
             continue;
 
-        else if (S_ISDIR(srcSt.st_mode)) {
-            struct stat dstSt;
-            auto res = lstat(dstFile.c_str(), &dstSt);
-            if (res == 0) {
-                if (S_ISDIR(dstSt.st_mode)) {
-                    createLinks(state, srcFile, dstFile, priority);
-                    continue;
-                } else if (S_ISLNK(dstSt.st_mode)) {
-                    auto target = canonPath(dstFile, true);
-                    if (!S_ISDIR(lstat(target).st_mode))
-                        throw Error("collision between '%1%' and non-directory '%2%'", srcFile, target);
-                    if (unlink(dstFile.c_str()) == -1)
-                        throw SysError("unlinking '%1%'", dstFile);
-                    if (mkdir(dstFile.c_str(), 0755) == -1)
-                        throw SysError("creating directory '%1%'", dstFile);
-                    createLinks(state, target, dstFile, state.priorities[dstFile]);
-                    createLinks(state, srcFile, dstFile, priority);
-                    continue;
-                }
-            } else if (errno != ENOENT)
-                throw SysError("getting status of '%1%'", dstFile);
-        }
-
-        else {
-            struct stat dstSt;
-            auto res = lstat(dstFile.c_str(), &dstSt);
-            if (res == 0) {
-                if (S_ISLNK(dstSt.st_mode)) {
-                    auto prevPriority = state.priorities[dstFile];
-                    if (prevPriority == priority)
-                        throw Error(
-                                "packages '%1%' and '%2%' have the same priority %3%; "
-                                "use 'nix-env --set-flag priority NUMBER INSTALLED_PKGNAME' "
-                                "to change the priority of one of the conflicting packages"
-                                " (0 being the highest priority)",
-                                srcFile, readLink(dstFile), priority);
-                    if (prevPriority < priority)
-                        continue;
-                    if (unlink(dstFile.c_str()) == -1)
-                        throw SysError("unlinking '%1%'", dstFile);
-                } else if (S_ISDIR(dstSt.st_mode))
-                    throw Error("collision between non-directory '%1%' and directory '%2%'", srcFile, dstFile);
-            } else if (errno != ENOENT)
-                throw SysError("getting status of '%1%'", dstFile);
-        }
+        planEntry(dir, ent.name, srcFile, dstFile, S_ISDIR(srcSt.st_mode), priority);
+    }
+}
 
-        createSymlink(srcFile, dstFile);
-        state.priorities[dstFile] = priority;
-        state.symlinks++;
+/* Create the planned directories and symlinks. */
+static void realise(const Path & dst, const Node & node, std::atomic<unsigned long> & symlinks)
+{
+    if (!node.expanded) {
+        createSymlink(node.target, dst);
+        symlinks++;
+        return;
     }
+
+    if (mkdir(dst.c_str(), 0755) == -1)
+        throw SysError("creating directory '%1%'", dst);
+
+    for (auto & i : node.children)
+        realise(dst + "/" + i.first, i.second, symlinks);
 }
 
 void buildProfile(const Path & out, Packages && pkgs)
 {
-    State state;
+    Node root;
+    root.expanded = true;
 
     std::set<Path> done, postponed;
 
     auto addPkg = [&](const Path & pkgDir, int priority) {
         if (!done.insert(pkgDir).second) return;
-        createLinks(state, pkgDir, out, priority);
+        planDir(root, pkgDir, out, priority);
 
         try {
             for (const auto & p : tokenizeString<std::vector<string>>(
@@ -133,8 +169,8 @@ void buildProfile(const Path & out, Packages && pkgs)
     };
 
     /* Symlink to the packages that have been installed explicitly by the
-     * user. Process in priority order to reduce unnecessary
-     * symlink/unlink steps.
+     * user. Process in priority order so that collisions are resolved
+     * towards the higher-priority package.
      */
     std::sort(pkgs.begin(), pkgs.end(), [](const Package & a, const Package & b) {
         return a.priority < b.priority || (a.priority == b.priority && a.path < b.path);
@@ -156,7 +192,20 @@ void buildProfile(const Path & out, Packages && pkgs)
             addPkg(pkgDir, priorityCounter++);
     }
 
-    debug("created %d symlinks in user environment", state.symlinks);
+    /* Realise the planned tree. The top-level subtrees are
+       independent, so create them in parallel. */
+    std::atomic<unsigned long> symlinks{0};
+    ThreadPool pool;
+    for (auto & i : root.children) {
+        auto dst = out + "/" + i.first;
+        auto & node = i.second;
+        pool.enqueue([dst, &node, &symlinks]() {
+            realise(dst, node, symlinks);
+        });
+    }
+    pool.process();
+
+    debug("created %d symlinks in user environment", symlinks.load());
 }
 
 void builtinBuildenv(const BasicDerivation & drv)
@@ -1,4 +1,7 @@
 #include "crypto.hh"
+#include "hash.hh"
+#include "lru-cache.hh"
+#include "sync.hh"
 #include "util.hh"
 #include "globals.hh"
 
@@ -89,6 +92,34 @@ bool verifyDetached(const std::string & data, const std::string & sig,
         (unsigned char *) key->second.key.data()) == 0;
 }
 
+bool verifyDetachedCached(const std::string & data, const std::string & sig,
+    const PublicKeys & publicKeys)
+{
+    /* The cache key covers the public key bytes, so changing the
+       trusted keys cannot revive a stale entry. Negative results are
+       cached too: a bad signature stays bad. */
+    static Sync<LRUCache<std::string, bool>> cache_{32 * 1024};
+
+    auto ss = split(sig);
+
+    auto key = publicKeys.find(std::string(ss.first));
+    if (key == publicKeys.end()) return false;
+
+    auto cacheKey = hashString(htSHA256,
+        key->second.key + ";" + sig + ";" + data).to_string(Base32, false);
+
+    {
+        auto cache(cache_.lock());
+        if (auto res = cache->get(cacheKey)) return *res;
+    }
+
+    auto res = verifyDetached(data, sig, publicKeys);
+
+    cache_.lock()->upsert(cacheKey, res);
+
+    return res;
+}
+
 PublicKeys getDefaultPublicKeys()
 {
     PublicKeys publicKeys;
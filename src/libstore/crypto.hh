@@ -57,6 +57,13 @@ typedef std::map<std::string, PublicKey> PublicKeys;
 bool verifyDetached(const std::string & data, const std::string & sig,
     const PublicKeys & publicKeys);
 
+/* Like verifyDetached(), but memoise the result, so that checking
+   the same fingerprint/signature pair again (e.g. once when a
+   narinfo arrives and once in addToStore() after the download) only
+   costs one Ed25519 verification. */
+bool verifyDetachedCached(const std::string & data, const std::string & sig,
+    const PublicKeys & publicKeys);
+
 PublicKeys getDefaultPublicKeys();
 
 }
@@ -1,7 +1,15 @@
 #include "daemon.hh"
 #include "monitor-fd.hh"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <sys/socket.h>
 #include "worker-protocol.hh"
 #include "store-api.hh"
+#include "local-store.hh"
 #include "path-with-outputs.hh"
 #include "finally.hh"
 #include "affinity.hh"
@@ -42,6 +50,12 @@ struct TunnelLogger : public Logger
 
     unsigned int clientVersion;
 
+    /* Whether the client subscribes to build log lines (protocol >=
+       1.33). Clients that throttle or drop them anyway can turn this
+       off and save the traffic; build failures still carry the log
+       tail in the error itself. */
+    std::atomic<bool> clientWantsBuildLogs{true};
+
     TunnelLogger(FdSink & to, unsigned int clientVersion)
         : to(to), clientVersion(clientVersion) { }
 
@@ -144,6 +158,9 @@ struct TunnelLogger : public Logger
     void result(ActivityId act, ResultType type, const Fields & fields) override
     {
         if (GET_PROTOCOL_MINOR(clientVersion) < 20) return;
+        if (!clientWantsBuildLogs
+            && (type == resBuildLogLine || type == resPostBuildLogLine))
+            return;
         StringSink buf;
         buf << STDERR_RESULT << act << type << fields;
         enqueueMsg(*buf.s);
@@ -264,7 +281,8 @@ static std::vector<DerivedPath> readDerivedPaths(Store & store, unsigned int cli
 
 static void performOp(TunnelLogger * logger, ref<Store> store,
     TrustedFlag trusted, RecursiveFlag recursive, unsigned int clientVersion,
-    Source & from, BufferedSink & to, unsigned int op)
+    Source & from, BufferedSink & to, unsigned int op,
+    std::shared_ptr<LocalStore::TempRootsScope> & tempRootsScope)
 {
     switch (op) {
 
@@ -347,7 +365,7 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
     case wopQueryDerivationOutputNames: {
         auto path = store->parseStorePath(readString(from));
         logger->startWork();
-        auto names = store->readDerivation(path).outputNames();
+        auto names = store->readDerivationShared(path)->outputNames();
         logger->stopWork();
         to << names;
         break;
@@ -380,6 +398,15 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         break;
     }
 
+    case wopQueryPathsFromHashParts: {
+        auto hashParts = readStrings<std::set<std::string>>(from);
+        logger->startWork();
+        auto res = store->queryPathsFromHashParts(hashParts);
+        logger->stopWork();
+        worker_proto::write(*store, to, res);
+        break;
+    }
+
     case wopAddToStore: {
         if (GET_PROTOCOL_MINOR(clientVersion) >= 25) {
             auto name = readString(from);
@@ -608,7 +635,20 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
     case wopAddTempRoot: {
         auto path = store->parseStorePath(readString(from));
         logger->startWork();
-        store->addTempRoot(path);
+        /* In the threaded daemon the store (and hence its temporary
+           roots file) is shared by all connections, so tie the
+           client's root to this connection instead: it should go
+           away when the client disconnects, not when the daemon
+           eventually exits. */
+        std::shared_ptr<LocalStore> localStore;
+        if (isLoggerPerThread())
+            localStore = store.dynamic_pointer_cast<LocalStore>();
+        if (localStore) {
+            if (!tempRootsScope)
+                tempRootsScope = localStore->openTempRootsScope();
+            localStore->addTempRoot(path, *tempRootsScope);
+        } else
+            store->addTempRoot(path);
         logger->stopWork();
         to << 1;
         break;
@@ -698,6 +738,9 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
             }
         }
 
+        if (GET_PROTOCOL_MINOR(clientVersion) >= 33)
+            logger->clientWantsBuildLogs = readInt(from);
+
         logger->startWork();
 
         // FIXME: use some setting in recursive mode. Will need to use
@@ -916,11 +959,76 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         break;
     }
 
+    case wopQueryStoreGeneration: {
+        logger->startWork();
+        auto gen = store->queryStoreGeneration();
+        logger->stopWork();
+        to << gen;
+        break;
+    }
+
+    case wopWaitStoreGeneration: {
+        auto known = readNum<uint64_t>(from);
+        auto timeoutMs = readNum<uint64_t>(from);
+        logger->startWork();
+        /* Cap the long poll so that a forgotten client doesn't pin a
+           daemon thread forever. */
+        auto gen = store->waitStoreGeneration(known,
+            std::min<uint64_t>(timeoutMs, 10 * 60 * 1000));
+        logger->stopWork();
+        to << gen;
+        break;
+    }
+
+    case wopQueryRealisations: {
+        std::set<DrvOutput> ids;
+        for (auto & s : readStrings<Strings>(from))
+            ids.insert(DrvOutput::parse(s));
+        logger->startWork();
+        std::set<Realisation> realisations;
+        for (auto & id : ids)
+            if (auto info = store->queryRealisation(id))
+                realisations.insert(*info);
+        logger->stopWork();
+        worker_proto::write(*store, to, realisations);
+        break;
+    }
+
     default:
         throw Error("invalid operation %1%", op);
     }
 }
 
+/* Operations that can occupy the daemon for a long time relative to a
+   single protocol round trip. */
+static bool isExpensiveOp(WorkerOp op)
+{
+    switch (op) {
+    case wopAddToStore:
+    case wopAddToStoreNar:
+    case wopAddMultipleToStore:
+    case wopAddTextToStore:
+    case wopImportPaths:
+    case wopExportPath:
+    case wopCollectGarbage:
+    case wopQueryMissing:
+    case wopVerifyStore:
+    case wopOptimiseStore:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Bounds the number of expensive operations in flight across all
+   connections served by this process (see
+   'daemon-heavy-op-concurrency'). */
+static struct {
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    unsigned int active = 0;
+} expensiveOps;
+
 void processConnection(
     ref<Store> store,
     FdSource & from,
@@ -929,7 +1037,19 @@ void processConnection(
     RecursiveFlag recursive,
     std::function<void(Store &)> authHook)
 {
-    auto monitor = !recursive ? std::make_unique<MonitorFdHup>(from.fd) : nullptr;
+    /* In the threaded daemon the interrupt flag is shared by all
+       connections, so a hangup can't trigger it; instead shut down
+       the socket so that the worker's next read or write fails. */
+    std::unique_ptr<MonitorFdHup> monitor;
+    if (!recursive) {
+        if (isLoggerPerThread()) {
+            int fd = from.fd;
+            monitor = std::make_unique<MonitorFdHup>(fd, [fd]() {
+                shutdown(fd, SHUT_RDWR);
+            });
+        } else
+            monitor = std::make_unique<MonitorFdHup>(from.fd);
+    }
 
     /* Exchange the greeting. */
     unsigned int magic = readInt(from);
@@ -944,14 +1064,24 @@ void processConnection(
     auto tunnelLogger = new TunnelLogger(to, clientVersion);
     auto prevLogger = nix::logger;
     // FIXME
-    if (!recursive)
-        logger = tunnelLogger;
+    if (!recursive) {
+        if (isLoggerPerThread())
+            setPerThreadLogger(tunnelLogger);
+        else
+            logger = tunnelLogger;
+    }
 
     unsigned int opCount = 0;
+    std::chrono::nanoseconds busyTime{0};
 
     Finally finally([&]() {
-        _isInterrupted = false;
-        prevLogger->log(lvlDebug, fmt("%d operations", opCount));
+        if (isLoggerPerThread())
+            setPerThreadLogger(nullptr);
+        else
+            _isInterrupted = false;
+        prevLogger->log(lvlDebug, fmt("%d operations, %d bytes received, %d bytes sent, %d ms of work",
+            opCount, from.read, to.written,
+            std::chrono::duration_cast<std::chrono::milliseconds>(busyTime).count()));
     });
 
     if (GET_PROTOCOL_MINOR(clientVersion) >= 14 && readInt(from)) {
@@ -973,6 +1103,16 @@ void processConnection(
         tunnelLogger->stopWork();
         to.flush();
 
+        /* Connection-scoped temporary roots, created lazily on the
+           first wopAddTempRoot. */
+        std::shared_ptr<LocalStore::TempRootsScope> tempRootsScope;
+
+        /* Token bucket for pacing untrusted clients, refilled at
+           'daemon-ops-per-second' with a burst of one second's
+           worth. */
+        double tokens = settings.daemonOpsPerSecond;
+        auto lastRefill = std::chrono::steady_clock::now();
+
         /* Process client requests. */
         while (true) {
             WorkerOp op;
@@ -986,8 +1126,48 @@ void processConnection(
 
             opCount++;
 
+            if (unsigned int opsPerSecond = settings.daemonOpsPerSecond;
+                opsPerSecond && trusted != Trusted)
+            {
+                auto now = std::chrono::steady_clock::now();
+                tokens = std::min<double>(opsPerSecond,
+                    tokens + std::chrono::duration<double>(now - lastRefill).count() * opsPerSecond);
+                lastRefill = now;
+                if (tokens < 1) {
+                    std::this_thread::sleep_for(
+                        std::chrono::duration<double>((1 - tokens) / opsPerSecond));
+                    tokens = 1;
+                }
+                tokens -= 1;
+            }
+
+            /* Wait for a slot if this operation is expensive and a
+               concurrency limit is configured, so a single client
+               can't occupy the whole daemon. */
+            bool holdsSlot = false;
+            if (unsigned int limit = settings.daemonHeavyOpConcurrency;
+                limit && isExpensiveOp(op))
+            {
+                std::unique_lock lock(expensiveOps.mutex);
+                expensiveOps.wakeup.wait(lock, [&]() { return expensiveOps.active < limit; });
+                expensiveOps.active++;
+                holdsSlot = true;
+            }
+
+            Finally releaseSlot([&]() {
+                if (holdsSlot) {
+                    {
+                        std::lock_guard lock(expensiveOps.mutex);
+                        expensiveOps.active--;
+                    }
+                    expensiveOps.wakeup.notify_one();
+                }
+            });
+
+            auto opStart = std::chrono::steady_clock::now();
+
             try {
-                performOp(tunnelLogger, store, trusted, recursive, clientVersion, from, to, op);
+                performOp(tunnelLogger, store, trusted, recursive, clientVersion, from, to, op, tempRootsScope);
             } catch (Error & e) {
                 /* If we're not in a state where we can send replies, then
                    something went wrong processing the input of the
@@ -1003,6 +1183,8 @@ void processConnection(
                 throw;
             }
 
+            busyTime += std::chrono::steady_clock::now() - opStart;
+
             to.flush();
 
             assert(!tunnelLogger->state_.lock()->canSendStderr);
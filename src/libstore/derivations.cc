@@ -1,4 +1,5 @@
 #include "derivations.hh"
+#include "drv-hash-cache.hh"
 #include "store-api.hh"
 #include "globals.hh"
 #include "util.hh"
@@ -96,9 +97,33 @@ StorePath writeDerivation(Store & store,
        held during a garbage collection). */
     auto suffix = std::string(drv.name) + drvExtension;
     auto contents = drv.unparse(store, false);
-    return readOnly || settings.readOnlyMode
-        ? store.computeStorePathForText(suffix, contents, references)
-        : store.addTextToStore(suffix, contents, references, repair);
+
+    if (readOnly || settings.readOnlyMode)
+        return store.computeStorePathForText(suffix, contents, references);
+
+    /* Concurrent evaluations tend to write the same few thousand
+       derivations over and over. Since the store path is a content
+       hash, we can answer repeats from a process-level memo, and ask
+       the store whether it already has the path before transferring
+       the contents. */
+    static Sync<std::set<std::pair<std::string, StorePath>>> written_;
+
+    auto path = store.computeStorePathForText(suffix, contents, references);
+    auto key = std::make_pair(store.getUri(), path);
+
+    if (!repair) {
+        if (written_.lock()->count(key))
+            return path;
+        if (store.isValidPath(path)) {
+            written_.lock()->insert(key);
+            return path;
+        }
+    }
+
+    auto path2 = store.addTextToStore(suffix, contents, references, repair);
+    assert(path2 == path);
+    written_.lock()->insert(std::move(key));
+    return path2;
 }
 
 
@@ -479,12 +504,39 @@ static const DrvHashModulo pathDerivationModulo(Store & store, const StorePath &
             return h->second;
         }
     }
+
+    /* Consult the persistent cache, so that repeated instantiations
+       of an unchanged derivation closure don't recompute tens of
+       thousands of hashes. A read-only or missing cache directory
+       just disables persistence. */
+    std::shared_ptr<DrvHashCache> diskCache;
+    try {
+        diskCache = getDrvHashCache().get_ptr();
+    } catch (Error &) {
+        ignoreException();
+    }
+
+    auto key = store.printStorePath(drvPath);
+
+    if (diskCache)
+        if (auto h = diskCache->lookup(key)) {
+            drvHashes.lock()->insert_or_assign(drvPath, *h);
+            return *h;
+        }
+
     auto h = hashDerivationModulo(
         store,
         store.readInvalidDerivation(drvPath),
         false);
     // Cache it
     drvHashes.lock()->insert_or_assign(drvPath, h);
+    if (diskCache) {
+        try {
+            diskCache->upsert(key, h);
+        } catch (Error &) {
+            ignoreException();
+        }
+    }
     return h;
 }
 
@@ -719,15 +771,17 @@ static void rewriteDerivation(Store & store, BasicDerivation & drv, const String
         debug("rewriting %s as %s", rewrite.first, rewrite.second);
     }
 
-    drv.builder = rewriteStrings(drv.builder, rewrites);
+    StringRewriter rewriter(rewrites);
+
+    drv.builder = rewriter(drv.builder);
     for (auto & arg: drv.args) {
-        arg = rewriteStrings(arg, rewrites);
+        arg = rewriter(arg);
     }
 
     StringPairs newEnv;
     for (auto & envVar: drv.env) {
-        auto envName = rewriteStrings(envVar.first, rewrites);
-        auto envValue = rewriteStrings(envVar.second, rewrites);
+        auto envName = rewriter(envVar.first);
+        auto envValue = rewriter(envVar.second);
         newEnv.emplace(envName, envValue);
     }
     drv.env = newEnv;
@@ -0,0 +1,128 @@
+#include "drv-hash-cache.hh"
+#include "sync.hh"
+#include "sqlite.hh"
+#include "globals.hh"
+
+#include <sqlite3.h>
+
+namespace nix {
+
+static const char * schema = R"sql(
+
+create table if not exists DrvHashes (
+    path text primary key not null,
+    hash text not null
+);
+
+)sql";
+
+/* The hash column is a rendering of the DrvHashModulo variant:
+   'r:<hash>' for a regular derivation, 'd:<hash>' for a deferred
+   one, and 'fixed;<output>=<hash>;...' for the output hashes of a
+   fixed-output derivation. */
+
+static std::string renderDrvHashModulo(const DrvHashModulo & drvHash)
+{
+    return std::visit(overloaded {
+        [](const Hash & hash) {
+            return "r:" + hash.to_string(Base16, true);
+        },
+        [](const DeferredHash & deferredHash) {
+            return "d:" + deferredHash.hash.to_string(Base16, true);
+        },
+        [](const CaOutputHashes & outputHashes) {
+            std::string s = "fixed";
+            for (auto & [name, hash] : outputHashes)
+                s += ";" + name + "=" + hash.to_string(Base16, true);
+            return s;
+        },
+    }, drvHash);
+}
+
+static std::optional<DrvHashModulo> parseDrvHashModulo(const std::string & s)
+{
+    try {
+        if (hasPrefix(s, "r:"))
+            return DrvHashModulo(Hash::parseAnyPrefixed(s.substr(2)));
+        if (hasPrefix(s, "d:"))
+            return DrvHashModulo(DeferredHash { Hash::parseAnyPrefixed(s.substr(2)) });
+        if (hasPrefix(s, "fixed")) {
+            CaOutputHashes outputHashes;
+            for (auto & t : tokenizeString<Strings>(s.substr(5), ";")) {
+                auto eq = t.find('=');
+                if (eq == std::string::npos) return std::nullopt;
+                outputHashes.insert_or_assign(
+                    t.substr(0, eq),
+                    Hash::parseAnyPrefixed(t.substr(eq + 1)));
+            }
+            return DrvHashModulo(std::move(outputHashes));
+        }
+    } catch (BadHash &) {
+    }
+    return std::nullopt;
+}
+
+class DrvHashCacheImpl : public DrvHashCache
+{
+public:
+
+    struct State
+    {
+        SQLite db;
+        SQLiteStmt insertHash, queryHash;
+    };
+
+    Sync<State> _state;
+
+    DrvHashCacheImpl()
+    {
+        auto state(_state.lock());
+
+        Path dbPath = getCacheDir() + "/nix/drv-hashes-v1.sqlite";
+        createDirs(dirOf(dbPath));
+
+        state->db = SQLite(dbPath);
+
+        state->db.isCache();
+
+        state->db.exec(schema);
+
+        state->insertHash.create(state->db,
+            "insert or replace into DrvHashes(path, hash) values (?, ?)");
+
+        state->queryHash.create(state->db,
+            "select hash from DrvHashes where path = ?");
+    }
+
+    std::optional<DrvHashModulo> lookup(const std::string & drvPath) override
+    {
+        return retrySQLite<std::optional<DrvHashModulo>>([&]() -> std::optional<DrvHashModulo> {
+            auto state(_state.lock());
+
+            auto queryHash(state->queryHash.use()(drvPath));
+            if (!queryHash.next()) return std::nullopt;
+
+            return parseDrvHashModulo(queryHash.getStr(0));
+        });
+    }
+
+    void upsert(const std::string & drvPath, const DrvHashModulo & drvHash) override
+    {
+        retrySQLite<void>([&]() {
+            auto state(_state.lock());
+
+            state->insertHash.use()
+                (drvPath)
+                (renderDrvHashModulo(drvHash))
+                .exec();
+        });
+    }
+};
+
+ref<DrvHashCache> getDrvHashCache()
+{
+    static ref<DrvHashCache> cache = make_ref<DrvHashCacheImpl>();
+    return cache;
+}
+
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "derivations.hh"
+
+namespace nix {
+
+/* A persistent, per-user cache of hashDerivationModulo() results,
+   keyed by .drv store path. Since a .drv file's store path is a hash
+   of its contents, the file is immutable and entries never need to
+   be invalidated; repeated instantiations of an unchanged derivation
+   closure skip the SHA-256 recomputation entirely. */
+class DrvHashCache
+{
+public:
+
+    virtual ~DrvHashCache() { }
+
+    virtual std::optional<DrvHashModulo> lookup(const std::string & drvPath) = 0;
+
+    virtual void upsert(const std::string & drvPath, const DrvHashModulo & hash) = 0;
+};
+
+/* Return a singleton cache object that can be safely shared by
+   multiple threads. */
+ref<DrvHashCache> getDrvHashCache();
+
+}
@@ -1,9 +1,13 @@
 #include "serialise.hh"
 #include "store-api.hh"
 #include "archive.hh"
+#include "compression.hh"
 #include "worker-protocol.hh"
 
 #include <algorithm>
+#include <deque>
+#include <future>
+#include <thread>
 
 namespace nix {
 
@@ -25,6 +29,63 @@ void Store::exportPaths(const StorePathSet & paths, Sink & sink)
     sink << 0;
 }
 
+void Store::exportPathsV2(const StorePathSet & paths, Sink & sink,
+    const std::string & compression, size_t jobs)
+{
+    auto sorted = topoSortPaths(paths);
+    std::reverse(sorted.begin(), sorted.end());
+
+    sink << exportMagicV2 << compression << (uint64_t) sorted.size();
+
+    /* Index header: the receiver knows every path, its references
+       and its uncompressed size before the first NAR byte
+       arrives. */
+    for (auto & path : sorted) {
+        auto info = queryPathInfo(path);
+        sink << printStorePath(path)
+             << (info->deriver ? printStorePath(*info->deriver) : "");
+        worker_proto::write(*this, sink, info->references);
+        sink << info->narSize;
+    }
+
+    /* Dump and compress a single path. */
+    auto makeFrame = [&](const StorePath & path) -> std::pair<Hash, ref<std::string>>
+    {
+        auto info = queryPathInfo(path);
+
+        StringSink nar;
+        HashSink hashSink(htSHA256);
+        TeeSink teeSink(nar, hashSink);
+
+        narFromPath(path, teeSink);
+
+        /* Refuse to export paths that have changed, like
+           exportPath(). */
+        Hash hash = hashSink.currentHash().first;
+        if (hash != info->narHash && info->narHash != Hash(info->narHash.type))
+            throw Error("hash of path '%s' has changed from '%s' to '%s'!",
+                printStorePath(path), info->narHash.to_string(Base32, true), hash.to_string(Base32, true));
+
+        return {hash, compress(compression, *nar.s)};
+    };
+
+    /* Frames are produced by a window of background jobs but emitted
+       in index order, so the output is deterministic and the sink
+       only ever sees complete frames. */
+    size_t window = jobs ? jobs : std::max(1U, std::thread::hardware_concurrency());
+    std::deque<std::future<std::pair<Hash, ref<std::string>>>> inFlight;
+    size_t next = 0;
+
+    while (next < sorted.size() || !inFlight.empty()) {
+        while (next < sorted.size() && inFlight.size() < window)
+            inFlight.push_back(std::async(std::launch::async, makeFrame, std::cref(sorted[next++])));
+        auto [hash, data] = inFlight.front().get();
+        inFlight.pop_front();
+        sink << (uint64_t) exportMagic << hash.to_string(Base32, true) << *data;
+    }
+}
+
+
 void Store::exportPath(const StorePath & path, Sink & sink)
 {
     auto info = queryPathInfo(path);
@@ -57,6 +118,8 @@ StorePaths Store::importPaths(Source & source, CheckSigsFlag checkSigs)
     while (true) {
         auto n = readNum<uint64_t>(source);
         if (n == 0) break;
+        if (n == exportMagicV2 && res.empty())
+            return importPathsV2(source, checkSigs);
         if (n != 1) throw Error("input doesn't look like something created by 'nix-store --export'");
 
         /* Extract the NAR from the source. */
@@ -97,4 +160,83 @@ StorePaths Store::importPaths(Source & source, CheckSigsFlag checkSigs)
     return res;
 }
 
+
+StorePaths Store::importPathsV2(Source & source, CheckSigsFlag checkSigs)
+{
+    auto compression = readString(source);
+    auto expected = readNum<uint64_t>(source);
+
+    /* Read the index header. */
+    std::vector<ValidPathInfo> infos;
+    infos.reserve(expected);
+    for (uint64_t i = 0; i < expected; ++i) {
+        auto path = parseStorePath(readString(source));
+        auto deriver = readString(source);
+        ValidPathInfo info { path, Hash::dummy };
+        if (deriver != "")
+            info.deriver = parseStorePath(deriver);
+        info.references = worker_proto::read(*this, source, Phantom<StorePathSet> {});
+        info.narSize = readNum<uint64_t>(source);
+        infos.push_back(std::move(info));
+    }
+
+    StorePaths res;
+    uint64_t nrFailed = 0;
+
+    /* Two-stage pipeline: while a frame is being added to the store,
+       the next one is read from the source and decompressed. */
+    std::future<void> adding;
+    std::optional<StorePath> addingPath;
+
+    auto finishAdding = [&]() {
+        if (!adding.valid()) return;
+        try {
+            adding.get();
+            res.push_back(*addingPath);
+        } catch (Error & e) {
+            warn("could not import path '%s': %s", printStorePath(*addingPath), e.what());
+            nrFailed++;
+        }
+    };
+
+    for (uint64_t i = 0; i < expected; ++i) {
+        /* Frame boundaries are length-prefixed, so a corrupted
+           payload only loses this path; but a corrupted boundary
+           loses our position in the stream. */
+        if (readNum<uint64_t>(source) != exportMagic)
+            throw Error("corrupted frame boundary in v2 export; cannot continue");
+        auto narHashS = readString(source);
+        auto data = readString(source);
+
+        std::shared_ptr<std::string> nar;
+        try {
+            auto narHash = Hash::parseAnyPrefixed(narHashS);
+            nar = decompress(compression, data).get_ptr();
+            if (hashString(htSHA256, *nar) != narHash)
+                throw Error("hash mismatch");
+            infos[i].narHash = narHash;
+            infos[i].narSize = nar->size();
+        } catch (Error & e) {
+            warn("skipping corrupted frame for path '%s': %s", printStorePath(infos[i].path), e.what());
+            nrFailed++;
+            continue;
+        }
+
+        finishAdding();
+
+        addingPath = infos[i].path;
+        adding = std::async(std::launch::async, [this, i, nar, &infos, checkSigs]() {
+            StringSource narSource { *nar };
+            addToStore(infos[i], narSource, NoRepair, checkSigs);
+        });
+    }
+
+    finishAdding();
+
+    if (nrFailed)
+        throw Error("import of %d of %d paths failed", nrFailed, expected);
+
+    return res;
+}
+
 }
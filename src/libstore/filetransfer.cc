@@ -6,6 +6,9 @@
 #include "compression.hh"
 #include "finally.hh"
 #include "callback.hh"
+#include "json.hh"
+#include "tracepoints.hh"
+#include "url.hh"
 
 #if ENABLE_S3
 #include <aws/core/client/ClientConfiguration.h>
@@ -19,6 +22,7 @@
 #include <algorithm>
 #include <cmath>
 #include <cstring>
+#include <fstream>
 #include <iostream>
 #include <queue>
 #include <random>
@@ -48,6 +52,49 @@ struct curlFileTransfer : public FileTransfer
     std::random_device rd;
     std::mt19937 mt19937;
 
+    /* Per-host statistics (see FileTransfer::HostStats). */
+    Sync<std::map<std::string, HostStats>> hostStats_;
+
+    static std::string statsHost(const std::string & uri)
+    {
+        try {
+            auto parsed = parseURL(uri);
+            if (parsed.authority && *parsed.authority != "")
+                return *parsed.authority;
+            return parsed.scheme;
+        } catch (...) {
+            return "<unparsed>";
+        }
+    }
+
+    void recordRetry(const std::string & uri)
+    {
+        (*hostStats_.lock())[statsHost(uri)].retries++;
+    }
+
+    void recordResult(const std::string & uri, bool succeeded,
+        uint64_t bytesReceived, double dns, double connect, double firstByte, double total)
+    {
+        auto stats(hostStats_.lock());
+        auto & s = (*stats)[statsHost(uri)];
+        s.requests++;
+        (succeeded ? s.succeeded : s.failed)++;
+        s.bytesReceived += bytesReceived;
+        s.dnsTime += dns;
+        s.connectTime += connect;
+        s.firstByteTime += firstByte;
+        s.totalTime += total;
+        size_t bucket = 0;
+        while (bucket < HostStats::nrLatencyBuckets - 1 && total * 1000 >= (1ULL << bucket))
+            bucket++;
+        s.latencyBuckets[bucket]++;
+    }
+
+    std::map<std::string, HostStats> getHostStats() override
+    {
+        return *hostStats_.lock();
+    }
+
     struct TransferItem : public std::enable_shared_from_this<TransferItem>
     {
         curlFileTransfer & fileTransfer;
@@ -92,7 +139,7 @@ struct curlFileTransfer : public FileTransfer
             : fileTransfer(fileTransfer)
             , request(request)
             , act(*logger, lvlTalkative, actFileTransfer,
-                fmt(request.data ? "uploading '%s'" : "downloading '%s'", request.uri),
+                fmt(request.data || request.dataStream ? "uploading '%s'" : "downloading '%s'", request.uri),
                 {request.uri}, request.parentAct)
             , callback(std::move(callback))
             , finalSink([this](std::string_view data) {
@@ -256,6 +303,15 @@ struct curlFileTransfer : public FileTransfer
         size_t readOffset = 0;
         size_t readCallback(char *buffer, size_t size, size_t nitems)
         {
+            if (request.dataStream) {
+                /* Stream the body from the supplied stream, so large
+                   uploads don't have to be held in memory. */
+                request.dataStream->read(buffer, size * nitems);
+                auto count = request.dataStream->gcount();
+                if (count <= 0 && !request.dataStream->eof())
+                    return CURL_READFUNC_ABORT;
+                return count;
+            }
             if (readOffset == request.data->length())
                 return 0;
             auto count = std::min(size * nitems, request.data->length() - readOffset);
@@ -311,11 +367,18 @@ struct curlFileTransfer : public FileTransfer
             if (request.head)
                 curl_easy_setopt(req, CURLOPT_NOBODY, 1);
 
-            if (request.data) {
+            if (request.data || request.dataStream) {
                 curl_easy_setopt(req, CURLOPT_UPLOAD, 1L);
                 curl_easy_setopt(req, CURLOPT_READFUNCTION, readCallbackWrapper);
                 curl_easy_setopt(req, CURLOPT_READDATA, this);
-                curl_easy_setopt(req, CURLOPT_INFILESIZE_LARGE, (curl_off_t) request.data->length());
+                curl_easy_setopt(req, CURLOPT_INFILESIZE_LARGE,
+                    (curl_off_t) (request.data ? request.data->length() : request.dataStreamSize));
+                if (request.dataStream) {
+                    /* Rewind the stream on (re)start so retries send
+                       the body from the beginning. */
+                    request.dataStream->clear();
+                    request.dataStream->seekg(0);
+                }
             }
 
             if (request.verifyTLS) {
@@ -348,11 +411,22 @@ struct curlFileTransfer : public FileTransfer
         {
             auto httpStatus = getHTTPStatus();
 
+            NIX_PROBE3(file_transfer_done, request.uri.c_str(), (int) code, httpStatus);
+
             char * effectiveUriCStr;
             curl_easy_getinfo(req, CURLINFO_EFFECTIVE_URL, &effectiveUriCStr);
             if (effectiveUriCStr)
                 result.effectiveUri = effectiveUriCStr;
 
+            result.acceptRanges = acceptRanges;
+
+            #if LIBCURL_VERSION_NUM >= 0x073700
+            curl_off_t contentLength = 0;
+            curl_easy_getinfo(req, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &contentLength);
+            if (contentLength > 0)
+                result.contentLength = contentLength;
+            #endif
+
             debug("finished %s of '%s'; curl status = %d, HTTP status = %d, body = %d bytes",
                 request.verb(), request.uri, code, httpStatus, result.bodySize);
 
@@ -369,6 +443,17 @@ struct curlFileTransfer : public FileTransfer
                 httpStatus = 304;
             }
 
+            {
+                double dns = 0, connect = 0, firstByte = 0, total = 0;
+                curl_easy_getinfo(req, CURLINFO_NAMELOOKUP_TIME, &dns);
+                curl_easy_getinfo(req, CURLINFO_APPCONNECT_TIME, &connect);
+                curl_easy_getinfo(req, CURLINFO_STARTTRANSFER_TIME, &firstByte);
+                curl_easy_getinfo(req, CURLINFO_TOTAL_TIME, &total);
+                fileTransfer.recordResult(request.uri,
+                    !writeException && code == CURLE_OK && successfulStatuses.count(httpStatus),
+                    result.bodySize, dns, connect, firstByte, total);
+            }
+
             if (writeException)
                 failEx(writeException);
 
@@ -468,6 +553,7 @@ struct curlFileTransfer : public FileTransfer
                     else
                         warn("%s; retrying in %d ms", exc.what(), ms);
                     embargo = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+                    fileTransfer.recordRetry(request.uri);
                     fileTransfer.enqueueItem(shared_from_this());
                 }
                 else
@@ -510,6 +596,19 @@ struct curlFileTransfer : public FileTransfer
         #if LIBCURL_VERSION_NUM >= 0x071e00 // Max connections requires >= 7.30.0
         curl_multi_setopt(curlm, CURLMOPT_MAX_TOTAL_CONNECTIONS,
             fileTransferSettings.httpConnections.get());
+        if (fileTransferSettings.httpConnectionsPerHost.get() != 0)
+            /* Capping per-host connections makes curl coalesce
+               concurrent requests to the same server onto a few
+               HTTP/2 connections (each easy handle sets
+               CURLOPT_PIPEWAIT), instead of opening one connection
+               per request. */
+            curl_multi_setopt(curlm, CURLMOPT_MAX_HOST_CONNECTIONS,
+                fileTransferSettings.httpConnectionsPerHost.get());
+        #endif
+        #if LIBCURL_VERSION_NUM >= 0x074300 // Max concurrent streams requires >= 7.67.0
+        if (fileTransferSettings.http2MaxStreams.get() != 0)
+            curl_multi_setopt(curlm, CURLMOPT_MAX_CONCURRENT_STREAMS,
+                fileTransferSettings.http2MaxStreams.get());
         #endif
 
         wakeupPipe.create();
@@ -525,6 +624,9 @@ struct curlFileTransfer : public FileTransfer
         workerThread.join();
 
         if (curlm) curl_multi_cleanup(curlm);
+
+        if (getEnv("NIX_SHOW_TRANSFER_STATS").value_or("0") != "0")
+            printHostStats();
     }
 
     void stopWorkerThread()
@@ -659,6 +761,8 @@ struct curlFileTransfer : public FileTransfer
 
     void enqueueItem(std::shared_ptr<TransferItem> item)
     {
+        NIX_PROBE1(file_transfer_enqueue, item->request.uri.c_str());
+
         if (item->request.data
             && !hasPrefix(item->request.uri, "http://")
             && !hasPrefix(item->request.uri, "https://"))
@@ -729,6 +833,33 @@ ref<curlFileTransfer> makeCurlFileTransfer()
     return make_ref<curlFileTransfer>();
 }
 
+void FileTransfer::printHostStats()
+{
+    auto stats = getHostStats();
+    if (stats.empty()) return;
+
+    auto outPath = getEnv("NIX_SHOW_TRANSFER_STATS_PATH").value_or("-");
+    std::fstream fs;
+    if (outPath != "-")
+        fs.open(outPath, std::fstream::out);
+    JSONObject topObj(outPath == "-" ? std::cerr : fs, true);
+    for (auto & [host, s] : stats) {
+        auto obj = topObj.object(host);
+        obj.attr("requests", s.requests);
+        obj.attr("succeeded", s.succeeded);
+        obj.attr("failed", s.failed);
+        obj.attr("retries", s.retries);
+        obj.attr("bytesReceived", s.bytesReceived);
+        obj.attr("dnsSeconds", s.dnsTime);
+        obj.attr("connectSeconds", s.connectTime);
+        obj.attr("firstByteSeconds", s.firstByteTime);
+        obj.attr("totalSeconds", s.totalTime);
+        auto buckets = obj.list("latencyMsBuckets");
+        for (auto & n : s.latencyBuckets)
+            buckets.elem(n);
+    }
+}
+
 ref<FileTransfer> getFileTransfer()
 {
     static ref<curlFileTransfer> fileTransfer = makeCurlFileTransfer();
@@ -769,8 +900,83 @@ FileTransferResult FileTransfer::upload(const FileTransferRequest & request)
     return enqueueFileTransfer(request).get();
 }
 
-void FileTransfer::download(FileTransferRequest && request, Sink & sink)
+std::optional<FileTransferResult> FileTransfer::trySegmentedDownload(const FileTransferRequest & request, Sink & sink)
+{
+    auto segments = fileTransferSettings.downloadSegments.get();
+    auto segmentSize = fileTransferSettings.downloadSegmentSize.get();
+
+    if (segments <= 1 || segmentSize == 0
+        || request.data || request.dataStream || request.head
+        || request.expectedETag != ""
+        || (!hasPrefix(request.uri, "http://") && !hasPrefix(request.uri, "https://")))
+        return {};
+
+    /* Probe the file size and range support. */
+    FileTransferRequest probe(request.uri);
+    probe.headers = request.headers;
+    probe.head = true;
+    FileTransferResult probeRes;
+    try {
+        probeRes = enqueueFileTransfer(probe).get();
+    } catch (FileTransferError &) {
+        return {};
+    }
+
+    if (!probeRes.acceptRanges
+        || probeRes.contentLength < 2 * segmentSize)
+        return {};
+
+    auto size = probeRes.contentLength;
+
+    debug("downloading '%s' (%d bytes) in %d-byte segments", request.uri, size, segmentSize);
+
+    /* Fetch fixed-size ranges with at most 'segments' transfers in
+       flight, and write them to the sink in order. Each segment gets
+       the usual retry treatment, so a dropped connection only repeats
+       the segment it was carrying. The ETag from the probe guards
+       against the file changing mid-download. */
+    std::queue<std::pair<std::future<FileTransferResult>, uint64_t>> inFlight;
+
+    uint64_t offset = 0;
+
+    auto enqueueNext = [&]() {
+        if (offset >= size) return;
+        auto len = std::min<uint64_t>(segmentSize, size - offset);
+        FileTransferRequest segReq(request.uri);
+        segReq.headers = request.headers;
+        segReq.headers.emplace_back("Range", fmt("bytes=%d-%d", offset, offset + len - 1));
+        if (probeRes.etag != "")
+            segReq.headers.emplace_back("If-Match", probeRes.etag);
+        segReq.parentAct = request.parentAct;
+        inFlight.emplace(enqueueFileTransfer(segReq), len);
+        offset += len;
+    };
+
+    for (unsigned int n = 0; n < segments; ++n)
+        enqueueNext();
+
+    while (!inFlight.empty()) {
+        checkInterrupt();
+        auto [fut, expected] = std::move(inFlight.front());
+        inFlight.pop();
+        auto res = fut.get();
+        enqueueNext();
+        if (!res.data || res.data->size() != expected)
+            throw nix::Error("server returned %d bytes instead of the requested %d while downloading '%s' in segments",
+                res.data ? res.data->size() : 0, expected, request.uri);
+        sink(*res.data);
+    }
+
+    probeRes.data.reset();
+    probeRes.bodySize = size;
+    return probeRes;
+}
+
+
+FileTransferResult FileTransfer::download(FileTransferRequest && request, Sink & sink)
 {
+    if (auto res = trySegmentedDownload(request, sink)) return std::move(*res);
+
     /* Note: we can't call 'sink' via request.dataCallback, because
        that would cause the sink to execute on the fileTransfer
        thread. If 'sink' is a coroutine, this will fail. Also, if the
@@ -783,6 +989,7 @@ void FileTransfer::download(FileTransferRequest && request, Sink & sink)
         bool quit = false;
         std::exception_ptr exc;
         std::string data;
+        FileTransferResult result;
         std::condition_variable avail, request;
     };
 
@@ -823,7 +1030,8 @@ void FileTransfer::download(FileTransferRequest && request, Sink & sink)
             auto state(_state->lock());
             state->quit = true;
             try {
-                fut.get();
+                state->result = fut.get();
+                state->result.data.reset();
             } catch (...) {
                 state->exc = std::current_exception();
             }
@@ -845,7 +1053,7 @@ void FileTransfer::download(FileTransferRequest && request, Sink & sink)
 
                 if (state->quit) {
                     if (state->exc) std::rethrow_exception(state->exc);
-                    return;
+                    return std::move(state->result);
                 }
 
                 state.wait(state->avail);
@@ -26,6 +26,24 @@ struct FileTransferSettings : Config
         )",
         {"binary-caches-parallel-connections"}};
 
+    Setting<size_t> httpConnectionsPerHost{
+        this, 0, "http-connections-per-host",
+        R"(
+          The maximum number of parallel TCP connections per host. With
+          HTTP/2 servers a small value (e.g. 2) forces requests such as
+          `.narinfo` probes to be multiplexed as concurrent streams
+          over a few connections instead of opening a connection per
+          request. 0 (the default) means no limit.
+        )"};
+
+    Setting<size_t> http2MaxStreams{
+        this, 100, "http2-max-streams",
+        R"(
+          The maximum number of concurrent HTTP/2 streams that Nix
+          will open over a single connection. The server may impose a
+          lower limit. 0 means libcurl's default.
+        )"};
+
     Setting<unsigned long> connectTimeout{
         this, 0, "connect-timeout",
         R"(
@@ -44,6 +62,26 @@ struct FileTransferSettings : Config
 
     Setting<unsigned int> tries{this, 5, "download-attempts",
         "How often Nix will attempt to download a file before giving up."};
+
+    Setting<unsigned int> downloadSegments{
+        this, 1, "download-segments",
+        R"(
+          The number of concurrent range requests used to download a
+          single large file (e.g. a NAR) from servers that support
+          byte ranges. 1 (the default) disables segmented downloading.
+          Segmentation helps when a single connection can't saturate
+          the available bandwidth, and a dropped connection only loses
+          the segment being transferred.
+        )"};
+
+    Setting<uint64_t> downloadSegmentSize{
+        this, 64 * 1024 * 1024, "download-segment-size",
+        R"(
+          The size in bytes of the segments used for segmented
+          downloads. Files smaller than twice this size are downloaded
+          over a single connection. Note that up to `download-segments`
+          segments are buffered in memory.
+        )"};
 };
 
 extern FileTransferSettings fileTransferSettings;
@@ -60,6 +98,12 @@ struct FileTransferRequest
     ActivityId parentAct;
     bool decompress = true;
     std::shared_ptr<std::string> data;
+    /* If set, the request body is streamed from this stream instead
+       of being held in memory in 'data'; 'dataStreamSize' must be its
+       total size. The stream must be seekable so the transfer can be
+       retried. */
+    std::shared_ptr<std::basic_iostream<char>> dataStream;
+    size_t dataStreamSize = 0;
     std::string mimeType;
     std::function<void(std::string_view data)> dataCallback;
 
@@ -68,7 +112,7 @@ struct FileTransferRequest
 
     std::string verb()
     {
-        return data ? "upload" : "download";
+        return data || dataStream ? "upload" : "download";
     }
 };
 
@@ -79,6 +123,11 @@ struct FileTransferResult
     std::string effectiveUri;
     std::shared_ptr<std::string> data;
     uint64_t bodySize = 0;
+    /* Whether the server advertised byte range support. */
+    bool acceptRanges = false;
+    /* The Content-Length header, if any. For a 'head' request this is
+       the size of the file. 0 if unknown. */
+    uint64_t contentLength = 0;
 };
 
 class Store;
@@ -102,8 +151,42 @@ struct FileTransfer
     FileTransferResult upload(const FileTransferRequest & request);
 
     /* Download a file, writing its data to a sink. The sink will be
-       invoked on the thread of the caller. */
-    void download(FileTransferRequest && request, Sink & sink);
+       invoked on the thread of the caller. The returned result has
+       'data' unset. */
+    FileTransferResult download(FileTransferRequest && request, Sink & sink);
+
+    /* Download a file using multiple concurrent range requests,
+       writing the segments to the sink in order. Returns nothing
+       (after transferring nothing) if segmented downloading is
+       disabled or the server doesn't support it. */
+    std::optional<FileTransferResult> trySegmentedDownload(const FileTransferRequest & request, Sink & sink);
+
+    /* Per-host transfer statistics, harvested from the curl timing
+       info of every completed request. Times are cumulative
+       seconds. */
+    struct HostStats
+    {
+        uint64_t requests = 0;
+        uint64_t succeeded = 0;
+        uint64_t failed = 0;
+        uint64_t retries = 0;
+        uint64_t bytesReceived = 0;
+        double dnsTime = 0;
+        double connectTime = 0; /* includes the TLS handshake */
+        double firstByteTime = 0;
+        double totalTime = 0;
+        /* Total request latency histogram: bucket n counts requests
+           that took less than 2^n milliseconds (the last bucket
+           counts the rest). */
+        constexpr static size_t nrLatencyBuckets = 16;
+        uint64_t latencyBuckets[nrLatencyBuckets] = {0};
+    };
+
+    virtual std::map<std::string, HostStats> getHostStats() { return {}; }
+
+    /* Log the per-host statistics, in JSON if the NIX_SHOW_STATS
+       convention asks for a machine-readable dump. */
+    void printHostStats();
 
     enum Error { NotFound, Forbidden, Misc, Transient, Interrupted };
 };
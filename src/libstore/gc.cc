@@ -3,6 +3,8 @@
 #include "local-store.hh"
 #include "local-fs-store.hh"
 #include "finally.hh"
+#include "thread-pool.hh"
+#include "tracepoints.hh"
 
 #include <functional>
 #include <queue>
@@ -80,60 +82,59 @@ Path LocalFSStore::addPermRoot(const StorePath & storePath, const Path & _gcRoot
 }
 
 
-void LocalStore::addTempRoot(const StorePath & path)
+/* Open and lock a fresh temporary roots file at 'path', retrying if
+   the garbage collector deletes it before we get the lock. */
+static AutoCloseFD createTempRootsFile(const Path & path)
 {
-    auto state(_state.lock());
-
-    /* Create the temporary roots file for this process. */
-    if (!state->fdTempRoots) {
-
-        while (1) {
-            if (pathExists(fnTempRoots))
-                /* It *must* be stale, since there can be no two
-                   processes with the same pid. */
-                unlink(fnTempRoots.c_str());
-
-            state->fdTempRoots = openLockFile(fnTempRoots, true);
+    while (1) {
+        if (pathExists(path))
+            /* It *must* be stale: the name contains our pid, and
+               there can be no two processes with the same pid. */
+            unlink(path.c_str());
 
-            debug("acquiring write lock on '%s'", fnTempRoots);
-            lockFile(state->fdTempRoots.get(), ltWrite, true);
+        AutoCloseFD fd = openLockFile(path, true);
 
-            /* Check whether the garbage collector didn't get in our
-               way. */
-            struct stat st;
-            if (fstat(state->fdTempRoots.get(), &st) == -1)
-                throw SysError("statting '%1%'", fnTempRoots);
-            if (st.st_size == 0) break;
+        debug("acquiring write lock on '%s'", path);
+        lockFile(fd.get(), ltWrite, true);
 
-            /* The garbage collector deleted this file before we could
-               get a lock.  (It won't delete the file after we get a
-               lock.)  Try again. */
-        }
+        /* Check whether the garbage collector didn't get in our
+           way. */
+        struct stat st;
+        if (fstat(fd.get(), &st) == -1)
+            throw SysError("statting '%1%'", path);
+        if (st.st_size == 0) return fd;
 
+        /* The garbage collector deleted this file before we could
+           get a lock.  (It won't delete the file after we get a
+           lock.)  Try again. */
     }
+}
 
-    if (!state->fdGCLock)
-        state->fdGCLock = openGCLock();
+
+void LocalStore::registerTempRoot(State & state, const StorePath & path, int fdTempRoots)
+{
+    if (!state.fdGCLock)
+        state.fdGCLock = openGCLock();
 
  restart:
-    FdLock gcLock(state->fdGCLock.get(), ltRead, false, "");
+    FdLock gcLock(state.fdGCLock.get(), ltRead, false, "");
 
     if (!gcLock.acquired) {
         /* We couldn't get a shared global GC lock, so the garbage
            collector is running. So we have to connect to the garbage
            collector and inform it about our root. */
-        if (!state->fdRootsSocket) {
+        if (!state.fdRootsSocket) {
             auto socketPath = stateDir.get() + gcSocketPath;
             debug("connecting to '%s'", socketPath);
-            state->fdRootsSocket = createUnixDomainSocket();
-            nix::connect(state->fdRootsSocket.get(), socketPath);
+            state.fdRootsSocket = createUnixDomainSocket();
+            nix::connect(state.fdRootsSocket.get(), socketPath);
         }
 
         try {
             debug("sending GC root '%s'", printStorePath(path));
-            writeFull(state->fdRootsSocket.get(), printStorePath(path) + "\n", false);
+            writeFull(state.fdRootsSocket.get(), printStorePath(path) + "\n", false);
             char c;
-            readFull(state->fdRootsSocket.get(), &c, 1);
+            readFull(state.fdRootsSocket.get(), &c, 1);
             assert(c == '1');
             debug("got ack for GC root '%s'", printStorePath(path));
         } catch (SysError & e) {
@@ -141,19 +142,60 @@ void LocalStore::addTempRoot(const StorePath & path)
                restart. */
             if (e.errNo == EPIPE) {
                 debug("GC socket disconnected");
-                state->fdRootsSocket.close();
+                state.fdRootsSocket.close();
                 goto restart;
             }
         } catch (EndOfFile & e) {
             debug("GC socket disconnected");
-            state->fdRootsSocket.close();
+            state.fdRootsSocket.close();
             goto restart;
         }
     }
 
     /* Append the store path to the temporary roots file. */
     string s = printStorePath(path) + '\0';
-    writeFull(state->fdTempRoots.get(), s);
+    writeFull(fdTempRoots, s);
+}
+
+
+void LocalStore::addTempRoot(const StorePath & path)
+{
+    auto state(_state.lock());
+
+    /* Create the temporary roots file for this process. */
+    if (!state->fdTempRoots)
+        state->fdTempRoots = createTempRootsFile(fnTempRoots);
+
+    registerTempRoot(*state, path, state->fdTempRoots.get());
+}
+
+
+std::shared_ptr<LocalStore::TempRootsScope> LocalStore::openTempRootsScope()
+{
+    static std::atomic<unsigned int> counter{0};
+
+    auto scope = std::make_shared<TempRootsScope>();
+    scope->path = fmt("%s/%d-%d", tempRootsDir, getpid(), counter++);
+    scope->fd = createTempRootsFile(scope->path);
+    return scope;
+}
+
+
+LocalStore::TempRootsScope::~TempRootsScope()
+{
+    try {
+        if (fd)
+            unlink(path.c_str());
+    } catch (...) {
+        ignoreException();
+    }
+}
+
+
+void LocalStore::addTempRoot(const StorePath & path, TempRootsScope & scope)
+{
+    auto state(_state.lock());
+    registerTempRoot(*state, path, scope.fd.get());
 }
 
 
@@ -226,8 +268,9 @@ void LocalStore::findRoots(const Path & path, unsigned char type, Roots & roots)
             type = getFileType(path);
 
         if (type == DT_DIR) {
-            for (auto & i : readDirectory(path))
-                findRoots(path + "/" + i.name, i.type, roots);
+            forEachDirEntry(path, [&](const DirEntryView & entry) {
+                findRoots(path + "/" + string(entry.name), entry.type, roots);
+            });
         }
 
         else if (type == DT_LNK) {
@@ -338,7 +381,9 @@ void LocalStore::findRuntimeRoots(Roots & roots, bool censor)
 {
     UncheckedRoots unchecked;
 
-    auto procDir = AutoCloseDir{opendir("/proc")};
+    auto procDir = settings.gcScanRuntimeRoots
+        ? AutoCloseDir{opendir("/proc")}
+        : AutoCloseDir{};
     if (procDir) {
         struct dirent * ent;
         auto digitsRegex = std::regex(R"(^\d+$)");
@@ -398,7 +443,7 @@ void LocalStore::findRuntimeRoots(Roots & roots, bool censor)
     // lsof is really slow on OS X. This actually causes the gc-concurrent.sh test to fail.
     // See: https://github.com/NixOS/nix/issues/3011
     // Because of this we disable lsof when running the tests.
-    if (getEnv("_NIX_TEST_NO_LSOF") != "1") {
+    if (settings.gcScanRuntimeRoots && getEnv("_NIX_TEST_NO_LSOF") != "1") {
         try {
             std::regex lsofRegex(R"(^n(/.*)$)");
             auto lsofLines =
@@ -444,6 +489,14 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
     bool gcKeepOutputs = settings.gcKeepOutputs;
     bool gcKeepDerivations = settings.gcKeepDerivations;
 
+    NIX_PROBE1(gc_start, (int) options.action);
+    Finally probeAtEnd([&]() { NIX_PROBE1(gc_done, results.bytesFreed); });
+
+    /* Signal both the start of the collection and (via Finally) its
+       end to generation watchers. */
+    if (shouldDelete) bumpStoreGeneration();
+    Finally bumpAtEnd([&]() { if (shouldDelete) bumpStoreGeneration(); });
+
     StorePathSet roots, dead, alive;
 
     struct Shared
@@ -590,9 +643,22 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
         roots.insert(root.first);
     }
 
-    /* Helper function that deletes a path from the store and throws
-       GCLimitReached if we've deleted enough garbage. */
-    auto deleteFromStore = [&](std::string_view baseName)
+    /* Pool for unlinking dead store paths from disk in parallel.
+       Database invalidation stays ordered on this thread; only the
+       filesystem deletion, which is independent between dead store
+       paths, is fanned out. */
+    ThreadPool deletePool;
+    std::atomic<uint64_t> bytesFreedAsync{0};
+    uint64_t bytesScheduled = 0;
+
+    /* Helper function that schedules deletion of a path from the
+       store and throws GCLimitReached if we've deleted enough
+       garbage. Paths with a recorded on-disk size are counted
+       towards the limit as soon as their deletion is scheduled, so
+       '--max-freed' doesn't overshoot while the deleter threads
+       lag behind. */
+    auto deleteFromStore = [&](std::string_view baseName,
+        std::optional<uint64_t> recordedSize = std::nullopt)
     {
         Path path = storeDir + "/" + std::string(baseName);
         Path realPath = realStoreDir + "/" + std::string(baseName);
@@ -601,11 +667,15 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
 
         results.paths.insert(path);
 
-        uint64_t bytesFreed;
-        deletePath(realPath, bytesFreed);
-        results.bytesFreed += bytesFreed;
+        deletePool.enqueue([realPath, &bytesFreedAsync]() {
+            uint64_t bytesFreed;
+            deletePath(realPath, bytesFreed);
+            bytesFreedAsync += bytesFreed;
+        });
+
+        if (recordedSize) bytesScheduled += *recordedSize;
 
-        if (results.bytesFreed > options.maxFreed) {
+        if (results.bytesFreed + std::max<uint64_t>(bytesScheduled, bytesFreedAsync) > options.maxFreed) {
             printInfo("deleted more than %d bytes; stopping", options.maxFreed);
             throw GCLimitReached();
         }
@@ -613,6 +683,15 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
 
     std::map<StorePath, StorePathSet> referrersCache;
 
+    /* A whole-store GC will ask for the referrers of essentially
+       every path anyway, and issuing one SQLite query per path
+       dominates the trace phase on big stores. Load the entire
+       referrer relation upfront in a single scan instead. */
+    if (options.action != GCOptions::gcDeleteSpecific) {
+        printInfo("loading referrer graph...");
+        queryAllReferrers(referrersCache);
+    }
+
     /* Helper function that visits all paths reachable from `start`
        via the referrers edges and optionally derivers and derivation
        output edges. If none of those paths are roots, then all
@@ -624,6 +703,13 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
         /* Wake up any GC client waiting for deletion of the paths in
            'visited' to finish. */
         Finally releasePending([&]() {
+            /* Make sure the paths are actually gone from disk before
+               clients are allowed to re-create them. */
+            try {
+                deletePool.process();
+            } catch (...) {
+                ignoreException();
+            }
             auto shared(_shared.lock());
             shared->pending.reset();
             wakeup.notify_all();
@@ -687,6 +773,10 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
                 /* Visit the referrers of this path. */
                 auto i = referrersCache.find(*path);
                 if (i == referrersCache.end()) {
+                    /* Valid paths without any referrers don't appear
+                       in the preloaded graph, and in the
+                       delete-specific case the graph isn't preloaded
+                       at all. */
                     StorePathSet referrers;
                     queryReferrers(*path, referrers);
                     referrersCache.emplace(*path, std::move(referrers));
@@ -717,8 +807,10 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
         for (auto & path : topoSortPaths(visited)) {
             if (!dead.insert(path).second) continue;
             if (shouldDelete) {
+                /* Fetch the recorded size before the row is gone. */
+                auto recordedSize = queryPathDiskSize(path);
                 invalidatePathChecked(path);
-                deleteFromStore(path.to_string());
+                deleteFromStore(path.to_string(), recordedSize);
                 referrersCache.erase(path);
             }
         }
@@ -744,9 +836,10 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
 
     } else if (options.maxFreed > 0) {
 
-        if (shouldDelete)
+        if (shouldDelete) {
+            NIX_PROBE(gc_deleting_garbage);
             printInfo("deleting garbage...");
-        else
+        } else
             printInfo("determining live/dead paths...");
 
         try {
@@ -774,6 +867,11 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
         }
     }
 
+    /* Wait for any remaining queued deletions to finish and account
+       for the space they freed. */
+    deletePool.process();
+    results.bytesFreed += bytesFreedAsync;
+
     if (options.action == GCOptions::gcReturnLive) {
         for (auto & i : alive)
             results.paths.insert(printStorePath(i));
@@ -792,6 +890,7 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
        might see a link count of 1 just before optimisePath() increases
        the link count. */
     if (options.action == GCOptions::gcDeleteDead || options.action == GCOptions::gcDeleteSpecific) {
+        NIX_PROBE(gc_deleting_unused_links);
         printInfo("deleting unused links...");
 
         AutoCloseDir dir(opendir(linksDir.c_str()));
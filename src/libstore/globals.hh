@@ -203,6 +203,18 @@ public:
           For the exact format and examples, see [the manual chapter on remote builds](../advanced-topics/distributed-builds.md)
         )"};
 
+    Setting<unsigned int> remoteMachineBackoff{
+        this, 60, "remote-machine-backoff",
+        R"(
+          How long (in seconds) `build-remote` avoids dispatching to a
+          build machine after a failed connection attempt. The delay
+          doubles with every consecutive failure, up to 64 times this
+          value. The failure state is persisted across invocations, so
+          a new build does not pay a connection timeout for a machine
+          that was recently found to be unreachable. Set to `0` to
+          disable.
+        )"};
+
     Setting<bool> buildersUseSubstitutes{
         this, false, "builders-use-substitutes",
         R"(
@@ -230,6 +242,36 @@ public:
     Setting<bool> useSQLiteWAL{this, !isWSL1(), "use-sqlite-wal",
         "Whether SQLite should use WAL mode."};
 
+    Setting<uint64_t> sqlitePageSize{this, 0, "sqlite-page-size",
+        R"(
+          The SQLite page size (in bytes) for the Nix database. On an
+          existing database this takes effect the next time the
+          database is vacuumed. `0` (the default) keeps SQLite's
+          default.
+        )"};
+
+    Setting<uint64_t> sqliteCacheSize{this, 0, "sqlite-cache-size",
+        R"(
+          The size (in KiB) of the page cache of each connection to
+          the Nix database. `0` (the default) keeps SQLite's default.
+        )"};
+
+    Setting<uint64_t> sqliteMmapSize{this, 0, "sqlite-mmap-size",
+        R"(
+          If non-zero, serve reads of the Nix database through a
+          memory map of up to this many bytes instead of `read()`
+          system calls.
+        )"};
+
+    Setting<uint64_t> sqliteOptimizeInterval{this, 100000, "sqlite-optimize-interval",
+        R"(
+          Refresh the query planner statistics of the Nix database
+          (`PRAGMA optimize`) and reclaim free pages after this many
+          registered or deleted store paths. This keeps query plans
+          from degrading as the database ages. `0` disables the
+          periodic maintenance.
+        )"};
+
     Setting<bool> syncBeforeRegistering{this, false, "sync-before-registering",
         "Whether to call `sync()` before registering a path as valid."};
 
@@ -294,8 +336,10 @@ public:
         this, true, "compress-build-log",
         R"(
           If set to `true` (the default), build logs written to
-          `/nix/var/log/nix/drvs` will be compressed on the fly using bzip2.
-          Otherwise, they will not be compressed.
+          `/nix/var/log/nix/drvs` will be compressed on the fly using
+          zstd, in a seekable format that allows the tail of a log to
+          be retrieved without decompressing all of it. Otherwise,
+          they will not be compressed.
         )",
         {"build-compress-log"}};
 
@@ -348,6 +392,24 @@ public:
         )",
         {"gc-keep-derivations"}};
 
+    Setting<bool> gcScanRuntimeRoots{
+        this, true, "gc-scan-runtime-roots",
+        R"(
+          If `true` (default), the garbage collector scans the file
+          descriptor tables, memory maps and environments of all running
+          processes (via `/proc` on Linux, `lsof` elsewhere) to find store
+          paths that are in use but not registered as roots.
+
+          This scan is a safety net for processes that use store paths
+          without telling Nix about them, but on machines with many
+          processes it can dominate the time the garbage collector holds
+          the GC lock. Processes started by Nix register their roots
+          explicitly through the temporary-roots mechanism, so if all
+          store-path consumers on a machine do so (e.g. dedicated build
+          hosts), the scan can be turned off to make GC pauses
+          independent of system load.
+        )"};
+
     Setting<bool> autoOptimiseStore{
         this, false, "auto-optimise-store",
         R"(
@@ -358,6 +420,19 @@ public:
           duplicate files.
         )"};
 
+    Setting<bool> useReflinks{
+        this, false, "use-reflinks",
+        R"(
+          If set to `true`, store optimisation deduplicates files by
+          sharing their data extents (reflinks, i.e. `FICLONE` on
+          Linux) instead of replacing them with hard links to a single
+          copy. Every file keeps its own inode, which avoids the
+          maximum hard-link count and suits filesystems such as btrfs
+          and XFS that support copy-on-write data sharing. On
+          filesystems without reflink support Nix falls back to hard
+          links.
+        )"};
+
     Setting<bool> envKeepDerivations{
         this, false, "keep-env-derivations",
         R"(
@@ -436,6 +511,21 @@ public:
     Setting<bool> sandboxFallback{this, true, "sandbox-fallback",
         "Whether to disable sandboxing when the kernel doesn't allow it."};
 
+    Setting<size_t> sandboxPoolSize{
+        this, 0, "sandbox-pool-size",
+        R"(
+          (Linux only) The maximum number of sandbox skeleton
+          directories to keep around for re-use by later builds.
+          Normally the chroot directory of a build is deleted when the
+          build finishes and recreated from scratch for the next one.
+          With a non-zero pool size, up to this many used chroots are
+          instead scrubbed back to a pristine skeleton on a background
+          thread and claimed by subsequent builds with a cheap rename,
+          taking most of the sandbox setup and teardown off the
+          critical path. This mainly helps workloads consisting of
+          many small derivations.
+        )"};
+
     Setting<size_t> buildRepeat{
         this, 0, "repeat",
         R"(
@@ -461,6 +551,30 @@ public:
 
     Setting<Path> sandboxBuildDir{this, "/build", "sandbox-build-dir",
         "The build directory inside the sandbox."};
+
+    Setting<std::string> sandboxBuildDirSize{
+        this, "50%", "sandbox-build-dir-size",
+        R"(
+          The maximum size of the `tmpfs` filesystem mounted on the build
+          directory of derivations that request the `tmpfs-build-dir`
+          system feature. A derivation can override it with its
+          `tmpfsBuildDirSize` attribute. For the format, see the
+          description of the `size` option of `tmpfs` in mount8. The
+          default is `50%`.
+        )"};
+
+    Setting<bool> useCgroups{
+        this, false, "use-cgroups",
+        R"(
+          Whether to run each build in its own cgroup (requires a
+          cgroup v2 hierarchy delegated to the Nix daemon). All build
+          cgroups get an equal `cpu.weight`, so the kernel gives a lone
+          build the whole machine and divides the CPUs fairly between
+          however many builds are running, instead of every build being
+          statically limited by `cores`. With `cores = 0`,
+          `NIX_BUILD_CORES` is set to the build's fair share of the CPUs
+          at the time it starts.
+        )"};
 #endif
 
     Setting<PathSet> allowedImpureHostPrefixes{this, {}, "allowed-impure-host-deps",
@@ -481,6 +595,17 @@ public:
           line.
         )"};
 
+    Setting<Path> buildTraceFile{
+        this, "", "trace-file",
+        R"(
+          If set, write a Chrome trace-event JSON file describing the
+          build schedule to this path: one track per build or
+          substitution slot, with spans for running goals, time spent
+          waiting for a build slot, and post-build steps such as
+          output registration. The file can be loaded into
+          `chrome://tracing` or <https://ui.perfetto.dev/>.
+        )"};
+
     PathSetting diffHook{
         this, true, "", "diff-hook",
         R"(
@@ -566,9 +691,9 @@ public:
           to `false` to disable signature checking.
         )"};
 
-    Setting<StringSet> extraPlatforms{
+    LazySetting<StringSet> extraPlatforms{
         this,
-        getDefaultExtraPlatforms(),
+        [this]() { return getDefaultExtraPlatforms(); },
         "extra-platforms",
         R"(
           Platforms other than the native one which this machine is capable of
@@ -585,8 +710,8 @@ public:
           natively-built versions of your derivations.
         )"};
 
-    Setting<StringSet> systemFeatures{
-        this, getDefaultSystemFeatures(),
+    LazySetting<StringSet> systemFeatures{
+        this, [this]() { return getDefaultSystemFeatures(); },
         "system-features",
         R"(
           A set of system “features” supported by this machine, e.g. `kvm`.
@@ -667,6 +792,16 @@ public:
           mismatch if the build isn't reproducible.
         )"};
 
+    Setting<unsigned int> copyAttempts{
+        this, 3, "copy-attempts",
+        R"(
+          How many times to attempt copying a set of store paths before
+          giving up. Between attempts the destination is re-queried, so
+          paths that were copied completely before a transient failure
+          (e.g. a dropped connection halfway through a large closure)
+          are not transferred again.
+        )"};
+
     /* ?Who we trust to use the daemon in safe ways */
     Setting<Strings> allowedUsers{
         this, {"*"}, "allowed-users",
@@ -679,6 +814,29 @@ public:
           Note that trusted users are always allowed to connect.
         )"};
 
+    Setting<unsigned int> daemonOpsPerSecond{
+        this, 0, "daemon-ops-per-second",
+        R"(
+          The maximum number of worker protocol operations per second that
+          an untrusted client may issue over a single daemon connection.
+          A client exceeding the limit is paced by delaying its next
+          operation, which keeps one misbehaving client from starving
+          others on a shared daemon. Trusted users are exempt. `0` (the
+          default) disables the limit.
+        )"};
+
+    Setting<unsigned int> daemonHeavyOpConcurrency{
+        this, 0, "daemon-heavy-op-concurrency",
+        R"(
+          The maximum number of expensive worker protocol operations
+          (garbage collection, imports, store verification, closure
+          queries) that daemon connections may run concurrently. Further
+          such operations wait for a slot, while cheap operations from
+          other connections proceed unhindered. Only effective when the
+          daemon serves connections from a single process (`nix daemon
+          --threaded`). `0` (the default) disables the limit.
+        )"};
+
     Setting<bool> printMissing{this, true, "print-missing",
         "Whether to print what paths need to be built or downloaded."};
 
@@ -842,6 +1000,27 @@ public:
     Setting<uint64_t> minFreeCheckInterval{this, 5, "min-free-check-interval",
         "Number of seconds between checking free disk space."};
 
+    Setting<bool> sshSharedConnections{
+        this, false, "ssh-shared-connections",
+        R"(
+          If set to `true`, SSH connections to remote stores and build
+          machines use a persistent control socket in
+          `$XDG_CACHE_HOME/nix/ssh`, so that all Nix store instances and
+          processes talking to the same host share one SSH connection
+          instead of each paying the handshake cost. The connection is
+          kept alive for `ssh-connection-keep-alive` seconds after the
+          last user exits.
+        )"};
+
+    Setting<unsigned int> sshConnectionKeepAlive{
+        this, 600, "ssh-connection-keep-alive",
+        R"(
+          How many seconds an idle shared SSH connection (see
+          `ssh-shared-connections`) is kept alive after its last user
+          has exited. Setting this to `0` keeps the connection open
+          indefinitely.
+        )"};
+
     PluginFilesSetting pluginFiles{
         this, {}, "plugin-files",
         R"(
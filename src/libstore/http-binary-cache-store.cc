@@ -126,7 +126,19 @@ protected:
         const std::string & mimeType) override
     {
         auto req = makeRequest(path);
-        req.data = std::make_shared<string>(StreamToSourceAdapter(istream).drain());
+        /* If the stream is seekable (e.g. a compressed NAR spooled to
+           a temporary file), stream the upload instead of reading the
+           whole body into memory first. */
+        istream->seekg(0, std::ios_base::end);
+        auto size = istream->tellg();
+        if (size >= 0) {
+            istream->seekg(0);
+            req.dataStream = istream;
+            req.dataStreamSize = size;
+        } else {
+            istream->clear();
+            req.data = std::make_shared<string>(StreamToSourceAdapter(istream).drain());
+        }
         req.mimeType = mimeType;
         try {
             getFileTransfer()->upload(req);
@@ -158,6 +170,35 @@ protected:
         }
     }
 
+    bool supportsFileRanges() override
+    { return true; }
+
+    std::optional<std::string> getFileRange(const std::string & path,
+        uint64_t offset, uint64_t size) override
+    {
+        checkEnabled();
+        auto request(makeRequest(path));
+        request.headers.emplace_back("Range",
+            fmt("bytes=%d-%d", offset, offset + size - 1));
+        try {
+            auto result = getFileTransfer()->download(request);
+            if (!result.data) return std::nullopt;
+            /* A server that ignores the Range header replies with the
+               whole file; slice out the part we asked for. */
+            if (result.data->size() > size) {
+                if (result.data->size() < offset + size) return std::nullopt;
+                return result.data->substr(offset, size);
+            }
+            if (result.data->size() != size) return std::nullopt;
+            return std::move(*result.data);
+        } catch (FileTransferError & e) {
+            if (e.error == FileTransfer::NotFound || e.error == FileTransfer::Forbidden)
+                throw NoSuchBinaryCacheFile("file '%s' does not exist in binary cache '%s'", path, getUri());
+            maybeDisable();
+            throw;
+        }
+    }
+
     void getFile(const std::string & path,
         Callback<std::shared_ptr<std::string>> callback) noexcept override
     {
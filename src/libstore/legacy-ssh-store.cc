@@ -1,4 +1,5 @@
 #include "archive.hh"
+#include "compression.hh"
 #include "pool.hh"
 #include "remote-store.hh"
 #include "serve-protocol.hh"
@@ -20,6 +21,8 @@ struct LegacySSHStoreConfig : virtual StoreConfig
     const Setting<bool> compress{(StoreConfig*) this, false, "compress", "whether to compress the connection"};
     const Setting<Path> remoteProgram{(StoreConfig*) this, "nix-store", "remote-program", "path to the nix-store executable on the remote system"};
     const Setting<std::string> remoteStore{(StoreConfig*) this, "", "remote-store", "URI of the store on the remote system"};
+    const Setting<std::string> narCompression{(StoreConfig*) this, "zstd", "nar-compression",
+        "compression method for NAR transfers ('zstd', 'xz', 'gzip', 'none'); only used when the remote side is recent enough"};
 
     const std::string name() override { return "Legacy SSH Store"; }
 };
@@ -179,7 +182,20 @@ struct LegacySSHStore : public virtual LegacySSHStoreConfig, public virtual Stor
                 << info.sigs
                 << renderContentAddress(info.ca);
             try {
-                copyNAR(source, conn->to);
+                if (GET_PROTOCOL_MINOR(conn->remoteVersion) >= 9) {
+                    /* NAR contents are highly compressible, so on WAN
+                       links compressing them is a big win. The
+                       compressed stream is framed so that the
+                       connection stays in a known state afterwards. */
+                    conn->to << narCompression.get();
+                    std::exception_ptr ex;
+                    FramedSink framedSink(conn->to, ex);
+                    auto compressionSink = makeCompressionSink(narCompression, framedSink);
+                    copyNAR(source, *compressionSink);
+                    compressionSink->finish();
+                    framedSink.flush();
+                } else
+                    copyNAR(source, conn->to);
             } catch (...) {
                 conn->good = false;
                 throw;
@@ -218,8 +234,17 @@ struct LegacySSHStore : public virtual LegacySSHStoreConfig, public virtual Stor
         auto conn(connections->get());
 
         conn->to << cmdDumpStorePath << printStorePath(path);
-        conn->to.flush();
-        copyNAR(conn->from, sink);
+        if (GET_PROTOCOL_MINOR(conn->remoteVersion) >= 9) {
+            conn->to << narCompression.get();
+            conn->to.flush();
+            FramedSource framedSource(conn->from);
+            auto decompressionSink = makeDecompressionSink(narCompression, sink, true);
+            framedSource.drainInto(*decompressionSink);
+            decompressionSink->finish();
+        } else {
+            conn->to.flush();
+            copyNAR(conn->from, sink);
+        }
     }
 
     std::optional<StorePath> queryPathFromHashPart(const std::string & hashPart) override
@@ -367,6 +392,21 @@ public:
         return conn->remoteVersion;
     }
 
+    std::optional<std::pair<uint64_t, uint64_t>> queryBuildLoad() override
+    {
+        auto conn(connections->get());
+
+        if (GET_PROTOCOL_MINOR(conn->remoteVersion) < 8)
+            return std::nullopt;
+
+        conn->to << cmdQueryLoad;
+        conn->to.flush();
+
+        uint64_t maxJobs = readInt(conn->from);
+        uint64_t load100 = readInt(conn->from);
+        return {{maxJobs, load100}};
+    }
+
     void queryRealisationUncached(const DrvOutput &,
         Callback<std::shared_ptr<const Realisation>> callback) noexcept override
     // TODO: Implement
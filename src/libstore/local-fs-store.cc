@@ -3,9 +3,13 @@
 #include "store-api.hh"
 #include "local-fs-store.hh"
 #include "globals.hh"
+#include "build-log.hh"
 #include "compression.hh"
 #include "derivations.hh"
 
+#include <fcntl.h>
+#include <sys/stat.h>
+
 namespace nix {
 
 LocalFSStore::LocalFSStore(const Params & params)
@@ -112,10 +116,17 @@ std::shared_ptr<std::string> LocalFSStore::getBuildLog(const StorePath & path_)
             ? fmt("%s/%s/%s/%s", logDir, drvsLogDir, string(baseName, 0, 2), string(baseName, 2))
             : fmt("%s/%s/%s", logDir, drvsLogDir, baseName);
         Path logBz2Path = logPath + ".bz2";
+        Path logZstPath = logPath + ".zst";
 
         if (pathExists(logPath))
             return std::make_shared<std::string>(readFile(logPath));
 
+        else if (pathExists(logZstPath)) {
+            try {
+                return decompress("zstd", readFile(logZstPath));
+            } catch (Error &) { }
+        }
+
         else if (pathExists(logBz2Path)) {
             try {
                 return decompress("bzip2", readFile(logBz2Path));
@@ -127,4 +138,54 @@ std::shared_ptr<std::string> LocalFSStore::getBuildLog(const StorePath & path_)
     return nullptr;
 }
 
+std::shared_ptr<std::string> LocalFSStore::getBuildLogTail(const StorePath & path_, size_t bytes)
+{
+    auto path = path_;
+
+    if (!path.isDerivation()) {
+        try {
+            auto info = queryPathInfo(path);
+            if (!info->deriver) return nullptr;
+            path = *info->deriver;
+        } catch (InvalidPath &) {
+            return nullptr;
+        }
+    }
+
+    auto baseName = std::string(baseNameOf(printStorePath(path)));
+
+    for (int j = 0; j < 2; j++) {
+
+        Path logPath =
+            j == 0
+            ? fmt("%s/%s/%s/%s", logDir, drvsLogDir, string(baseName, 0, 2), string(baseName, 2))
+            : fmt("%s/%s/%s", logDir, drvsLogDir, baseName);
+        Path logZstPath = logPath + ".zst";
+
+        if (pathExists(logZstPath)) {
+            try {
+                if (auto tail = readCompressedLogTail(logZstPath, bytes))
+                    return std::make_shared<std::string>(std::move(*tail));
+            } catch (Error &) { }
+        }
+
+        else if (pathExists(logPath)) {
+            /* Uncompressed logs support cheap tails directly. */
+            AutoCloseFD fd = open(logPath.c_str(), O_RDONLY | O_CLOEXEC);
+            if (!fd) continue;
+            struct stat st;
+            if (fstat(fd.get(), &st)) continue;
+            if ((uint64_t) st.st_size > bytes
+                && lseek(fd.get(), st.st_size - bytes, SEEK_SET) == -1)
+                continue;
+            return std::make_shared<std::string>(drainFD(fd.get()));
+        }
+
+    }
+
+    /* Fall back to decompressing the whole log (e.g. old bzip2 logs
+       or zstd logs without an index). */
+    return Store::getBuildLogTail(path_, bytes);
+}
+
 }
@@ -46,6 +46,8 @@ public:
     }
 
     std::shared_ptr<std::string> getBuildLog(const StorePath & path) override;
+
+    std::shared_ptr<std::string> getBuildLogTail(const StorePath & path, size_t bytes) override;
 };
 
 }
@@ -8,10 +8,13 @@
 #include "references.hh"
 #include "callback.hh"
 #include "topo-sort.hh"
+#include "path-info-cache.hh"
+#include "thread-pool.hh"
 
 #include <iostream>
 #include <algorithm>
 #include <cstring>
+#include <thread>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -50,6 +53,15 @@ struct LocalStore::State::Stmts {
     SQLiteStmt QueryPathInfo;
     SQLiteStmt QueryReferences;
     SQLiteStmt QueryReferrers;
+    SQLiteStmt QueryReferrersClosure;
+    SQLiteStmt QueryLastVerified;
+    SQLiteStmt UpdateLastVerified;
+    SQLiteStmt QueryDiskSize;
+    SQLiteStmt UpdateDiskSize;
+    SQLiteStmt QueryTotalDiskSize;
+    SQLiteStmt AddBuildStats;
+    SQLiteStmt QueryLastOutputHashes;
+    SQLiteStmt UpdateBuildOutputHashes;
     SQLiteStmt InvalidatePath;
     SQLiteStmt AddDerivationOutput;
     SQLiteStmt RegisterRealisedOutput;
@@ -58,7 +70,6 @@ struct LocalStore::State::Stmts {
     SQLiteStmt QueryDerivationOutputs;
     SQLiteStmt QueryRealisedOutput;
     SQLiteStmt QueryAllRealisedOutputs;
-    SQLiteStmt QueryPathFromHashPart;
     SQLiteStmt QueryValidPaths;
     SQLiteStmt QueryRealisationReferences;
     SQLiteStmt AddRealisationReference;
@@ -301,6 +312,52 @@ LocalStore::LocalStore(const Params & params)
             txn.commit();
         }
 
+        if (curSchema < 11) {
+            /* Widen the reverse index so that referrer queries can
+               be answered from the index alone. */
+            SQLiteTxn txn(state->db);
+            state->db.exec("drop index if exists IndexReference");
+            state->db.exec("create index if not exists IndexReference on Refs(reference, referrer)");
+            txn.commit();
+        }
+
+        if (curSchema < 12) {
+            SQLiteTxn txn(state->db);
+            state->db.exec(
+                "create table if not exists LastContentsVerified ("
+                "    path integer primary key,"
+                "    time integer not null,"
+                "    foreign key (path) references ValidPaths(id) on delete cascade"
+                ")");
+            txn.commit();
+        }
+
+        if (curSchema < 13) {
+            SQLiteTxn txn(state->db);
+            state->db.exec(
+                "create table if not exists BuildStats ("
+                "    name     text not null,"
+                "    time     integer not null,"
+                "    wallTime integer not null,"
+                "    cpuTime  integer,"
+                "    peakRSS  integer"
+                ");"
+                "create index if not exists IndexBuildStats on BuildStats(name);");
+            txn.commit();
+        }
+
+        if (curSchema < 14) {
+            SQLiteTxn txn(state->db);
+            state->db.exec("alter table ValidPaths add column diskSize integer");
+            txn.commit();
+        }
+
+        if (curSchema < 15) {
+            SQLiteTxn txn(state->db);
+            state->db.exec("alter table BuildStats add column outputHashes text");
+            txn.commit();
+        }
+
         writeFile(schemaPath, (format("%1%") % nixSchemaVersion).str());
 
         lockFile(globalLock.get(), ltRead, true);
@@ -312,11 +369,25 @@ LocalStore::LocalStore(const Params & params)
         migrateCASchema(state->db, dbDir + "/ca-schema", globalLock);
     }
 
+    /* With WAL mode, readers don't block the writer, so open a pool
+       of read-only connections for the hot metadata queries. */
+    if (settings.useSQLiteWAL)
+        readConnPool = std::make_shared<Pool<State>>(
+            std::max(4U, std::thread::hardware_concurrency()),
+            [this]() { return openReadConn(); });
+
+    if (sharedPathInfoCache)
+        try {
+            pathInfoCacheFile = std::make_shared<SharedPathInfoCache>(dbDir + "/path-info-cache");
+        } catch (...) {
+            ignoreException();
+        }
+
     /* Prepare SQL statements. */
     state->stmts->RegisterValidPath.create(state->db,
-        "insert into ValidPaths (path, hash, registrationTime, deriver, narSize, ultimate, sigs, ca) values (?, ?, ?, ?, ?, ?, ?, ?);");
+        "insert into ValidPaths (path, hash, registrationTime, deriver, narSize, ultimate, sigs, ca, diskSize) values (?, ?, ?, ?, ?, ?, ?, ?, ?);");
     state->stmts->UpdatePathInfo.create(state->db,
-        "update ValidPaths set narSize = ?, hash = ?, ultimate = ?, sigs = ?, ca = ? where path = ?;");
+        "update ValidPaths set narSize = ?, hash = ?, ultimate = ?, sigs = ?, ca = ?, diskSize = ? where path = ?;");
     state->stmts->AddReference.create(state->db,
         "insert or replace into Refs (referrer, reference) values (?, ?);");
     state->stmts->QueryPathInfo.create(state->db,
@@ -325,6 +396,28 @@ LocalStore::LocalStore(const Params & params)
         "select path from Refs join ValidPaths on reference = id where referrer = ?;");
     state->stmts->QueryReferrers.create(state->db,
         "select path from Refs join ValidPaths on referrer = id where reference = (select id from ValidPaths where path = ?);");
+    state->stmts->QueryReferrersClosure.create(state->db,
+        "with recursive closure(id) as ("
+        "  select id from ValidPaths where path = ?"
+        "  union"
+        "  select referrer from Refs join closure on reference = closure.id) "
+        "select path from ValidPaths join closure on ValidPaths.id = closure.id;");
+    state->stmts->QueryLastVerified.create(state->db,
+        "select time from LastContentsVerified join ValidPaths on ValidPaths.id = LastContentsVerified.path where ValidPaths.path = ?;");
+    state->stmts->UpdateLastVerified.create(state->db,
+        "insert or replace into LastContentsVerified (path, time) select id, ? from ValidPaths where path = ?;");
+    state->stmts->QueryDiskSize.create(state->db,
+        "select diskSize from ValidPaths where path = ?;");
+    state->stmts->UpdateDiskSize.create(state->db,
+        "update ValidPaths set diskSize = ? where path = ?;");
+    state->stmts->QueryTotalDiskSize.create(state->db,
+        "select sum(coalesce(diskSize, narSize, 0)) from ValidPaths;");
+    state->stmts->AddBuildStats.create(state->db,
+        "insert into BuildStats (name, time, wallTime, cpuTime, peakRSS) values (?, ?, ?, ?, ?);");
+    state->stmts->QueryLastOutputHashes.create(state->db,
+        "select outputHashes from BuildStats where name = ? and outputHashes is not null order by rowid desc limit 1;");
+    state->stmts->UpdateBuildOutputHashes.create(state->db,
+        "update BuildStats set outputHashes = ? where rowid = (select max(rowid) from BuildStats where name = ?);");
     state->stmts->InvalidatePath.create(state->db,
         "delete from ValidPaths where path = ?;");
     state->stmts->AddDerivationOutput.create(state->db,
@@ -333,10 +426,6 @@ LocalStore::LocalStore(const Params & params)
         "select v.id, v.path from DerivationOutputs d join ValidPaths v on d.drv = v.id where d.path = ?;");
     state->stmts->QueryDerivationOutputs.create(state->db,
         "select id, path from DerivationOutputs where drv = ?;");
-    // Use "path >= ?" with limit 1 rather than "path like '?%'" to
-    // ensure efficient lookup.
-    state->stmts->QueryPathFromHashPart.create(state->db,
-        "select path from ValidPaths where path >= ? limit 1;");
     state->stmts->QueryValidPaths.create(state->db, "select path from ValidPaths");
     if (settings.isExperimentalFeatureEnabled(Xp::CaDerivations)) {
         state->stmts->RegisterRealisedOutput.create(state->db,
@@ -416,6 +505,15 @@ LocalStore::~LocalStore()
             state->fdTempRoots = -1;
             unlink(fnTempRoots.c_str());
         }
+
+        /* Per the SQLite recommendation, refresh the query planner
+           statistics when closing a connection that may have written
+           a lot. Best-effort, and with a short busy timeout so that a
+           concurrent writer can't hold up our exit. */
+        if (state->db) {
+            sqlite3_busy_timeout(state->db, 100);
+            sqlite3_exec(state->db, "pragma optimize;", 0, 0, 0);
+        }
     } catch (...) {
         ignoreException();
     }
@@ -482,6 +580,14 @@ void LocalStore::openDB(State & state, bool create)
     if (mode == "wal" && sqlite3_exec(db, "pragma wal_autocheckpoint = 40000;", 0, 0, 0) != SQLITE_OK)
         throwSQLiteError(db, "setting autocheckpoint interval");
 
+    db.tune();
+
+    /* Use incremental auto-vacuum so that the periodic maintenance
+       below can return free pages to the file system without the
+       cost of a full vacuum. On an existing database this only takes
+       effect after the next full vacuum. */
+    db.exec("pragma auto_vacuum = incremental");
+
     /* Initialise the database schema, if necessary. */
     if (create) {
         static const char schema[] =
@@ -492,6 +598,26 @@ void LocalStore::openDB(State & state, bool create)
 }
 
 
+ref<LocalStore::State> LocalStore::openReadConn()
+{
+    auto conn = make_ref<State>();
+    conn->db = SQLite(dbDir + "/db.sqlite", false, true);
+    conn->db.tune();
+    conn->stmts = std::make_unique<State::Stmts>();
+
+    /* Only the statements used by the read paths below; everything
+       else goes through the writer connection. */
+    conn->stmts->QueryPathInfo.create(conn->db,
+        "select id, hash, registrationTime, deriver, narSize, ultimate, sigs, ca from ValidPaths where path = ?;");
+    conn->stmts->QueryReferences.create(conn->db,
+        "select path from Refs join ValidPaths on reference = id where referrer = ?;");
+    conn->stmts->QueryReferrers.create(conn->db,
+        "select path from Refs join ValidPaths on referrer = id where reference = (select id from ValidPaths where path = ?);");
+
+    return conn;
+}
+
+
 /* To improve purity, users may want to make the Nix store a read-only
    bind mount.  So make the Nix store writable for this process. */
 void LocalStore::makeStoreWritable()
@@ -555,7 +681,10 @@ void canonicaliseTimestampAndPermissions(const Path & path)
 }
 
 
-static void canonicalisePathMetaData_(const Path & path, uid_t fromUid, InodesSeen & inodesSeen)
+/* Canonicalise a single inode. Returns its stat, so that the caller
+   can recurse into directories, or std::nullopt if the inode is a
+   hard link to one that has already been handled. */
+static std::optional<struct stat> canonicaliseNode(const Path & path, uid_t fromUid, const InodesSeen & inodesSeen)
 {
     checkInterrupt();
 
@@ -609,11 +738,9 @@ static void canonicalisePathMetaData_(const Path & path, uid_t fromUid, InodesSe
             throw BuildError("invalid ownership on file '%1%'", path);
         mode_t mode = st.st_mode & ~S_IFMT;
         assert(S_ISLNK(st.st_mode) || (st.st_uid == geteuid() && (mode == 0444 || mode == 0555) && st.st_mtime == mtimeStore));
-        return;
+        return std::nullopt;
     }
 
-    inodesSeen.insert(Inode(st.st_dev, st.st_ino));
-
     canonicaliseTimestampAndPermissions(path, st);
 
     /* Change ownership to the current uid.  If it's a symlink, use
@@ -634,7 +761,18 @@ static void canonicalisePathMetaData_(const Path & path, uid_t fromUid, InodesSe
                 path, geteuid());
     }
 
-    if (S_ISDIR(st.st_mode)) {
+    return st;
+}
+
+
+static void canonicalisePathMetaData_(const Path & path, uid_t fromUid, InodesSeen & inodesSeen)
+{
+    auto st = canonicaliseNode(path, fromUid, inodesSeen);
+    if (!st) return;
+
+    inodesSeen.insert(Inode(st->st_dev, st->st_ino));
+
+    if (S_ISDIR(st->st_mode)) {
         DirEntries entries = readDirectory(path);
         for (auto & i : entries)
             canonicalisePathMetaData_(path + "/" + i.name, fromUid, inodesSeen);
@@ -644,7 +782,30 @@ static void canonicalisePathMetaData_(const Path & path, uid_t fromUid, InodesSe
 
 void canonicalisePathMetaData(const Path & path, uid_t fromUid, InodesSeen & inodesSeen)
 {
-    canonicalisePathMetaData_(path, fromUid, inodesSeen);
+    if (fromUid == (uid_t) -1) {
+        /* Without a build user there are no ownership checks, so the
+           subtrees can be canonicalised in any order; fan them out on
+           a thread pool, since for large trees this walk is one long
+           chain of per-inode syscalls. */
+        ThreadPool pool;
+        std::mutex seenMutex;
+
+        std::function<void(const Path &)> doPath = [&](const Path & p) {
+            auto st = canonicaliseNode(p, fromUid, inodesSeen);
+            if (!st) return;
+            {
+                std::lock_guard<std::mutex> lock(seenMutex);
+                inodesSeen.insert(Inode(st->st_dev, st->st_ino));
+            }
+            if (S_ISDIR(st->st_mode))
+                for (auto & i : readDirectory(p))
+                    pool.enqueue(std::bind(doPath, p + "/" + i.name));
+        };
+
+        pool.enqueue(std::bind(doPath, path));
+        pool.process();
+    } else
+        canonicalisePathMetaData_(path, fromUid, inodesSeen);
 
     /* On platforms that don't have lchown(), the top-level path can't
        be a symlink, since we can't change its ownership. */
@@ -773,6 +934,8 @@ void LocalStore::registerDrvOutput(const Realisation & info)
                 .exec();
         }
     });
+
+    bumpStoreGeneration();
 }
 
 void LocalStore::cacheDrvOutputMapping(State & state, const uint64_t deriver, const string & outputName, const StorePath & output)
@@ -788,6 +951,24 @@ void LocalStore::cacheDrvOutputMapping(State & state, const uint64_t deriver, co
 }
 
 
+/* Compute the number of bytes 'path' occupies on disk. Regular files
+   with multiple hard links are shared with other store paths through
+   the .links directory, so charge each link an equal fraction of the
+   file's blocks; summed over all store paths this approximates the
+   store's actual disk usage. */
+static uint64_t measureDiskSize(const Path & path)
+{
+    auto st = lstat(path);
+    uint64_t size = (uint64_t) st.st_blocks * 512;
+    if (S_ISREG(st.st_mode) && st.st_nlink > 1)
+        size /= st.st_nlink;
+    if (S_ISDIR(st.st_mode))
+        for (auto & i : readDirectory(path))
+            size += measureDiskSize(path + "/" + i.name);
+    return size;
+}
+
+
 uint64_t LocalStore::addValidPath(State & state,
     const ValidPathInfo & info, bool checkOutputs)
 {
@@ -795,6 +976,15 @@ uint64_t LocalStore::addValidPath(State & state,
         throw Error("cannot add path '%s' to the Nix store because it claims to be content-addressed but isn't",
             printStorePath(info.path));
 
+    /* The contents are normally on disk by the time a path is
+       registered, and still hot in the page cache; but e.g.
+       '--load-db' registers paths whose contents may be absent. */
+    uint64_t diskSize = 0;
+    try {
+        diskSize = measureDiskSize(Store::toRealPath(info.path));
+    } catch (SysError &) {
+    }
+
     state.stmts->RegisterValidPath.use()
         (printStorePath(info.path))
         (info.narHash.to_string(Base16, true))
@@ -804,6 +994,7 @@ uint64_t LocalStore::addValidPath(State & state,
         (info.ultimate ? 1 : 0, info.ultimate)
         (concatStringsSep(" ", info.sigs), !info.sigs.empty())
         (renderContentAddress(info.ca), (bool) info.ca)
+        (diskSize, diskSize != 0)
         .exec();
     uint64_t id = state.db.getLastInsertedRowId();
 
@@ -829,11 +1020,8 @@ uint64_t LocalStore::addValidPath(State & state,
         }
     }
 
-    {
-        auto state_(Store::state.lock());
-        state_->pathInfoCache.upsert(std::string(info.path.to_string()),
-            PathInfoCacheValue{ .value = std::make_shared<const ValidPathInfo>(info) });
-    }
+    Store::pathInfoCache.upsert(std::string(info.path.to_string()),
+        PathInfoCacheValue{ .value = std::make_shared<const ValidPathInfo>(info) });
 
     return id;
 }
@@ -843,10 +1031,36 @@ void LocalStore::queryPathInfoUncached(const StorePath & path,
     Callback<std::shared_ptr<const ValidPathInfo>> callback) noexcept
 {
     try {
-        callback(retrySQLite<std::shared_ptr<const ValidPathInfo>>([&]() {
+        if (pathInfoCacheFile) {
+            std::shared_ptr<const ValidPathInfo> info;
+            try {
+                info = pathInfoCacheFile->lookup(*this, std::string(path.hashPart()));
+            } catch (...) {
+                ignoreException();
+            }
+            if (info) {
+                callback(std::move(info));
+                return;
+            }
+        }
+
+        auto info = retrySQLite<std::shared_ptr<const ValidPathInfo>>([&]() -> std::shared_ptr<const ValidPathInfo> {
+            if (readConnPool) {
+                auto conn(readConnPool->get());
+                return queryPathInfoInternal(*conn, path);
+            }
             auto state(_state.lock());
             return queryPathInfoInternal(*state, path);
-        }));
+        });
+
+        if (info && pathInfoCacheFile)
+            try {
+                pathInfoCacheFile->add(*this, *info);
+            } catch (...) {
+                ignoreException();
+            }
+
+        callback(std::move(info));
 
     } catch (...) { callback.rethrow(); }
 }
@@ -902,14 +1116,31 @@ std::shared_ptr<const ValidPathInfo> LocalStore::queryPathInfoInternal(State & s
 /* Update path info in the database. */
 void LocalStore::updatePathInfo(State & state, const ValidPathInfo & info)
 {
+    uint64_t diskSize = 0;
+    try {
+        diskSize = measureDiskSize(Store::toRealPath(info.path));
+    } catch (SysError &) {
+    }
+
     state.stmts->UpdatePathInfo.use()
         (info.narSize, info.narSize != 0)
         (info.narHash.to_string(Base16, true))
         (info.ultimate ? 1 : 0, info.ultimate)
         (concatStringsSep(" ", info.sigs), !info.sigs.empty())
         (renderContentAddress(info.ca), (bool) info.ca)
+        (diskSize, diskSize != 0)
         (printStorePath(info.path))
         .exec();
+
+    /* Invalidate rather than update the shared cache: appending a
+       fresh record happens in registerValidPaths(), outside the
+       transaction. */
+    if (pathInfoCacheFile)
+        try {
+            pathInfoCacheFile->invalidateAll();
+        } catch (...) {
+            ignoreException();
+        }
 }
 
 
@@ -931,6 +1162,10 @@ bool LocalStore::isValidPath_(State & state, const StorePath & path)
 bool LocalStore::isValidPathUncached(const StorePath & path)
 {
     return retrySQLite<bool>([&]() {
+        if (readConnPool) {
+            auto conn(readConnPool->get());
+            return isValidPath_(*conn, path);
+        }
         auto state(_state.lock());
         return isValidPath_(*state, path);
     });
@@ -970,12 +1205,129 @@ void LocalStore::queryReferrers(State & state, const StorePath & path, StorePath
 void LocalStore::queryReferrers(const StorePath & path, StorePathSet & referrers)
 {
     return retrySQLite<void>([&]() {
+        if (readConnPool) {
+            auto conn(readConnPool->get());
+            queryReferrers(*conn, path, referrers);
+            return;
+        }
         auto state(_state.lock());
         queryReferrers(*state, path, referrers);
     });
 }
 
 
+StorePathSet LocalStore::queryReferrersClosure(const StorePath & path)
+{
+    return retrySQLite<StorePathSet>([&]() {
+        auto state(_state.lock());
+        auto use(state->stmts->QueryReferrersClosure.use()(printStorePath(path)));
+        StorePathSet res;
+        while (use.next()) res.insert(parseStorePath(use.getStr(0)));
+        return res;
+    });
+}
+
+
+void LocalStore::computeFSClosure(const StorePathSet & paths,
+    StorePathSet & out, bool flipDirection, bool includeOutputs, bool includeDerivers)
+{
+    /* Answer plain reverse-closure queries with one recursive query
+       per starting path; the generic implementation issues a
+       referrer query for every path in the closure. */
+    if (flipDirection && !includeOutputs && !includeDerivers) {
+        for (auto & path : paths) {
+            auto closure = queryReferrersClosure(path);
+            /* A valid path is always in its own closure, so an empty
+               result means the path doesn't exist. */
+            if (closure.empty())
+                throw InvalidPath("path '%s' is not valid", printStorePath(path));
+            for (auto & p : closure)
+                out.insert(p);
+        }
+        return;
+    }
+
+    Store::computeFSClosure(paths, out, flipDirection, includeOutputs, includeDerivers);
+}
+
+
+void LocalStore::addBuildStats(const std::string & name,
+    time_t stopTime, uint64_t wallTime,
+    std::optional<uint64_t> cpuTime, std::optional<uint64_t> peakRSS)
+{
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+        state->stmts->AddBuildStats.use()
+            (name)
+            (stopTime)
+            (wallTime)
+            (cpuTime ? *cpuTime : 0, (bool) cpuTime)
+            (peakRSS ? *peakRSS : 0, (bool) peakRSS)
+            .exec();
+    });
+}
+
+
+std::optional<std::string> LocalStore::addBuildOutputHashes(
+    const std::string & name, const std::string & outputHashes)
+{
+    return retrySQLite<std::optional<std::string>>([&]() -> std::optional<std::string> {
+        auto state(_state.lock());
+
+        std::optional<std::string> prev;
+        {
+            auto use(state->stmts->QueryLastOutputHashes.use()(name));
+            if (use.next()) prev = use.getStr(0);
+        }
+
+        state->stmts->UpdateBuildOutputHashes.use()
+            (outputHashes)
+            (name)
+            .exec();
+
+        return prev;
+    });
+}
+
+
+std::map<std::string, uint64_t> LocalStore::queryBuildDurations()
+{
+    return retrySQLite<std::map<std::string, uint64_t>>([&]() {
+        auto state(_state.lock());
+
+        SQLiteStmt stmt(state->db,
+            "select name, wallTime from BuildStats order by time");
+
+        auto use(stmt.use());
+
+        /* Later builds overwrite earlier ones, so the result holds
+           the most recently observed duration for each name. */
+        std::map<std::string, uint64_t> res;
+        while (use.next())
+            res[use.getStr(0)] = (uint64_t) use.getInt(1);
+        return res;
+    });
+}
+
+
+void LocalStore::queryAllReferrers(std::map<StorePath, StorePathSet> & referrers)
+{
+    return retrySQLite<void>([&]() {
+        auto state(_state.lock());
+
+        SQLiteStmt stmt(state->db,
+            "select p1.path, p2.path from Refs "
+            "join ValidPaths p1 on p1.id = reference "
+            "join ValidPaths p2 on p2.id = referrer");
+
+        auto use(stmt.use());
+
+        while (use.next())
+            referrers[parseStorePath(use.getStr(0))].insert(parseStorePath(use.getStr(1)));
+    });
+}
+
+
 StorePathSet LocalStore::queryValidDerivers(const StorePath & path)
 {
     return retrySQLite<StorePathSet>([&]() {
@@ -1025,23 +1377,57 @@ LocalStore::queryPartialDerivationOutputMap(const StorePath & path_)
     return outputs;
 }
 
+void LocalStore::updateHashPartIndex(State & state)
+{
+    auto gen = queryStoreGeneration(state);
+    if (state.hashPartIndexGeneration == gen) return;
+
+    std::vector<std::string> index;
+    auto use(state.stmts->QueryValidPaths.use());
+    while (use.next())
+        index.push_back(std::string(parseStorePath(use.getStr(0)).to_string()));
+    std::sort(index.begin(), index.end());
+
+    state.hashPartIndex = std::move(index);
+    state.hashPartIndexGeneration = gen;
+}
+
+
+static std::optional<StorePath> lookupHashPart(
+    const std::vector<std::string> & index, const std::string & hashPart)
+{
+    auto i = std::lower_bound(index.begin(), index.end(), hashPart);
+    if (i != index.end() && i->compare(0, hashPart.size(), hashPart) == 0)
+        return StorePath(*i);
+    return {};
+}
+
+
 std::optional<StorePath> LocalStore::queryPathFromHashPart(const std::string & hashPart)
 {
     if (hashPart.size() != StorePath::HashLen) throw Error("invalid hash part");
 
-    Path prefix = storeDir + "/" + hashPart;
-
     return retrySQLite<std::optional<StorePath>>([&]() -> std::optional<StorePath> {
         auto state(_state.lock());
+        updateHashPartIndex(*state);
+        return lookupHashPart(state->hashPartIndex, hashPart);
+    });
+}
 
-        auto useQueryPathFromHashPart(state->stmts->QueryPathFromHashPart.use()(prefix));
 
-        if (!useQueryPathFromHashPart.next()) return {};
+std::map<std::string, StorePath> LocalStore::queryPathsFromHashParts(const std::set<std::string> & hashParts)
+{
+    for (auto & hashPart : hashParts)
+        if (hashPart.size() != StorePath::HashLen) throw Error("invalid hash part");
 
-        const char * s = (const char *) sqlite3_column_text(state->stmts->QueryPathFromHashPart, 0);
-        if (s && prefix.compare(0, prefix.size(), s, prefix.size()) == 0)
-            return parseStorePath(s);
-        return {};
+    return retrySQLite<std::map<std::string, StorePath>>([&]() {
+        auto state(_state.lock());
+        updateHashPartIndex(*state);
+        std::map<std::string, StorePath> res;
+        for (auto & hashPart : hashParts)
+            if (auto path = lookupHashPart(state->hashPartIndex, hashPart))
+                res.insert_or_assign(hashPart, std::move(*path));
+        return res;
     });
 }
 
@@ -1082,6 +1468,11 @@ void LocalStore::querySubstitutablePathInfos(const StorePathCAMap & paths, Subst
 {
     if (!settings.useSubstitutes) return;
     for (auto & sub : getDefaultSubstituters()) {
+
+        /* Determine which paths still need to be checked against
+           this substituter, and the path names to use there. */
+        std::vector<std::pair<StorePath, StorePath>> toQuery; /* (our path, sub path) */
+
         for (auto & path : paths) {
             if (infos.count(path.first))
                 // Choose first succeeding substituter.
@@ -1099,27 +1490,70 @@ void LocalStore::querySubstitutablePathInfos(const StorePathCAMap & paths, Subst
             } else if (sub->storeDir != storeDir) continue;
 
             debug("checking substituter '%s' for path '%s'", sub->getUri(), sub->printStorePath(subPath));
-            try {
-                auto info = sub->queryPathInfo(subPath);
-
-                if (sub->storeDir != storeDir && !(info->isContentAddressed(*sub) && info->references.empty()))
-                    continue;
-
-                auto narInfo = std::dynamic_pointer_cast<const NarInfo>(
-                    std::shared_ptr<const ValidPathInfo>(info));
-                infos.insert_or_assign(path.first, SubstitutablePathInfo{
-                    info->deriver,
-                    info->references,
-                    narInfo ? narInfo->fileSize : 0,
-                    info->narSize});
-            } catch (InvalidPath &) {
-            } catch (SubstituterDisabled &) {
-            } catch (Error & e) {
-                if (settings.tryFallback)
-                    logError(e.info());
-                else
-                    throw;
-            }
+            toQuery.push_back({path.first, subPath});
+        }
+
+        if (toQuery.empty()) continue;
+
+        {
+            StorePathSet subPaths;
+            for (auto & q : toQuery)
+                subPaths.insert(q.second);
+            sub->prefetchPathInfos(subPaths);
+        }
+
+        /* Issue all queries for this substituter asynchronously, so
+           that a binary cache substituter can put them on the wire in
+           one burst instead of one blocking round trip per path. */
+        struct QueryState
+        {
+            size_t left;
+            std::map<StorePath, std::shared_ptr<const ValidPathInfo>> results;
+            std::exception_ptr exc;
+        };
+
+        Sync<QueryState> queryState_({toQuery.size(), {}, nullptr});
+        std::condition_variable wakeup;
+
+        for (auto & q : toQuery)
+            sub->queryPathInfo(q.second, {[&, path(q.first)](std::future<ref<const ValidPathInfo>> fut) {
+                std::shared_ptr<const ValidPathInfo> info;
+                std::exception_ptr exc;
+                try {
+                    info = fut.get().get_ptr();
+                } catch (InvalidPath &) {
+                } catch (SubstituterDisabled &) {
+                } catch (Error & e) {
+                    if (settings.tryFallback)
+                        logError(e.info());
+                    else
+                        exc = std::current_exception();
+                }
+                auto queryState(queryState_.lock());
+                if (info) queryState->results.insert_or_assign(path, info);
+                if (exc && !queryState->exc) queryState->exc = exc;
+                assert(queryState->left);
+                queryState->left--;
+                wakeup.notify_all();
+            }});
+
+        auto queryState(queryState_.lock());
+        while (queryState->left)
+            queryState.wait(wakeup);
+
+        if (queryState->exc)
+            std::rethrow_exception(queryState->exc);
+
+        for (auto & [path, info] : queryState->results) {
+            if (sub->storeDir != storeDir && !(info->isContentAddressed(*sub) && info->references.empty()))
+                continue;
+
+            auto narInfo = std::dynamic_pointer_cast<const NarInfo>(info);
+            infos.insert_or_assign(path, SubstitutablePathInfo{
+                info->deriver,
+                info->references,
+                narInfo ? narInfo->fileSize : 0,
+                info->narSize});
         }
     }
 }
@@ -1137,9 +1571,76 @@ void LocalStore::registerValidPaths(const ValidPathInfos & infos)
        be fsync-ed.  So some may want to fsync them before registering
        the validity, at the expense of some speed of the path
        registering operation. */
-    if (settings.syncBeforeRegistering) sync();
+    if (settings.syncBeforeRegistering) {
+#if __linux__
+        /* Syncing the file system containing the store suffices, and
+           doesn't flush unrelated dirty pages the way a global
+           sync() does. */
+        AutoCloseFD fd = open(realStoreDir.get().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (!fd || syncfs(fd.get()) == -1)
+            sync();
+#else
+        sync();
+#endif
+    }
 
-    return retrySQLite<void>([&]() {
+    std::unique_lock<std::mutex> lock(regQueue.mutex);
+
+    for (auto & [path, i] : infos)
+        regQueue.pending.insert_or_assign(path, i);
+
+    /* Our paths will be committed in the batch with this
+       generation. */
+    auto target = regQueue.generation + 1;
+
+    if (regQueue.committing) {
+        /* Another thread is committing; it will pick up our paths in
+           its next transaction. Wait for that commit (our durability
+           barrier) and propagate its outcome. */
+        regQueue.wakeup.wait(lock, [&]() { return regQueue.committed >= target; });
+        if (regQueue.error && regQueue.errorGeneration == target)
+            std::rethrow_exception(regQueue.error);
+        return;
+    }
+
+    /* We're the committing thread. Keep committing batches until the
+       queue is empty, so registrations queued by other threads while
+       we were busy get group-committed too. */
+    regQueue.committing = true;
+    std::exception_ptr myError;
+
+    while (!regQueue.pending.empty()) {
+        auto batch = std::move(regQueue.pending);
+        regQueue.pending = ValidPathInfos();
+        auto generation = ++regQueue.generation;
+
+        lock.unlock();
+        std::exception_ptr error;
+        try {
+            registerValidPathsBatch(batch);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        lock.lock();
+
+        regQueue.committed = generation;
+        if (error) {
+            regQueue.error = error;
+            regQueue.errorGeneration = generation;
+            if (generation == target) myError = error;
+        }
+        regQueue.wakeup.notify_all();
+    }
+
+    regQueue.committing = false;
+
+    if (myError) std::rethrow_exception(myError);
+}
+
+
+void LocalStore::registerValidPathsBatch(const ValidPathInfos & infos)
+{
+    retrySQLite<void>([&]() {
         auto state(_state.lock());
 
         SQLiteTxn txn(state->db);
@@ -1188,6 +1689,132 @@ void LocalStore::registerValidPaths(const ValidPathInfos & infos)
 
         txn.commit();
     });
+
+    if (pathInfoCacheFile)
+        try {
+            for (auto & [_, i] : infos)
+                pathInfoCacheFile->add(*this, i);
+        } catch (...) {
+            ignoreException();
+        }
+
+    countMutations(infos.size());
+
+    bumpStoreGeneration();
+}
+
+
+void LocalStore::countMutations(size_t n)
+{
+    if (!settings.sqliteOptimizeInterval) return;
+
+    auto state(_state.lock());
+
+    state->mutationsSinceOptimize += n;
+    if (state->mutationsSinceOptimize < settings.sqliteOptimizeInterval) return;
+    state->mutationsSinceOptimize = 0;
+
+    /* Query plans and fragmentation degrade gradually, so it's fine
+       for a maintenance pass to be skipped occasionally; the next
+       interval will pick it up. */
+    try {
+        debug("running database maintenance");
+        state->db.maintain();
+    } catch (SQLiteError &) {
+        ignoreException();
+    }
+}
+
+
+void LocalStore::bumpStoreGeneration()
+{
+    generationBumps++;
+    std::lock_guard<std::mutex> lock(generationMutex);
+    generationWakeup.notify_all();
+}
+
+
+uint64_t LocalStore::queryStoreGeneration(State & state)
+{
+    /* 'data_version' changes whenever another connection commits to
+       the database, so writes by other processes are covered; our
+       own commits are counted by 'generationBumps'. */
+    SQLiteStmt stmt(state.db, "pragma data_version;");
+    auto use(stmt.use());
+    if (!use.next())
+        throw Error("'pragma data_version' produced no result");
+    return generationBumps + (uint64_t) use.getInt(0);
+}
+
+
+uint64_t LocalStore::queryStoreGeneration()
+{
+    return retrySQLite<uint64_t>([&]() {
+        auto state(_state.lock());
+        return queryStoreGeneration(*state);
+    });
+}
+
+
+uint64_t LocalStore::waitStoreGeneration(uint64_t known, uint64_t timeoutMs)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    for (;;) {
+        auto gen = queryStoreGeneration();
+        if (gen != known) return gen;
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline) return gen;
+        /* In-process changes wake us up immediately; changes by
+           other processes are only noticed when data_version is
+           re-read, so cap the wait. */
+        std::unique_lock<std::mutex> lock(generationMutex);
+        generationWakeup.wait_for(lock,
+            std::min(std::chrono::milliseconds(500),
+                std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now)));
+    }
+}
+
+
+std::optional<uint64_t> LocalStore::queryPathDiskSize(const StorePath & path)
+{
+    return retrySQLite<std::optional<uint64_t>>([&]() -> std::optional<uint64_t> {
+        auto state(_state.lock());
+        auto use(state->stmts->QueryDiskSize.use()(printStorePath(path)));
+        if (!use.next() || use.isNull(0))
+            return std::nullopt;
+        return (uint64_t) use.getInt(0);
+    });
+}
+
+
+uint64_t LocalStore::queryStoreDiskSize()
+{
+    return retrySQLite<uint64_t>([&]() {
+        auto state(_state.lock());
+        auto use(state->stmts->QueryTotalDiskSize.use());
+        if (!use.next())
+            throw Error("querying total disk size of the Nix store failed");
+        return (uint64_t) use.getInt(0);
+    });
+}
+
+
+void LocalStore::updatePathDiskSize(const StorePath & path)
+{
+    uint64_t diskSize = 0;
+    try {
+        diskSize = measureDiskSize(Store::toRealPath(path));
+    } catch (SysError &) {
+        return;
+    }
+
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+        state->stmts->UpdateDiskSize.use()
+            (diskSize, diskSize != 0)
+            (printStorePath(path))
+            .exec();
+    });
 }
 
 
@@ -1199,13 +1826,19 @@ void LocalStore::invalidatePath(State & state, const StorePath & path)
 
     state.stmts->InvalidatePath.use()(printStorePath(path)).exec();
 
+    if (pathInfoCacheFile)
+        try {
+            pathInfoCacheFile->invalidateAll();
+        } catch (...) {
+            ignoreException();
+        }
+
     /* Note that the foreign key constraints on the Refs table take
        care of deleting the references entries for `path'. */
 
-    {
-        auto state_(Store::state.lock());
-        state_->pathInfoCache.erase(std::string(path.to_string()));
-    }
+    Store::pathInfoCache.erase(std::string(path.to_string()));
+
+    invalidateClosureCache();
 }
 
 const PublicKeys & LocalStore::getPublicKeys()
@@ -1228,6 +1861,38 @@ bool LocalStore::realisationIsUntrusted(const Realisation & realisation)
 
 void LocalStore::addToStore(const ValidPathInfo & info, Source & source,
     RepairFlag repair, CheckSigsFlag checkSigs)
+{
+    addToStore_(info, source, repair, checkSigs, true);
+}
+
+
+void LocalStore::addMultipleToStore(Source & source,
+    RepairFlag repair, CheckSigsFlag checkSigs)
+{
+    auto expected = readNum<uint64_t>(source);
+
+    ValidPathInfos infos;
+
+    for (uint64_t i = 0; i < expected; ++i) {
+        auto info = ValidPathInfo::read(source, *this, 16);
+        info.ultimate = false;
+        /* Unpack and check the NAR, but defer the database
+           registration: the temporary root taken by addToStore_()
+           protects the path from the garbage collector until then. */
+        addToStore_(info, source, repair, checkSigs, false);
+        auto path = info.path;
+        infos.insert_or_assign(path, std::move(info));
+    }
+
+    /* Register all the paths in a single transaction instead of one
+       commit (and fsync) per path. */
+    if (!infos.empty())
+        registerValidPaths(infos);
+}
+
+
+void LocalStore::addToStore_(const ValidPathInfo & info, Source & source,
+    RepairFlag repair, CheckSigsFlag checkSigs, bool doRegister)
 {
     if (checkSigs && pathInfoIsUntrusted(info))
         throw Error("cannot add path '%s' because it lacks a valid signature", printStorePath(info.path));
@@ -1256,7 +1921,11 @@ void LocalStore::addToStore(const ValidPathInfo & info, Source & source,
 
             TeeSource wrapperSource { source, hashSink };
 
-            restorePath(realPath, wrapperSource);
+            /* Restoring with 'canonicalise' gives the files their
+               canonical metadata as they are created, so no
+               canonicalisePathMetaData() pass over the result is
+               needed. */
+            restorePath(realPath, wrapperSource, true);
 
             auto hashResult = hashSink.finish();
 
@@ -1295,11 +1964,10 @@ void LocalStore::addToStore(const ValidPathInfo & info, Source & source,
 
             autoGC();
 
-            canonicalisePathMetaData(realPath, -1);
-
             optimisePath(realPath); // FIXME: combine with hashPath()
 
-            registerValidPath(info);
+            if (doRegister)
+                registerValidPath(info);
         }
 
         outputLock.setDeletion(true);
@@ -1355,7 +2023,7 @@ StorePath LocalStore::addToStoreFromDump(Source & source0, const string & name,
         tempPath = tempDir + "/x";
 
         if (method == FileIngestionMethod::Recursive)
-            restorePath(tempPath, bothSource);
+            restorePath(tempPath, bothSource, /* canonicalise */ true);
         else
             writeFile(tempPath, bothSource);
 
@@ -1387,7 +2055,7 @@ StorePath LocalStore::addToStoreFromDump(Source & source0, const string & name,
                  StringSource dumpSource { dump };
                 /* Restore from the NAR in memory. */
                 if (method == FileIngestionMethod::Recursive)
-                    restorePath(realPath, dumpSource);
+                    restorePath(realPath, dumpSource, /* canonicalise */ true);
                 else
                     writeFile(realPath, dumpSource);
             } else {
@@ -1405,7 +2073,9 @@ StorePath LocalStore::addToStoreFromDump(Source & source0, const string & name,
                 narHash = narSink.finish();
             }
 
-            canonicalisePathMetaData(realPath, -1); // FIXME: merge into restorePath
+            if (method != FileIngestionMethod::Recursive)
+                /* restorePath() canonicalised as it went. */
+                canonicalisePathMetaData(realPath, -1);
 
             optimisePath(realPath);
 
@@ -1501,6 +2171,10 @@ void LocalStore::invalidatePathChecked(const StorePath & path)
 
         txn.commit();
     });
+
+    countMutations(1);
+
+    bumpStoreGeneration();
 }
 
 
@@ -1516,7 +2190,9 @@ bool LocalStore::verifyStore(bool checkContents, RepairFlag repair)
     FdLock gcLock(fdGCLock.get(), ltRead, true, "waiting for the big garbage collector lock...");
 
     StringSet store;
-    for (auto & i : readDirectory(realStoreDir)) store.insert(i.name);
+    forEachDirEntry(realStoreDir, [&](const DirEntryView & entry) {
+        store.insert(string(entry.name));
+    });
 
     /* Check whether all valid paths actually exist. */
     printInfo("checking path existence...");
@@ -1530,32 +2206,66 @@ bool LocalStore::verifyStore(bool checkContents, RepairFlag repair)
     /* Optionally, check the content hashes (slow). */
     if (checkContents) {
 
+        /* The workers share only the database connection (which has
+           its own lock) and a few counters, so the hashing
+           parallelises freely. The pool size bounds how many files
+           are being read at any one time. */
+        std::atomic<bool> contentErrors{false};
+        ThreadPool pool;
+
         printInfo("checking link hashes...");
 
-        for (auto & link : readDirectory(linksDir)) {
-            printMsg(lvlTalkative, "checking contents of '%s'", link.name);
-            Path linkPath = linksDir + "/" + link.name;
-            string hash = hashPath(htSHA256, linkPath).first.to_string(Base32, false);
-            if (hash != link.name) {
-                printError("link '%s' was modified! expected hash '%s', got '%s'",
-                    linkPath, link.name, hash);
-                if (repair) {
-                    if (unlink(linkPath.c_str()) == 0)
-                        printInfo("removed link '%s'", linkPath);
-                    else
-                        throw SysError("removing corrupt link '%s'", linkPath);
-                } else {
-                    errors = true;
+        forEachDirEntry(linksDir, [&](const DirEntryView & entry) {
+            pool.enqueue([this, name(string(entry.name)), repair, &contentErrors]() {
+                checkInterrupt();
+                printMsg(lvlTalkative, "checking contents of '%s'", name);
+                Path linkPath = linksDir + "/" + name;
+                string hash = hashPath(htSHA256, linkPath).first.to_string(Base32, false);
+                if (hash != name) {
+                    printError("link '%s' was modified! expected hash '%s', got '%s'",
+                        linkPath, name, hash);
+                    if (repair) {
+                        if (unlink(linkPath.c_str()) == 0)
+                            printInfo("removed link '%s'", linkPath);
+                        else
+                            throw SysError("removing corrupt link '%s'", linkPath);
+                    } else {
+                        contentErrors = true;
+                    }
                 }
-            }
-        }
+            });
+        });
+
+        pool.process();
 
         printInfo("checking store hashes...");
 
         Hash nullHash(htSHA256);
 
-        for (auto & i : validPaths) {
+        time_t now = time(0);
+
+        /* Repairing can trigger substitutions or builds, so collect
+           the damaged paths and repair them after the scan. */
+        Sync<StorePathSet> toRepair;
+
+        for (auto & i : validPaths)
+            pool.enqueue([&, i]() {
             try {
+                checkInterrupt();
+
+                /* In incremental mode, skip paths whose contents were
+                   verified recently. */
+                if (verifyTTL.get() != 0) {
+                    std::optional<int64_t> lastVerified;
+                    retrySQLite<void>([&]() {
+                        auto state(_state.lock());
+                        auto use(state->stmts->QueryLastVerified.use()(printStorePath(i)));
+                        if (use.next()) lastVerified = use.getInt(0);
+                    });
+                    if (lastVerified && *lastVerified + (int64_t) verifyTTL > now)
+                        return;
+                }
+
                 auto info = std::const_pointer_cast<ValidPathInfo>(std::shared_ptr<const ValidPathInfo>(queryPathInfo(i)));
 
                 /* Check the content hash (optionally - slow). */
@@ -1569,7 +2279,7 @@ bool LocalStore::verifyStore(bool checkContents, RepairFlag repair)
                 if (info->narHash != nullHash && info->narHash != current.first) {
                     printError("path '%s' was modified! expected hash '%s', got '%s'",
                         printStorePath(i), info->narHash.to_string(Base32, true), current.first.to_string(Base32, true));
-                    if (repair) repairPath(i); else errors = true;
+                    if (repair) toRepair.lock()->insert(i); else contentErrors = true;
                 } else {
 
                     bool update = false;
@@ -1593,6 +2303,11 @@ bool LocalStore::verifyStore(bool checkContents, RepairFlag repair)
                         updatePathInfo(*state, *info);
                     }
 
+                    retrySQLite<void>([&]() {
+                        auto state(_state.lock());
+                        state->stmts->UpdateLastVerified.use()(now)(printStorePath(i)).exec();
+                    });
+
                 }
 
             } catch (Error & e) {
@@ -1602,9 +2317,16 @@ bool LocalStore::verifyStore(bool checkContents, RepairFlag repair)
                     logError(e.info());
                 else
                     warn(e.msg());
-                errors = true;
+                contentErrors = true;
             }
-        }
+            });
+
+        pool.process();
+
+        for (auto & i : *toRepair.lock())
+            repairPath(i);
+
+        if (contentErrors) errors = true;
     }
 
     return errors;
@@ -3,12 +3,16 @@
 #include "sqlite.hh"
 
 #include "pathlocks.hh"
+#include "pool.hh"
 #include "store-api.hh"
 #include "local-fs-store.hh"
 #include "sync.hh"
 #include "util.hh"
 
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <future>
 #include <string>
 #include <unordered_set>
@@ -17,18 +21,22 @@
 namespace nix {
 
 
+class SharedPathInfoCache;
+
+
 /* Nix store and database schema version.  Version 1 (or 0) was Nix <=
    0.7.  Version 2 was Nix 0.8 and 0.9.  Version 3 is Nix 0.10.
    Version 4 is Nix 0.11.  Version 5 is Nix 0.12-0.16.  Version 6 is
    Nix 1.0.  Version 7 is Nix 1.3. Version 10 is 2.0. */
-const int nixSchemaVersion = 10;
+const int nixSchemaVersion = 15;
 
 
+/* Atomic, since store paths are deduplicated on a thread pool. */
 struct OptimiseStats
 {
-    unsigned long filesLinked = 0;
-    uint64_t bytesFreed = 0;
-    uint64_t blocksFreed = 0;
+    std::atomic<unsigned long> filesLinked{0};
+    std::atomic<uint64_t> bytesFreed{0};
+    std::atomic<uint64_t> blocksFreed{0};
 };
 
 struct LocalStoreConfig : virtual LocalFSStoreConfig
@@ -39,6 +47,14 @@ struct LocalStoreConfig : virtual LocalFSStoreConfig
         settings.requireSigs,
         "require-sigs", "whether store paths should have a trusted signature on import"};
 
+    Setting<bool> sharedPathInfoCache{(StoreConfig*) this, false,
+        "shared-path-info-cache",
+        "whether to maintain a memory-mapped cache of path info records shared between processes"};
+
+    Setting<unsigned int> verifyTTL{(StoreConfig*) this, 0,
+        "verify-ttl",
+        "if non-zero, 'nix-store --verify --check-contents' skips paths whose contents were verified less than this number of seconds ago"};
+
     const std::string name() override { return "Local Store"; }
 };
 
@@ -83,10 +99,68 @@ private:
         uint64_t availAfterGC = std::numeric_limits<uint64_t>::max();
 
         std::unique_ptr<PublicKeys> publicKeys;
+
+        /* Sorted base names of all valid paths, used to answer hash
+           part queries by binary search instead of one SQL query per
+           lookup. Rebuilt lazily whenever the store generation no
+           longer matches 'hashPartIndexGeneration'. */
+        std::vector<std::string> hashPartIndex;
+        std::optional<uint64_t> hashPartIndexGeneration;
+
+        /* Number of path registrations and invalidations since the
+           last database maintenance pass (see
+           'sqlite-optimize-interval'). */
+        uint64_t mutationsSinceOptimize = 0;
     };
 
     Sync<State> _state;
 
+    /* Pool of read-only connections used by the hot metadata
+       queries. With WAL mode, readers don't block the writer, so
+       concurrent queries (e.g. from the ThreadPool in
+       computeFSClosure()) scale with cores instead of serialising on
+       the single writer connection above. Null if the database is
+       not in WAL mode. */
+    std::shared_ptr<Pool<State>> readConnPool;
+
+    /* Cross-process path info cache; may be null. */
+    std::shared_ptr<SharedPathInfoCache> pathInfoCacheFile;
+
+    /* Group commit of path registrations. While one thread is
+       committing a batch, concurrent callers of registerValidPaths()
+       add their paths to 'pending' and wait; the committing thread
+       picks them up in its next transaction. This coalesces the
+       per-commit fsync across concurrent imports. */
+    struct RegistrationQueue
+    {
+        std::mutex mutex;
+        std::condition_variable wakeup;
+        bool committing = false;
+        ValidPathInfos pending;
+        /* Bumped each time a batch is taken from 'pending';
+           'committed' trails it as batches finish. */
+        uint64_t generation = 0, committed = 0;
+        /* Error from the batch with generation 'errorGeneration',
+           rethrown in every thread that contributed to it. */
+        uint64_t errorGeneration = 0;
+        std::exception_ptr error;
+    };
+
+    RegistrationQueue regQueue;
+
+    /* In-process component of the store generation (see
+       queryStoreGeneration()). Changes made by other processes are
+       picked up through SQLite's 'data_version' pragma. */
+    std::atomic<uint64_t> generationBumps{0};
+    std::mutex generationMutex;
+    std::condition_variable generationWakeup;
+
+    void bumpStoreGeneration();
+
+    uint64_t queryStoreGeneration(State & state);
+
+    void updateHashPartIndex(State & state);
+
 public:
 
     const Path dbDir;
@@ -127,12 +201,46 @@ public:
 
     void queryReferrers(const StorePath & path, StorePathSet & referrers) override;
 
+    /* Load the entire referrer relation in one query, for bulk
+       consumers like the garbage collector. */
+    void queryAllReferrers(std::map<StorePath, StorePathSet> & referrers);
+
+    /* Return the closure of 'path' under the referrers relation,
+       computed in a single recursive query instead of one query per
+       path. */
+    StorePathSet queryReferrersClosure(const StorePath & path);
+
+    using Store::computeFSClosure;
+
+    void computeFSClosure(const StorePathSet & paths,
+        StorePathSet & out, bool flipDirection = false,
+        bool includeOutputs = false, bool includeDerivers = false) override;
+
+    /* Record the resource usage of a finished build, for estimating
+       the duration of future builds of the same derivation. */
+    void addBuildStats(const std::string & name, time_t stopTime,
+        uint64_t wallTime, std::optional<uint64_t> cpuTime,
+        std::optional<uint64_t> peakRSS);
+
+    /* Attach the content hashes of the outputs of a just-finished
+       build to its BuildStats record, and return the hashes recorded
+       by the previous build of the same derivation name, so that the
+       caller can detect rebuilds that produced unchanged output. */
+    std::optional<std::string> addBuildOutputHashes(const std::string & name,
+        const std::string & outputHashes);
+
+    /* Return the most recently observed build duration, in seconds,
+       for every derivation name that has been built. */
+    std::map<std::string, uint64_t> queryBuildDurations();
+
     StorePathSet queryValidDerivers(const StorePath & path) override;
 
     std::map<std::string, std::optional<StorePath>> queryPartialDerivationOutputMap(const StorePath & path) override;
 
     std::optional<StorePath> queryPathFromHashPart(const std::string & hashPart) override;
 
+    std::map<std::string, StorePath> queryPathsFromHashParts(const std::set<std::string> & hashParts) override;
+
     StorePathSet querySubstitutablePaths(const StorePathSet & paths) override;
 
     void querySubstitutablePathInfos(const StorePathCAMap & paths,
@@ -144,6 +252,9 @@ public:
     void addToStore(const ValidPathInfo & info, Source & source,
         RepairFlag repair, CheckSigsFlag checkSigs) override;
 
+    void addMultipleToStore(Source & source,
+        RepairFlag repair, CheckSigsFlag checkSigs) override;
+
     StorePath addToStoreFromDump(Source & dump, const string & name,
         FileIngestionMethod method, HashType hashAlgo, RepairFlag repair, const StorePathSet & references) override;
 
@@ -152,12 +263,32 @@ public:
 
     void addTempRoot(const StorePath & path) override;
 
+    /* A set of temporary roots with its own file in the temproots
+       directory, tied to the lifetime of the handle rather than to
+       this process. Used by the threaded daemon so that a client's
+       roots are released when its connection ends instead of
+       accumulating for the daemon's lifetime. */
+    struct TempRootsScope
+    {
+        Path path;
+        AutoCloseFD fd;
+        ~TempRootsScope();
+    };
+
+    std::shared_ptr<TempRootsScope> openTempRootsScope();
+
+    void addTempRoot(const StorePath & path, TempRootsScope & scope);
+
     void addIndirectRoot(const Path & path) override;
 
 private:
 
     void findTempRoots(Roots & roots, bool censor);
 
+    /* Inform a running garbage collector about 'path', then append it
+       to the temporary roots file 'fdTempRoots'. */
+    void registerTempRoot(State & state, const StorePath & path, int fdTempRoots);
+
     AutoCloseFD openGCLock();
 
 public:
@@ -166,6 +297,26 @@ public:
 
     void collectGarbage(const GCOptions & options, GCResults & results) override;
 
+    uint64_t queryStoreGeneration() override;
+
+    uint64_t waitStoreGeneration(uint64_t known, uint64_t timeoutMs) override;
+
+    /* Return the recorded on-disk size of a path, i.e. the number of
+       bytes it occupies with hardlink sharing apportioned between the
+       links, or std::nullopt for paths registered before the size
+       accounting was added. */
+    std::optional<uint64_t> queryPathDiskSize(const StorePath & path);
+
+    /* Return the total on-disk size of the store, summed from the
+       recorded per-path sizes (falling back to the NAR size for paths
+       that don't have one recorded). This is a single aggregate query
+       and doesn't touch the filesystem. */
+    uint64_t queryStoreDiskSize();
+
+    /* Re-measure a path and update its recorded on-disk size, e.g.
+       after hard-linking changed its footprint. */
+    void updatePathDiskSize(const StorePath & path);
+
     /* Optimise the disk space usage of the Nix store by hard-linking
        files with the same contents. */
     void optimiseStore(OptimiseStats & stats);
@@ -216,6 +367,9 @@ private:
 
     void openDB(State & state, bool create);
 
+    /* Open a read-only connection for readConnPool. */
+    ref<State> openReadConn();
+
     void makeStoreWritable();
 
     uint64_t queryValidPathId(State & state, const StorePath & path);
@@ -234,6 +388,14 @@ private:
 
     void updatePathInfo(State & state, const ValidPathInfo & info);
 
+    /* Commit one batch of registrations in a single transaction. */
+    void registerValidPathsBatch(const ValidPathInfos & infos);
+
+    /* Record 'n' database mutations and run a maintenance pass
+       ('pragma optimize', incremental vacuum) when
+       'sqlite-optimize-interval' mutations have accumulated. */
+    void countMutations(size_t n);
+
     void upgradeStore6();
     void upgradeStore7();
     PathSet queryValidPathsOld();
@@ -252,8 +414,14 @@ private:
     typedef std::unordered_set<ino_t> InodeHash;
 
     InodeHash loadInodeHash();
-    Strings readDirectoryIgnoringInodes(const Path & path, const InodeHash & inodeHash);
-    void optimisePath_(Activity * act, OptimiseStats & stats, const Path & path, InodeHash & inodeHash);
+    Strings readDirectoryIgnoringInodes(const Path & path, Sync<InodeHash> & inodeHash);
+    void optimisePath_(Activity * act, OptimiseStats & stats, const Path & path, Sync<InodeHash> & inodeHash);
+
+    /* Worker for addToStore()/addMultipleToStore(). If 'doRegister'
+       is false, the path is unpacked and checked but not registered
+       in the database; the caller must do so itself. */
+    void addToStore_(const ValidPathInfo & info, Source & source,
+        RepairFlag repair, CheckSigsFlag checkSigs, bool doRegister);
 
     // Internal versions that are not wrapped in retry_sqlite.
     bool isValidPath_(State & state, const StorePath & path);
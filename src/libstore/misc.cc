@@ -13,6 +13,28 @@ namespace nix {
 void Store::computeFSClosure(const StorePathSet & startPaths,
     StorePathSet & paths_, bool flipDirection, bool includeOutputs, bool includeDerivers)
 {
+    /* The plain forward closure is memoised across calls: references
+       of valid paths are immutable, so an entry only goes stale when
+       paths are deleted, which bumps the cache generation. The
+       flipped/outputs/derivers variants can also change when paths
+       are added, so they are not cached. */
+    bool cacheable = !flipDirection && !includeOutputs && !includeDerivers;
+    bool memoise = cacheable && paths_.empty() && startPaths.size() == 1;
+
+    StorePathSet roots;
+    if (cacheable) {
+        auto cache(closureCache.lock());
+        for (auto & path : startPaths) {
+            auto i = cache->closures.find(path);
+            if (i != cache->closures.end() && i->second.first == cache->generation)
+                paths_.insert(i->second.second->begin(), i->second.second->end());
+            else
+                roots.insert(path);
+        }
+        if (roots.empty()) return;
+    } else
+        roots = startPaths;
+
     std::function<std::set<StorePath>(const StorePath & path, std::future<ref<const ValidPathInfo>> &)> queryDeps;
     if (flipDirection)
         queryDeps = [&](const StorePath& path,
@@ -54,7 +76,7 @@ void Store::computeFSClosure(const StorePathSet & startPaths,
         };
 
     computeClosure<StorePath>(
-        startPaths, paths_,
+        roots, paths_,
         [&](const StorePath& path,
             std::function<void(std::promise<std::set<StorePath>>&)>
                 processEdges) {
@@ -71,6 +93,16 @@ void Store::computeFSClosure(const StorePathSet & startPaths,
             queryPathInfo(path, getDependencies);
             processEdges(promise);
         });
+
+    if (memoise) {
+        auto cache(closureCache.lock());
+        /* Crude bound on memory use; a full clear is fine since
+           entries are cheap to recompute. */
+        if (cache->closures.size() > 16 * 1024)
+            cache->closures.clear();
+        cache->closures.insert_or_assign(*roots.begin(),
+            std::make_pair(cache->generation, std::make_shared<const StorePathSet>(paths_)));
+    }
 }
 
 void Store::computeFSClosure(const StorePath & startPath,
@@ -100,138 +132,214 @@ void Store::queryMissing(const std::vector<DerivedPath> & targets,
 
     downloadSize_ = narSize_ = 0;
 
-    ThreadPool pool;
-
     struct State
     {
         std::unordered_set<std::string> done;
         StorePathSet & unknown, & willSubstitute, & willBuild;
         uint64_t & downloadSize;
         uint64_t & narSize;
+        /* The next breadth-first wave of paths to process. */
+        std::vector<DerivedPath> next;
     };
 
-    struct DrvState
+    /* A derivation whose invalid outputs are candidates for
+       substitution: it must be built unless all of them turn out to
+       be substitutable. */
+    struct DrvTodo
     {
-        size_t left;
-        bool done = false;
+        StorePath drvPath;
+        std::shared_ptr<Derivation> drv;
         StorePathSet outPaths;
-        DrvState(size_t left) : left(left) { }
     };
 
     Sync<State> state_(State{{}, unknown_, willSubstitute_, willBuild_, downloadSize_, narSize_});
 
-    std::function<void(DerivedPath)> doPath;
+    auto mustBuildDrv = [&](State & state, const StorePath & drvPath, const Derivation & drv) {
+        state.willBuild.insert(drvPath);
+        for (auto & i : drv.inputDrvs)
+            state.next.push_back(DerivedPath::Built { i.first, i.second });
+    };
 
-    auto mustBuildDrv = [&](const StorePath & drvPath, const Derivation & drv) {
+    /* Process the graph breadth-first: classify an entire wave of
+       paths (cheap local checks and .drv reads, done in parallel),
+       then issue a single bulk substitutability query for all
+       candidate paths of the wave, and only then recurse into the
+       next wave. This turns one substituter round trip per path into
+       one per closure level. Validity is likewise established with
+       one bulk queryValidPaths() per wave rather than one
+       isValidPath() exchange per path, which matters when talking to
+       the daemon. */
+    std::vector<DerivedPath> queue(targets);
+
+    while (!queue.empty()) {
+
+        Sync<std::vector<DrvTodo>> drvTodos_;
+        Sync<StorePathCAMap> candidates_;
+        Sync<StorePathSet> opaqueTodos_;
+
+        /* Dedupe the wave and bulk-query the validity of every
+           derivation and opaque path in it. */
+        std::vector<DerivedPath::Built> builts;
+        std::vector<DerivedPath::Opaque> opaques;
+        StorePathSet validPaths;
+        StorePathSet pathsToQuery;
         {
             auto state(state_.lock());
-            state->willBuild.insert(drvPath);
+            for (auto & req : queue) {
+                if (!state->done.insert(req.to_string(*this)).second) continue;
+                std::visit(overloaded {
+                    [&](const DerivedPath::Built & bfd) {
+                        pathsToQuery.insert(bfd.drvPath);
+                        builts.push_back(bfd);
+                    },
+                    [&](const DerivedPath::Opaque & bo) {
+                        pathsToQuery.insert(bo.path);
+                        opaques.push_back(bo);
+                    },
+                }, req.raw());
+            }
         }
+        if (!pathsToQuery.empty())
+            validPaths = queryValidPaths(pathsToQuery);
 
-        for (auto & i : drv.inputDrvs)
-            pool.enqueue(std::bind(doPath, DerivedPath::Built { i.first, i.second }));
-    };
+        for (auto & bo : opaques) {
+            if (validPaths.count(bo.path)) continue;
+            candidates_.lock()->insert_or_assign(bo.path, std::nullopt);
+            opaqueTodos_.lock()->insert(bo.path);
+        }
 
-    auto checkOutput = [&](
-        const StorePath & drvPath, ref<Derivation> drv, const StorePath & outPath, ref<Sync<DrvState>> drvState_)
-    {
-        if (drvState_->lock()->done) return;
+        /* Read the output maps of the valid derivations (in parallel)
+           and bulk-query the validity of all their wanted outputs. */
+        struct BuiltTodo
+        {
+            DerivedPath::Built bfd;
+            /* true for regular derivations, and CA derivations for which we
+               have a trust mapping for all wanted outputs. */
+            bool knownOutputPaths;
+            StorePathSet wantedOutputs;
+        };
+        Sync<std::vector<BuiltTodo>> builtTodos_;
+        Sync<StorePathSet> outputsToQuery_;
 
-        SubstitutablePathInfos infos;
-        querySubstitutablePathInfos({{outPath, getDerivationCA(*drv)}}, infos);
-
-        if (infos.empty()) {
-            drvState_->lock()->done = true;
-            mustBuildDrv(drvPath, *drv);
-        } else {
-            {
-                auto drvState(drvState_->lock());
-                if (drvState->done) return;
-                assert(drvState->left);
-                drvState->left--;
-                drvState->outPaths.insert(outPath);
-                if (!drvState->left) {
-                    for (auto & path : drvState->outPaths)
-                        pool.enqueue(std::bind(doPath, DerivedPath::Opaque { path } ));
-                }
-            }
+        {
+            ThreadPool pool;
+            for (auto & bfd : builts)
+                pool.enqueue([&, bfd]() {
+                    if (!validPaths.count(bfd.drvPath)) {
+                        // FIXME: we could try to substitute the derivation.
+                        auto state(state_.lock());
+                        state->unknown.insert(bfd.drvPath);
+                        return;
+                    }
+                    BuiltTodo todo{bfd, true, {}};
+                    for (auto & [outputName, pathOpt] : queryPartialDerivationOutputMap(bfd.drvPath)) {
+                        if (!pathOpt) {
+                            todo.knownOutputPaths = false;
+                            break;
+                        }
+                        if (wantOutput(outputName, bfd.outputs))
+                            todo.wantedOutputs.insert(*pathOpt);
+                    }
+                    {
+                        auto outputsToQuery(outputsToQuery_.lock());
+                        for (auto & outPath : todo.wantedOutputs)
+                            outputsToQuery->insert(outPath);
+                    }
+                    builtTodos_.lock()->push_back(std::move(todo));
+                });
+            pool.process();
         }
-    };
-
-    doPath = [&](const DerivedPath & req) {
 
+        StorePathSet validOutputs;
         {
-            auto state(state_.lock());
-            if (!state->done.insert(req.to_string(*this)).second) return;
+            auto outputsToQuery(outputsToQuery_.lock());
+            if (!outputsToQuery->empty())
+                validOutputs = queryValidPaths(*outputsToQuery);
         }
 
-        std::visit(overloaded {
-          [&](const DerivedPath::Built & bfd) {
-            if (!isValidPath(bfd.drvPath)) {
-                // FIXME: we could try to substitute the derivation.
-                auto state(state_.lock());
-                state->unknown.insert(bfd.drvPath);
-                return;
-            }
+        auto classify = [&](const BuiltTodo & todo) {
+            auto & bfd = todo.bfd;
 
             StorePathSet invalid;
-            /* true for regular derivations, and CA derivations for which we
-               have a trust mapping for all wanted outputs. */
-            auto knownOutputPaths = true;
-            for (auto & [outputName, pathOpt] : queryPartialDerivationOutputMap(bfd.drvPath)) {
-                if (!pathOpt) {
-                    knownOutputPaths = false;
-                    break;
-                }
-                if (wantOutput(outputName, bfd.outputs) && !isValidPath(*pathOpt))
-                    invalid.insert(*pathOpt);
-            }
-            if (knownOutputPaths && invalid.empty()) return;
+            for (auto & outPath : todo.wantedOutputs)
+                if (!validOutputs.count(outPath))
+                    invalid.insert(outPath);
+            if (todo.knownOutputPaths && invalid.empty()) return;
 
             auto drv = make_ref<Derivation>(derivationFromPath(bfd.drvPath));
             ParsedDerivation parsedDrv(StorePath(bfd.drvPath), *drv);
 
-            if (knownOutputPaths && settings.useSubstitutes && parsedDrv.substitutesAllowed()) {
-                auto drvState = make_ref<Sync<DrvState>>(DrvState(invalid.size()));
-                for (auto & output : invalid)
-                    pool.enqueue(std::bind(checkOutput, bfd.drvPath, drv, output, drvState));
-            } else
-                mustBuildDrv(bfd.drvPath, *drv);
+            if (todo.knownOutputPaths && settings.useSubstitutes && parsedDrv.substitutesAllowed()) {
+                auto ca = getDerivationCA(*drv);
+                {
+                    auto candidates(candidates_.lock());
+                    for (auto & outPath : invalid)
+                        candidates->insert_or_assign(outPath, ca);
+                }
+                drvTodos_.lock()->push_back({bfd.drvPath, drv.get_ptr(), std::move(invalid)});
+            } else {
+                auto state(state_.lock());
+                mustBuildDrv(*state, bfd.drvPath, *drv);
+            }
+        };
 
-          },
-          [&](const DerivedPath::Opaque & bo) {
+        {
+            ThreadPool pool;
+            auto builtTodos(builtTodos_.lock());
+            for (auto & todo : *builtTodos)
+                pool.enqueue(std::bind(classify, std::ref(todo)));
+            pool.process();
+        }
 
-            if (isValidPath(bo.path)) return;
+        /* One bulk substituter query for the whole wave. */
+        SubstitutablePathInfos infos;
+        {
+            auto candidates(candidates_.lock());
+            if (!candidates->empty())
+                querySubstitutablePathInfos(*candidates, infos);
+        }
 
-            SubstitutablePathInfos infos;
-            querySubstitutablePathInfos({{bo.path, std::nullopt}}, infos);
+        auto state(state_.lock());
 
-            if (infos.empty()) {
-                auto state(state_.lock());
-                state->unknown.insert(bo.path);
-                return;
-            }
-
-            auto info = infos.find(bo.path);
-            assert(info != infos.end());
+        auto substitutePath = [&](const StorePath & path, const SubstitutablePathInfo & info) {
+            state->willSubstitute.insert(path);
+            state->downloadSize += info.downloadSize;
+            state->narSize += info.narSize;
+            for (auto & ref : info.references)
+                state->next.push_back(DerivedPath::Opaque { ref });
+        };
 
-            {
-                auto state(state_.lock());
-                state->willSubstitute.insert(bo.path);
-                state->downloadSize += info->second.downloadSize;
-                state->narSize += info->second.narSize;
+        for (auto & path : *opaqueTodos_.lock()) {
+            auto info = infos.find(path);
+            if (info == infos.end()) {
+                state->unknown.insert(path);
+                continue;
             }
+            substitutePath(path, info->second);
+        }
 
-            for (auto & ref : info->second.references)
-                pool.enqueue(std::bind(doPath, DerivedPath::Opaque { ref }));
-          },
-        }, req.raw());
-    };
-
-    for (auto & path : targets)
-        pool.enqueue(std::bind(doPath, path));
+        for (auto & todo : *drvTodos_.lock()) {
+            auto substitutable = true;
+            for (auto & outPath : todo.outPaths)
+                if (!infos.count(outPath)) {
+                    substitutable = false;
+                    break;
+                }
+            if (!substitutable) {
+                mustBuildDrv(*state, todo.drvPath, *todo.drv);
+                continue;
+            }
+            for (auto & outPath : todo.outPaths) {
+                /* Already queried in this wave, so handle the output
+                   directly instead of re-enqueueing it. */
+                if (!state->done.insert(printStorePath(outPath)).second) continue;
+                substitutePath(outPath, infos.at(outPath));
+            }
+        }
 
-    pool.process();
+        queue = std::move(state->next);
+        state->next.clear();
+    }
 }
 
 
@@ -277,7 +385,7 @@ std::map<DrvOutput, StorePath> drvOutputReferences(
 
     for (const auto& [inputDrv, outputNames] : drv.inputDrvs) {
         auto outputHashes =
-            staticOutputHashes(store, store.readDerivation(inputDrv));
+            staticOutputHashes(store, *store.readDerivationShared(inputDrv));
         for (const auto& outputName : outputNames) {
             auto thisRealisation = store.queryRealisation(
                 DrvOutput{outputHashes.at(outputName), outputName});
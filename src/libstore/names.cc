@@ -38,6 +38,11 @@ DrvName::DrvName(std::string_view s) : hits(0)
 }
 
 
+/* Out of line because Regex is incomplete in the header. */
+DrvName::DrvName(DrvName &&) = default;
+DrvName & DrvName::operator = (DrvName &&) = default;
+
+
 DrvName::~DrvName()
 { }
 
@@ -56,6 +61,13 @@ bool DrvName::matches(DrvName & n)
 }
 
 
+const VersionKey & DrvName::versionKey()
+{
+    if (!versionKey_) versionKey_ = VersionKey(version);
+    return *versionKey_;
+}
+
+
 string nextComponent(string::const_iterator & p,
     const string::const_iterator end)
 {
@@ -78,30 +90,41 @@ string nextComponent(string::const_iterator & p,
 }
 
 
-static bool componentsLT(const string & c1, const string & c2)
+VersionKey::VersionKey(const string & version)
 {
-    auto n1 = string2Int<int>(c1);
-    auto n2 = string2Int<int>(c2);
+    auto p = version.begin();
+    while (p != version.end()) {
+        Component c;
+        c.text = nextComponent(p, version.end());
+        c.number = string2Int<int>(c.text);
+        components.push_back(std::move(c));
+    }
+}
 
-    if (n1 && n2) return *n1 < *n2;
-    else if (c1 == "" && n2) return true;
-    else if (c1 == "pre" && c2 != "pre") return true;
-    else if (c2 == "pre") return false;
+
+static bool componentsLT(const VersionKey::Component & c1,
+    const VersionKey::Component & c2)
+{
+    if (c1.number && c2.number) return *c1.number < *c2.number;
+    else if (c1.text == "" && c2.number) return true;
+    else if (c1.text == "pre" && c2.text != "pre") return true;
+    else if (c2.text == "pre") return false;
     /* Assume that `2.3a' < `2.3.1'. */
-    else if (n2) return true;
-    else if (n1) return false;
-    else return c1 < c2;
+    else if (c2.number) return true;
+    else if (c1.number) return false;
+    else return c1.text < c2.text;
 }
 
 
-int compareVersions(const string & v1, const string & v2)
+int VersionKey::compare(const VersionKey & other) const
 {
-    string::const_iterator p1 = v1.begin();
-    string::const_iterator p2 = v2.begin();
+    /* A version that has run out of components compares like a
+       sequence of empty ones, as with compareVersions(). */
+    static const Component empty;
 
-    while (p1 != v1.end() || p2 != v2.end()) {
-        string c1 = nextComponent(p1, v1.end());
-        string c2 = nextComponent(p2, v2.end());
+    for (size_t i = 0; i < components.size() || i < other.components.size(); ++i) {
+        auto & c1 = i < components.size() ? components[i] : empty;
+        auto & c2 = i < other.components.size() ? other.components[i] : empty;
         if (componentsLT(c1, c2)) return -1;
         else if (componentsLT(c2, c1)) return 1;
     }
@@ -110,6 +133,12 @@ int compareVersions(const string & v1, const string & v2)
 }
 
 
+int compareVersions(const string & v1, const string & v2)
+{
+    return VersionKey(v1).compare(VersionKey(v2));
+}
+
+
 DrvNames drvNamesFromArgs(const Strings & opArgs)
 {
     DrvNames result;
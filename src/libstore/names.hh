@@ -1,6 +1,7 @@
 #pragma once
 
 #include <memory>
+#include <optional>
 
 #include "types.hh"
 
@@ -8,6 +9,34 @@ namespace nix {
 
 struct Regex;
 
+/* A version string pre-parsed into its dot/dash-separated components.
+   Comparing two keys is equivalent to compareVersions() on the
+   original strings, but doesn't re-tokenise them, which matters in
+   O(n × m) matching loops that compare the same versions over and
+   over (e.g. 'nix-env -u'). */
+struct VersionKey
+{
+    struct Component
+    {
+        std::optional<int> number; /* set iff the component is numeric */
+        string text;
+    };
+
+    std::vector<Component> components;
+
+    VersionKey() { }
+    VersionKey(const string & version);
+
+    /* Return -1, 0 or 1, with the same ordering as
+       compareVersions(). */
+    int compare(const VersionKey & other) const;
+
+    bool operator < (const VersionKey & other) const
+    {
+        return compare(other) < 0;
+    }
+};
+
 struct DrvName
 {
     string fullName;
@@ -17,12 +46,18 @@ struct DrvName
 
     DrvName();
     DrvName(std::string_view s);
+    DrvName(DrvName &&);
+    DrvName & operator = (DrvName &&);
     ~DrvName();
 
     bool matches(DrvName & n);
 
+    /* The version parsed into components, computed on first use. */
+    const VersionKey & versionKey();
+
 private:
     std::unique_ptr<Regex> regex;
+    std::optional<VersionKey> versionKey_;
 };
 
 typedef list<DrvName> DrvNames;
@@ -1,6 +1,7 @@
 #include "nar-accessor.hh"
 #include "archive.hh"
 #include "json.hh"
+#include "serialise.hh"
 
 #include <map>
 #include <stack>
@@ -10,6 +11,10 @@
 
 namespace nix {
 
+/* Magic prefix distinguishing the binary listing format from the
+   JSON one. */
+static const std::string narListingBinaryMagic = "nix-nar-listing-1\n";
+
 struct NarMember
 {
     FSAccessor::Type type = FSAccessor::Type::tMissing;
@@ -120,6 +125,43 @@ struct NarAccessor : public FSAccessor
     NarAccessor(const std::string & listing, GetNarBytes getNarBytes)
         : getNarBytes(getNarBytes)
     {
+        if (listing.compare(0, narListingBinaryMagic.size(), narListingBinaryMagic) == 0) {
+            auto body = listing.substr(narListingBinaryMagic.size());
+            StringSource source(body);
+
+            std::function<void(NarMember &)> recurse;
+
+            recurse = [&](NarMember & member) {
+                auto type = readNum<uint64_t>(source);
+                switch (type) {
+                case (uint64_t) FSAccessor::Type::tRegular:
+                    member.type = FSAccessor::Type::tRegular;
+                    member.isExecutable = readNum<uint64_t>(source) != 0;
+                    member.start = readNum<uint64_t>(source);
+                    member.size = readNum<uint64_t>(source);
+                    break;
+                case (uint64_t) FSAccessor::Type::tDirectory: {
+                    member.type = FSAccessor::Type::tDirectory;
+                    auto n = readNum<uint64_t>(source);
+                    for (uint64_t i = 0; i < n; ++i) {
+                        auto name = readString(source);
+                        recurse(member.children[name]);
+                    }
+                    break;
+                }
+                case (uint64_t) FSAccessor::Type::tSymlink:
+                    member.type = FSAccessor::Type::tSymlink;
+                    member.target = readString(source);
+                    break;
+                default:
+                    throw Error("unsupported node type in binary NAR listing");
+                }
+            };
+
+            recurse(root);
+            return;
+        }
+
         using json = nlohmann::json;
 
         std::function<void(NarMember &, json &)> recurse;
@@ -278,4 +320,40 @@ void listNar(JSONPlaceholder & res, ref<FSAccessor> accessor,
     }
 }
 
+static void listNarBinary(Sink & sink, ref<FSAccessor> accessor, const Path & path)
+{
+    auto st = accessor->stat(path);
+
+    sink << (uint64_t) st.type;
+
+    switch (st.type) {
+    case FSAccessor::Type::tRegular:
+        sink << (uint64_t) (st.isExecutable ? 1 : 0) << st.narOffset << st.fileSize;
+        break;
+    case FSAccessor::Type::tDirectory: {
+        auto names = accessor->readDirectory(path);
+        sink << (uint64_t) names.size();
+        /* StringSet iteration gives the entries in sorted order. */
+        for (auto & name : names) {
+            sink << name;
+            listNarBinary(sink, accessor, path + "/" + name);
+        }
+        break;
+    }
+    case FSAccessor::Type::tSymlink:
+        sink << accessor->readLink(path);
+        break;
+    default:
+        throw Error("path '%s' does not exist in NAR", path);
+    }
+}
+
+std::string listNarBinary(ref<FSAccessor> accessor)
+{
+    StringSink sink;
+    sink(narListingBinaryMagic);
+    listNarBinary(sink, accessor, "");
+    return std::move(*sink.s);
+}
+
 }
@@ -31,4 +31,10 @@ class JSONPlaceholder;
 void listNar(JSONPlaceholder & res, ref<FSAccessor> accessor,
     const Path & path, bool recurse);
 
+/* Like listNar(), but produce a compact binary listing
+   (length-prefixed names, sorted directory entries). It parses at a
+   fraction of the cost of the JSON listing; makeLazyNarAccessor()
+   detects the format automatically. */
+std::string listNarBinary(ref<FSAccessor> accessor);
+
 }
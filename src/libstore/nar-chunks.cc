@@ -0,0 +1,120 @@
+#include "nar-chunks.hh"
+
+#include <array>
+
+namespace nix {
+
+static const std::string narChunkManifestMagic = "nix-nar-chunks-1";
+
+/* The gear table is derived from a fixed seed (via splitmix64),
+   since chunk boundaries must be reproducible across machines and
+   Nix versions for deduplication to work. */
+static std::array<uint64_t, 256> makeGearTable()
+{
+    std::array<uint64_t, 256> table;
+    uint64_t x = 0x6e69782d6368756e; // "nix-chun"
+    for (auto & v : table) {
+        x += 0x9e3779b97f4a7c15;
+        uint64_t z = x;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+        v = z ^ (z >> 31);
+    }
+    return table;
+}
+
+static const std::array<uint64_t, 256> gearTable = makeGearTable();
+
+static size_t log2Floor(size_t n)
+{
+    size_t bits = 0;
+    while (n >>= 1) bits++;
+    return bits;
+}
+
+ChunkingSink::ChunkingSink(size_t avgSize, std::function<void(std::string_view)> emit)
+    : emit(std::move(emit))
+    , minSize(avgSize / 4)
+    , avgSize(avgSize)
+    , maxSize(avgSize * 4)
+{
+    assert(minSize > 0);
+    /* Before the average point the mask has two extra bits (making
+       cuts harder), after it two fewer (making them easier), which
+       keeps the chunk size distribution close to 'avgSize'. */
+    auto bits = log2Floor(avgSize);
+    maskS = (UINT64_C(1) << (bits + 2)) - 1;
+    maskL = (UINT64_C(1) << (bits - 2)) - 1;
+}
+
+void ChunkingSink::operator () (std::string_view data)
+{
+    pending.append(data);
+
+    for (;;) {
+        /* The first 'minSize' bytes of a chunk are never cut and not
+           hashed; the gear hash warms up over the bytes that
+           follow. */
+        if (scanned < minSize) {
+            scanned = std::min(pending.size(), minSize);
+            gear = 0;
+        }
+
+        auto p = (const unsigned char *) pending.data();
+        size_t cut = 0;
+
+        for (size_t i = scanned; i < pending.size(); ++i) {
+            gear = (gear << 1) + gearTable[p[i]];
+            if (!(gear & (i < avgSize ? maskS : maskL)) || i + 1 >= maxSize) {
+                cut = i + 1;
+                break;
+            }
+        }
+
+        if (!cut) {
+            scanned = pending.size();
+            return;
+        }
+
+        emit(std::string_view(pending).substr(0, cut));
+        pending.erase(0, cut);
+        scanned = 0;
+    }
+}
+
+void ChunkingSink::finish()
+{
+    if (!pending.empty())
+        emit(pending);
+    pending.clear();
+    scanned = 0;
+    gear = 0;
+}
+
+std::string NarChunkManifest::to_string() const
+{
+    StringSink sink;
+    sink << narChunkManifestMagic << compression << narSize << chunks.size();
+    for (auto & [hash, size] : chunks)
+        sink << hash.to_string(Base32, true) << size;
+    return std::move(*sink.s);
+}
+
+NarChunkManifest NarChunkManifest::parse(const std::string & s)
+{
+    NarChunkManifest res;
+    StringSource source(s);
+    if (readString(source) != narChunkManifestMagic)
+        throw Error("NAR chunk manifest has an unsupported format");
+    res.compression = readString(source);
+    res.narSize = readNum<uint64_t>(source);
+    auto n = readNum<uint64_t>(source);
+    for (uint64_t i = 0; i < n; ++i) {
+        auto hash = Hash::parseAnyPrefixed(readString(source));
+        auto size = readNum<uint64_t>(source);
+        res.chunks.emplace_back(hash, size);
+    }
+    return res;
+}
+
+}
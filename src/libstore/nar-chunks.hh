@@ -0,0 +1,50 @@
+#pragma once
+
+#include "hash.hh"
+#include "serialise.hh"
+
+namespace nix {
+
+/* A sink that splits the data written to it into content-defined
+   chunks using a FastCDC-style gear hash, passing each complete
+   chunk to 'emit'. Chunk boundaries depend only on the content, so
+   identical stretches of data produce identical chunks regardless of
+   their position in the stream. Call finish() to flush the final
+   (possibly short) chunk. */
+struct ChunkingSink : Sink
+{
+    std::function<void(std::string_view chunk)> emit;
+
+    const size_t minSize, avgSize, maxSize;
+
+    /* 'avgSize' is the target average chunk size; the minimum and
+       maximum chunk sizes are a quarter and four times it. */
+    ChunkingSink(size_t avgSize, std::function<void(std::string_view)> emit);
+
+    void operator () (std::string_view data) override;
+
+    void finish();
+
+private:
+
+    std::string pending;
+    size_t scanned = 0;
+    uint64_t gear = 0;
+    uint64_t maskS, maskL;
+};
+
+/* The manifest of a chunked NAR: the uncompressed hash and size of
+   every chunk, in order, plus the compression method of the chunk
+   files. */
+struct NarChunkManifest
+{
+    std::string compression;
+    uint64_t narSize = 0;
+    std::vector<std::pair<Hash, uint64_t>> chunks;
+
+    std::string to_string() const;
+
+    static NarChunkManifest parse(const std::string & s);
+};
+
+}
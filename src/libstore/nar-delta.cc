@@ -0,0 +1,125 @@
+#include "nar-delta.hh"
+
+#include <cstring>
+#include <unordered_map>
+
+namespace nix {
+
+/* A delta is the magic string followed by a sequence of
+   instructions: 1 <offset> <length> copies bytes from the base,
+   2 <data> inserts literal data, and 0 ends the delta. */
+static const std::string narDeltaMagic = "nix-nar-delta-1";
+
+static constexpr size_t blockSize = 4096;
+
+/* The rsync rolling checksum over a window of 'len' bytes: 'a' is the
+   sum of the bytes, 'b' the sum of the partial sums. It can be slid
+   one byte forward in O(1). */
+struct RollingChecksum
+{
+    uint32_t a = 0, b = 0;
+    uint32_t len;
+
+    RollingChecksum(const unsigned char * data, size_t len) : len(len)
+    {
+        for (size_t i = 0; i < len; ++i) {
+            a += data[i];
+            b += (uint32_t) (len - i) * data[i];
+        }
+    }
+
+    void roll(unsigned char out, unsigned char in)
+    {
+        a += in - out;
+        b += a - len * out;
+    }
+
+    uint32_t digest() const
+    {
+        return (b << 16) | (a & 0xffff);
+    }
+};
+
+void makeNarDelta(std::string_view base, std::string_view data, Sink & sink)
+{
+    sink << narDeltaMagic;
+
+    /* Index the non-overlapping blocks of the base by their weak
+       checksum. Collisions are resolved below by comparing the
+       actual bytes. */
+    std::unordered_multimap<uint32_t, size_t> blocks;
+    auto baseP = (const unsigned char *) base.data();
+    for (size_t o = 0; o + blockSize <= base.size(); o += blockSize)
+        blocks.emplace(RollingChecksum(baseP + o, blockSize).digest(), o);
+
+    auto dataP = (const unsigned char *) data.data();
+
+    auto flushLiteral = [&](size_t from, size_t to) {
+        if (to > from) {
+            sink << 2;
+            writeString(data.substr(from, to - from), sink);
+        }
+    };
+
+    size_t lit = 0; /* start of the pending literal data */
+    size_t i = 0;
+
+    if (data.size() >= blockSize && !blocks.empty()) {
+        RollingChecksum rc(dataP, blockSize);
+        while (i + blockSize <= data.size()) {
+            bool matched = false;
+            auto [lo, hi] = blocks.equal_range(rc.digest());
+            for (auto j = lo; j != hi; ++j) {
+                auto o = j->second;
+                if (memcmp(base.data() + o, data.data() + i, blockSize) != 0) continue;
+                /* Extend the match as far as it goes. */
+                size_t n = blockSize;
+                while (o + n < base.size() && i + n < data.size() && base[o + n] == data[i + n]) ++n;
+                flushLiteral(lit, i);
+                sink << 1 << (uint64_t) o << (uint64_t) n;
+                lit = i += n;
+                if (i + blockSize <= data.size())
+                    rc = RollingChecksum(dataP + i, blockSize);
+                matched = true;
+                break;
+            }
+            if (!matched) {
+                if (i + blockSize < data.size())
+                    rc.roll(dataP[i], dataP[i + blockSize]);
+                ++i;
+            }
+        }
+    }
+
+    flushLiteral(lit, data.size());
+
+    sink << 0;
+}
+
+void applyNarDelta(std::string_view base, Source & delta, Sink & sink)
+{
+    auto corrupt = []() {
+        return Error("NAR delta is corrupt");
+    };
+
+    if (readString(delta) != narDeltaMagic) throw corrupt();
+
+    while (true) {
+        auto op = readNum<uint64_t>(delta);
+        if (op == 0)
+            break;
+        else if (op == 1) {
+            auto offset = readNum<uint64_t>(delta);
+            auto length = readNum<uint64_t>(delta);
+            if (offset + length < offset || offset + length > base.size())
+                throw corrupt();
+            sink(base.substr(offset, length));
+        }
+        else if (op == 2)
+            sink(readString(delta));
+        else
+            throw corrupt();
+    }
+}
+
+}
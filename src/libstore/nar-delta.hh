@@ -0,0 +1,20 @@
+#pragma once
+
+#include "serialise.hh"
+
+namespace nix {
+
+/* Compute a binary delta that transforms 'base' into 'data', using an
+   rsync-style rolling checksum to find stretches shared between the
+   two, and write it to 'sink'. The result is a sequence of "copy a
+   range from the base" and "insert literal data" instructions; for
+   consecutive versions of the same package it is typically a small
+   fraction of the full NAR. */
+void makeNarDelta(std::string_view base, std::string_view data, Sink & sink);
+
+/* Apply a delta produced by makeNarDelta() to 'base', writing the
+   reconstructed data to 'sink'. Throws Error if the delta is
+   malformed. Note: the caller must verify the hash of the result. */
+void applyNarDelta(std::string_view base, Source & delta, Sink & sink);
+
+}
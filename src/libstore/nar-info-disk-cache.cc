@@ -70,6 +70,11 @@ public:
         int priority;
     };
 
+    /* Flush pending NAR info upserts to the database once this many
+       have accumulated, so a mass substitutability check pays for one
+       transaction per burst instead of one per path. */
+    const size_t maxPendingUpserts = 64;
+
     struct State
     {
         SQLite db;
@@ -77,6 +82,12 @@ public:
             queryNAR, insertRealisation, insertMissingRealisation,
             queryRealisation, purgeCache;
         std::map<std::string, Cache> caches;
+
+        /* Upserts not yet written to the database, keyed by (cache
+           id, hash part). A null value denotes a negative entry.
+           Lookups consult this map first, so buffering is not
+           observable. */
+        std::map<std::pair<int, std::string>, std::shared_ptr<const ValidPathInfo>> pendingUpserts;
     };
 
     Sync<State> _state;
@@ -156,6 +167,57 @@ public:
         });
     }
 
+    ~NarInfoDiskCacheImpl()
+    {
+        try {
+            auto state(_state.lock());
+            retrySQLite<void>([&]() { flushPending(*state); });
+        } catch (...) {
+            ignoreException();
+        }
+    }
+
+    /* Write all pending upserts in a single transaction. Must be
+       called with the state lock held, from within retrySQLite. */
+    void flushPending(State & state)
+    {
+        if (state.pendingUpserts.empty()) return;
+
+        SQLiteTxn txn(state.db);
+
+        auto now = time(0);
+
+        for (auto & [key, info] : state.pendingUpserts) {
+            if (info) {
+                auto narInfo = std::dynamic_pointer_cast<const NarInfo>(info);
+                state.insertNAR.use()
+                    (key.first)
+                    (key.second)
+                    (std::string(info->path.name()))
+                    (narInfo ? narInfo->url : "", narInfo != 0)
+                    (narInfo ? narInfo->compression : "", narInfo != 0)
+                    (narInfo && narInfo->fileHash ? narInfo->fileHash->to_string(Base32, true) : "", narInfo && narInfo->fileHash)
+                    (narInfo ? narInfo->fileSize : 0, narInfo != 0 && narInfo->fileSize)
+                    (info->narHash.to_string(Base32, true))
+                    (info->narSize)
+                    (concatStringsSep(" ", info->shortRefs()))
+                    (info->deriver ? std::string(info->deriver->to_string()) : "", (bool) info->deriver)
+                    (concatStringsSep(" ", info->sigs))
+                    (renderContentAddress(info->ca))
+                    (now).exec();
+            } else {
+                state.insertMissingNAR.use()
+                    (key.first)
+                    (key.second)
+                    (now).exec();
+            }
+        }
+
+        txn.commit();
+
+        state.pendingUpserts.clear();
+    }
+
     Cache & getCache(State & state, const std::string & uri)
     {
         auto i = state.caches.find(uri);
@@ -199,6 +261,55 @@ public:
         });
     }
 
+    /* Look up a single hash part. Must be called with the state lock
+       held, from within retrySQLite. */
+    std::pair<Outcome, std::shared_ptr<NarInfo>> queryNarInfo(
+        State & state, Cache & cache, const std::string & hashPart, time_t now)
+    {
+        /* Pending upserts shadow whatever is in the database. */
+        auto pending = state.pendingUpserts.find({cache.id, hashPart});
+        if (pending != state.pendingUpserts.end()) {
+            if (!pending->second)
+                return {oInvalid, 0};
+            auto narInfo = std::dynamic_pointer_cast<const NarInfo>(pending->second);
+            return {oValid, narInfo
+                ? std::make_shared<NarInfo>(*narInfo)
+                : std::make_shared<NarInfo>(*pending->second)};
+        }
+
+        auto queryNAR(state.queryNAR.use()
+            (cache.id)
+            (hashPart)
+            (now - settings.ttlNegativeNarInfoCache)
+            (now - settings.ttlPositiveNarInfoCache));
+
+        if (!queryNAR.next())
+            return {oUnknown, 0};
+
+        if (!queryNAR.getInt(0))
+            return {oInvalid, 0};
+
+        auto namePart = queryNAR.getStr(1);
+        auto narInfo = make_ref<NarInfo>(
+            StorePath(hashPart + "-" + namePart),
+            Hash::parseAnyPrefixed(queryNAR.getStr(6)));
+        narInfo->url = queryNAR.getStr(2);
+        narInfo->compression = queryNAR.getStr(3);
+        if (!queryNAR.isNull(4))
+            narInfo->fileHash = Hash::parseAnyPrefixed(queryNAR.getStr(4));
+        narInfo->fileSize = queryNAR.getInt(5);
+        narInfo->narSize = queryNAR.getInt(7);
+        for (auto & r : tokenizeString<Strings>(queryNAR.getStr(8), " "))
+            narInfo->references.insert(StorePath(r));
+        if (!queryNAR.isNull(9))
+            narInfo->deriver = StorePath(queryNAR.getStr(9));
+        for (auto & sig : tokenizeString<Strings>(queryNAR.getStr(10), " "))
+            narInfo->sigs.insert(sig);
+        narInfo->ca = parseContentAddressOpt(queryNAR.getStr(11));
+
+        return {oValid, narInfo};
+    }
+
     std::pair<Outcome, std::shared_ptr<NarInfo>> lookupNarInfo(
         const std::string & uri, const std::string & hashPart) override
     {
@@ -208,39 +319,31 @@ public:
 
             auto & cache(getCache(*state, uri));
 
-            auto now = time(0);
+            return queryNarInfo(*state, cache, hashPart, time(0));
+        });
+    }
 
-            auto queryNAR(state->queryNAR.use()
-                (cache.id)
-                (hashPart)
-                (now - settings.ttlNegativeNarInfoCache)
-                (now - settings.ttlPositiveNarInfoCache));
+    std::map<std::string, std::pair<Outcome, std::shared_ptr<NarInfo>>> lookupNarInfos(
+        const std::string & uri, const std::set<std::string> & hashParts) override
+    {
+        typedef std::map<std::string, std::pair<Outcome, std::shared_ptr<NarInfo>>> Result;
 
-            if (!queryNAR.next())
-                return {oUnknown, 0};
+        return retrySQLite<Result>([&]() -> Result {
+            auto state(_state.lock());
 
-            if (!queryNAR.getInt(0))
-                return {oInvalid, 0};
+            auto & cache(getCache(*state, uri));
+
+            auto now = time(0);
+
+            Result res;
 
-            auto namePart = queryNAR.getStr(1);
-            auto narInfo = make_ref<NarInfo>(
-                StorePath(hashPart + "-" + namePart),
-                Hash::parseAnyPrefixed(queryNAR.getStr(6)));
-            narInfo->url = queryNAR.getStr(2);
-            narInfo->compression = queryNAR.getStr(3);
-            if (!queryNAR.isNull(4))
-                narInfo->fileHash = Hash::parseAnyPrefixed(queryNAR.getStr(4));
-            narInfo->fileSize = queryNAR.getInt(5);
-            narInfo->narSize = queryNAR.getInt(7);
-            for (auto & r : tokenizeString<Strings>(queryNAR.getStr(8), " "))
-                narInfo->references.insert(StorePath(r));
-            if (!queryNAR.isNull(9))
-                narInfo->deriver = StorePath(queryNAR.getStr(9));
-            for (auto & sig : tokenizeString<Strings>(queryNAR.getStr(10), " "))
-                narInfo->sigs.insert(sig);
-            narInfo->ca = parseContentAddressOpt(queryNAR.getStr(11));
-
-            return {oValid, narInfo};
+            for (auto & hashPart : hashParts) {
+                auto r = queryNarInfo(*state, cache, hashPart, now);
+                if (r.first != oUnknown)
+                    res.emplace(hashPart, std::move(r));
+            }
+
+            return res;
         });
     }
 
@@ -280,40 +383,19 @@ public:
         const std::string & uri, const std::string & hashPart,
         std::shared_ptr<const ValidPathInfo> info) override
     {
-        retrySQLite<void>([&]() {
-            auto state(_state.lock());
-
-            auto & cache(getCache(*state, uri));
-
-            if (info) {
+        auto state(_state.lock());
 
-                auto narInfo = std::dynamic_pointer_cast<const NarInfo>(info);
+        auto & cache(getCache(*state, uri));
 
-                //assert(hashPart == storePathToHash(info->path));
+        //assert(hashPart == storePathToHash(info->path));
 
-                state->insertNAR.use()
-                    (cache.id)
-                    (hashPart)
-                    (std::string(info->path.name()))
-                    (narInfo ? narInfo->url : "", narInfo != 0)
-                    (narInfo ? narInfo->compression : "", narInfo != 0)
-                    (narInfo && narInfo->fileHash ? narInfo->fileHash->to_string(Base32, true) : "", narInfo && narInfo->fileHash)
-                    (narInfo ? narInfo->fileSize : 0, narInfo != 0 && narInfo->fileSize)
-                    (info->narHash.to_string(Base32, true))
-                    (info->narSize)
-                    (concatStringsSep(" ", info->shortRefs()))
-                    (info->deriver ? std::string(info->deriver->to_string()) : "", (bool) info->deriver)
-                    (concatStringsSep(" ", info->sigs))
-                    (renderContentAddress(info->ca))
-                    (time(0)).exec();
+        /* Just buffer the entry; it's written out, together with
+           everything else that accumulated in the meantime, once the
+           buffer fills up (or at exit). */
+        state->pendingUpserts[{cache.id, hashPart}] = info;
 
-            } else {
-                state->insertMissingNAR.use()
-                    (cache.id)
-                    (hashPart)
-                    (time(0)).exec();
-            }
-        });
+        if (state->pendingUpserts.size() >= maxPendingUpserts)
+            retrySQLite<void>([&]() { flushPending(*state); });
     }
 
     void upsertRealisation(
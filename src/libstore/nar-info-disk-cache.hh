@@ -27,6 +27,12 @@ public:
     virtual std::pair<Outcome, std::shared_ptr<NarInfo>> lookupNarInfo(
         const std::string & uri, const std::string & hashPart) = 0;
 
+    /* Look up a whole set of hash parts in one go. The result only
+       contains entries for hash parts that are in the cache (i.e. an
+       absent key means oUnknown). */
+    virtual std::map<std::string, std::pair<Outcome, std::shared_ptr<NarInfo>>> lookupNarInfos(
+        const std::string & uri, const std::set<std::string> & hashParts) = 0;
+
     virtual void upsertNarInfo(
         const std::string & uri, const std::string & hashPart,
         std::shared_ptr<const ValidPathInfo> info) = 0;
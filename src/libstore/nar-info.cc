@@ -78,6 +78,17 @@ NarInfo::NarInfo(const Store & store, const std::string & s, const std::string &
             // FIXME: allow blank ca or require skipping field?
             ca = parseContentAddressOpt(value);
         }
+        else if (name == "DeltaURL")
+            deltaUrl = value;
+        else if (name == "DeltaSize") {
+            auto n = string2Int<decltype(deltaSize)>(value);
+            if (!n) throw corrupt();
+            deltaSize = *n;
+        }
+        else if (name == "DeltaBase")
+            deltaBase = StorePath(value);
+        else if (name == "ChunksURL")
+            chunksUrl = value;
 
         pos = eol + 1;
     }
@@ -115,6 +126,15 @@ std::string NarInfo::to_string(const Store & store) const
     if (ca)
         res += "CA: " + renderContentAddress(*ca) + "\n";
 
+    if (!deltaUrl.empty() && deltaBase) {
+        res += "DeltaURL: " + deltaUrl + "\n";
+        res += "DeltaSize: " + std::to_string(deltaSize) + "\n";
+        res += "DeltaBase: " + std::string(deltaBase->to_string()) + "\n";
+    }
+
+    if (!chunksUrl.empty())
+        res += "ChunksURL: " + chunksUrl + "\n";
+
     return res;
 }
 
@@ -16,6 +16,17 @@ struct NarInfo : ValidPathInfo
     uint64_t fileSize = 0;
     std::string system;
 
+    /* An optional binary delta against an older version of this
+       path: a client that has 'deltaBase' can download 'deltaUrl'
+       (of 'deltaSize' bytes) instead of the full NAR. */
+    std::string deltaUrl;
+    uint64_t deltaSize = 0;
+    std::optional<StorePath> deltaBase;
+
+    /* If set, the NAR is stored as content-defined chunks and this
+       is the URL of the chunk manifest (see NarChunkManifest). */
+    std::string chunksUrl;
+
     NarInfo() = delete;
     NarInfo(StorePath && path, Hash narHash) : ValidPathInfo(std::move(path), narHash) { }
     NarInfo(const ValidPathInfo & info) : ValidPathInfo(info) { }
@@ -1,6 +1,7 @@
 #include "util.hh"
 #include "local-store.hh"
 #include "globals.hh"
+#include "thread-pool.hh"
 
 #include <cstdlib>
 #include <cstring>
@@ -11,6 +12,14 @@
 #include <stdio.h>
 #include <regex>
 
+#if __linux__
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+#endif
+
 
 namespace nix {
 
@@ -39,21 +48,117 @@ struct MakeReadOnly
 };
 
 
+#if __linux__
+
+enum struct CloneResult { Ok, Exists, Unsupported };
+
+/* Create 'to' as a new file whose data extents are shared with those
+   of 'from', i.e. a metadata-only copy on reflink-capable filesystems
+   such as btrfs and XFS. */
+static CloneResult cloneFile(const Path & from, const Path & to, mode_t mode)
+{
+    AutoCloseFD fdFrom = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fdFrom) throw SysError("opening file '%1%'", from);
+
+    AutoCloseFD fdTo = open(to.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, mode);
+    if (!fdTo) {
+        if (errno == EEXIST) return CloneResult::Exists;
+        throw SysError("creating file '%1%'", to);
+    }
+
+    if (ioctl(fdTo.get(), FICLONE, fdFrom.get()) == -1) {
+        int err = errno;
+        unlink(to.c_str());
+        if (err == EOPNOTSUPP || err == EINVAL || err == EXDEV || err == ENOTTY)
+            return CloneResult::Unsupported;
+        errno = err;
+        throw SysError("cloning '%1%' to '%2%'", from, to);
+    }
+
+    return CloneResult::Ok;
+}
+
+
+/* Deduplicate 'path' against 'linkPath' by sharing data extents
+   instead of hard linking. Each store file keeps its own inode, which
+   sidesteps the maximum hard-link count and suits filesystems tuned
+   for reflinks, at the cost of not being able to recognise
+   already-deduplicated files by their inode (so re-running the
+   optimiser re-clones them). Returns false if the filesystem doesn't
+   support reflinks, in which case the caller falls back to hard
+   links. */
+static bool reflinkPath(Activity * act, OptimiseStats & stats,
+    const Path & realStoreDir, const Path & path, const Path & linkPath,
+    struct stat & st)
+{
+ retry:
+    if (!pathExists(linkPath)) {
+        /* Publish the contents by cloning them into the links
+           directory. EEXIST just means another process got there
+           first; the clone itself already shares our extents, so
+           there is nothing further to do. */
+        auto res = cloneFile(path, linkPath, st.st_mode);
+        if (res == CloneResult::Unsupported)
+            return false;
+        if (res == CloneResult::Ok)
+            return true;
+    }
+
+    auto stLink = lstat(linkPath);
+
+    if (st.st_size != stLink.st_size) {
+        warn("removing corrupted link '%s'", linkPath);
+        unlink(linkPath.c_str());
+        goto retry;
+    }
+
+    printMsg(lvlTalkative, format("reflinking '%1%' to '%2%'") % path % linkPath);
+
+    /* Make the containing directory writable, but only if it's not
+       the store itself (we don't want or need to mess with its
+       permissions). */
+    bool mustToggle = dirOf(path) != realStoreDir;
+    if (mustToggle) makeWritable(dirOf(path));
+
+    /* When we're done, make the directory read-only again and reset
+       its timestamp back to 0. */
+    MakeReadOnly makeReadOnly(mustToggle ? dirOf(path) : "");
+
+    Path tempLink = (format("%1%/.tmp-link-%2%-%3%")
+        % realStoreDir % getpid() % random()).str();
+
+    if (cloneFile(linkPath, tempLink, st.st_mode) != CloneResult::Ok)
+        return false;
+
+    /* Atomically replace the old file with the new clone. */
+    if (rename(tempLink.c_str(), path.c_str()) == -1) {
+        if (unlink(tempLink.c_str()) == -1)
+            printError("unable to unlink '%1%'", tempLink);
+        throw SysError("cannot rename '%1%' to '%2%'", tempLink, path);
+    }
+
+    stats.filesLinked++;
+    stats.bytesFreed += st.st_size;
+    stats.blocksFreed += st.st_blocks;
+
+    if (act)
+        act->result(resFileLinked, st.st_size, st.st_blocks);
+
+    return true;
+}
+
+#endif
+
+
 LocalStore::InodeHash LocalStore::loadInodeHash()
 {
     debug("loading hash inodes in memory");
     InodeHash inodeHash;
 
-    AutoCloseDir dir(opendir(linksDir.c_str()));
-    if (!dir) throw SysError("opening directory '%1%'", linksDir);
-
-    struct dirent * dirent;
-    while (errno = 0, dirent = readdir(dir.get())) { /* sic */
-        checkInterrupt();
-        // We don't care if we hit non-hash files, anything goes
-        inodeHash.insert(dirent->d_ino);
-    }
-    if (errno) throw SysError("reading directory '%1%'", linksDir);
+    // We don't care if we hit non-hash files, anything goes
+    forEachDirEntry(linksDir, [&](const DirEntryView & entry) {
+        inodeHash.insert(entry.ino);
+    });
 
     printMsg(lvlTalkative, format("loaded %1% hash inodes") % inodeHash.size());
 
@@ -61,34 +166,26 @@ LocalStore::InodeHash LocalStore::loadInodeHash()
 }
 
 
-Strings LocalStore::readDirectoryIgnoringInodes(const Path & path, const InodeHash & inodeHash)
+Strings LocalStore::readDirectoryIgnoringInodes(const Path & path, Sync<InodeHash> & inodeHash_)
 {
     Strings names;
 
-    AutoCloseDir dir(opendir(path.c_str()));
-    if (!dir) throw SysError("opening directory '%1%'", path);
+    auto inodeHash(inodeHash_.lock());
 
-    struct dirent * dirent;
-    while (errno = 0, dirent = readdir(dir.get())) { /* sic */
-        checkInterrupt();
-
-        if (inodeHash.count(dirent->d_ino)) {
-            debug(format("'%1%' is already linked") % dirent->d_name);
-            continue;
+    forEachDirEntry(path, [&](const DirEntryView & entry) {
+        if (inodeHash->count(entry.ino)) {
+            debug(format("'%1%' is already linked") % entry.name);
+            return;
         }
-
-        string name = dirent->d_name;
-        if (name == "." || name == "..") continue;
-        names.push_back(name);
-    }
-    if (errno) throw SysError("reading directory '%1%'", path);
+        names.push_back(string(entry.name));
+    });
 
     return names;
 }
 
 
 void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
-    const Path & path, InodeHash & inodeHash)
+    const Path & path, Sync<InodeHash> & inodeHash)
 {
     checkInterrupt();
 
@@ -131,7 +228,7 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
     }
 
     /* This can still happen on top-level files. */
-    if (st.st_nlink > 1 && inodeHash.count(st.st_ino)) {
+    if (st.st_nlink > 1 && inodeHash.lock()->count(st.st_ino)) {
         debug("'%s' is already linked, with %d other file(s)", path, st.st_nlink - 2);
         return;
     }
@@ -151,11 +248,21 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
     /* Check if this is a known hash. */
     Path linkPath = linksDir + "/" + hash.to_string(Base32, false);
 
+#if __linux__
+    /* On reflink-capable filesystems, deduplicate by sharing data
+       extents with the links directory copy rather than hard
+       linking, if enabled. If the filesystem turns out not to
+       support reflinks, fall through to hard links. */
+    if (settings.useReflinks && S_ISREG(st.st_mode)
+        && reflinkPath(act, stats, realStoreDir, path, linkPath, st))
+        return;
+#endif
+
  retry:
     if (!pathExists(linkPath)) {
         /* Nope, create a hard link in the links directory. */
         if (link(path.c_str(), linkPath.c_str()) == 0) {
-            inodeHash.insert(st.st_ino);
+            inodeHash.lock()->insert(st.st_ino);
             return;
         }
 
@@ -249,22 +356,35 @@ void LocalStore::optimiseStore(OptimiseStats & stats)
     Activity act(*logger, actOptimiseStore);
 
     auto paths = queryAllValidPaths();
-    InodeHash inodeHash = loadInodeHash();
+    Sync<InodeHash> inodeHash{loadInodeHash()};
 
     act.progress(0, paths.size());
 
-    uint64_t done = 0;
+    std::atomic<uint64_t> done{0};
+
+    /* Hash and deduplicate the store paths on a thread pool, since
+       hashing dominates a full pass. Concurrent attempts to create
+       the same links directory entry are resolved by the EEXIST retry
+       logic in optimisePath_(), exactly as they are between
+       concurrent processes. */
+    ThreadPool pool;
 
     for (auto & i : paths) {
         addTempRoot(i);
-        if (!isValidPath(i)) continue; /* path was GC'ed, probably */
-        {
-            Activity act(*logger, lvlTalkative, actUnknown, fmt("optimising path '%s'", printStorePath(i)));
-            optimisePath_(&act, stats, realStoreDir + "/" + std::string(i.to_string()), inodeHash);
-        }
-        done++;
-        act.progress(done, paths.size());
+        pool.enqueue([&, i]() {
+            if (!isValidPath(i)) return; /* path was GC'ed, probably */
+            {
+                Activity act(*logger, lvlTalkative, actUnknown, fmt("optimising path '%s'", printStorePath(i)));
+                optimisePath_(&act, stats, realStoreDir + "/" + std::string(i.to_string()), inodeHash);
+            }
+            /* Hard-linking changed the path's on-disk footprint, so
+               refresh its recorded size. */
+            updatePathDiskSize(i);
+            act.progress(++done, paths.size());
+        });
     }
+
+    pool.process();
 }
 
 void LocalStore::optimiseStore()
@@ -275,13 +395,13 @@ void LocalStore::optimiseStore()
 
     printInfo("%s freed by hard-linking %d files",
         showBytes(stats.bytesFreed),
-        stats.filesLinked);
+        stats.filesLinked.load());
 }
 
 void LocalStore::optimisePath(const Path & path)
 {
     OptimiseStats stats;
-    InodeHash inodeHash;
+    Sync<InodeHash> inodeHash;
 
     if (settings.autoOptimiseStore) optimisePath_(nullptr, stats, path, inodeHash);
 }
@@ -1,4 +1,5 @@
 #include "parsed-derivations.hh"
+#include "sync.hh"
 
 #include <nlohmann/json.hpp>
 #include <regex>
@@ -6,16 +7,31 @@
 
 namespace nix {
 
+/* Parsed __json attributes, keyed by derivation path. The same
+   derivation is typically inspected many times per build (goal
+   (re)starts, queryMissing, the build hook), and structured attrs can
+   be multi-megabyte documents, so parse each one only once per
+   process. */
+static Sync<std::map<StorePath, std::shared_ptr<const nlohmann::json>>> structuredAttrsCache;
+
 ParsedDerivation::ParsedDerivation(const StorePath & drvPath, BasicDerivation & drv)
     : drvPath(drvPath), drv(drv)
 {
     /* Parse the __json attribute, if any. */
     auto jsonAttr = drv.env.find("__json");
     if (jsonAttr != drv.env.end()) {
-        try {
-            structuredAttrs = std::make_unique<nlohmann::json>(nlohmann::json::parse(jsonAttr->second));
-        } catch (std::exception & e) {
-            throw Error("cannot process __json attribute of '%s': %s", drvPath.to_string(), e.what());
+        {
+            auto cache(structuredAttrsCache.lock());
+            auto i = cache->find(drvPath);
+            if (i != cache->end()) structuredAttrs = i->second;
+        }
+        if (!structuredAttrs) {
+            try {
+                structuredAttrs = std::make_shared<const nlohmann::json>(nlohmann::json::parse(jsonAttr->second));
+            } catch (std::exception & e) {
+                throw Error("cannot process __json attribute of '%s': %s", drvPath.to_string(), e.what());
+            }
+            structuredAttrsCache.lock()->insert_or_assign(drvPath, structuredAttrs);
         }
     }
 }
@@ -90,12 +106,15 @@ std::optional<Strings> ParsedDerivation::getStringsAttr(const std::string & name
 
 StringSet ParsedDerivation::getRequiredSystemFeatures() const
 {
-    StringSet res;
-    for (auto & i : getStringsAttr("requiredSystemFeatures").value_or(Strings()))
-        res.insert(i);
-    if (!derivationHasKnownOutputPaths(drv.type()))
-        res.insert("ca-derivations");
-    return res;
+    if (!requiredSystemFeatures) {
+        StringSet res;
+        for (auto & i : getStringsAttr("requiredSystemFeatures").value_or(Strings()))
+            res.insert(i);
+        if (!derivationHasKnownOutputPaths(drv.type()))
+            res.insert("ca-derivations");
+        requiredSystemFeatures = std::move(res);
+    }
+    return *requiredSystemFeatures;
 }
 
 bool ParsedDerivation::canBuildLocally(Store & localStore) const
@@ -117,12 +136,16 @@ bool ParsedDerivation::canBuildLocally(Store & localStore) const
 
 bool ParsedDerivation::willBuildLocally(Store & localStore) const
 {
-    return getBoolAttr("preferLocalBuild") && canBuildLocally(localStore);
+    if (!preferLocalBuild)
+        preferLocalBuild = getBoolAttr("preferLocalBuild");
+    return *preferLocalBuild && canBuildLocally(localStore);
 }
 
 bool ParsedDerivation::substitutesAllowed() const
 {
-    return getBoolAttr("allowSubstitutes", true);
+    if (!allowSubstitutes)
+        allowSubstitutes = getBoolAttr("allowSubstitutes", true);
+    return *allowSubstitutes;
 }
 
 static std::regex shVarName("[A-Za-z_][A-Za-z0-9_]*");
@@ -10,7 +10,12 @@ class ParsedDerivation
 {
     StorePath drvPath;
     BasicDerivation & drv;
-    std::unique_ptr<nlohmann::json> structuredAttrs;
+    std::shared_ptr<const nlohmann::json> structuredAttrs;
+
+    /* Memoized hot attributes, so that repeated scheduling checks
+       don't have to touch the JSON DOM. */
+    mutable std::optional<bool> preferLocalBuild, allowSubstitutes;
+    mutable std::optional<StringSet> requiredSystemFeatures;
 
 public:
 
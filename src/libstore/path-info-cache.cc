@@ -0,0 +1,199 @@
+#include "path-info-cache.hh"
+#include "pathlocks.hh"
+#include "serialise.hh"
+#include "store-api.hh"
+#include "finally.hh"
+
+#include <atomic>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace nix {
+
+/* File layout: a fixed header followed by an append-only sequence of
+   records. Each record is a 32-bit length followed by a ValidPathInfo
+   in the serialisation used by the daemon protocol. A record is
+   immutable once 'used' has been advanced past it, so readers never
+   need to lock the file; appenders serialise through a write lock on
+   the file descriptor. A record for a path that already has one
+   supersedes the earlier record. */
+
+struct SharedPathInfoCache::Header
+{
+    uint64_t magic;
+
+    /* Bumped on invalidation. */
+    std::atomic<uint64_t> generation;
+
+    /* The end of the record area. Advanced only after the record has
+       been fully written. */
+    std::atomic<uint64_t> used;
+};
+
+static const uint64_t cacheFileMagic = 0x314349502d78696e; // "nix-PIC1"
+
+/* The daemon protocol serialisation version used for the records;
+   must be >= 16 so that all ValidPathInfo fields round-trip. */
+static const unsigned int cacheFormat = 16;
+
+static void preadFull(int fd, char * buf, size_t count, uint64_t offset)
+{
+    while (count) {
+        ssize_t res = pread(fd, buf, count, offset);
+        if (res == -1) {
+            if (errno == EINTR) continue;
+            throw SysError("reading from path info cache");
+        }
+        if (res == 0)
+            throw Error("unexpected end of file in path info cache");
+        count -= res;
+        buf += res;
+        offset += res;
+    }
+}
+
+static void pwriteFull(int fd, const char * buf, size_t count, uint64_t offset)
+{
+    while (count) {
+        ssize_t res = pwrite(fd, buf, count, offset);
+        if (res == -1) {
+            if (errno == EINTR) continue;
+            throw SysError("writing to path info cache");
+        }
+        count -= res;
+        buf += res;
+        offset += res;
+    }
+}
+
+SharedPathInfoCache::SharedPathInfoCache(const Path & path)
+{
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd)
+        writable = true;
+    else {
+        fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (!fd)
+            throw SysError("opening path info cache '%s'", path);
+    }
+
+    struct stat st;
+    if (fstat(fd.get(), &st) == -1)
+        throw SysError("statting path info cache '%s'", path);
+
+    if ((uint64_t) st.st_size < sizeof(Header)) {
+        if (!writable)
+            throw Error("path info cache '%s' is truncated", path);
+        /* Initialise the header under the file lock so that
+           concurrent creators don't clobber each other. */
+        lockFile(fd.get(), ltWrite, true);
+        Finally unlock([&]() { lockFile(fd.get(), ltNone, false); });
+        if (fstat(fd.get(), &st) == -1)
+            throw SysError("statting path info cache '%s'", path);
+        if ((uint64_t) st.st_size < sizeof(Header)) {
+            Header h{cacheFileMagic, {0}, {sizeof(Header)}};
+            pwriteFull(fd.get(), (const char *) &h, sizeof(h), 0);
+        }
+    }
+
+    void * p = mmap(nullptr, sizeof(Header),
+        PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED, fd.get(), 0);
+    if (p == MAP_FAILED)
+        throw SysError("mapping path info cache '%s'", path);
+    header = (Header *) p;
+
+    if (header->magic != cacheFileMagic)
+        throw Error("path info cache '%s' has an unrecognised format", path);
+}
+
+SharedPathInfoCache::~SharedPathInfoCache()
+{
+    if (header) munmap(header, sizeof(Header));
+}
+
+void SharedPathInfoCache::refresh(IndexState & state, const Store & store)
+{
+    auto generation = header->generation.load();
+    if (generation != state.generation) {
+        state.entries.clear();
+        state.scanned = sizeof(Header);
+        state.generation = generation;
+    }
+
+    auto used = header->used.load();
+
+    while (state.scanned < used) {
+        uint32_t len;
+        if (state.scanned + sizeof(len) > used)
+            throw Error("corrupt record in path info cache");
+        preadFull(fd.get(), (char *) &len, sizeof(len), state.scanned);
+        if (state.scanned + sizeof(len) + len > used)
+            throw Error("corrupt record in path info cache");
+        std::string buf(len, 0);
+        preadFull(fd.get(), buf.data(), len, state.scanned + sizeof(len));
+        StringSource source { buf };
+        auto info = std::make_shared<ValidPathInfo>(
+            ValidPathInfo::read(source, store, cacheFormat));
+        auto hashPart = std::string(info->path.hashPart());
+        state.entries.insert_or_assign(std::move(hashPart), std::move(info));
+        state.scanned += sizeof(len) + len;
+    }
+}
+
+std::shared_ptr<const ValidPathInfo> SharedPathInfoCache::lookup(
+    const Store & store, const std::string & hashPart)
+{
+    auto state(index.lock());
+    refresh(*state, store);
+    auto i = state->entries.find(hashPart);
+    return i == state->entries.end() ? nullptr : i->second;
+}
+
+void SharedPathInfoCache::add(const Store & store, const ValidPathInfo & info)
+{
+    if (!writable) return;
+
+    /* Skip paths that already have an up-to-date record. */
+    {
+        auto state(index.lock());
+        refresh(*state, store);
+        auto i = state->entries.find(std::string(info.path.hashPart()));
+        if (i != state->entries.end()
+            && i->second->narHash == info.narHash
+            && i->second->references == info.references
+            && i->second->sigs == info.sigs)
+            return;
+    }
+
+    StringSink sink;
+    info.write(sink, store, cacheFormat);
+    uint32_t len = sink.s->size();
+
+    std::string record((const char *) &len, sizeof(len));
+    record += *sink.s;
+
+    lockFile(fd.get(), ltWrite, true);
+    Finally unlock([&]() { lockFile(fd.get(), ltNone, false); });
+
+    auto used = header->used.load();
+    pwriteFull(fd.get(), record.data(), record.size(), used);
+    header->used.store(used + record.size());
+}
+
+void SharedPathInfoCache::invalidateAll()
+{
+    if (!writable) return;
+
+    lockFile(fd.get(), ltWrite, true);
+    Finally unlock([&]() { lockFile(fd.get(), ltNone, false); });
+
+    header->generation++;
+    header->used.store(sizeof(Header));
+    if (ftruncate(fd.get(), sizeof(Header)) == -1)
+        throw SysError("truncating path info cache");
+}
+
+}
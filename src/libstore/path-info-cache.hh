@@ -0,0 +1,76 @@
+#pragma once
+
+#include "path-info.hh"
+#include "sync.hh"
+#include "util.hh"
+
+#include <map>
+
+namespace nix {
+
+class Store;
+
+/* A cache of ValidPathInfo records shared between processes through a
+   memory-mapped file. It allows a freshly started process to reuse
+   path info looked up by earlier processes without re-querying the
+   store for every path.
+
+   The cache is a read-through cache: processes that can write to the
+   file append records as they query the store, and every reader
+   maintains an in-memory index over the record area. A generation
+   counter in the mmap'd header is bumped whenever a path is
+   invalidated (e.g. by the garbage collector), causing readers to
+   discard their index and writers to start a fresh record area. */
+class SharedPathInfoCache
+{
+private:
+
+    struct Header;
+
+    AutoCloseFD fd;
+
+    /* The mmap'd header of the cache file. */
+    Header * header = nullptr;
+
+    bool writable = false;
+
+    struct IndexState
+    {
+        /* The generation the index was built against. */
+        uint64_t generation = 0;
+
+        /* How far into the record area we have parsed. */
+        uint64_t scanned = 0;
+
+        /* Path infos parsed so far, keyed by the hash part of the
+           store path. */
+        std::map<std::string, std::shared_ptr<const ValidPathInfo>> entries;
+    };
+
+    Sync<IndexState> index;
+
+    /* Bring the index up to date with the record area, discarding it
+       first if the generation has changed. */
+    void refresh(IndexState & state, const Store & store);
+
+public:
+
+    SharedPathInfoCache(const Path & path);
+
+    ~SharedPathInfoCache();
+
+    /* Look up a path info by the hash part of its store path.
+       Returns null on a cache miss. */
+    std::shared_ptr<const ValidPathInfo> lookup(
+        const Store & store, const std::string & hashPart);
+
+    /* Add a record to the cache. A no-op if the cache file is not
+       writable by this process. */
+    void add(const Store & store, const ValidPathInfo & info);
+
+    /* Invalidate the entire cache by bumping the generation
+       counter. */
+    void invalidateAll();
+};
+
+}
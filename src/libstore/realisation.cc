@@ -33,12 +33,16 @@ void Realisation::closure(Store & store, const std::set<Realisation> & startOutp
 {
     auto getDeps = [&](const Realisation& current) -> std::set<Realisation> {
         std::set<Realisation> res;
-        for (auto& [currentDep, _] : current.dependentRealisations) {
-            if (auto currentRealisation = store.queryRealisation(currentDep))
-                res.insert(*currentRealisation);
-            else
+        std::set<DrvOutput> ids;
+        for (auto& [currentDep, _] : current.dependentRealisations)
+            ids.insert(currentDep);
+        auto realisations = store.queryRealisations(ids);
+        for (auto& id : ids) {
+            auto i = realisations.find(id);
+            if (i == realisations.end())
                 throw Error(
-                    "Unrealised derivation '%s'", currentDep.to_string());
+                    "Unrealised derivation '%s'", id.to_string());
+            res.insert(*i->second);
         }
         return res;
     };
@@ -14,10 +14,25 @@ namespace nix {
 static size_t refLength = 32; /* characters */
 
 
-static void search(
-    std::string_view s,
-    StringSet & hashes,
-    StringSet & seen)
+static uint32_t firstWord(const char * s)
+{
+    uint32_t w;
+    memcpy(&w, s, sizeof(w));
+    return w;
+}
+
+
+RefScanSink::RefScanSink(StringSet && hashes)
+{
+    for (auto & hash : hashes) {
+        assert(hash.size() == refLength);
+        prefixes.insert(firstWord(hash.data()));
+        this->hashes.insert(hash);
+    }
+}
+
+
+void RefScanSink::search(std::string_view s)
 {
     static std::once_flag initialised;
     static bool isBase32[256];
@@ -37,11 +52,17 @@ static void search(
                 break;
             }
         if (!match) continue;
-        std::string ref(s.substr(i, refLength));
-        if (hashes.erase(ref)) {
-            debug(format("found reference to '%1%' at offset '%2%'")
-                  % ref % i);
-            seen.insert(ref);
+        /* All remaining windows in a base32 run land here, so reject
+           the overwhelming majority on a single word comparison
+           before doing a full lookup. */
+        if (prefixes.count(firstWord(s.data() + i))) {
+            auto ref = s.substr(i, refLength);
+            if (auto it = hashes.find(ref); it != hashes.end()) {
+                debug(format("found reference to '%1%' at offset '%2%'")
+                      % std::string(ref) % i);
+                seen.insert(std::string(ref));
+                hashes.erase(it);
+            }
         }
         ++i;
     }
@@ -54,10 +75,10 @@ void RefScanSink::operator () (std::string_view data)
        fragment, so search in the concatenation of the tail of the
        previous fragment and the start of the current fragment. */
     auto s = tail;
-    s.append(data.data(), refLength);
-    search(s, hashes, seen);
+    s.append(data.data(), std::min(data.size(), refLength));
+    search(s);
 
-    search(data, hashes, seen);
+    search(data);
 
     auto tailLen = std::min(data.size(), refLength);
     auto rest = refLength - tailLen;
@@ -110,9 +131,13 @@ StorePathSet scanForReferences(
 
 
 RewritingSink::RewritingSink(const std::string & from, const std::string & to, Sink & nextSink)
-    : from(from), to(to), nextSink(nextSink)
+    : RewritingSink(StringMap{{from, to}}, nextSink)
+{
+}
+
+RewritingSink::RewritingSink(const StringMap & rewrites, Sink & nextSink)
+    : rewriter(rewrites), nextSink(nextSink)
 {
-    assert(from.size() == to.size());
 }
 
 void RewritingSink::operator () (std::string_view data)
@@ -120,27 +145,53 @@ void RewritingSink::operator () (std::string_view data)
     std::string s(prev);
     s.append(data);
 
-    size_t j = 0;
-    while ((j = s.find(from, j)) != string::npos) {
-        matches.push_back(pos + j);
-        s.replace(j, from.size(), to);
+    if (rewriter.empty()) {
+        prev.clear();
+        pos += s.size();
+        if (!s.empty()) nextSink(s);
+        return;
     }
 
-    prev = s.size() < from.size() ? s : std::string(s, s.size() - from.size() + 1, from.size() - 1);
-
-    auto consumed = s.size() - prev.size();
-
-    pos += consumed;
+    /* A match starting within the last maxPatternSize() - 1 bytes
+       might continue into the next chunk, so hold those bytes back
+       until more data (or flush()) arrives. */
+    size_t limit = s.size() >= rewriter.maxPatternSize()
+        ? s.size() - (rewriter.maxPatternSize() - 1) : 0;
+
+    std::string out;
+    size_t p = 0;
+    while (auto m = rewriter.findNext(s, p)) {
+        if (m->pos >= limit) break;
+        out.append(s, p, m->pos - p);
+        matches.push_back(pos + out.size());
+        out.append(m->rewrite->to);
+        p = m->pos + m->rewrite->from.size();
+    }
 
-    if (consumed) nextSink(s.substr(0, consumed));
+    auto cut = std::max(p, limit);
+    out.append(s, p, cut - p);
+    prev = std::string(s, cut);
+    pos += out.size();
+    if (!out.empty()) nextSink(out);
 }
 
 void RewritingSink::flush()
 {
     if (prev.empty()) return;
-    pos += prev.size();
-    nextSink(prev);
+
+    std::string out;
+    size_t p = 0;
+    while (auto m = rewriter.findNext(prev, p)) {
+        out.append(prev, p, m->pos - p);
+        matches.push_back(pos + out.size());
+        out.append(m->rewrite->to);
+        p = m->pos + m->rewrite->from.size();
+    }
+    out.append(prev, p, prev.size() - p);
+
     prev.clear();
+    pos += out.size();
+    if (!out.empty()) nextSink(out);
 }
 
 HashModuloSink::HashModuloSink(HashType ht, const std::string & modulus)
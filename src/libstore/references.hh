@@ -2,6 +2,9 @@
 
 #include "hash.hh"
 #include "path.hh"
+#include "util.hh"
+
+#include <unordered_set>
 
 namespace nix {
 
@@ -11,15 +14,23 @@ StorePathSet scanForReferences(Sink & toTee, const Path & path, const StorePathS
 
 class RefScanSink : public Sink
 {
-    StringSet hashes;
+    /* Transparent comparator so that candidate windows can be looked
+       up as string_views without allocating. */
+    std::set<std::string, std::less<>> hashes;
     StringSet seen;
 
+    /* The first four bytes of every hash, used as a cheap filter:
+       nearly all candidate windows are rejected on this single word
+       comparison instead of a full set lookup. */
+    std::unordered_set<uint32_t> prefixes;
+
     std::string tail;
 
+    void search(std::string_view s);
+
 public:
 
-    RefScanSink(StringSet && hashes) : hashes(hashes)
-    { }
+    RefScanSink(StringSet && hashes);
 
     StringSet & getResult()
     { return seen; }
@@ -29,13 +40,16 @@ public:
 
 struct RewritingSink : Sink
 {
-    std::string from, to, prev;
+    const StringRewriter rewriter;
+    std::string prev;
     Sink & nextSink;
     uint64_t pos = 0;
 
+    /* Offsets of the replacements in the rewritten stream. */
     std::vector<uint64_t> matches;
 
     RewritingSink(const std::string & from, const std::string & to, Sink & nextSink);
+    RewritingSink(const StringMap & rewrites, Sink & nextSink);
 
     void operator () (std::string_view data) override;
 
@@ -1,6 +1,9 @@
 #include "remote-fs-accessor.hh"
+#include "binary-cache-store.hh"
 #include "nar-accessor.hh"
+#include "nar-info.hh"
 #include "json.hh"
+#include "thread-pool.hh"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -16,6 +19,20 @@ RemoteFSAccessor::RemoteFSAccessor(ref<Store> store, const Path & cacheDir)
         createDirs(cacheDir);
 }
 
+/* Make an accessor that reads file contents via ranged requests
+   against the remote NAR. */
+static ref<FSAccessor> makeRemoteRangeAccessor(
+    std::shared_ptr<BinaryCacheStore> binaryCacheStore,
+    const std::string & url, const std::string & listing)
+{
+    return makeLazyNarAccessor(listing,
+        [binaryCacheStore, url](uint64_t offset, uint64_t length) {
+            if (auto data = binaryCacheStore->getFileRange(url, offset, length))
+                return std::move(*data);
+            throw Error("binary cache did not honour range request for '%s'", url);
+        });
+}
+
 Path RemoteFSAccessor::makeCacheFile(std::string_view hashPart, const std::string & ext)
 {
     assert(cacheDir != "");
@@ -29,10 +46,7 @@ void RemoteFSAccessor::addToCache(std::string_view hashPart, const std::string &
 
     if (cacheDir != "") {
         try {
-            std::ostringstream str;
-            JSONPlaceholder jsonRoot(str);
-            listNar(jsonRoot, narAccessor, "", true);
-            writeFile(makeCacheFile(hashPart, "ls"), str.str());
+            writeFile(makeCacheFile(hashPart, "lsb"), listNarBinary(narAccessor));
 
             /* FIXME: do this asynchronously. */
             writeFile(makeCacheFile(hashPart, "nar"), nar);
@@ -62,7 +76,12 @@ std::pair<ref<FSAccessor>, Path> RemoteFSAccessor::fetch(const Path & path_, boo
     if (cacheDir != "" && pathExists(cacheFile = makeCacheFile(storePath.hashPart(), "nar"))) {
 
         try {
-            listing = nix::readFile(makeCacheFile(storePath.hashPart(), "ls"));
+            try {
+                listing = nix::readFile(makeCacheFile(storePath.hashPart(), "lsb"));
+            } catch (SysError &) {
+                /* Listing cached by an older version. */
+                listing = nix::readFile(makeCacheFile(storePath.hashPart(), "ls"));
+            }
 
             auto narAccessor = makeLazyNarAccessor(listing,
                 [cacheFile](uint64_t offset, uint64_t length) {
@@ -95,12 +114,72 @@ std::pair<ref<FSAccessor>, Path> RemoteFSAccessor::fetch(const Path & path_, boo
         } catch (SysError &) { }
     }
 
+    /* If the store can serve byte ranges and provides a NAR listing,
+       access the remote NAR in place instead of fetching it
+       wholesale: `nix store cat` on a multi-gigabyte NAR then only
+       transfers the listing and the bytes of the member read. The
+       listing offsets refer to the uncompressed NAR, so this only
+       works for caches that use 'compression = none'. */
+    if (auto binaryCacheStore = store.dynamic_pointer_cast<BinaryCacheStore>()) {
+        if (binaryCacheStore->supportsFileRanges()) {
+            auto info = std::dynamic_pointer_cast<const NarInfo>(
+                store->queryPathInfo(storePath).get_ptr());
+            if (info && (info->compression == "none" || info->compression == "")) {
+                auto listing2 = binaryCacheStore->getFile(std::string(storePath.hashPart()) + ".lsb");
+                if (!listing2)
+                    listing2 = binaryCacheStore->getFile(std::string(storePath.hashPart()) + ".ls");
+                if (listing2) {
+                    auto narAccessor = makeRemoteRangeAccessor(binaryCacheStore, info->url, *listing2);
+                    nars.emplace(storePath.hashPart(), narAccessor);
+                    return {narAccessor, restPath};
+                }
+            }
+        }
+    }
+
     store->narFromPath(storePath, sink);
     auto narAccessor = makeNarAccessor(sink.s);
     addToCache(storePath.hashPart(), *sink.s, narAccessor);
     return {narAccessor, restPath};
 }
 
+void RemoteFSAccessor::prefetchListings(const StorePathSet & paths)
+{
+    auto binaryCacheStore = store.dynamic_pointer_cast<BinaryCacheStore>();
+    if (!binaryCacheStore || !binaryCacheStore->supportsFileRanges()) return;
+
+    /* The fetches run in a thread pool; the results are merged into
+       'nars' here, so the accessor itself stays single-threaded. */
+    Sync<std::vector<std::pair<std::string, std::shared_ptr<FSAccessor>>>> results;
+
+    ThreadPool pool;
+
+    for (auto & storePath : paths) {
+        if (nars.count(std::string(storePath.hashPart()))) continue;
+        pool.enqueue([&, storePath]() {
+            try {
+                auto info = std::dynamic_pointer_cast<const NarInfo>(
+                    store->queryPathInfo(storePath).get_ptr());
+                if (!info || !(info->compression == "none" || info->compression == ""))
+                    return;
+                auto listing = binaryCacheStore->getFile(std::string(storePath.hashPart()) + ".lsb");
+                if (!listing)
+                    listing = binaryCacheStore->getFile(std::string(storePath.hashPart()) + ".ls");
+                if (!listing) return;
+                auto narAccessor = makeRemoteRangeAccessor(binaryCacheStore, info->url, *listing);
+                results.lock()->emplace_back(storePath.hashPart(), narAccessor.get_ptr());
+            } catch (...) {
+                ignoreException();
+            }
+        });
+    }
+
+    pool.process();
+
+    for (auto & [hashPart, accessor] : *results.lock())
+        nars.emplace(hashPart, ref<FSAccessor>(accessor));
+}
+
 FSAccessor::Stat RemoteFSAccessor::stat(const Path & path)
 {
     auto res = fetch(path);
@@ -28,6 +28,13 @@ public:
     RemoteFSAccessor(ref<Store> store,
         const /* FIXME: use std::optional */ Path & cacheDir = "");
 
+    /* Fetch the listings of 'paths' with parallel requests, so that
+       subsequent stat()/readDirectory() calls on them are served
+       from memory. Only effective for binary caches that support
+       range requests and serve uncompressed NARs; other paths are
+       fetched on demand as usual. */
+    void prefetchListings(const StorePathSet & paths);
+
     Stat stat(const Path & path) override;
 
     StringSet readDirectory(const Path & path) override;
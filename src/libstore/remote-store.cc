@@ -143,6 +143,13 @@ RemoteStore::RemoteStore(const Params & params)
 }
 
 
+void RemoteStore::init()
+{
+    if (warmConnections)
+        connections->warmUp(warmConnections);
+}
+
+
 ref<RemoteStore::Connection> RemoteStore::openConnectionWrapper()
 {
     if (failed)
@@ -158,6 +165,8 @@ ref<RemoteStore::Connection> RemoteStore::openConnectionWrapper()
 
 void RemoteStore::initConnection(Connection & conn)
 {
+    bool optionsSent = false;
+
     /* Send the magic greeting, check for the reply. */
     try {
         conn.to << WORKER_MAGIC_1;
@@ -194,6 +203,12 @@ void RemoteStore::initConnection(Connection & conn)
         if (GET_PROTOCOL_MINOR(conn.daemonVersion) >= 11)
             conn.to << false;
 
+        /* Pipeline the initial wopSetOptions behind the handshake: the
+           daemon replies to the handshake before reading the first op,
+           so both replies can be awaited after a single flush, saving a
+           round trip per connection. */
+        optionsSent = sendOptions(conn);
+
         auto ex = conn.processStderr();
         if (ex) std::rethrow_exception(ex);
     }
@@ -201,11 +216,14 @@ void RemoteStore::initConnection(Connection & conn)
         throw Error("cannot open connection to remote store '%s': %s", getUri(), e.what());
     }
 
-    setOptions(conn);
+    if (optionsSent) {
+        auto ex = conn.processStderr();
+        if (ex) std::rethrow_exception(ex);
+    }
 }
 
 
-void RemoteStore::setOptions(Connection & conn)
+bool RemoteStore::sendOptions(Connection & conn)
 {
     conn.to << wopSetOptions
        << settings.keepFailed
@@ -239,6 +257,20 @@ void RemoteStore::setOptions(Connection & conn)
             conn.to << i.first << i.second.value;
     }
 
+    /* Tell the daemon whether to bother sending build log lines at
+       all; the log tail of a failed build reaches us through the
+       error either way. */
+    if (GET_PROTOCOL_MINOR(conn.daemonVersion) >= 33)
+        conn.to << logger->wantsBuildLogs();
+
+    return true;
+}
+
+
+void RemoteStore::setOptions(Connection & conn)
+{
+    if (!sendOptions(conn)) return;
+
     auto ex = conn.processStderr();
     if (ex) std::rethrow_exception(ex);
 }
@@ -496,6 +528,16 @@ std::optional<StorePath> RemoteStore::queryPathFromHashPart(const std::string &
     return parseStorePath(path);
 }
 
+std::map<std::string, StorePath> RemoteStore::queryPathsFromHashParts(const std::set<std::string> & hashParts)
+{
+    auto conn(getConnection());
+    if (GET_PROTOCOL_MINOR(conn->daemonVersion) < 35)
+        return Store::queryPathsFromHashParts(hashParts);
+    conn->to << wopQueryPathsFromHashParts << hashParts;
+    conn.processStderr();
+    return worker_proto::read(*this, conn->from, Phantom<std::map<std::string, StorePath>> {});
+}
+
 
 ref<const ValidPathInfo> RemoteStore::addCAToStore(
     Source & dump,
@@ -680,6 +722,52 @@ void RemoteStore::registerDrvOutput(const Realisation & info)
     conn.processStderr();
 }
 
+std::map<DrvOutput, std::shared_ptr<const Realisation>> RemoteStore::queryRealisationsUncached(
+    const std::set<DrvOutput> & ids)
+{
+    auto conn(getConnection());
+
+    if (GET_PROTOCOL_MINOR(conn->daemonVersion) < 34)
+        return Store::queryRealisationsUncached(ids);
+
+    conn->to << wopQueryRealisations;
+    Strings idStrs;
+    for (auto & id : ids)
+        idStrs.push_back(id.to_string());
+    conn->to << idStrs;
+    conn.processStderr();
+
+    auto realisations = worker_proto::read(
+        *this, conn->from, Phantom<std::set<Realisation>> {});
+
+    std::map<DrvOutput, std::shared_ptr<const Realisation>> res;
+    for (auto & realisation : realisations)
+        res.emplace(realisation.id, std::make_shared<const Realisation>(realisation));
+    return res;
+}
+
+uint64_t RemoteStore::queryStoreGeneration()
+{
+    auto conn(getConnection());
+    if (GET_PROTOCOL_MINOR(conn->daemonVersion) < 34)
+        unsupported("queryStoreGeneration");
+    conn->to << wopQueryStoreGeneration;
+    conn.processStderr();
+    return readNum<uint64_t>(conn->from);
+}
+
+uint64_t RemoteStore::waitStoreGeneration(uint64_t known, uint64_t timeoutMs)
+{
+    auto conn(getConnection());
+    if (GET_PROTOCOL_MINOR(conn->daemonVersion) < 34)
+        return Store::waitStoreGeneration(known, timeoutMs);
+    /* The daemon long-polls on our behalf, so a watcher costs no
+       round trips until something actually changes. */
+    conn->to << wopWaitStoreGeneration << known << timeoutMs;
+    conn.processStderr();
+    return readNum<uint64_t>(conn->from);
+}
+
 void RemoteStore::queryRealisationUncached(const DrvOutput & id,
     Callback<std::shared_ptr<const Realisation>> callback) noexcept
 {
@@ -844,10 +932,7 @@ void RemoteStore::collectGarbage(const GCOptions & options, GCResults & results)
     results.bytesFreed = readLongLong(conn->from);
     readLongLong(conn->from); // obsolete
 
-    {
-        auto state_(Store::state.lock());
-        state_->pathInfoCache.clear();
-    }
+    Store::pathInfoCache.clear();
 }
 
 
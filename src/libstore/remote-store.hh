@@ -25,6 +25,9 @@ struct RemoteStoreConfig : virtual StoreConfig
 
     const Setting<unsigned int> maxConnectionAge{(StoreConfig*) this, std::numeric_limits<unsigned int>::max(),
             "max-connection-age", "number of seconds to reuse a connection"};
+
+    const Setting<unsigned int> warmConnections{(StoreConfig*) this, 0,
+            "warm-connections", "number of connections to the Nix daemon to open eagerly when the store is opened"};
 };
 
 /* FIXME: RemoteStore is a misnomer - should be something like
@@ -37,6 +40,11 @@ public:
 
     RemoteStore(const Params & params);
 
+    /* Pre-warm the connection pool, if requested. Can't be done from
+       the constructor since opening a connection involves virtual
+       calls into the concrete store. */
+    void init() override;
+
     /* Implementations of abstract store API methods. */
 
     bool isValidPathUncached(const StorePath & path) override;
@@ -58,6 +66,8 @@ public:
     std::map<std::string, std::optional<StorePath>> queryPartialDerivationOutputMap(const StorePath & path) override;
     std::optional<StorePath> queryPathFromHashPart(const std::string & hashPart) override;
 
+    std::map<std::string, StorePath> queryPathsFromHashParts(const std::set<std::string> & hashParts) override;
+
     StorePathSet querySubstitutablePaths(const StorePathSet & paths) override;
 
     void querySubstitutablePathInfos(const StorePathCAMap & paths,
@@ -88,6 +98,13 @@ public:
 
     void registerDrvOutput(const Realisation & info) override;
 
+    std::map<DrvOutput, std::shared_ptr<const Realisation>> queryRealisationsUncached(
+        const std::set<DrvOutput> & ids) override;
+
+    uint64_t queryStoreGeneration() override;
+
+    uint64_t waitStoreGeneration(uint64_t known, uint64_t timeoutMs) override;
+
     void queryRealisationUncached(const DrvOutput &,
         Callback<std::shared_ptr<const Realisation>> callback) noexcept override;
 
@@ -146,7 +163,12 @@ protected:
 
     ref<Pool<Connection>> connections;
 
-    virtual void setOptions(Connection & conn);
+    /* Write a wopSetOptions op for the current settings to 'conn'
+       without awaiting the reply. Returns false if this store doesn't
+       forward options at all. */
+    virtual bool sendOptions(Connection & conn);
+
+    void setOptions(Connection & conn);
 
     void setOptions() override;
 
@@ -7,7 +7,8 @@ create table if not exists ValidPaths (
     narSize          integer,
     ultimate         integer, -- null implies "false"
     sigs             text, -- space-separated
-    ca               text -- if not null, an assertion that the path is content-addressed; see ValidPathInfo
+    ca               text, -- if not null, an assertion that the path is content-addressed; see ValidPathInfo
+    diskSize         integer -- bytes occupied on disk, with hardlink sharing apportioned
 );
 
 create table if not exists Refs (
@@ -19,7 +20,11 @@ create table if not exists Refs (
 );
 
 create index if not exists IndexReferrer on Refs(referrer);
-create index if not exists IndexReference on Refs(reference);
+
+-- Covering index: referrer queries only need the referrer id, so
+-- including it lets them be answered from the index alone, without
+-- touching the Refs table.
+create index if not exists IndexReference on Refs(reference, referrer);
 
 -- Paths can refer to themselves, causing a tuple (N, N) in the Refs
 -- table.  This causes a deletion of the corresponding row in
@@ -40,3 +45,30 @@ create table if not exists DerivationOutputs (
 );
 
 create index if not exists IndexDerivationOutputs on DerivationOutputs(path);
+
+-- Statistics of completed builds, keyed by the derivation name (with
+-- the hash part removed), used to estimate the duration of future
+-- builds of the same derivation.
+create table if not exists BuildStats (
+    name     text not null,
+    time     integer not null, -- when the build finished
+    wallTime integer not null, -- in seconds
+    cpuTime  integer, -- user + system CPU time, in seconds
+    peakRSS  integer, -- in KiB
+    -- Content hashes of the outputs with self-references zeroed out,
+    -- as "output:hash" pairs. Stable across rebuilds at different
+    -- output paths, so an unchanged value identifies a rebuild whose
+    -- output came out identical.
+    outputHashes text
+);
+
+create index if not exists IndexBuildStats on BuildStats(name);
+
+-- Records when the contents of a path were last verified by
+-- 'nix-store --verify --check-contents', so that scheduled runs can
+-- skip recently checked paths (see the 'verify-ttl' setting).
+create table if not exists LastContentsVerified (
+    path integer primary key,
+    time integer not null,
+    foreign key (path) references ValidPaths(id) on delete cascade
+);
@@ -1,5 +1,6 @@
 #include "sqlite.hh"
 #include "globals.hh"
+#include "tracepoints.hh"
 #include "util.hh"
 
 #include <sqlite3.h>
@@ -23,17 +24,19 @@ namespace nix {
             : fmt("SQLite database '%s' is busy", path));
     }
     else
-        throw SQLiteError("%s: %s (in '%s')", fs.s, sqlite3_errstr(exterr), path);
+        throw SQLiteError("%s: %s (in '%s')", fs.s, sqlite3_errstr(exterr), std::string(path));
 }
 
-SQLite::SQLite(const Path & path, bool create)
+SQLite::SQLite(const Path & path, bool create, bool readOnly)
 {
     // useSQLiteWAL also indicates what virtual file system we need.  Using
     // `unix-dotfile` is needed on NFS file systems and on Windows' Subsystem
     // for Linux (WSL) where useSQLiteWAL should be false by default.
     const char *vfs = settings.useSQLiteWAL ? 0 : "unix-dotfile";
     if (sqlite3_open_v2(path.c_str(), &db,
-            SQLITE_OPEN_READWRITE | (create ? SQLITE_OPEN_CREATE : 0), vfs) != SQLITE_OK)
+            readOnly
+            ? SQLITE_OPEN_READONLY
+            : SQLITE_OPEN_READWRITE | (create ? SQLITE_OPEN_CREATE : 0), vfs) != SQLITE_OK)
         throw Error("cannot open SQLite database '%s'", path);
 
     if (sqlite3_busy_timeout(db, 60 * 60 * 1000) != SQLITE_OK)
@@ -55,7 +58,45 @@ SQLite::~SQLite()
 void SQLite::isCache()
 {
     exec("pragma synchronous = off");
-    exec("pragma main.journal_mode = truncate");
+    /* WAL means that writers don't block readers, so a process
+       populating a cold cache doesn't stall concurrent warm readers.
+       Like in LocalStore, fall back to truncate journaling on file
+       systems that don't support WAL (see useSQLiteWAL). */
+    if (settings.useSQLiteWAL)
+        exec("pragma main.journal_mode = wal");
+    else
+        exec("pragma main.journal_mode = truncate");
+    /* Serve reads through a memory map instead of seek/read system
+       calls; warm lookups then mostly hit the page cache. */
+    exec("pragma mmap_size = 268435456");
+}
+
+void SQLite::tune()
+{
+    /* On an existing database, a changed page size only takes effect
+       on the next vacuum. */
+    if (settings.sqlitePageSize)
+        exec(fmt("pragma page_size = %d", settings.sqlitePageSize.get()));
+    /* A negative cache_size is interpreted by SQLite as KiB rather
+       than pages, so it's independent of the page size. */
+    if (settings.sqliteCacheSize)
+        exec(fmt("pragma cache_size = -%d", settings.sqliteCacheSize.get()));
+    if (settings.sqliteMmapSize)
+        exec(fmt("pragma mmap_size = %d", settings.sqliteMmapSize.get()));
+}
+
+void SQLite::maintain()
+{
+    /* 'pragma optimize' re-runs ANALYZE only for tables whose
+       contents have changed enough to degrade the recorded
+       statistics, so stale query plans get fixed without paying for
+       a full ANALYZE every time. */
+    exec("pragma optimize");
+
+    /* Return free pages to the file system, a bounded number at a
+       time. A no-op unless the database uses incremental
+       auto-vacuum. */
+    exec("pragma incremental_vacuum(8192)");
 }
 
 void SQLite::exec(const std::string & stmt)
@@ -206,8 +247,19 @@ SQLiteTxn::~SQLiteTxn()
     }
 }
 
+static std::atomic<uint64_t> sqliteBusyCount{0};
+
+uint64_t getSQLiteBusyCount()
+{
+    return sqliteBusyCount;
+}
+
 void handleSQLiteBusy(const SQLiteBusy & e)
 {
+    NIX_PROBE(sqlite_busy_retry);
+
+    sqliteBusyCount++;
+
     static std::atomic<time_t> lastWarned{0};
 
     time_t now = time(0);
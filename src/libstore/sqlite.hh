@@ -15,7 +15,7 @@ struct SQLite
 {
     sqlite3 * db = 0;
     SQLite() { }
-    SQLite(const Path & path, bool create = true);
+    SQLite(const Path & path, bool create = true, bool readOnly = false);
     SQLite(const SQLite & from) = delete;
     SQLite& operator = (const SQLite & from) = delete;
     SQLite& operator = (SQLite && from) { db = from.db; from.db = 0; return *this; }
@@ -25,6 +25,15 @@ struct SQLite
     /* Disable synchronous mode, set truncate journal mode. */
     void isCache();
 
+    /* Apply the page-cache tuning settings (sqlite-page-size,
+       sqlite-cache-size, sqlite-mmap-size). */
+    void tune();
+
+    /* Refresh the query planner statistics and reclaim free pages.
+       Cheap when there is nothing to do, so it can be run
+       periodically on a long-lived connection. */
+    void maintain();
+
     void exec(const std::string & stmt);
 
     uint64_t getLastInsertedRowId();
@@ -103,6 +112,10 @@ MakeError(SQLiteBusy, SQLiteError);
 
 void handleSQLiteBusy(const SQLiteBusy & e);
 
+/* Number of times this process has retried a SQLite transaction
+   because the database was busy. */
+uint64_t getSQLiteBusyCount();
+
 /* Convenience function for retrying a SQLite transaction when the
    database is busy. */
 template<typename T, typename F>
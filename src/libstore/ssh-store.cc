@@ -70,7 +70,7 @@ private:
 
     SSHMaster master;
 
-    void setOptions(RemoteStore::Connection & conn) override
+    bool sendOptions(RemoteStore::Connection & conn) override
     {
         /* TODO Add a way to explicitly ask for some options to be
            forwarded. One option: A way to query the daemon for its
@@ -78,6 +78,7 @@ private:
            forward-cores or forward-overridden-cores that only
            override the requested settings.
         */
+        return false;
     };
 };
 
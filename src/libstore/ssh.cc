@@ -1,4 +1,5 @@
 #include "ssh.hh"
+#include "globals.hh"
 
 namespace nix {
 
@@ -69,8 +70,14 @@ std::unique_ptr<SSHMaster::Connection> SSHMaster::startCommand(const std::string
         } else {
             args = { "ssh", host.c_str(), "-x", "-a" };
             addCommonSSHOpts(args);
-            if (socketPath != "")
+            if (socketPath != "") {
                 args.insert(args.end(), {"-S", socketPath});
+                if (settings.sshSharedConnections)
+                    args.insert(args.end(),
+                        { "-oControlMaster=auto"
+                        , fmt("-oControlPersist=%ds", settings.sshConnectionKeepAlive.get())
+                        });
+            }
             if (verbosity >= lvlChatty)
                 args.push_back("-v");
         }
@@ -96,6 +103,20 @@ Path SSHMaster::startMaster()
 {
     if (!useMaster) return "";
 
+    /* With connection sharing enabled, let ssh manage the master
+       itself: 'ControlMaster=auto' (added in startCommand()) starts
+       one on first use and 'ControlPersist' keeps it alive in the
+       background, so the control socket outlives this process and is
+       shared with every other Nix process talking to the same host.
+       '%C' expands to a hash of local host name, user, remote host
+       and port, which keeps the socket path unique per target and
+       short enough for sockaddr_un. */
+    if (settings.sshSharedConnections) {
+        auto socketDir = getCacheDir() + "/nix/ssh";
+        createDirs(socketDir);
+        return socketDir + "/%C";
+    }
+
     auto state(state_.lock());
 
     if (state->sshMaster != -1) return state->socketPath;
@@ -3,6 +3,10 @@
 #include "globals.hh"
 #include "store-api.hh"
 #include "util.hh"
+#include "binary-cache-store.hh"
+#include "names.hh"
+#include "nar-delta.hh"
+#include "nar-info.hh"
 #include "nar-info-disk-cache.hh"
 #include "thread-pool.hh"
 #include "json.hh"
@@ -12,6 +16,7 @@
 #include "remote-store.hh"
 
 #include <regex>
+#include <thread>
 
 namespace nix {
 
@@ -181,6 +186,8 @@ StorePath Store::makeFixedOutputPath(
     const StorePathSet & references,
     bool hasSelfReference) const
 {
+    if (hash.type == htBLAKE3)
+        settings.requireExperimentalFeature(Xp::Blake3Hashes);
     if (hash.type == htSHA256 && method == FileIngestionMethod::Recursive) {
         return makeStorePath(makeType(*this, "source", references, hasSelfReference), hash, name);
     } else {
@@ -362,7 +369,8 @@ StringSet StoreConfig::getDefaultSystemFeatures()
 
 Store::Store(const Params & params)
     : StoreConfig(params)
-    , state({(size_t) pathInfoCacheSize})
+    , pathInfoCache((size_t) pathInfoCacheSize)
+    , drvCache((size_t) drvCacheSize)
 {
 }
 
@@ -372,6 +380,42 @@ std::string Store::getUri()
     return "";
 }
 
+void Store::invalidateClosureCache()
+{
+    closureCache.lock()->generation++;
+}
+
+void Store::recordSubstituterRequest(uint64_t durationUs, bool failed)
+{
+    auto state(substituterHealthState.lock());
+    state->recent.emplace_back(durationUs, failed);
+    if (state->recent.size() > SubstituterHealthState::maxRecent)
+        state->recent.pop_front();
+}
+
+Store::SubstituterHealth Store::getSubstituterHealth()
+{
+    auto state(substituterHealthState.lock());
+
+    SubstituterHealth health;
+    health.nrSamples = state->recent.size();
+    if (!health.nrSamples) return health;
+
+    std::vector<uint64_t> latencies;
+    latencies.reserve(health.nrSamples);
+    size_t nrFailed = 0;
+    for (auto & [latency, failed] : state->recent) {
+        latencies.push_back(latency);
+        if (failed) nrFailed++;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    health.p95LatencyUs = latencies[latencies.size() * 95 / 100];
+    health.errorRate = (double) nrFailed / health.nrSamples;
+
+    return health;
+}
+
 bool Store::PathInfoCacheValue::isKnownNow()
 {
     std::chrono::duration ttl = didExist()
@@ -412,11 +456,19 @@ StorePathSet Store::queryDerivationOutputs(const StorePath & path)
     return outputPaths;
 }
 
+std::map<std::string, StorePath> Store::queryPathsFromHashParts(const std::set<std::string> & hashParts)
+{
+    std::map<std::string, StorePath> res;
+    for (auto & hashPart : hashParts)
+        if (auto path = queryPathFromHashPart(hashPart))
+            res.insert_or_assign(hashPart, std::move(*path));
+    return res;
+}
+
 bool Store::isValidPath(const StorePath & storePath)
 {
     {
-        auto state_(state.lock());
-        auto res = state_->pathInfoCache.get(std::string(storePath.to_string()));
+        auto res = pathInfoCache.get(std::string(storePath.to_string()));
         if (res && res->isKnownNow()) {
             stats.narInfoReadAverted++;
             return res->didExist();
@@ -427,8 +479,7 @@ bool Store::isValidPath(const StorePath & storePath)
         auto res = diskCache->lookupNarInfo(getUri(), std::string(storePath.hashPart()));
         if (res.first != NarInfoDiskCache::oUnknown) {
             stats.narInfoReadAverted++;
-            auto state_(state.lock());
-            state_->pathInfoCache.upsert(std::string(storePath.to_string()),
+            pathInfoCache.upsert(std::string(storePath.to_string()),
                 res.first == NarInfoDiskCache::oInvalid ? PathInfoCacheValue{} : PathInfoCacheValue { .value = res.second });
             return res.first == NarInfoDiskCache::oValid;
         }
@@ -489,22 +540,24 @@ void Store::queryPathInfo(const StorePath & storePath,
 
     try {
         {
-            auto res = state.lock()->pathInfoCache.get(std::string(storePath.to_string()));
+            auto res = pathInfoCache.get(std::string(storePath.to_string()));
             if (res && res->isKnownNow()) {
                 stats.narInfoReadAverted++;
+                stats.pathInfoCacheHits++;
                 if (!res->didExist())
                     throw InvalidPath("path '%s' is not valid", printStorePath(storePath));
                 return callback(ref<const ValidPathInfo>(res->value));
             }
         }
 
+        stats.pathInfoCacheMisses++;
+
         if (diskCache) {
             auto res = diskCache->lookupNarInfo(getUri(), hashPart);
             if (res.first != NarInfoDiskCache::oUnknown) {
                 stats.narInfoReadAverted++;
                 {
-                    auto state_(state.lock());
-                    state_->pathInfoCache.upsert(std::string(storePath.to_string()),
+                    pathInfoCache.upsert(std::string(storePath.to_string()),
                         res.first == NarInfoDiskCache::oInvalid ? PathInfoCacheValue{} : PathInfoCacheValue{ .value = res.second });
                     if (res.first == NarInfoDiskCache::oInvalid ||
                         !goodStorePath(storePath, res.second->path))
@@ -527,10 +580,7 @@ void Store::queryPathInfo(const StorePath & storePath,
                 if (diskCache)
                     diskCache->upsertNarInfo(getUri(), hashPart, info);
 
-                {
-                    auto state_(state.lock());
-                    state_->pathInfoCache.upsert(std::string(storePath.to_string()), PathInfoCacheValue { .value = info });
-                }
+                pathInfoCache.upsert(std::string(storePath.to_string()), PathInfoCacheValue { .value = info });
 
                 if (!info || !goodStorePath(storePath, info->path)) {
                     stats.narInfoMissing++;
@@ -542,6 +592,53 @@ void Store::queryPathInfo(const StorePath & storePath,
         }});
 }
 
+std::map<StorePath, ref<const ValidPathInfo>> Store::queryPathInfos(const StorePathSet & paths)
+{
+    struct State
+    {
+        size_t left;
+        std::map<StorePath, ref<const ValidPathInfo>> infos;
+        std::exception_ptr exc;
+    };
+
+    Sync<State> state_(State{paths.size(), {}});
+
+    std::condition_variable wakeup;
+    ThreadPool pool;
+
+    prefetchPathInfos(paths);
+
+    auto doQuery = [&](const StorePath & path) {
+        checkInterrupt();
+        queryPathInfo(path, {[path, &state_, &wakeup](std::future<ref<const ValidPathInfo>> fut) {
+            auto state(state_.lock());
+            try {
+                state->infos.insert_or_assign(path, fut.get());
+            } catch (InvalidPath &) {
+            } catch (...) {
+                state->exc = std::current_exception();
+            }
+            assert(state->left);
+            if (!--state->left)
+                wakeup.notify_one();
+        }});
+    };
+
+    for (auto & path : paths)
+        pool.enqueue(std::bind(doQuery, path));
+
+    pool.process();
+
+    while (true) {
+        auto state(state_.lock());
+        if (!state->left) {
+            if (state->exc) std::rethrow_exception(state->exc);
+            return std::move(state->infos);
+        }
+        state.wait(wakeup);
+    }
+}
+
 void Store::queryRealisation(const DrvOutput & id,
         Callback<std::shared_ptr<const Realisation>> callback) noexcept
 {
@@ -611,6 +708,96 @@ std::shared_ptr<const Realisation> Store::queryRealisation(const DrvOutput & id)
     return promise.get_future().get();
 }
 
+std::map<DrvOutput, std::shared_ptr<const Realisation>> Store::queryRealisationsUncached(
+    const std::set<DrvOutput> & ids)
+{
+    std::map<DrvOutput, std::shared_ptr<const Realisation>> res;
+
+    for (auto & id : ids) {
+        using RealPtr = std::shared_ptr<const Realisation>;
+        std::promise<RealPtr> promise;
+        queryRealisationUncached(id,
+            {[&](std::future<RealPtr> result) {
+                try {
+                    promise.set_value(result.get());
+                } catch (...) {
+                    promise.set_exception(std::current_exception());
+                }
+            }});
+        if (auto info = promise.get_future().get())
+            res.emplace(id, info);
+    }
+
+    return res;
+}
+
+std::map<DrvOutput, std::shared_ptr<const Realisation>> Store::queryRealisations(
+    const std::set<DrvOutput> & ids)
+{
+    std::map<DrvOutput, std::shared_ptr<const Realisation>> res;
+
+    /* Serve what we can from the local disk cache and batch the
+       rest. */
+    std::set<DrvOutput> missing;
+    for (auto & id : ids) {
+        if (diskCache) {
+            auto [cacheOutcome, maybeCachedRealisation]
+                = diskCache->lookupRealisation(getUri(), id);
+            if (cacheOutcome == NarInfoDiskCache::oValid) {
+                res.emplace(id, maybeCachedRealisation);
+                continue;
+            }
+            if (cacheOutcome == NarInfoDiskCache::oInvalid)
+                continue;
+        }
+        missing.insert(id);
+    }
+
+    if (missing.empty()) return res;
+
+    auto fetched = queryRealisationsUncached(missing);
+
+    std::set<DrvOutput> prefetch;
+
+    for (auto & id : missing) {
+        auto i = fetched.find(id);
+        if (i == fetched.end()) {
+            if (diskCache)
+                diskCache->upsertAbsentRealisation(getUri(), id);
+            continue;
+        }
+        if (diskCache) {
+            diskCache->upsertRealisation(getUri(), *i->second);
+            for (auto & [depId, _] : i->second->dependentRealisations)
+                if (!ids.count(depId))
+                    prefetch.insert(depId);
+        }
+        res.emplace(id, i->second);
+    }
+
+    /* Warm the disk cache with the realisations the results depend
+       on: a closure walk will ask for them next, so this turns one
+       round trip per output into a few batched exchanges. */
+    if (!prefetch.empty())
+        queryRealisations(prefetch);
+
+    return res;
+}
+
+uint64_t Store::waitStoreGeneration(uint64_t known, uint64_t timeoutMs)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    for (;;) {
+        auto gen = queryStoreGeneration();
+        if (gen != known) return gen;
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline) return gen;
+        std::this_thread::sleep_for(
+            std::min(std::chrono::milliseconds(500),
+                std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now)));
+    }
+}
+
 void Store::substitutePaths(const StorePathSet & paths)
 {
     std::vector<DerivedPath> paths2;
@@ -633,6 +820,28 @@ void Store::substitutePaths(const StorePathSet & paths)
 }
 
 
+void Store::prefetchPathInfos(const StorePathSet & paths)
+{
+    if (!diskCache) return;
+
+    std::set<std::string> hashParts;
+    std::map<std::string, const StorePath *> byHashPart;
+    for (auto & path : paths) {
+        auto hashPart = std::string(path.hashPart());
+        byHashPart.emplace(hashPart, &path);
+        hashParts.insert(std::move(hashPart));
+    }
+
+    for (auto & [hashPart, entry] : diskCache->lookupNarInfos(getUri(), hashParts)) {
+        auto & path = *byHashPart[hashPart];
+        if (entry.first == NarInfoDiskCache::oInvalid)
+            pathInfoCache.upsert(std::string(path.to_string()), PathInfoCacheValue{});
+        else if (entry.first == NarInfoDiskCache::oValid && goodStorePath(path, entry.second->path))
+            pathInfoCache.upsert(std::string(path.to_string()), PathInfoCacheValue{ .value = entry.second });
+    }
+}
+
+
 StorePathSet Store::queryValidPaths(const StorePathSet & paths, SubstituteFlag maybeSubstitute)
 {
     struct State
@@ -647,6 +856,10 @@ StorePathSet Store::queryValidPaths(const StorePathSet & paths, SubstituteFlag m
     std::condition_variable wakeup;
     ThreadPool pool;
 
+    /* Answer as many of the queries below as possible from the NAR
+       info disk cache in one go. */
+    prefetchPathInfos(paths);
+
     auto doQuery = [&](const Path & path) {
         checkInterrupt();
         queryPathInfo(parseStorePath(path), {[path, this, &state_, &wakeup](std::future<ref<const ValidPathInfo>> fut) {
@@ -750,49 +963,83 @@ StorePathSet Store::exportReferences(const StorePathSet & storePaths, const Stor
 void Store::pathInfoToJSON(JSONPlaceholder & jsonOut, const StorePathSet & storePaths,
     bool includeImpureInfo, bool showClosureSize,
     Base hashBase,
-    AllowInvalidFlag allowInvalid)
+    AllowInvalidFlag allowInvalid,
+    const StringSet * fields)
 {
+    auto wantField = [&](const char * name) {
+        return !fields || fields->count(name);
+    };
+
     auto jsonList = jsonOut.list();
 
+    /* Keep a window of queries in flight ahead of the output loop,
+       so for stores that answer asynchronously (binary caches) the
+       next infos are fetched while the current object is written.
+       The results land in the path info cache; the window is kept
+       well below the cache size so they are still there when the
+       ordered loop below reaches them. */
+    const size_t prefetchWindow = 1024;
+    auto prefetchIter = storePaths.begin();
+    size_t issued = 0, emitted = 0;
+
+    auto pump = [&]() {
+        while (prefetchIter != storePaths.end() && issued - emitted < prefetchWindow) {
+            issued++;
+            queryPathInfo(*prefetchIter++, {[](std::future<ref<const ValidPathInfo>> fut) {
+                try { fut.get(); } catch (...) { }
+            }});
+        }
+    };
+
     for (auto & storePath : storePaths) {
+        pump();
+        emitted++;
+
         auto jsonPath = jsonList.object();
         jsonPath.attr("path", printStorePath(storePath));
 
         try {
             auto info = queryPathInfo(storePath);
 
-            jsonPath
-                .attr("narHash", info->narHash.to_string(hashBase, true))
-                .attr("narSize", info->narSize);
+            if (wantField("narHash"))
+                jsonPath.attr("narHash", info->narHash.to_string(hashBase, true));
+            if (wantField("narSize"))
+                jsonPath.attr("narSize", info->narSize);
 
-            {
+            if (wantField("references")) {
                 auto jsonRefs = jsonPath.list("references");
                 for (auto & ref : info->references)
                     jsonRefs.elem(printStorePath(ref));
             }
 
-            if (info->ca)
+            if (info->ca && wantField("ca"))
                 jsonPath.attr("ca", renderContentAddress(info->ca));
 
             std::pair<uint64_t, uint64_t> closureSizes;
 
+            /* The closure walk is the expensive part, so skip it
+               unless a closure field was asked for. */
+            showClosureSize = showClosureSize
+                && (wantField("closureSize") || wantField("closureDownloadSize"));
+
             if (showClosureSize) {
                 closureSizes = getClosureSize(info->path);
-                jsonPath.attr("closureSize", closureSizes.first);
+                if (wantField("closureSize"))
+                    jsonPath.attr("closureSize", closureSizes.first);
             }
 
             if (includeImpureInfo) {
 
-                if (info->deriver)
+                if (info->deriver && wantField("deriver"))
                     jsonPath.attr("deriver", printStorePath(*info->deriver));
 
-                if (info->registrationTime)
+                if (info->registrationTime && wantField("registrationTime"))
                     jsonPath.attr("registrationTime", info->registrationTime);
 
-                if (info->ultimate)
+                if (info->ultimate && wantField("ultimate"))
                     jsonPath.attr("ultimate", info->ultimate);
 
-                if (!info->sigs.empty()) {
+                if (!info->sigs.empty() && wantField("signatures")) {
                     auto jsonSigs = jsonPath.list("signatures");
                     for (auto & sig : info->sigs)
                         jsonSigs.elem(sig);
@@ -802,13 +1049,13 @@ void Store::pathInfoToJSON(JSONPlaceholder & jsonOut, const StorePathSet & store
                     std::shared_ptr<const ValidPathInfo>(info));
 
                 if (narInfo) {
-                    if (!narInfo->url.empty())
+                    if (!narInfo->url.empty() && wantField("url"))
                         jsonPath.attr("url", narInfo->url);
-                    if (narInfo->fileHash)
+                    if (narInfo->fileHash && wantField("downloadHash"))
                         jsonPath.attr("downloadHash", narInfo->fileHash->to_string(hashBase, true));
-                    if (narInfo->fileSize)
+                    if (narInfo->fileSize && wantField("downloadSize"))
                         jsonPath.attr("downloadSize", narInfo->fileSize);
-                    if (showClosureSize)
+                    if (showClosureSize && wantField("closureDownloadSize"))
                         jsonPath.attr("closureDownloadSize", closureSizes.second);
                 }
             }
@@ -839,14 +1086,19 @@ std::pair<uint64_t, uint64_t> Store::getClosureSize(const StorePath & storePath)
 
 const Store::Stats & Store::getStats()
 {
-    {
-        auto state_(state.lock());
-        stats.pathInfoCacheSize = state_->pathInfoCache.size();
-    }
+    stats.pathInfoCacheSize = pathInfoCache.size();
     return stats;
 }
 
 
+std::shared_ptr<std::string> Store::getBuildLogTail(const StorePath & path, size_t bytes)
+{
+    auto log = getBuildLog(path);
+    if (!log || log->size() <= bytes) return log;
+    return std::make_shared<std::string>(*log, log->size() - bytes);
+}
+
+
 static std::string makeCopyPathMessage(
     std::string_view srcUri,
     std::string_view dstUri,
@@ -860,6 +1112,112 @@ static std::string makeCopyPathMessage(
 }
 
 
+/* Try to copy 'storePath' by downloading a binary delta advertised by
+   'srcStore' and applying it to an older version of the same package
+   that 'dstStore' already has. Returns false if no usable delta is
+   available; throws nothing (failures fall back to the full NAR). */
+static bool tryCopyStorePathDelta(
+    Store & srcStore,
+    Store & dstStore,
+    const StorePath & storePath,
+    const ValidPathInfo & info,
+    RepairFlag repair,
+    CheckSigsFlag checkSigs,
+    Activity & act)
+{
+    auto cache = dynamic_cast<BinaryCacheStore *>(&srcStore);
+    if (!cache) return false;
+
+    auto narInfo = dynamic_cast<const NarInfo *>(&info);
+    if (!narInfo || narInfo->deltaUrl.empty() || !narInfo->deltaBase) return false;
+
+    auto & basePath = *narInfo->deltaBase;
+
+    if (narInfo->narSize > cache->narDeltaMaxSize) return false;
+
+    try {
+        if (!dstStore.isValidPath(basePath)) return false;
+
+        if (dstStore.queryPathInfo(basePath)->narSize > cache->narDeltaMaxSize)
+            return false;
+
+        debug("fetching delta '%s' for '%s'", narInfo->deltaUrl,
+            srcStore.printStorePath(storePath));
+
+        StringSink baseNar;
+        dstStore.narFromPath(basePath, baseNar);
+
+        StringSink delta;
+        cache->getFile(narInfo->deltaUrl, delta);
+        act.progress(delta.s->size(), narInfo->deltaSize);
+
+        StringSink nar;
+        StringSource deltaSource(*delta.s);
+        applyNarDelta(*baseNar.s, deltaSource, nar);
+
+        if (hashString(htSHA256, *nar.s) != info.narHash)
+            throw Error("NAR reconstructed from delta for '%s' has wrong hash",
+                srcStore.printStorePath(storePath));
+
+        StringSource source(*nar.s);
+        dstStore.addToStore(info, source, repair, checkSigs);
+
+        return true;
+    } catch (Error & e) {
+        warn("failed to apply NAR delta for '%s': %s; falling back to full download",
+            srcStore.printStorePath(storePath), e.msg());
+        return false;
+    }
+}
+
+/* If 'dstStore' is a binary cache with 'write-nar-deltas' enabled,
+   publish a delta for 'storePath' against the best predecessor (same
+   package name, highest older/other version) that the cache already
+   has. Failures are logged but never propagate: the path itself has
+   already been copied. */
+static void tryWriteNarDelta(
+    Store & srcStore,
+    Store & dstStore,
+    const StorePath & storePath)
+{
+    auto cache = dynamic_cast<BinaryCacheStore *>(&dstStore);
+    if (!cache || !cache->writeNARDeltas) return;
+
+    try {
+        if (srcStore.queryPathInfo(storePath)->narSize > cache->narDeltaMaxSize)
+            return;
+
+        DrvName name(storePath.name());
+        if (name.name.empty()) return;
+
+        std::optional<StorePath> base;
+        std::string baseVersion;
+        for (auto & p : srcStore.queryAllValidPaths()) {
+            if (p == storePath) continue;
+            DrvName candidate(p.name());
+            if (candidate.name != name.name) continue;
+            if (base && compareVersions(candidate.version, baseVersion) <= 0)
+                continue;
+            base = p;
+            baseVersion = candidate.version;
+        }
+
+        if (!base || !cache->isValidPath(*base)) return;
+
+        if (srcStore.queryPathInfo(*base)->narSize > cache->narDeltaMaxSize)
+            return;
+
+        StringSink baseNar, nar;
+        srcStore.narFromPath(*base, baseNar);
+        srcStore.narFromPath(storePath, nar);
+
+        cache->writeNarDelta(storePath, *base, *baseNar.s, *nar.s);
+    } catch (Error & e) {
+        warn("failed to write NAR delta for '%s': %s",
+            dstStore.printStorePath(storePath), e.msg());
+    }
+}
+
 void copyStorePath(
     Store & srcStore,
     Store & dstStore,
@@ -894,6 +1252,9 @@ void copyStorePath(
         info = info2;
     }
 
+    if (tryCopyStorePathDelta(srcStore, dstStore, storePath, *info, repair, checkSigs, act))
+        return;
+
     auto source = sinkToSource([&](Sink & sink) {
         LambdaSink progressSink([&](std::string_view data) {
             total += data.size();
@@ -906,6 +1267,8 @@ void copyStorePath(
     });
 
     dstStore.addToStore(*info, *source, repair, checkSigs);
+
+    tryWriteNarDelta(srcStore, dstStore, storePath);
 }
 
 
@@ -983,27 +1346,59 @@ std::map<StorePath, StorePath> copyPaths(
 
     Activity act(*logger, lvlInfo, actCopyPaths, fmt("copying %d paths", missing.size()));
 
-    auto sorted = srcStore.topoSortPaths(missing);
-    std::reverse(sorted.begin(), sorted.end());
+    /* A closure copy is resumable at path granularity: every path
+       that reaches the destination completely is registered as valid
+       there, and the validity query above skips it on the next run.
+       So on a transient failure halfway through, just ask the
+       destination what actually arrived and retry the remainder,
+       rather than failing (and rather than keeping a separate
+       checkpoint file that could disagree with the destination). */
+    for (unsigned int attempt = 1; !missing.empty(); attempt++) {
+
+        auto sorted = srcStore.topoSortPaths(missing);
+        std::reverse(sorted.begin(), sorted.end());
+
+        /* Read (and decompress) NARs from the source on a separate
+           thread, buffering ahead of the destination writes, so a
+           slow destination doesn't leave the source idle and vice
+           versa. */
+        auto source = sinkToSourceThreaded([&](Sink & sink) {
+            sink << sorted.size();
+            for (auto & storePath : sorted) {
+                auto srcUri = srcStore.getUri();
+                auto dstUri = dstStore.getUri();
+                auto storePathS = srcStore.printStorePath(storePath);
+                Activity act(*logger, lvlInfo, actCopyPath,
+                    makeCopyPathMessage(srcUri, dstUri, storePathS),
+                    {storePathS, srcUri, dstUri});
+                PushActivity pact(act.id);
+
+                auto info = srcStore.queryPathInfo(storePath);
+                info->write(sink, srcStore, 16);
+                srcStore.narFromPath(storePath, sink);
+            }
+        });
 
-    auto source = sinkToSource([&](Sink & sink) {
-        sink << sorted.size();
-        for (auto & storePath : sorted) {
-            auto srcUri = srcStore.getUri();
-            auto dstUri = dstStore.getUri();
-            auto storePathS = srcStore.printStorePath(storePath);
-            Activity act(*logger, lvlInfo, actCopyPath,
-                makeCopyPathMessage(srcUri, dstUri, storePathS),
-                {storePathS, srcUri, dstUri});
-            PushActivity pact(act.id);
+        try {
+            dstStore.addMultipleToStore(*source, repair, checkSigs);
+            break;
+        } catch (Error & e) {
+            if (attempt >= settings.copyAttempts) throw;
 
-            auto info = srcStore.queryPathInfo(storePath);
-            info->write(sink, srcStore, 16);
-            srcStore.narFromPath(storePath, sink);
-        }
-    });
+            /* Drop whatever did arrive before the failure and retry
+               with the rest. */
+            dstStore.clearPathInfoCache();
+            auto valid2 = dstStore.queryValidPaths(missing, NoSubstitute);
+            StorePathSet missing2;
+            for (auto & path : missing)
+                if (!valid2.count(path)) missing2.insert(path);
+
+            warn("error copying paths: %s; %d of %d paths arrived, retrying with the remaining %d",
+                e.what(), missing.size() - missing2.size(), missing.size(), missing2.size());
 
-    dstStore.addMultipleToStore(*source, repair, checkSigs);
+            missing = std::move(missing2);
+        }
+    }
 
     #if 0
     std::atomic<size_t> nrDone{0};
@@ -1213,7 +1608,7 @@ size_t ValidPathInfo::checkSignatures(const Store & store, const PublicKeys & pu
 
 bool ValidPathInfo::checkSignature(const Store & store, const PublicKeys & publicKeys, const std::string & sig) const
 {
-    return verifyDetached(fingerprint(store), sig, publicKeys);
+    return verifyDetachedCached(fingerprint(store), sig, publicKeys);
 }
 
 
@@ -1232,23 +1627,38 @@ Derivation Store::derivationFromPath(const StorePath & drvPath)
     return readDerivation(drvPath);
 }
 
-Derivation readDerivationCommon(Store& store, const StorePath& drvPath, bool requireValidPath)
+std::shared_ptr<const Derivation> Store::readDerivationCached(const StorePath & drvPath, bool requireValidPath)
 {
-    auto accessor = store.getFSAccessor();
+    auto key = std::string(drvPath.to_string());
+
+    if (auto drv = drvCache.get(key)) {
+        /* The cache doesn't record validity (an entry may have been
+           inserted by readInvalidDerivation()), so re-check it. */
+        if (requireValidPath && !isValidPath(drvPath))
+            throw InvalidPath("path '%s' is not valid", printStorePath(drvPath));
+        return *drv;
+    }
+
+    auto accessor = getFSAccessor();
     try {
-        return parseDerivation(store,
-            accessor->readFile(store.printStorePath(drvPath), requireValidPath),
-            Derivation::nameFromPath(drvPath));
+        auto drv = std::make_shared<const Derivation>(parseDerivation(*this,
+            accessor->readFile(printStorePath(drvPath), requireValidPath),
+            Derivation::nameFromPath(drvPath)));
+        drvCache.upsert(key, drv);
+        return drv;
     } catch (FormatError & e) {
-        throw Error("error parsing derivation '%s': %s", store.printStorePath(drvPath), e.msg());
+        throw Error("error parsing derivation '%s': %s", printStorePath(drvPath), e.msg());
     }
 }
 
 Derivation Store::readDerivation(const StorePath & drvPath)
-{ return readDerivationCommon(*this, drvPath, true); }
+{ return *readDerivationCached(drvPath, true); }
+
+std::shared_ptr<const Derivation> Store::readDerivationShared(const StorePath & drvPath)
+{ return readDerivationCached(drvPath, true); }
 
 Derivation Store::readInvalidDerivation(const StorePath & drvPath)
-{ return readDerivationCommon(*this, drvPath, false); }
+{ return *readDerivationCached(drvPath, false); }
 
 }
 
@@ -1361,6 +1771,7 @@ ref<Store> openStore(const std::string & uri_,
         params.insert(uriParams.begin(), uriParams.end());
 
         if (auto store = openFromNonUri(uri, params)) {
+            store->init();
             store->warnUnknownSettings();
             return ref<Store>(store);
         }
@@ -14,6 +14,7 @@
 #include "path-info.hh"
 
 #include <atomic>
+#include <deque>
 #include <limits>
 #include <map>
 #include <unordered_map>
@@ -75,6 +76,11 @@ enum AllowInvalidFlag : bool { DisallowInvalid = false, AllowInvalid = true };
 /* Magic header of exportPath() output (obsolete). */
 const uint32_t exportMagic = 0x4558494e;
 
+/* Magic header of exportPathsV2() output ("NIXEXP2\n"). Distinct
+   from the leading 0/1 words of the v1 format, so importPaths() can
+   tell the two apart. */
+const uint64_t exportMagicV2 = 0x4e4958455850320a;
+
 
 typedef std::unordered_map<StorePath, std::unordered_set<std::string>> Roots;
 
@@ -192,13 +198,16 @@ struct StoreConfig : public Config
 
     const Setting<int> pathInfoCacheSize{this, 65536, "path-info-cache-size", "size of the in-memory store path information cache"};
 
+    const Setting<int> drvCacheSize{this, 16384, "derivation-cache-size", "size of the in-memory parsed derivation cache"};
+
     const Setting<bool> isTrusted{this, false, "trusted", "whether paths from this store can be used as substitutes even when they lack trusted signatures"};
 
     Setting<int> priority{this, 0, "priority", "priority of this substituter (lower value means higher priority)"};
 
     Setting<bool> wantMassQuery{this, false, "want-mass-query", "whether this substituter can be queried efficiently for path validity"};
 
-    Setting<StringSet> systemFeatures{this, getDefaultSystemFeatures(),
+    LazySetting<StringSet> systemFeatures{this,
+        [this]() { return getDefaultSystemFeatures(); },
         "system-features",
         "Optional features that the system this store builds on implements (like \"kvm\")."};
 
@@ -230,15 +239,45 @@ protected:
         }
     };
 
-    struct State
-    {
-        LRUCache<std::string, PathInfoCacheValue> pathInfoCache;
-    };
+    /* Internally synchronised and sharded, since it is hammered from
+       many threads during parallel substitution checks. */
+    ShardedLRUCache<std::string, PathInfoCacheValue> pathInfoCache;
 
-    Sync<State> state;
+    /* Cache of parsed derivations, keyed by the .drv base name.
+       During large builds the same .drv files are read over and over
+       (e.g. by queryMissing()), and the character-by-character ATerm
+       parse dominates; since .drv files are immutable the parse
+       result can be reused indefinitely. */
+    ShardedLRUCache<std::string, std::shared_ptr<const Derivation>> drvCache;
+
+    /* Internal helper for the readDerivation() family. */
+    std::shared_ptr<const Derivation> readDerivationCached(const StorePath & drvPath, bool requireValidPath);
 
     std::shared_ptr<NarInfoDiskCache> diskCache;
 
+    /* Memoised plain forward closures (computeFSClosure() with no
+       flags), keyed by start path. References of valid paths are
+       immutable, so an entry only goes stale when paths are deleted;
+       deletions bump 'generation' (see invalidateClosureCache()),
+       which lazily invalidates every entry. */
+    struct ClosureCacheState
+    {
+        uint64_t generation = 0;
+        std::map<StorePath, std::pair<uint64_t, std::shared_ptr<const StorePathSet>>> closures;
+    };
+    Sync<ClosureCacheState> closureCache;
+
+    /* Outcome of the most recent substituter requests against this
+       store (most recent last), used to compute getSubstituterHealth().
+       Substituters are long-lived (see getDefaultSubstituters()), so
+       this covers requests from all goals. */
+    struct SubstituterHealthState
+    {
+        static constexpr size_t maxRecent = 100;
+        std::deque<std::pair<uint64_t /* µs */, bool /* failed */>> recent;
+    };
+    Sync<SubstituterHealthState> substituterHealthState;
+
     Store(const Params & params);
 
 public:
@@ -252,6 +291,24 @@ public:
 
     virtual std::string getUri() = 0;
 
+    /* Record the outcome of a request made to this store as a
+       substituter. */
+    void recordSubstituterRequest(uint64_t durationUs, bool failed);
+
+    /* Rolling health metrics of this store as a substituter, used by
+       PathSubstitutionGoal to demote degraded substituters. */
+    struct SubstituterHealth
+    {
+        size_t nrSamples = 0;
+        uint64_t p95LatencyUs = 0;
+        double errorRate = 0.0;
+    };
+    SubstituterHealth getSubstituterHealth();
+
+    /* Drop the memoised closures; must be called by implementations
+       after deleting paths. */
+    void invalidateClosureCache();
+
     StorePath parseStorePath(std::string_view path) const;
 
     std::optional<StorePath> maybeParseStorePath(std::string_view path) const;
@@ -350,6 +407,12 @@ public:
     virtual StorePathSet queryValidPaths(const StorePathSet & paths,
         SubstituteFlag maybeSubstitute = NoSubstitute);
 
+    /* Prime the in-memory path info cache for 'paths' with a single
+       bulk query against the on-disk NAR info cache, so that
+       subsequent queryPathInfo() calls don't hit the database one
+       path at a time. A no-op for stores without a disk cache. */
+    void prefetchPathInfos(const StorePathSet & paths);
+
     /* Query the set of all valid paths. Note that for some store
        backends, the name part of store paths may be replaced by 'x'
        (i.e. you'll get /nix/store/<hash>-x rather than
@@ -369,6 +432,14 @@ public:
     void queryPathInfo(const StorePath & path,
         Callback<ref<const ValidPathInfo>> callback) noexcept;
 
+    /* Query information about several paths at once. The lookups are
+       issued through the asynchronous interface, so stores with a
+       genuinely asynchronous backend (such as HTTP binary caches)
+       have all of them in flight at the same time instead of one
+       thread per blocked call. Invalid paths are absent from the
+       result. */
+    std::map<StorePath, ref<const ValidPathInfo>> queryPathInfos(const StorePathSet & paths);
+
     /* Query the information about a realisation. */
     std::shared_ptr<const Realisation> queryRealisation(const DrvOutput &);
 
@@ -376,6 +447,14 @@ public:
     void queryRealisation(const DrvOutput &,
         Callback<std::shared_ptr<const Realisation>> callback) noexcept;
 
+    /* Query several realisations at once; unknown outputs are left
+       out of the result. Much cheaper than calling queryRealisation()
+       in a loop against a remote store, and also prefetches the
+       realisations the results depend on into the local disk cache,
+       since a closure walk will ask for those next. */
+    std::map<DrvOutput, std::shared_ptr<const Realisation>> queryRealisations(
+        const std::set<DrvOutput> & ids);
+
 
     /* Check whether the given valid path info is sufficiently attested, by
        either being signed by a trusted public key or content-addressed, in
@@ -404,6 +483,12 @@ protected:
     virtual void queryRealisationUncached(const DrvOutput &,
         Callback<std::shared_ptr<const Realisation>> callback) noexcept = 0;
 
+    /* Bulk version of queryRealisationUncached(). The default
+       implementation just queries the outputs one by one; stores
+       that can batch should override it. */
+    virtual std::map<DrvOutput, std::shared_ptr<const Realisation>> queryRealisationsUncached(
+        const std::set<DrvOutput> & ids);
+
 public:
 
     /* Queries the set of incoming FS references for a store path.
@@ -433,6 +518,12 @@ public:
        path, or empty if the path doesn't exist. */
     virtual std::optional<StorePath> queryPathFromHashPart(const std::string & hashPart) = 0;
 
+    /* Bulk version of queryPathFromHashPart(). Hash parts that don't
+       resolve to a valid path are omitted from the result. The
+       default implementation does one query per hash part; stores
+       that can do better override it. */
+    virtual std::map<std::string, StorePath> queryPathsFromHashParts(const std::set<std::string> & hashParts);
+
     /* Query which of the given paths have substitutes. */
     virtual StorePathSet querySubstitutablePaths(const StorePathSet & paths) { return {}; };
 
@@ -581,6 +672,19 @@ public:
     virtual void collectGarbage(const GCOptions & options, GCResults & results)
     { unsupported("collectGarbage"); }
 
+    /* Return a counter that changes whenever the contents of the
+       store change (paths registered or deleted, garbage collection
+       runs). Monitoring tools can compare it against a previously
+       seen value instead of re-querying path validity. */
+    virtual uint64_t queryStoreGeneration()
+    { unsupported("queryStoreGeneration"); }
+
+    /* Block until the store generation differs from 'known' or
+       'timeoutMs' milliseconds have passed, and return the current
+       generation. The default implementation polls
+       queryStoreGeneration(). */
+    virtual uint64_t waitStoreGeneration(uint64_t known, uint64_t timeoutMs);
+
     /* Return a string representing information about the path that
        can be loaded into the database using `nix-store --load-db' or
        `nix-store --register-validity'. */
@@ -591,11 +695,15 @@ public:
        hash and the references. If ‘includeImpureInfo’ is true,
        variable elements such as the registration time are
        included. If ‘showClosureSize’ is true, the closure size of
-       each path is included. */
+       each path is included. If 'fields' is non-null, only the named
+       fields are emitted ('path' is always present), and the work to
+       compute omitted fields is skipped. Each path's object is
+       written to the output as soon as its info is available. */
     void pathInfoToJSON(JSONPlaceholder & jsonOut, const StorePathSet & storePaths,
         bool includeImpureInfo, bool showClosureSize,
         Base hashBase = Base32,
-        AllowInvalidFlag allowInvalid = DisallowInvalid);
+        AllowInvalidFlag allowInvalid = DisallowInvalid,
+        const StringSet * fields = nullptr);
 
     /* Return the size of the closure of the specified path, that is,
        the sum of the size of the NAR serialisation of each path in
@@ -633,6 +741,13 @@ public:
     /* Read a derivation (which must already be valid). */
     Derivation readDerivation(const StorePath & drvPath);
 
+    /* Like readDerivation(), but returns a pointer into the in-memory
+       derivation cache, avoiding a copy of the environment. Since
+       .drv files are immutable (their store path is a hash of their
+       contents), cached entries never become stale. Callers that
+       don't modify the derivation should prefer this on hot paths. */
+    std::shared_ptr<const Derivation> readDerivationShared(const StorePath & drvPath);
+
     /* Read a derivation from a potentially invalid path. */
     Derivation readInvalidDerivation(const StorePath & drvPath);
 
@@ -666,6 +781,17 @@ public:
        --import’. */
     void exportPaths(const StorePathSet & paths, Sink & sink);
 
+    /* Export multiple paths in the v2 container format: an index
+       header describing all paths, followed by one length-prefixed,
+       individually compressed and hashed frame per path. NARs are
+       dumped and compressed by a window of background jobs, so the
+       export runs at device speed on multi-core machines, and a
+       corrupted frame is detected (and skipped) per path on
+       import. */
+    void exportPathsV2(const StorePathSet & paths, Sink & sink,
+        const std::string & compression = "xz",
+        size_t jobs = 0 /* 0 = number of CPU cores */);
+
     void exportPath(const StorePath & path, Sink & sink);
 
     /* Import a sequence of NAR dumps created by exportPaths() into
@@ -674,10 +800,16 @@ public:
        access. */
     StorePaths importPaths(Source & source, CheckSigsFlag checkSigs = CheckSigs);
 
+    /* Import a v2 export container (see exportPathsV2()). Called by
+       importPaths() when it sees the v2 magic. */
+    StorePaths importPathsV2(Source & source, CheckSigsFlag checkSigs = CheckSigs);
+
     struct Stats
     {
         std::atomic<uint64_t> narInfoRead{0};
         std::atomic<uint64_t> narInfoReadAverted{0};
+        std::atomic<uint64_t> pathInfoCacheHits{0};
+        std::atomic<uint64_t> pathInfoCacheMisses{0};
         std::atomic<uint64_t> narInfoMissing{0};
         std::atomic<uint64_t> narInfoWrite{0};
         std::atomic<uint64_t> pathInfoCacheSize{0};
@@ -703,11 +835,17 @@ public:
     virtual std::shared_ptr<std::string> getBuildLog(const StorePath & path)
     { return nullptr; }
 
+    /* Return the last 'bytes' bytes of the build log of the specified
+       store path, if available, or null otherwise. Stores that keep
+       logs in a seekable format can serve this without materialising
+       the whole log. */
+    virtual std::shared_ptr<std::string> getBuildLogTail(const StorePath & path, size_t bytes);
+
     /* Hack to allow long-running processes like hydra-queue-runner to
        occasionally flush their path info cache. */
     void clearPathInfoCache()
     {
-        state.lock()->pathInfoCache.clear();
+        pathInfoCache.clear();
     }
 
     /* Establish a connection to the store, for store types that have
@@ -720,6 +858,16 @@ public:
         return 0;
     };
 
+    /* Query the build load of a remote machine: its job capacity
+       (maxJobs) and 100 times its 1-minute load average. Returns
+       std::nullopt for stores that can't report this, including
+       remotes that predate the command. Used by the build hook to
+       pick the least-loaded builder. */
+    virtual std::optional<std::pair<uint64_t, uint64_t>> queryBuildLoad()
+    {
+        return std::nullopt;
+    }
+
     virtual Path toRealPath(const Path & storePath)
     {
         return storePath;
@@ -12,4 +12,11 @@ std::map<std::string, nlohmann::json> BaseSetting<T>::toJSONObject()
     obj.emplace("defaultValue", defaultValue);
     return obj;
 }
+
+template<typename T>
+std::map<std::string, nlohmann::json> LazySetting<T>::toJSONObject()
+{
+    force();
+    return BaseSetting<T>::toJSONObject();
+}
 }
@@ -7,13 +7,23 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <fcntl.h>
 
+#if __linux__
+#include <sys/sendfile.h>
+#endif
+
 #include "archive.hh"
 #include "util.hh"
 #include "config.hh"
+#include "sync.hh"
+
+#include <condition_variable>
+#include <queue>
+#include <thread>
 
 namespace nix {
 
@@ -29,6 +39,10 @@ struct ArchiveSettings : Config
         "Whether to enable a Darwin-specific hack for dealing with file name collisions."};
     Setting<bool> preallocateContents{this, false, "preallocate-contents",
         "Whether to preallocate files when writing objects with known size."};
+    Setting<bool> dumpReadahead{this, true, "nar-dump-readahead",
+        "Whether to ask the kernel to read the files of a directory in the background while it is being dumped."};
+    Setting<bool> threadedRestore{this, true, "threaded-nar-restore",
+        "Whether to write the contents of a NAR to disk on a separate thread while it is being parsed."};
 };
 
 static ArchiveSettings archiveSettings;
@@ -42,6 +56,37 @@ static string caseHackSuffix = "~nix~case~hack~";
 PathFilter defaultPathFilter = [](const Path &) { return true; };
 
 
+#if __linux__
+/* Copy the contents of a regular file directly to the file
+   descriptor underlying 'sink', letting the kernel move the data
+   instead of bouncing it through a userspace buffer. Returns false
+   (having written nothing) if sendfile() doesn't support this pair
+   of file descriptors. */
+static bool trySendfile(int fromFd, FdSink & sink, off_t size)
+{
+    sink.flush();
+
+    off_t left = size;
+
+    while (left > 0) {
+        auto res = sendfile(sink.fd, fromFd, nullptr, std::min<off_t>(left, 1 << 30));
+        if (res == -1) {
+            if (errno == EINTR) continue;
+            if (left == size && (errno == EINVAL || errno == ENOSYS))
+                return false;
+            throw SysError("copying file to sink with sendfile()");
+        }
+        if (res == 0)
+            throw Error("unexpected end of file while copying with sendfile()");
+        left -= res;
+        sink.written += res;
+    }
+
+    return true;
+}
+#endif
+
+
 static void dumpContents(const Path & path, off_t size,
     Sink & sink)
 {
@@ -50,6 +95,16 @@ static void dumpContents(const Path & path, off_t size,
     AutoCloseFD fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
     if (!fd) throw SysError("opening file '%1%'", path);
 
+#if __linux__
+    /* When dumping to a file descriptor (e.g. the daemon serving
+       wopNarFromPath to a client socket), skip the userspace copy. */
+    if (auto fdSink = dynamic_cast<FdSink *>(&sink))
+        if (trySendfile(fd.get(), *fdSink, size)) {
+            writePadding(size, sink);
+            return;
+        }
+#endif
+
     std::vector<char> buf(65536);
     size_t left = size;
 
@@ -82,10 +137,28 @@ static void dump(const Path & path, Sink & sink, PathFilter & filter)
     else if (S_ISDIR(st.st_mode)) {
         sink << "type" << "directory";
 
+        auto entries = readDirectory(path);
+
+#ifdef POSIX_FADV_WILLNEED
+        /* Ask the kernel to start reading the regular files in this
+           directory in the background, so that the sequential dump
+           below mostly finds their contents in the page cache
+           already. The NAR ordering is unaffected; only the I/O is
+           concurrent. */
+        if (archiveSettings.dumpReadahead)
+            for (auto & i : entries)
+                if (i.type == DT_REG || i.type == DT_UNKNOWN) {
+                    AutoCloseFD fd = open((path + "/" + i.name).c_str(),
+                        O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_NONBLOCK);
+                    if (fd)
+                        posix_fadvise(fd.get(), 0, 0, POSIX_FADV_WILLNEED);
+                }
+#endif
+
         /* If we're on a case-insensitive system like macOS, undo
            the case hack applied by restorePath(). */
         std::map<string, string> unhacked;
-        for (auto & i : readDirectory(path))
+        for (auto & i : entries)
             if (archiveSettings.useCaseHack) {
                 string name(i.name);
                 size_t pos = i.name.find(caseHackSuffix);
@@ -277,6 +350,11 @@ static void parse(ParseSink & sink, Source & source, const Path & path)
         else
             throw badArchive("unknown field " + s);
     }
+
+    if (type == tpRegular)
+        sink.closeRegularFile();
+    else if (type == tpDirectory)
+        sink.closeDirectory(path);
 }
 
 
@@ -295,11 +373,28 @@ void parseDump(ParseSink & sink, Source & source)
 }
 
 
+/* The canonical modification time of store paths (see
+   canonicalisePathMetaData() in libstore). */
+static const time_t mtimeStore = 1;
+
 struct RestoreSink : ParseSink
 {
     Path dstPath;
+
+    /* Whether to give the restored files and directories their
+       canonical store metadata (mode 0444/0555, mtime 1) as they are
+       created, making a later canonicalisePathMetaData() pass over
+       the result unnecessary. */
+    bool canonicalise = false;
+
     AutoCloseFD fd;
 
+    /* Final destination of the file currently open in 'fd', if it
+       was created with O_TMPFILE and still has to be linked into
+       place. */
+    std::optional<Path> pendingFile;
+    bool isExec = false;
+
     void createDirectory(const Path & path) override
     {
         Path p = dstPath + path;
@@ -307,15 +402,49 @@ struct RestoreSink : ParseSink
             throw SysError("creating directory '%1%'", p);
     };
 
+    void closeDirectory(const Path & path) override
+    {
+        if (!canonicalise) return;
+        Path p = dstPath + path;
+        /* The mode can only be fixed now, since 0555 would have
+           prevented the creation of the directory's entries. */
+        if (chmod(p.c_str(), 0555) == -1)
+            throw SysError("changing mode of '%1%' to %2$o", p, 0555);
+        struct timeval times[2] = { { mtimeStore, 0 }, { mtimeStore, 0 } };
+        if (utimes(p.c_str(), times) == -1)
+            throw SysError("changing modification time of '%1%'", p);
+    }
+
     void createRegularFile(const Path & path) override
     {
         Path p = dstPath + path;
+        isExec = false;
+#ifdef O_TMPFILE
+        if (canonicalise) {
+            /* Create the file invisibly and link it into place when
+               it's complete, so that the directory never contains a
+               half-restored file. */
+            fd = open(dirOf(p).c_str(), O_TMPFILE | O_WRONLY | O_CLOEXEC, 0444);
+            if (fd) {
+                pendingFile = p;
+                return;
+            }
+            /* The file system may not support O_TMPFILE. */
+            if (errno != EOPNOTSUPP && errno != EINVAL && errno != EISDIR)
+                throw SysError("creating temporary file in '%1%'", dirOf(p));
+        }
+#endif
         fd = open(p.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0666);
         if (!fd) throw SysError("creating file '%1%'", p);
     }
 
     void isExecutable() override
     {
+        if (canonicalise) {
+            /* Applied in closeRegularFile(). */
+            isExec = true;
+            return;
+        }
         struct stat st;
         if (fstat(fd.get(), &st) == -1)
             throw SysError("fstat");
@@ -323,6 +452,25 @@ struct RestoreSink : ParseSink
             throw SysError("fchmod");
     }
 
+    void closeRegularFile() override
+    {
+        if (!canonicalise) return;
+        /* Set the canonical metadata on the file descriptor, before
+           the file becomes visible in the store. */
+        if (fchmod(fd.get(), isExec ? 0555 : 0444) == -1)
+            throw SysError("fchmod");
+        struct timespec times[2] = { { 0, UTIME_OMIT }, { mtimeStore, 0 } };
+        if (futimens(fd.get(), times) == -1)
+            throw SysError("futimens");
+        if (pendingFile) {
+            if (linkat(AT_FDCWD, fmt("/proc/self/fd/%d", fd.get()).c_str(),
+                    AT_FDCWD, pendingFile->c_str(), AT_SYMLINK_FOLLOW) == -1)
+                throw SysError("linking '%1%' into place", *pendingFile);
+            pendingFile.reset();
+        }
+        fd.close();
+    }
+
     void preallocateContents(uint64_t len) override
     {
         if (!archiveSettings.preallocateContents)
@@ -349,16 +497,170 @@ struct RestoreSink : ParseSink
     void createSymlink(const Path & path, const string & target) override
     {
         Path p = dstPath + path;
-        nix::createSymlink(target, p);
+        nix::createSymlink(target, p,
+            canonicalise ? std::optional<time_t>(mtimeStore) : std::nullopt);
+    }
+};
+
+
+/* A ParseSink that performs the file system operations of a
+   RestoreSink on a background thread, so that reading (and typically
+   decompressing) the NAR overlaps with writing its contents to
+   disk. The operations are executed strictly in order on a single
+   worker thread, preserving RestoreSink's semantics. */
+struct ThreadedRestoreSink : ParseSink
+{
+    RestoreSink inner;
+
+    typedef std::function<void()> op_t;
+
+    struct State
+    {
+        std::queue<std::pair<op_t, size_t>> ops;
+        size_t bytesQueued = 0;
+        bool done = false;
+        std::exception_ptr exception;
+    };
+
+    Sync<State> state_;
+
+    std::condition_variable wakeup, drained;
+
+    std::thread worker;
+
+    /* Limit the write backlog, so that a fast source can't make us
+       buffer a large part of the NAR in memory. */
+    static constexpr size_t maxQueuedBytes = 16 * 1024 * 1024;
+
+    ThreadedRestoreSink(const Path & dstPath, bool canonicalise)
+    {
+        inner.dstPath = dstPath;
+        inner.canonicalise = canonicalise;
+        worker = std::thread([this]() { run(); });
+    }
+
+    ~ThreadedRestoreSink()
+    {
+        try { finish(); } catch (...) { ignoreException(); }
+    }
+
+    void run()
+    {
+        while (true) {
+            op_t op;
+            size_t size;
+            {
+                auto state(state_.lock());
+                while (state->ops.empty()) {
+                    if (state->done) return;
+                    state.wait(wakeup);
+                }
+                std::tie(op, size) = std::move(state->ops.front());
+                state->ops.pop();
+            }
+            try {
+                op();
+            } catch (...) {
+                /* Drop the remaining work; the exception is rethrown
+                   on the parsing thread. */
+                auto state(state_.lock());
+                state->exception = std::current_exception();
+                while (!state->ops.empty()) state->ops.pop();
+                state->bytesQueued = 0;
+                drained.notify_all();
+                return;
+            }
+            {
+                auto state(state_.lock());
+                state->bytesQueued -= size;
+                drained.notify_all();
+            }
+        }
+    }
+
+    void enqueue(op_t op, size_t size = 0)
+    {
+        auto state(state_.lock());
+        while (!state->exception && state->bytesQueued > maxQueuedBytes)
+            state.wait(drained);
+        if (state->exception) std::rethrow_exception(state->exception);
+        state->ops.emplace(std::move(op), size);
+        state->bytesQueued += size;
+        wakeup.notify_one();
+    }
+
+    void createDirectory(const Path & path) override
+    {
+        enqueue([this, path]() { inner.createDirectory(path); });
+    }
+
+    void closeDirectory(const Path & path) override
+    {
+        enqueue([this, path]() { inner.closeDirectory(path); });
+    }
+
+    void createRegularFile(const Path & path) override
+    {
+        enqueue([this, path]() { inner.createRegularFile(path); });
+    }
+
+    void closeRegularFile() override
+    {
+        enqueue([this]() { inner.closeRegularFile(); });
+    }
+
+    void isExecutable() override
+    {
+        enqueue([this]() { inner.isExecutable(); });
+    }
+
+    void preallocateContents(uint64_t len) override
+    {
+        enqueue([this, len]() { inner.preallocateContents(len); });
+    }
+
+    void receiveContents(std::string_view data) override
+    {
+        /* The parser reuses its buffer, so the chunk has to be
+           copied. */
+        std::string buf(data);
+        auto size = buf.size();
+        enqueue([this, buf{std::move(buf)}]() { inner.receiveContents(buf); }, size);
+    }
+
+    void createSymlink(const Path & path, const string & target) override
+    {
+        enqueue([this, path, target]() { inner.createSymlink(path, target); });
+    }
+
+    /* Wait for the worker to catch up and rethrow any exception it
+       encountered. */
+    void finish()
+    {
+        {
+            auto state(state_.lock());
+            state->done = true;
+            wakeup.notify_all();
+        }
+        if (worker.joinable()) worker.join();
+        auto state(state_.lock());
+        if (state->exception) std::rethrow_exception(state->exception);
     }
 };
 
 
-void restorePath(const Path & path, Source & source)
+void restorePath(const Path & path, Source & source, bool canonicalise)
 {
-    RestoreSink sink;
-    sink.dstPath = path;
-    parseDump(sink, source);
+    if (archiveSettings.threadedRestore) {
+        ThreadedRestoreSink sink(path, canonicalise);
+        parseDump(sink, source);
+        sink.finish();
+    } else {
+        RestoreSink sink;
+        sink.dstPath = path;
+        sink.canonicalise = canonicalise;
+        parseDump(sink, source);
+    }
 }
 
 
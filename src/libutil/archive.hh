@@ -54,11 +54,15 @@ void dumpString(const std::string & s, Sink & sink);
 struct ParseSink
 {
     virtual void createDirectory(const Path & path) { };
+    /* Called when all entries of a directory have been created. */
+    virtual void closeDirectory(const Path & path) { };
 
     virtual void createRegularFile(const Path & path) { };
     virtual void isExecutable() { };
     virtual void preallocateContents(uint64_t size) { };
     virtual void receiveContents(std::string_view data) { };
+    /* Called when the contents of a regular file are complete. */
+    virtual void closeRegularFile() { };
 
     virtual void createSymlink(const Path & path, const string & target) { };
 };
@@ -90,7 +94,13 @@ struct RetrieveRegularNARSink : ParseSink
 
 void parseDump(ParseSink & sink, Source & source);
 
-void restorePath(const Path & path, Source & source);
+/* Restore a NAR to 'path'. If 'canonicalise' is set, files and
+   directories are given their canonical store metadata (mode
+   0444/0555, mtime 1) as they are created, so that no
+   canonicalisePathMetaData() pass over the result is needed; regular
+   files are then created invisibly with O_TMPFILE where supported and
+   linked into place once complete. */
+void restorePath(const Path & path, Source & source, bool canonicalise = false);
 
 /* Read a NAR from 'source' and write it to 'sink'. */
 void copyNAR(Source & source, Sink & sink);
@@ -17,7 +17,10 @@ struct CompressionSink : BufferedSink, FinishSink
 
 ref<std::string> decompress(const std::string & method, const std::string & in);
 
-std::unique_ptr<FinishSink> makeDecompressionSink(const std::string & method, Sink & nextSink);
+/* With 'parallel' set, multi-block/multi-stream archives are decoded
+   on several threads where the decompressor supports it (currently
+   only xz); otherwise the flag has no effect. */
+std::unique_ptr<FinishSink> makeDecompressionSink(const std::string & method, Sink & nextSink, bool parallel = false);
 
 ref<std::string> compress(const std::string & method, const std::string & in, const bool parallel = false, int level = -1);
 
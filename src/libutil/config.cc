@@ -376,6 +376,9 @@ template class BaseSetting<StringSet>;
 template class BaseSetting<StringMap>;
 template class BaseSetting<std::set<ExperimentalFeature>>;
 
+template class LazySetting<std::string>;
+template class LazySetting<StringSet>;
+
 void PathSetting::set(const std::string & str, bool append)
 {
     if (str == "") {
@@ -1,4 +1,5 @@
 #include <cassert>
+#include <functional>
 #include <map>
 #include <set>
 
@@ -231,7 +232,7 @@ class BaseSetting : public AbstractSetting
 protected:
 
     T value;
-    const T defaultValue;
+    T defaultValue; // only changed by LazySetting
 
 public:
 
@@ -297,6 +298,81 @@ public:
     void operator =(const T & v) { this->assign(v); }
 };
 
+/* A setting whose default value is expensive to compute, so it is
+   only computed when the setting is actually used. The function must
+   remain valid to call for the lifetime of the setting. */
+template<typename T>
+class LazySetting : public BaseSetting<T>
+{
+    std::function<T()> makeDefault;
+
+    /* Whether makeDefault has been called yet. */
+    mutable bool forced = false;
+
+    /* Whether the value has been set explicitly, in which case the
+       lazily computed default must not replace it. */
+    bool assigned = false;
+
+    void force() const
+    {
+        if (forced) return;
+        auto & self = const_cast<LazySetting<T> &>(*this);
+        self.forced = true;
+        self.defaultValue = makeDefault();
+        if (!assigned)
+            self.value = self.defaultValue;
+    }
+
+public:
+
+    LazySetting(Config * options,
+        std::function<T()> makeDefault,
+        const std::string & name,
+        const std::string & description,
+        const std::set<std::string> & aliases = {})
+        : BaseSetting<T>(T(), name, description, aliases)
+        , makeDefault(std::move(makeDefault))
+    {
+        options->addSetting(this);
+    }
+
+    operator const T &() const { force(); return this->value; }
+    operator T &() { force(); return this->value; }
+    const T & get() const { force(); return this->value; }
+    bool operator ==(const T & v2) const { return get() == v2; }
+    bool operator !=(const T & v2) const { return get() != v2; }
+    void operator =(const T & v) { this->assign(v); }
+
+    void assign(const T & v) override
+    {
+        assigned = true;
+        BaseSetting<T>::assign(v);
+    }
+
+    void set(const std::string & str, bool append = false) override
+    {
+        /* Appending extends the default value, so the latter has to
+           be computed first. */
+        if (append) force();
+        assigned = true;
+        BaseSetting<T>::set(str, append);
+    }
+
+    void override(const T & v) override
+    {
+        assigned = true;
+        BaseSetting<T>::override(v);
+    }
+
+    std::string to_string() const override
+    {
+        force();
+        return BaseSetting<T>::to_string();
+    }
+
+    std::map<std::string, nlohmann::json> toJSONObject() override;
+};
+
 /* A special setting for Paths. These are automatically canonicalised
    (e.g. "/foo//bar/" becomes "/foo/bar"). */
 class PathSetting : public BaseSetting<Path>
@@ -1,7 +1,11 @@
 #pragma once
 
 #include <boost/format.hpp>
+#include <cassert>
+#include <functional>
+#include <optional>
 #include <string>
+#include <tuple>
 #include "ansicolor.hh"
 
 
@@ -72,13 +76,20 @@ inline std::string fmt(const std::string & fs, const Args & ... args)
 // format function for hints in errors.  same as fmt, except templated values
 // are always in yellow.
 
+/* Note: 'yellowtxt' and 'normaltxt' hold a copy of their argument
+   rather than a reference, because hints capture their arguments for
+   deferred formatting (see hintfmt() below) and may outlive the
+   values they were constructed from. */
 template <class T>
 struct yellowtxt
 {
-    yellowtxt(const T &s) : value(s) {}
-    const T & value;
+    yellowtxt(const T & s) : value(s) {}
+    const T value;
 };
 
+template <size_t N>
+yellowtxt(const char (&)[N]) -> yellowtxt<std::string>;
+
 template <class T>
 std::ostream & operator<<(std::ostream & out, const yellowtxt<T> & y)
 {
@@ -89,9 +100,12 @@ template <class T>
 struct normaltxt
 {
     normaltxt(const T & s) : value(s) {}
-    const T & value;
+    const T value;
 };
 
+template <size_t N>
+normaltxt(const char (&)[N]) -> normaltxt<std::string>;
+
 template <class T>
 std::ostream & operator<<(std::ostream & out, const normaltxt<T> & y)
 {
@@ -103,55 +117,108 @@ class hintformat
 public:
     hintformat(const string & format) : fmt(format)
     {
-        fmt.exceptions(boost::io::all_error_bits ^
-                       boost::io::too_many_args_bit ^
-                       boost::io::too_few_args_bit);
+        fmt->exceptions(boost::io::all_error_bits ^
+                        boost::io::too_many_args_bit ^
+                        boost::io::too_few_args_bit);
     }
 
     hintformat(const hintformat & hf)
         : fmt(hf.fmt)
+        , deferred(hf.deferred)
+        , rendered(hf.rendered)
     { }
 
     hintformat(format && fmt)
         : fmt(std::move(fmt))
     { }
 
+    /* A hint whose formatting is deferred until str() is first
+       called. */
+    explicit hintformat(std::function<std::string()> deferred)
+        : deferred(std::move(deferred))
+    { }
+
     template<class T>
     hintformat & operator%(const T & value)
     {
-        fmt % yellowtxt(value);
+        assert(fmt);
+        *fmt % yellowtxt(value);
         return *this;
     }
 
     template<class T>
     hintformat & operator%(const normaltxt<T> & value)
     {
-        fmt % value.value;
+        assert(fmt);
+        *fmt % value.value;
         return *this;
     }
 
     std::string str() const
     {
-        return fmt.str();
+        if (deferred) {
+            if (!rendered) {
+                /* str() is reached from what(), which is noexcept,
+                   so a malformed format string must not propagate. */
+                try {
+                    rendered = deferred();
+                } catch (boost::io::format_error & e) {
+                    rendered = e.what();
+                }
+            }
+            return *rendered;
+        }
+        return fmt->str();
     }
 
 private:
-    format fmt;
+    std::optional<format> fmt;
+    std::function<std::string()> deferred;
+    mutable std::optional<std::string> rendered;
 };
 
 std::ostream & operator<<(std::ostream & os, const hintformat & hf);
 
+/* Capture a copy of a hint argument for deferred formatting. A
+   'const char *' is copied into a std::string, so the hint never
+   retains a pointer into storage that may be freed before rendering
+   (e.g. the c_str() of a temporary, or a strerror() buffer). */
+template<typename T>
+inline const T & copyHintArg(const T & x)
+{
+    return x;
+}
+
+inline std::string copyHintArg(const char * x)
+{
+    return x;
+}
+
+/* Hints are mostly constructed for exceptions, and exceptions are
+   frequently caught and discarded without their message ever being
+   shown (e.g. when evaluating under 'builtins.tryEval'). So capture
+   the format string and arguments by value and defer the (expensive)
+   boost::format work until the hint is actually rendered. */
 template<typename... Args>
 inline hintformat hintfmt(const std::string & fs, const Args & ... args)
 {
-    hintformat f(fs);
-    formatHelper(f, args...);
-    return f;
+    return hintformat(std::function<std::string()>(
+        [fs, copiedArgs = std::make_tuple(copyHintArg(args)...)]() {
+            hintformat f(fs);
+            std::apply([&f](const auto & ... as) {
+                formatHelper(f, as...);
+            }, copiedArgs);
+            return f.str();
+        }));
 }
 
 inline hintformat hintfmt(std::string plain_string)
 {
-    // we won't be receiving any args in this case, so just print the original string
-    return hintfmt("%s", normaltxt(plain_string));
+    // we won't be receiving any args in this case, so just print the
+    // original string (as 'hintfmt("%s", normaltxt(plain_string))'
+    // would)
+    return hintformat(std::function<std::string()>([plain_string{std::move(plain_string)}]() {
+        return ANSI_NORMAL + plain_string;
+    }));
 }
 }
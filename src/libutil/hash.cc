@@ -1,9 +1,14 @@
+#include <array>
 #include <iostream>
 #include <cstring>
 
 #include <openssl/md5.h>
 #include <openssl/sha.h>
 
+#if HAVE_BLAKE3
+#include <blake3.h>
+#endif
+
 #include "args.hh"
 #include "hash.hh"
 #include "archive.hh"
@@ -23,12 +28,18 @@ static size_t regularHashSize(HashType type) {
     case htSHA1: return sha1HashSize;
     case htSHA256: return sha256HashSize;
     case htSHA512: return sha512HashSize;
+    case htBLAKE3: return blake3HashSize;
     }
     abort();
 }
 
 
-std::set<std::string> hashTypes = { "md5", "sha1", "sha256", "sha512" };
+std::set<std::string> hashTypes = {
+    "md5", "sha1", "sha256", "sha512",
+#if HAVE_BLAKE3
+    "blake3",
+#endif
+};
 
 
 Hash::Hash(HashType type) : type(type)
@@ -68,6 +79,18 @@ bool Hash::operator < (const Hash & h) const
 
 const string base16Chars = "0123456789abcdef";
 
+/* Reverse of base16Chars (also accepting upper case); 0xff for
+   invalid characters. */
+static const auto base16Reverse = []() {
+    std::array<unsigned char, 256> tab;
+    tab.fill(0xff);
+    for (unsigned int i = 0; i < base16Chars.size(); ++i)
+        tab[(unsigned char) base16Chars[i]] = i;
+    for (char c = 'A'; c <= 'F'; ++c)
+        tab[(unsigned char) c] = c - 'A' + 10;
+    return tab;
+}();
+
 
 static string printHash16(const Hash & hash)
 {
@@ -83,6 +106,18 @@ static string printHash16(const Hash & hash)
 // omitted: E O U T
 const string base32Chars = "0123456789abcdfghijklmnpqrsvwxyz";
 
+/* Reverse of base32Chars; 0xff for invalid characters. Every store
+   path hash that enters the process goes through this, so a table
+   lookup instead of a scan over base32Chars is a measurable win in
+   metadata-heavy commands. */
+static const auto base32Reverse = []() {
+    std::array<unsigned char, 256> tab;
+    tab.fill(0xff);
+    for (unsigned int i = 0; i < base32Chars.size(); ++i)
+        tab[(unsigned char) base32Chars[i]] = i;
+    return tab;
+}();
+
 
 static string printHash32(const Hash & hash)
 {
@@ -210,17 +245,12 @@ Hash::Hash(std::string_view rest, HashType type, bool isSRI)
 {
     if (!isSRI && rest.size() == base16Len()) {
 
-        auto parseHexDigit = [&](char c) {
-            if (c >= '0' && c <= '9') return c - '0';
-            if (c >= 'A' && c <= 'F') return c - 'A' + 10;
-            if (c >= 'a' && c <= 'f') return c - 'a' + 10;
-            throw BadHash("invalid base-16 hash '%s'", rest);
-        };
-
         for (unsigned int i = 0; i < hashSize; i++) {
-            hash[i] =
-                parseHexDigit(rest[i * 2]) << 4
-                | parseHexDigit(rest[i * 2 + 1]);
+            auto hi = base16Reverse[(unsigned char) rest[i * 2]];
+            auto lo = base16Reverse[(unsigned char) rest[i * 2 + 1]];
+            if (hi == 0xff || lo == 0xff)
+                throw BadHash("invalid base-16 hash '%s'", rest);
+            hash[i] = hi << 4 | lo;
         }
     }
 
@@ -228,9 +258,7 @@ Hash::Hash(std::string_view rest, HashType type, bool isSRI)
 
         for (unsigned int n = 0; n < rest.size(); ++n) {
             char c = rest[rest.size() - n - 1];
-            unsigned char digit;
-            for (digit = 0; digit < base32Chars.size(); ++digit) /* !!! slow */
-                if (base32Chars[digit] == c) break;
+            unsigned char digit = base32Reverse[(unsigned char) c];
             if (digit >= 32)
                 throw BadHash("invalid base-32 hash '%s'", rest);
             unsigned int b = n * 5;
@@ -278,6 +306,9 @@ union Ctx
     SHA_CTX sha1;
     SHA256_CTX sha256;
     SHA512_CTX sha512;
+#if HAVE_BLAKE3
+    blake3_hasher blake3;
+#endif
 };
 
 
@@ -287,6 +318,9 @@ static void start(HashType ht, Ctx & ctx)
     else if (ht == htSHA1) SHA1_Init(&ctx.sha1);
     else if (ht == htSHA256) SHA256_Init(&ctx.sha256);
     else if (ht == htSHA512) SHA512_Init(&ctx.sha512);
+#if HAVE_BLAKE3
+    else if (ht == htBLAKE3) blake3_hasher_init(&ctx.blake3);
+#endif
 }
 
 
@@ -297,6 +331,13 @@ static void update(HashType ht, Ctx & ctx,
     else if (ht == htSHA1) SHA1_Update(&ctx.sha1, data.data(), data.size());
     else if (ht == htSHA256) SHA256_Update(&ctx.sha256, data.data(), data.size());
     else if (ht == htSHA512) SHA512_Update(&ctx.sha512, data.data(), data.size());
+#if HAVE_BLAKE3
+    /* BLAKE3 is a tree hash, so unlike the hashes above the library
+       can process the chunks of large updates in parallel with its
+       SIMD backends; feeding big buffers (as HashSink does) is what
+       makes it fast. */
+    else if (ht == htBLAKE3) blake3_hasher_update(&ctx.blake3, data.data(), data.size());
+#endif
 }
 
 
@@ -306,6 +347,9 @@ static void finish(HashType ht, Ctx & ctx, unsigned char * hash)
     else if (ht == htSHA1) SHA1_Final(hash, &ctx.sha1);
     else if (ht == htSHA256) SHA256_Final(hash, &ctx.sha256);
     else if (ht == htSHA512) SHA512_Final(hash, &ctx.sha512);
+#if HAVE_BLAKE3
+    else if (ht == htBLAKE3) blake3_hasher_finalize(&ctx.blake3, hash, blake3HashSize);
+#endif
 }
 
 
@@ -390,6 +434,9 @@ std::optional<HashType> parseHashTypeOpt(std::string_view s)
     else if (s == "sha1") return htSHA1;
     else if (s == "sha256") return htSHA256;
     else if (s == "sha512") return htSHA512;
+#if HAVE_BLAKE3
+    else if (s == "blake3") return htBLAKE3;
+#endif
     else return std::optional<HashType> {};
 }
 
@@ -409,6 +456,7 @@ string printHashType(HashType ht)
     case htSHA1: return "sha1";
     case htSHA256: return "sha256";
     case htSHA512: return "sha512";
+    case htBLAKE3: return "blake3";
     default:
         // illegal hash type enum value internally, as opposed to external input
         // which should be validated with nice error message.
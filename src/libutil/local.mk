@@ -11,3 +11,7 @@ libutil_LDFLAGS += -pthread $(OPENSSL_LIBS) $(LIBBROTLI_LIBS) $(LIBARCHIVE_LIBS)
 ifeq ($(HAVE_LIBCPUID), 1)
 	libutil_LDFLAGS += -lcpuid
 endif
+
+ifeq ($(HAVE_BLAKE3), 1)
+	libutil_LDFLAGS += $(LIBBLAKE3_LIBS)
+endif
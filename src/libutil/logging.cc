@@ -1,8 +1,10 @@
 #include "logging.hh"
 #include "util.hh"
 #include "config.hh"
+#include "sync.hh"
 
 #include <atomic>
+#include <cstdio>
 #include <nlohmann/json.hpp>
 #include <iostream>
 
@@ -53,6 +55,12 @@ public:
         return printBuildLogs;
     }
 
+    /* Build log lines are dropped below unless they were asked for,
+       so a remote producer need not send them at all. */
+    bool wantsBuildLogs() override {
+        return printBuildLogs;
+    }
+
     void log(Verbosity lvl, const FormatOrString & fs) override
     {
         if (lvl > verbosity) return;
@@ -139,40 +147,152 @@ Activity::Activity(Logger & logger, Verbosity lvl, ActivityType type,
     logger.startActivity(id, lvl, type, s, fields, parent);
 }
 
+/* Append 's' to 'out' as a JSON string literal, replacing invalid
+   UTF-8 sequences with U+FFFD (like nlohmann's
+   error_handler_t::replace, since build logs can contain arbitrary
+   bytes). */
+static void appendJSONString(std::string & out, std::string_view s)
+{
+    out += '"';
+    size_t i = 0, n = s.size();
+    while (i < n) {
+        unsigned char c = s[i];
+        if (c == '"') { out += "\\\""; i++; }
+        else if (c == '\\') { out += "\\\\"; i++; }
+        else if (c == '\n') { out += "\\n"; i++; }
+        else if (c == '\r') { out += "\\r"; i++; }
+        else if (c == '\t') { out += "\\t"; i++; }
+        else if (c < 0x20) {
+            char hex[8];
+            snprintf(hex, sizeof(hex), "\\u%04x", c);
+            out += hex;
+            i++;
+        }
+        else if (c < 0x80) { out += (char) c; i++; }
+        else {
+            size_t len =
+                (c & 0xe0) == 0xc0 ? 2 :
+                (c & 0xf0) == 0xe0 ? 3 :
+                (c & 0xf8) == 0xf0 ? 4 : 0;
+            bool ok = len && i + len <= n && c >= 0xc2 && c <= 0xf4;
+            for (size_t j = 1; ok && j < len; ++j)
+                ok = ((unsigned char) s[i + j] & 0xc0) == 0x80;
+            /* Reject overlong encodings, surrogates and code points
+               above U+10FFFF. */
+            if (ok && len == 3) {
+                unsigned char c1 = s[i + 1];
+                if ((c == 0xe0 && c1 < 0xa0) || (c == 0xed && c1 > 0x9f)) ok = false;
+            }
+            if (ok && len == 4) {
+                unsigned char c1 = s[i + 1];
+                if ((c == 0xf0 && c1 < 0x90) || (c == 0xf4 && c1 > 0x8f)) ok = false;
+            }
+            if (ok) {
+                out.append(s.data() + i, len);
+                i += len;
+            } else {
+                out += "\xef\xbf\xbd";
+                i++;
+            }
+        }
+    }
+    out += '"';
+}
+
 struct JSONLogger : Logger {
     Logger & prevLogger;
 
+    /* Batch buffer (empty and unused if json-log-buffer-size is 0).
+       Messages are complete "@nix {...}" lines separated by
+       newlines. */
+    Sync<std::string> buffer_;
+
     JSONLogger(Logger & prevLogger) : prevLogger(prevLogger) { }
 
+    ~JSONLogger()
+    {
+        try { flush(); } catch (...) { ignoreException(); }
+    }
+
     bool isVerbose() override {
         return true;
     }
 
-    void addFields(nlohmann::json & json, const Fields & fields)
+    /* Append the fields as '"fields":[...]'. The messages of the
+       fixed-shape events below are assembled directly into a string,
+       rather than through a JSON DOM, since they are produced at
+       very high rates (e.g. a result() per build log line). The key
+       order matches what nlohmann's sorted dump produced. */
+    void addFields(std::string & json, const Fields & fields)
     {
         if (fields.empty()) return;
-        auto & arr = json["fields"] = nlohmann::json::array();
-        for (auto & f : fields)
+        json += ",\"fields\":[";
+        bool first = true;
+        for (auto & f : fields) {
+            if (!first) json += ',';
+            first = false;
             if (f.type == Logger::Field::tInt)
-                arr.push_back(f.i);
+                json += std::to_string(f.i);
             else if (f.type == Logger::Field::tString)
-                arr.push_back(f.s);
+                appendJSONString(json, f.s);
             else
                 abort();
+        }
+        json += ']';
+    }
+
+    void write(std::string && json)
+    {
+        size_t bufferSize = loggerSettings.jsonLogBufferSize;
+        if (!bufferSize) {
+            prevLogger.log(lvlError, json);
+            return;
+        }
+        std::string toFlush;
+        {
+            auto buffer(buffer_.lock());
+            if (!buffer->empty()) *buffer += '\n';
+            *buffer += json;
+            if (buffer->size() >= bufferSize) {
+                toFlush = std::move(*buffer);
+                buffer->clear();
+            }
+        }
+        if (!toFlush.empty())
+            prevLogger.log(lvlError, toFlush);
+    }
+
+    void flush()
+    {
+        std::string toFlush;
+        {
+            auto buffer(buffer_.lock());
+            toFlush = std::move(*buffer);
+            buffer->clear();
+        }
+        if (!toFlush.empty())
+            prevLogger.log(lvlError, toFlush);
+    }
+
+    void stop() override
+    {
+        flush();
+        prevLogger.stop();
     }
 
     void write(const nlohmann::json & json)
     {
-        prevLogger.log(lvlError, "@nix " + json.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace));
+        write("@nix " + json.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace));
     }
 
     void log(Verbosity lvl, const FormatOrString & fs) override
     {
-        nlohmann::json json;
-        json["action"] = "msg";
-        json["level"] = lvl;
-        json["msg"] = fs.s;
-        write(json);
+        std::string json = "@nix {\"action\":\"msg\",\"level\":";
+        json += std::to_string(lvl);
+        json += ",\"msg\":";
+        appendJSONString(json, fs.s);
+        json += '}';
+        write(std::move(json));
     }
 
     void logEI(const ErrorInfo & ei) override
@@ -218,33 +338,39 @@ struct JSONLogger : Logger {
     void startActivity(ActivityId act, Verbosity lvl, ActivityType type,
         const std::string & s, const Fields & fields, ActivityId parent) override
     {
-        nlohmann::json json;
-        json["action"] = "start";
-        json["id"] = act;
-        json["level"] = lvl;
-        json["type"] = type;
-        json["text"] = s;
-        addFields(json, fields);
         // FIXME: handle parent
-        write(json);
+        std::string json = "@nix {\"action\":\"start\"";
+        addFields(json, fields);
+        json += ",\"id\":";
+        json += std::to_string(act);
+        json += ",\"level\":";
+        json += std::to_string(lvl);
+        json += ",\"text\":";
+        appendJSONString(json, s);
+        json += ",\"type\":";
+        json += std::to_string(type);
+        json += '}';
+        write(std::move(json));
     }
 
     void stopActivity(ActivityId act) override
     {
-        nlohmann::json json;
-        json["action"] = "stop";
-        json["id"] = act;
-        write(json);
+        std::string json = "@nix {\"action\":\"stop\",\"id\":";
+        json += std::to_string(act);
+        json += '}';
+        write(std::move(json));
     }
 
     void result(ActivityId act, ResultType type, const Fields & fields) override
     {
-        nlohmann::json json;
-        json["action"] = "result";
-        json["id"] = act;
-        json["type"] = type;
+        std::string json = "@nix {\"action\":\"result\"";
         addFields(json, fields);
-        write(json);
+        json += ",\"id\":";
+        json += std::to_string(act);
+        json += ",\"type\":";
+        json += std::to_string(type);
+        json += '}';
+        write(std::move(json));
     }
 };
 
@@ -253,6 +379,97 @@ Logger * makeJSONLogger(Logger & prevLogger)
     return new JSONLogger(prevLogger);
 }
 
+static thread_local Logger * perThreadLogger = nullptr;
+
+class PerThreadLogger : public Logger
+{
+    Logger & fallback;
+
+    Logger & current()
+    {
+        return perThreadLogger ? *perThreadLogger : fallback;
+    }
+
+public:
+
+    PerThreadLogger(Logger & fallback) : fallback(fallback) { }
+
+    void stop() override
+    {
+        current().stop();
+    }
+
+    bool isVerbose() override
+    {
+        return current().isVerbose();
+    }
+
+    bool wantsBuildLogs() override
+    {
+        return current().wantsBuildLogs();
+    }
+
+    void log(Verbosity lvl, const FormatOrString & fs) override
+    {
+        current().log(lvl, fs);
+    }
+
+    void logEI(const ErrorInfo & ei) override
+    {
+        current().logEI(ei);
+    }
+
+    void warn(const std::string & msg) override
+    {
+        current().warn(msg);
+    }
+
+    void startActivity(ActivityId act, Verbosity lvl, ActivityType type,
+        const std::string & s, const Fields & fields, ActivityId parent) override
+    {
+        current().startActivity(act, lvl, type, s, fields, parent);
+    }
+
+    void stopActivity(ActivityId act) override
+    {
+        current().stopActivity(act);
+    }
+
+    void result(ActivityId act, ResultType type, const Fields & fields) override
+    {
+        current().result(act, type, fields);
+    }
+
+    void writeToStdout(std::string_view s) override
+    {
+        current().writeToStdout(s);
+    }
+
+    std::optional<char> ask(std::string_view s) override
+    {
+        return current().ask(s);
+    }
+};
+
+static bool loggerIsPerThread = false;
+
+void makeLoggerPerThread()
+{
+    if (loggerIsPerThread) return;
+    logger = new PerThreadLogger(*logger);
+    loggerIsPerThread = true;
+}
+
+bool isLoggerPerThread()
+{
+    return loggerIsPerThread;
+}
+
+void setPerThreadLogger(Logger * logger)
+{
+    perThreadLogger = logger;
+}
+
 static Logger::Fields getFields(nlohmann::json & json)
 {
     Logger::Fields fields;
@@ -43,6 +43,16 @@ struct LoggerSettings : Config
           Where Nix should print out a stack trace in case of Nix
           expression evaluation errors.
         )"};
+
+    Setting<size_t> jsonLogBufferSize{
+        this, 0, "json-log-buffer-size",
+        R"(
+          Buffer size (in bytes) for batching messages of the JSON
+          log format (`--log-format internal-json`). The default of 0
+          writes every message immediately; a non-zero value reduces
+          the number of write system calls on busy builders, at the
+          cost of messages reaching the consumer with a delay.
+        )"};
 };
 
 extern LoggerSettings loggerSettings;
@@ -73,6 +83,11 @@ public:
     // Whether the logger prints the whole build log
     virtual bool isVerbose() { return false; }
 
+    // Whether the logger consumes build log lines (resBuildLogLine
+    // and friends) at all. A remote log producer (e.g. the daemon)
+    // may skip sending them when this returns false.
+    virtual bool wantsBuildLogs() { return true; }
+
     virtual void log(Verbosity lvl, const FormatOrString & fs) = 0;
 
     void log(const FormatOrString & fs)
@@ -166,6 +181,20 @@ Logger * makeSimpleLogger(bool printBuildLogs = true);
 
 Logger * makeJSONLogger(Logger & prevLogger);
 
+/* Replace the global logger with one that forwards to a per-thread
+   logger, falling back to the previous global logger for threads that
+   haven't set one. Used by the threaded daemon, where each connection
+   thread tunnels its log messages to its own client. */
+void makeLoggerPerThread();
+
+/* Whether makeLoggerPerThread() has been called. */
+bool isLoggerPerThread();
+
+/* Set the logger for the calling thread. Only meaningful after
+   makeLoggerPerThread(); a null logger reverts the thread to the
+   fallback logger. */
+void setPerThreadLogger(Logger * logger);
+
 bool handleJSONLogMessage(const std::string & msg,
     const Activity & act, std::map<ActivityId, Activity> & activities,
     bool trusted);
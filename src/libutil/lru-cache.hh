@@ -1,9 +1,13 @@
 #pragma once
 
+#include "sync.hh"
+
 #include <cassert>
 #include <map>
 #include <list>
+#include <memory>
 #include <optional>
+#include <vector>
 
 namespace nix {
 
@@ -90,4 +94,60 @@ public:
     }
 };
 
+/* A thread-safe LRU cache, sharded to reduce lock contention: keys
+   are hashed to one of several independently locked LRUCaches. Note
+   that eviction is therefore least-recently-used per shard rather
+   than globally. */
+template<typename Key, typename Value>
+class ShardedLRUCache
+{
+private:
+
+    std::vector<std::unique_ptr<Sync<LRUCache<Key, Value>>>> shards;
+
+    Sync<LRUCache<Key, Value>> & shard(const Key & key)
+    {
+        return *shards[std::hash<Key>()(key) % shards.size()];
+    }
+
+public:
+
+    ShardedLRUCache(size_t capacity, size_t numShards = 16)
+    {
+        shards.reserve(numShards);
+        for (size_t i = 0; i < numShards; ++i)
+            shards.push_back(std::make_unique<Sync<LRUCache<Key, Value>>>(
+                LRUCache<Key, Value>((capacity + numShards - 1) / numShards)));
+    }
+
+    void upsert(const Key & key, const Value & value)
+    {
+        shard(key).lock()->upsert(key, value);
+    }
+
+    bool erase(const Key & key)
+    {
+        return shard(key).lock()->erase(key);
+    }
+
+    std::optional<Value> get(const Key & key)
+    {
+        return shard(key).lock()->get(key);
+    }
+
+    size_t size()
+    {
+        size_t res = 0;
+        for (auto & shard : shards)
+            res += shard->lock()->size();
+        return res;
+    }
+
+    void clear()
+    {
+        for (auto & shard : shards)
+            shard->lock()->clear();
+    }
+};
+
 }
@@ -0,0 +1,136 @@
+#include "monitor-fd.hh"
+#include "util.hh"
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include <poll.h>
+#include <unistd.h>
+
+namespace nix {
+
+/* The shared watcher thread behind all MonitorFdHup instances. It
+   polls every registered fd plus a self-pipe used to interrupt the
+   poll when the set of fds changes. */
+struct FdHupWatcher
+{
+    std::mutex mutex;
+    std::condition_variable fired;
+    std::map<int, std::function<void()>> fds;
+    int firingFd = -1;
+    Pipe wakeupPipe;
+    bool threadStarted = false;
+
+    static FdHupWatcher & get()
+    {
+        /* Deliberately leaked: the watcher thread runs for the
+           lifetime of the process. */
+        static FdHupWatcher * watcher = new FdHupWatcher;
+        return *watcher;
+    }
+
+    void wakeup()
+    {
+        char c = 0;
+        [[maybe_unused]] auto res = write(wakeupPipe.writeSide.get(), &c, 1);
+    }
+
+    void add(int fd, std::function<void()> callback)
+    {
+        std::unique_lock lock(mutex);
+        fds.emplace(fd, std::move(callback));
+        if (!threadStarted) {
+            wakeupPipe.create();
+            std::thread([this]() { run(); }).detach();
+            threadStarted = true;
+        } else
+            wakeup();
+    }
+
+    void remove(int fd)
+    {
+        std::unique_lock lock(mutex);
+        fds.erase(fd);
+        /* Don't return while the callback for this fd is running on
+           the watcher thread, since it may refer to state owned by
+           the caller. */
+        while (firingFd == fd)
+            fired.wait(lock);
+        wakeup();
+    }
+
+    void run()
+    {
+        std::vector<struct pollfd> pollfds;
+
+        while (true) {
+            pollfds.clear();
+            /* This shouldn't be necessary, but macOS doesn't seem to
+               like a zeroed out events field.
+               See rdar://37537852. */
+            pollfds.push_back({ .fd = wakeupPipe.readSide.get(), .events = POLLIN });
+            {
+                std::unique_lock lock(mutex);
+                for (auto & [fd, _] : fds)
+                    pollfds.push_back({ .fd = fd, .events = POLLHUP });
+            }
+
+            auto count = poll(pollfds.data(), pollfds.size(), -1);
+            if (count == -1) {
+                if (errno == EINTR) continue;
+                abort(); // can't happen
+            }
+            /* This shouldn't happen, but can on macOS due to a bug.
+               See rdar://37550628.
+
+               This may eventually need a delay or further
+               coordination with the main thread if spinning proves
+               too harmful. */
+            if (count == 0) continue;
+
+            if (pollfds[0].revents & POLLIN) {
+                char buf[64];
+                [[maybe_unused]] auto res = read(wakeupPipe.readSide.get(), buf, sizeof(buf));
+            }
+
+            for (size_t i = 1; i < pollfds.size(); ++i) {
+                if (!(pollfds[i].revents & (POLLHUP | POLLNVAL))) continue;
+                std::function<void()> callback;
+                {
+                    std::unique_lock lock(mutex);
+                    auto j = fds.find(pollfds[i].fd);
+                    if (j == fds.end()) continue;
+                    if (pollfds[i].revents & POLLHUP) {
+                        callback = std::move(j->second);
+                        firingFd = pollfds[i].fd;
+                    }
+                    /* In either case stop watching this fd: it hung
+                       up or was closed behind our back. */
+                    fds.erase(j);
+                }
+                if (callback) {
+                    callback();
+                    std::unique_lock lock(mutex);
+                    firingFd = -1;
+                    fired.notify_all();
+                }
+            }
+        }
+    }
+};
+
+MonitorFdHup::MonitorFdHup(int fd, std::function<void()> callback)
+    : fd(fd)
+{
+    FdHupWatcher::get().add(fd,
+        callback ? std::move(callback) : []() { triggerInterrupt(); });
+}
+
+MonitorFdHup::~MonitorFdHup()
+{
+    FdHupWatcher::get().remove(fd);
+}
+
+}
@@ -84,6 +84,27 @@ public:
         state_->max--;
     }
 
+    /* Eagerly create instances until the pool holds 'size' of them
+       (never more than the maximum), so that later get() calls don't
+       pay the creation cost. */
+    void warmUp(size_t size)
+    {
+        while (true) {
+            {
+                auto state_(state.lock());
+                if (state_->idle.size() + state_->inUse >= std::min(size, state_->max))
+                    return;
+            }
+            /* Don't hold the lock while creating the instance, which
+               might take a while. This can overshoot if get() runs
+               concurrently, but only by transient in-use handles. */
+            auto r = factory();
+            auto state_(state.lock());
+            state_->idle.push_back(r);
+            wakeup.notify_one();
+        }
+    }
+
     ~Pool()
     {
         auto state_(state.lock());
@@ -1,9 +1,14 @@
 #include "serialise.hh"
+#include "sync.hh"
 #include "util.hh"
 
 #include <cstring>
 #include <cerrno>
+#include <list>
 #include <memory>
+#include <thread>
+
+#include <sys/uio.h>
 
 #include <boost/coroutine2/coroutine.hpp>
 
@@ -17,10 +22,12 @@ void BufferedSink::operator () (std::string_view data)
 
     while (!data.empty()) {
         /* Optimisation: bypass the buffer if the data exceeds the
-           buffer size. */
+           buffer size, writing any buffered data (e.g. protocol
+           framing) and the payload in one operation if possible. */
         if (bufPos + data.size() >= bufSize) {
-            flush();
-            write(data);
+            size_t n = bufPos;
+            bufPos = 0; // don't trigger the assert() in ~BufferedSink()
+            writeBuffered({buffer.get(), n}, data);
             break;
         }
         /* Otherwise, copy the bytes to the buffer.  Flush the buffer
@@ -28,7 +35,15 @@ void BufferedSink::operator () (std::string_view data)
         size_t n = bufPos + data.size() > bufSize ? bufSize - bufPos : data.size();
         memcpy(buffer.get() + bufPos, data.data(), n);
         data.remove_prefix(n); bufPos += n;
-        if (bufPos == bufSize) flush();
+        if (bufPos == bufSize) {
+            flush();
+            /* A full buffer indicates a bulk transfer; grow it to
+               amortise the cost of the write calls. */
+            if (bufSize < maxBufSize) {
+                bufSize = std::min(bufSize * 2, maxBufSize);
+                buffer = decltype(buffer)(new char[bufSize]);
+            }
+        }
     }
 }
 
@@ -81,6 +96,49 @@ bool FdSink::good()
 }
 
 
+void FdSink::writeBuffered(std::string_view buffered, std::string_view data)
+{
+    written += buffered.size() + data.size();
+    static bool warned = false;
+    if (warn && !warned) {
+        if (written > threshold) {
+            warnLargeDump();
+            warned = true;
+        }
+    }
+    try {
+        /* Write the buffered data and the payload with a single
+           system call per iteration. */
+        while (!buffered.empty() || !data.empty()) {
+            checkInterrupt();
+            struct iovec iov[2];
+            int iovcnt = 0;
+            if (!buffered.empty()) {
+                iov[iovcnt].iov_base = (char *) buffered.data();
+                iov[iovcnt].iov_len = buffered.size();
+                iovcnt++;
+            }
+            if (!data.empty()) {
+                iov[iovcnt].iov_base = (char *) data.data();
+                iov[iovcnt].iov_len = data.size();
+                iovcnt++;
+            }
+            ssize_t res = writev(fd, iov, iovcnt);
+            if (res == -1 && errno != EINTR)
+                throw SysError("writing to file");
+            if (res > 0) {
+                size_t n = std::min((size_t) res, buffered.size());
+                buffered.remove_prefix(n);
+                data.remove_prefix(res - n);
+            }
+        }
+    } catch (SysError & e) {
+        _good = false;
+        throw;
+    }
+}
+
+
 void Source::operator () (char * data, size_t len)
 {
     while (len) {
@@ -118,7 +176,19 @@ size_t BufferedSource::read(char * data, size_t len)
 {
     if (!buffer) buffer = decltype(buffer)(new char[bufSize]);
 
-    if (!bufPosIn) bufPosIn = readUnbuffered(buffer.get(), bufSize);
+    if (!bufPosIn) {
+        bufPosIn = readUnbuffered(buffer.get(), bufSize);
+        /* If the underlying source filled the entire buffer, it
+           probably has more data ready, so grow the buffer to move
+           more per call. */
+        if (bufPosIn == bufSize && bufSize < maxBufSize) {
+            auto newSize = std::min(bufSize * 2, maxBufSize);
+            auto newBuffer = decltype(buffer)(new char[newSize]);
+            memcpy(newBuffer.get(), buffer.get(), bufPosIn);
+            buffer = std::move(newBuffer);
+            bufSize = newSize;
+        }
+    }
 
     /* Copy out the data in the buffer. */
     size_t n = len > bufPosIn - bufPosOut ? bufPosIn - bufPosOut : len;
@@ -307,6 +377,98 @@ std::unique_ptr<Source> sinkToSource(
 }
 
 
+std::unique_ptr<Source> sinkToSourceThreaded(
+    std::function<void(Sink &)> fun,
+    size_t maxBufferSize)
+{
+    struct ThreadedSinkToSource : Source
+    {
+        struct State
+        {
+            std::list<std::string> chunks;
+            size_t size = 0;
+            bool eof = false;
+            bool aborted = false;
+            std::exception_ptr exc;
+        };
+
+        Sync<State> state_;
+        std::condition_variable canRead, canWrite;
+        size_t maxBufferSize;
+        std::thread thread;
+
+        std::string cur;
+        size_t pos = 0;
+
+        ThreadedSinkToSource(std::function<void(Sink &)> fun, size_t maxBufferSize)
+            : maxBufferSize(maxBufferSize)
+        {
+            thread = std::thread([this, fun{std::move(fun)}]() {
+                LambdaSink sink([&](std::string_view data) {
+                    if (data.empty()) return;
+                    auto state(state_.lock());
+                    while (state->size >= this->maxBufferSize && !state->aborted)
+                        state.wait(canWrite);
+                    if (state->aborted)
+                        throw Error("reader of threaded source has disappeared");
+                    state->chunks.emplace_back(data);
+                    state->size += data.size();
+                    canRead.notify_one();
+                });
+                try {
+                    fun(sink);
+                } catch (...) {
+                    auto state(state_.lock());
+                    if (!state->aborted)
+                        state->exc = std::current_exception();
+                }
+                {
+                    auto state(state_.lock());
+                    state->eof = true;
+                }
+                canRead.notify_one();
+            });
+        }
+
+        ~ThreadedSinkToSource()
+        {
+            {
+                auto state(state_.lock());
+                state->aborted = true;
+            }
+            canWrite.notify_one();
+            thread.join();
+        }
+
+        size_t read(char * data, size_t len) override
+        {
+            if (pos == cur.size()) {
+                auto state(state_.lock());
+                while (state->chunks.empty() && !state->eof)
+                    state.wait(canRead);
+                if (state->chunks.empty()) {
+                    if (state->exc) std::rethrow_exception(state->exc);
+                    throw EndOfFile("threaded source is exhausted");
+                }
+                cur = std::move(state->chunks.front());
+                state->chunks.pop_front();
+                state->size -= cur.size();
+                pos = 0;
+                canWrite.notify_one();
+            }
+
+            auto n = std::min(cur.size() - pos, len);
+            memcpy(data, cur.data() + pos, n);
+            pos += n;
+
+            return n;
+        }
+    };
+
+    return std::make_unique<ThreadedSinkToSource>(fun, maxBufferSize);
+}
+
+
 void writePadding(size_t len, Sink & sink)
 {
     if (len % 8) {
@@ -37,16 +37,32 @@ struct FinishSink : virtual Sink
 struct BufferedSink : virtual Sink
 {
     size_t bufSize, bufPos;
+
+    /* If larger than bufSize, the buffer is doubled (up to this
+       limit) every time it fills up completely, so that bulk
+       transfers need fewer write calls. */
+    size_t maxBufSize;
+
     std::unique_ptr<char[]> buffer;
 
     BufferedSink(size_t bufSize = 32 * 1024)
-        : bufSize(bufSize), bufPos(0), buffer(nullptr) { }
+        : bufSize(bufSize), bufPos(0), maxBufSize(bufSize), buffer(nullptr) { }
 
     void operator () (std::string_view data) override;
 
     void flush();
 
     virtual void write(std::string_view data) = 0;
+
+protected:
+
+    /* Write the contents of the buffer followed by 'data', preferably
+       in a single operation. */
+    virtual void writeBuffered(std::string_view buffered, std::string_view data)
+    {
+        if (!buffered.empty()) write(buffered);
+        write(data);
+    }
 };
 
 
@@ -78,10 +94,16 @@ struct Source
 struct BufferedSource : Source
 {
     size_t bufSize, bufPosIn, bufPosOut;
+
+    /* If larger than bufSize, the buffer is doubled (up to this
+       limit) whenever the underlying source fills it completely,
+       i.e. probably has more data ready. */
+    size_t maxBufSize;
+
     std::unique_ptr<char[]> buffer;
 
     BufferedSource(size_t bufSize = 32 * 1024)
-        : bufSize(bufSize), bufPosIn(0), bufPosOut(0), buffer(nullptr) { }
+        : bufSize(bufSize), bufPosIn(0), bufPosOut(0), maxBufSize(bufSize), buffer(nullptr) { }
 
     size_t read(char * data, size_t len) override;
 
@@ -100,8 +122,8 @@ struct FdSink : BufferedSink
     bool warn = false;
     size_t written = 0;
 
-    FdSink() : fd(-1) { }
-    FdSink(int fd) : fd(fd) { }
+    FdSink() : fd(-1) { maxBufSize = 4 * 1024 * 1024; }
+    FdSink(int fd) : fd(fd) { maxBufSize = 4 * 1024 * 1024; }
     FdSink(FdSink&&) = default;
 
     FdSink& operator=(FdSink && s)
@@ -120,6 +142,9 @@ struct FdSink : BufferedSink
 
     bool good() override;
 
+protected:
+    void writeBuffered(std::string_view buffered, std::string_view data) override;
+
 private:
     bool _good = true;
 };
@@ -131,8 +156,8 @@ struct FdSource : BufferedSource
     int fd;
     size_t read = 0;
 
-    FdSource() : fd(-1) { }
-    FdSource(int fd) : fd(fd) { }
+    FdSource() : fd(-1) { maxBufSize = 4 * 1024 * 1024; }
+    FdSource(int fd) : fd(fd) { maxBufSize = 4 * 1024 * 1024; }
     FdSource(FdSource&&) = default;
 
     FdSource& operator=(FdSource && s)
@@ -298,6 +323,14 @@ std::unique_ptr<Source> sinkToSource(
         throw EndOfFile("coroutine has finished");
     });
 
+/* Like sinkToSource(), but runs the function on a separate thread,
+   with a bounded buffer in between, so the producer and the consumer
+   of the data proceed concurrently instead of alternating on one
+   thread. */
+std::unique_ptr<Source> sinkToSourceThreaded(
+    std::function<void(Sink &)> fun,
+    size_t maxBufferSize = 16 * 1024 * 1024);
+
 
 void writePadding(size_t len, Sink & sink);
 void writeString(std::string_view s, Sink & sink);
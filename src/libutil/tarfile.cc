@@ -1,8 +1,16 @@
 #include <archive.h>
 #include <archive_entry.h>
 
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <condition_variable>
+
+#include "finally.hh"
 #include "serialise.hh"
+#include "sync.hh"
 #include "tarfile.hh"
+#include "thread-pool.hh"
 
 namespace nix {
 
@@ -17,7 +25,7 @@ static ssize_t callback_read(struct archive * archive, void * _self, const void
     *buffer = self->buffer.data();
 
     try {
-        return self->source->read((char *) self->buffer.data(), 4096);
+        return self->source->read((char *) self->buffer.data(), self->buffer.size());
     } catch (EndOfFile &) {
         return 0;
     } catch (std::exception & err) {
@@ -39,10 +47,16 @@ void TarArchive::check(int err, const std::string & reason)
         throw Error(reason, archive_error_string(this->archive));
 }
 
-TarArchive::TarArchive(Source & source, bool raw)
-    : source(&source), buffer(4096)
+TarArchive::TarArchive(Source & source, bool raw, bool parallel)
+    : source(&source), buffer(64 * 1024)
 {
     init();
+    if (parallel)
+        /* Ask the read filters to decode multi-block/multi-stream
+           archives on several threads (currently only xz supports
+           this). Silently ignored if the filter or the libarchive
+           version doesn't. */
+        archive_read_set_filter_option(archive, nullptr, "threads", "0");
     if (!raw)
         archive_read_support_format_all(archive);
     else
@@ -102,20 +116,177 @@ static void extract_archive(TarArchive & archive, const Path & destDir)
     archive.close();
 }
 
-void unpackTarfile(Source & source, const Path & destDir)
+/* Extract an archive using a pool of writer threads. Decompression
+   and the walk over the entry headers are inherently sequential and
+   stay on the calling thread, but writing out regular file contents
+   (the bulk of the work for source tarballs) is farmed out.
+   Directories, symlinks and special entries are created in archive
+   order on the calling thread; hard links are created after all file
+   data has been written. Only safe when 'destDir' is fresh. */
+static void extract_archive_parallel(TarArchive & archive, const Path & destDir)
+{
+    int flags = ARCHIVE_EXTRACT_FFLAGS
+        | ARCHIVE_EXTRACT_PERM
+        | ARCHIVE_EXTRACT_TIME
+        | ARCHIVE_EXTRACT_SECURE_SYMLINKS
+        | ARCHIVE_EXTRACT_SECURE_NODOTDOT;
+
+    ThreadPool pool;
+
+    /* Bound the file data buffered between this thread and the
+       writers. */
+    struct Buffered { uint64_t bytes = 0; };
+    Sync<Buffered> buffered_;
+    std::condition_variable wakeup;
+    const uint64_t maxBuffered = 256 * 1024 * 1024;
+
+    /* Symlinks created so far (relative to destDir). Refusing to
+       extract later entries through them is what
+       ARCHIVE_EXTRACT_SECURE_SYMLINKS does for the sequential
+       path. */
+    StringSet symlinks;
+
+    /* Directory modes are applied after extraction, since a
+       read-only directory would prevent the writers from creating
+       files inside it. */
+    std::vector<std::pair<Path, mode_t>> dirModes;
+
+    std::vector<std::pair<Path, Path>> hardLinks;
+
+    for (;;) {
+        struct archive_entry * entry;
+        int r = archive_read_next_header(archive.archive, &entry);
+        if (r == ARCHIVE_EOF) break;
+        auto name = archive_entry_pathname(entry);
+        if (!name)
+            throw Error("cannot get archive member name: %s", archive_error_string(archive.archive));
+        if (r == ARCHIVE_WARN)
+            warn(archive_error_string(archive.archive));
+        else
+            archive.check(r);
+
+        /* Resolve '..' lexically and anchor the result inside the
+           destination (cf. ARCHIVE_EXTRACT_SECURE_NODOTDOT). */
+        auto relPath = canonPath("/" + std::string(name));
+        auto dst = destDir + relPath;
+
+        for (size_t slash = relPath.find('/', 1);
+             slash != std::string::npos;
+             slash = relPath.find('/', slash + 1))
+            if (symlinks.count(std::string(relPath, 0, slash)))
+                throw Error("archive member '%s' traverses a symlink", name);
+
+        auto type = archive_entry_filetype(entry);
+
+        if (type == AE_IFDIR) {
+            if (relPath != "/") {
+                createDirs(dst);
+                dirModes.emplace_back(dst, archive_entry_perm(entry));
+            }
+        }
+
+        else if (type == AE_IFLNK) {
+            auto target = archive_entry_symlink(entry);
+            if (!target)
+                throw Error("cannot get symlink target of archive member '%s'", name);
+            createDirs(dirOf(dst));
+            if (symlink(target, dst.c_str()) == -1)
+                throw SysError("creating symlink '%s'", dst);
+            symlinks.insert(relPath);
+        }
+
+        else if (type == AE_IFREG && !archive_entry_hardlink(entry)) {
+            std::string data;
+            if (auto size = archive_entry_size(entry); size > 0)
+                data.reserve(size);
+            std::vector<char> buf(64 * 1024);
+            for (;;) {
+                auto n = archive_read_data(archive.archive, buf.data(), buf.size());
+                if (n == 0) break;
+                if (n < 0)
+                    throw Error("cannot read archive member '%s': %s", name, archive_error_string(archive.archive));
+                data.append(buf.data(), n);
+            }
+
+            {
+                auto buffered(buffered_.lock());
+                while (buffered->bytes && buffered->bytes + data.size() > maxBuffered)
+                    buffered.wait(wakeup);
+                buffered->bytes += data.size();
+            }
+
+            createDirs(dirOf(dst));
+
+            mode_t mode = archive_entry_perm(entry);
+            time_t mtime = archive_entry_mtime(entry);
+
+            pool.enqueue([dst, data{std::move(data)}, mode, mtime, &buffered_, &wakeup]() {
+                Finally release([&]() {
+                    auto buffered(buffered_.lock());
+                    buffered->bytes -= data.size();
+                    wakeup.notify_one();
+                });
+                AutoCloseFD fd = open(dst.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0666);
+                if (!fd)
+                    throw SysError("creating file '%s'", dst);
+                writeFull(fd.get(), data);
+                if (fchmod(fd.get(), mode & 07777) == -1)
+                    throw SysError("changing mode of '%s'", dst);
+                struct timespec times[2] = {{mtime, 0}, {mtime, 0}};
+                if (futimens(fd.get(), times) == -1)
+                    throw SysError("changing modification time of '%s'", dst);
+            });
+        }
+
+        else if (archive_entry_hardlink(entry)) {
+            auto target = destDir + canonPath("/" + std::string(archive_entry_hardlink(entry)));
+            createDirs(dirOf(dst));
+            hardLinks.emplace_back(target, dst);
+        }
+
+        else {
+            /* Rare entry types (fifos, devices) take the sequential
+               libarchive path; they carry no file data. */
+            archive_entry_set_pathname(entry, dst.c_str());
+            archive.check(archive_read_extract(archive.archive, entry, flags));
+        }
+    }
+
+    pool.process();
+
+    for (auto & [target, dst] : hardLinks)
+        if (link(target.c_str(), dst.c_str()) == -1)
+            throw SysError("creating hard link '%s'", dst);
+
+    /* Deepest directories were recorded last; process them first so
+       a read-only parent doesn't get in the way. */
+    for (auto i = dirModes.rbegin(); i != dirModes.rend(); ++i)
+        if (chmod(i->first.c_str(), i->second & 07777) == -1)
+            throw SysError("changing mode of '%s'", i->first);
+
+    archive.close();
+}
+
+void unpackTarfile(Source & source, const Path & destDir, bool parallel)
 {
     auto archive = TarArchive(source);
 
     createDirs(destDir);
-    extract_archive(archive, destDir);
+    if (parallel)
+        extract_archive_parallel(archive, destDir);
+    else
+        extract_archive(archive, destDir);
 }
 
-void unpackTarfile(const Path & tarFile, const Path & destDir)
+void unpackTarfile(const Path & tarFile, const Path & destDir, bool parallel)
 {
     auto archive = TarArchive(tarFile);
 
     createDirs(destDir);
-    extract_archive(archive, destDir);
+    if (parallel)
+        extract_archive_parallel(archive, destDir);
+    else
+        extract_archive(archive, destDir);
 }
 
 }
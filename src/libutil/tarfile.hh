@@ -10,7 +10,7 @@ struct TarArchive {
 
     void check(int err, const std::string & reason = "failed to extract archive (%s)");
 
-    TarArchive(Source & source, bool raw = false);
+    TarArchive(Source & source, bool raw = false, bool parallel = false);
 
     TarArchive(const Path & path);
 
@@ -24,8 +24,12 @@ struct TarArchive {
     ~TarArchive();
 };
 
-void unpackTarfile(Source & source, const Path & destDir);
+/* Unpack an archive into 'destDir'. With 'parallel' set, regular
+   file contents are written by a thread pool while the calling
+   thread decompresses; only use this for a freshly created
+   'destDir'. */
+void unpackTarfile(Source & source, const Path & destDir, bool parallel = false);
 
-void unpackTarfile(const Path & tarFile, const Path & destDir);
+void unpackTarfile(const Path & tarFile, const Path & destDir, bool parallel = false);
 
 }
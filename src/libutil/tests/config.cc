@@ -248,4 +248,37 @@ namespace nix {
         ASSERT_THROW(config.applyConfig("value == key"), UsageError);
         ASSERT_THROW(config.applyConfig("value "), UsageError);
     }
+
+    /* ----------------------------------------------------------------------------
+     * LazySetting
+     * --------------------------------------------------------------------------*/
+
+    TEST(LazySetting, defaultComputedOnFirstUse) {
+        Config config;
+        bool computed = false;
+        LazySetting<std::string> setting{&config, [&]() { computed = true; return "default-value"; },
+            "name-of-the-setting", "description"};
+
+        ASSERT_FALSE(computed);
+        ASSERT_EQ(setting.get(), "default-value");
+        ASSERT_TRUE(computed);
+    }
+
+    TEST(LazySetting, assignedValueNotClobberedByDefault) {
+        Config config;
+        LazySetting<std::string> setting{&config, []() { return "default-value"; },
+            "name-of-the-setting", "description"};
+
+        config.set("name-of-the-setting", "value");
+        ASSERT_EQ(setting.get(), "value");
+    }
+
+    TEST(LazySetting, appendExtendsDefault) {
+        Config config;
+        LazySetting<StringSet> setting{&config, []() { return StringSet{"a"}; },
+            "name-of-the-setting", "description"};
+
+        config.set("extra-name-of-the-setting", "b");
+        ASSERT_EQ(setting.get(), StringSet({"a", "b"}));
+    }
 }
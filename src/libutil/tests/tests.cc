@@ -405,6 +405,23 @@ namespace nix {
         ASSERT_EQ(rewriteStrings("this and that", rewrites), "this and that");
     }
 
+    TEST(rewriteStrings, singlePass) {
+        StringMap rewrites;
+        rewrites["this"] = "that";
+        rewrites["that"] = "this";
+
+        /* Replacements are not themselves rewritten. */
+        ASSERT_EQ(rewriteStrings("this and that", rewrites), "that and this");
+    }
+
+    TEST(rewriteStrings, longestMatchWins) {
+        StringMap rewrites;
+        rewrites["this"] = "1";
+        rewrites["this and"] = "2";
+
+        ASSERT_EQ(rewriteStrings("this and that", rewrites), "2 that");
+    }
+
     /* ----------------------------------------------------------------------------
      * replaceStrings
      * --------------------------------------------------------------------------*/
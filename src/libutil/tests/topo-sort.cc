@@ -0,0 +1,47 @@
+#include "topo-sort.hh"
+
+#include <gtest/gtest.h>
+
+namespace nix {
+
+static std::vector<int> sortGraph(std::set<int> items,
+    std::map<int, std::set<int>> edges)
+{
+    return topoSort<int>(items,
+        [&](const int & i) { return edges[i]; },
+        [](const int & i, const int & j) {
+            return Error("cycle between %d and %d", i, j);
+        });
+}
+
+TEST(topoSort, childrenAfterParents) {
+    auto sorted = sortGraph({1, 2, 3, 4}, {{1, {2, 3}}, {2, {4}}, {3, {4}}});
+    ASSERT_EQ(sorted.size(), (size_t) 4);
+    ASSERT_EQ(sorted.front(), 1);
+    ASSERT_EQ(sorted.back(), 4);
+}
+
+TEST(topoSort, ignoresChildrenOutsideSet) {
+    auto sorted = sortGraph({1, 2}, {{1, {2, 99}}, {2, {1000}}});
+    ASSERT_EQ(sorted, (std::vector<int>{1, 2}));
+}
+
+TEST(topoSort, detectsCycle) {
+    ASSERT_THROW(sortGraph({1, 2}, {{1, {2}}, {2, {1}}}), Error);
+}
+
+TEST(topoSort, deepChainDoesNotOverflowStack) {
+    std::set<int> items;
+    std::map<int, std::set<int>> edges;
+    const int depth = 1000000;
+    for (int i = 0; i < depth; ++i) {
+        items.insert(i);
+        if (i + 1 < depth) edges[i] = {i + 1};
+    }
+    auto sorted = sortGraph(std::move(items), std::move(edges));
+    ASSERT_EQ(sorted.size(), (size_t) depth);
+    ASSERT_EQ(sorted.front(), 0);
+    ASSERT_EQ(sorted.back(), depth - 1);
+}
+
+}
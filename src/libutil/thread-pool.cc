@@ -13,9 +13,46 @@ ThreadPool::ThreadPool(size_t _maxThreads)
         if (!maxThreads) maxThreads = 1;
     }
 
+    shards.resize(maxThreads);
+    for (auto & shard : shards)
+        shard = std::make_unique<Shard>();
+
     debug("starting pool of %d threads", maxThreads - 1);
 }
 
+size_t ThreadPool::myShard()
+{
+    /* Hashing the thread id gives every worker a stable shard of its
+       own (modulo the occasional collision, which merely shares a
+       lock between two threads). */
+    return std::hash<std::thread::id>()(std::this_thread::get_id()) % shards.size();
+}
+
+bool ThreadPool::tryPopWork(work_t & w)
+{
+    auto home = myShard();
+
+    for (size_t i = 0; i < shards.size(); ++i) {
+        auto & shard(*shards[(home + i) % shards.size()]);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (shard.queue.empty()) continue;
+        if (i == 0) {
+            /* Pop the most recently pushed item from our own shard
+               (it's more likely to be cache-hot)... */
+            w = std::move(shard.queue.back());
+            shard.queue.pop_back();
+        } else {
+            /* ...but steal the oldest item from other shards. */
+            w = std::move(shard.queue.front());
+            shard.queue.pop_front();
+        }
+        pendingCount--;
+        return true;
+    }
+
+    return false;
+}
+
 ThreadPool::~ThreadPool()
 {
     shutdown();
@@ -42,13 +79,30 @@ void ThreadPool::shutdown()
 
 void ThreadPool::enqueue(const work_t & t)
 {
-    auto state(state_.lock());
     if (quit)
         throw ThreadPoolShutDown("cannot enqueue a work item while the thread pool is shutting down");
-    state->pending.push(t);
-    /* Note: process() also executes items, so count it as a worker. */
-    if (state->pending.size() > state->workers.size() + 1 && state->workers.size() + 1 < maxThreads)
-        state->workers.emplace_back(&ThreadPool::doWork, this, false);
+
+    {
+        auto & shard(*shards[myShard()]);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.queue.push_back(t);
+    }
+
+    auto pending = ++pendingCount;
+
+    /* Start a new worker thread if the existing ones are likely all
+       busy. Note: process() also executes items, so count it as a
+       worker. Once the pool is fully grown, enqueueing doesn't touch
+       the pool-wide lock any more. */
+    auto n = numWorkers.load();
+    if (pending > n + 1 && n + 1 < maxThreads) {
+        auto state(state_.lock());
+        if (pendingCount > state->workers.size() + 1 && state->workers.size() + 1 < maxThreads) {
+            state->workers.emplace_back(&ThreadPool::doWork, this, false);
+            numWorkers = state->workers.size();
+        }
+    }
+
     work.notify_one();
 }
 
@@ -122,7 +176,7 @@ void ThreadPool::doWork(bool mainThread)
             while (true) {
                 if (quit) return;
 
-                if (!state->pending.empty()) break;
+                if (pendingCount.load() > 0) break;
 
                 /* If there are no active or pending items, and the
                    main thread is running process(), then no new items
@@ -133,14 +187,26 @@ void ThreadPool::doWork(bool mainThread)
                     return;
                 }
 
-                state.wait(work);
+                /* Wake up periodically, since enqueue() signals the
+                   condition variable without holding the pool-wide
+                   lock (to keep it off the fast path), so a
+                   notification can race with us going to sleep. */
+                state.wait_for(work, std::chrono::milliseconds(100));
             }
 
-            w = std::move(state->pending.front());
-            state->pending.pop();
             state->active++;
         }
 
+        /* Grab an item from the shards. This can fail if another
+           thread stole the last one first; in that case, go back to
+           waiting. */
+        if (!tryPopWork(w)) {
+            auto state(state_.lock());
+            state->active--;
+            didWork = false;
+            continue;
+        }
+
         try {
             w();
         } catch (...) {
@@ -3,11 +3,12 @@
 #include "sync.hh"
 #include "util.hh"
 
-#include <queue>
+#include <deque>
 #include <functional>
 #include <thread>
 #include <map>
 #include <atomic>
+#include <mutex>
 
 namespace nix {
 
@@ -42,9 +43,24 @@ private:
 
     size_t maxThreads;
 
+    /* The pending work items, sharded over several deques so that
+       threads mostly touch different locks. Each thread pushes and
+       pops at the back of its own shard and steals the oldest item
+       from another shard when its own is empty. */
+    struct Shard
+    {
+        std::mutex mutex;
+        std::deque<work_t> queue;
+    };
+
+    std::vector<std::unique_ptr<Shard>> shards;
+
+    std::atomic<size_t> pendingCount{0};
+
+    std::atomic<size_t> numWorkers{0};
+
     struct State
     {
-        std::queue<work_t> pending;
         size_t active = 0;
         std::exception_ptr exception;
         std::vector<std::thread> workers;
@@ -57,6 +73,13 @@ private:
 
     std::condition_variable work;
 
+    /* The shard preferred by the calling thread. */
+    size_t myShard();
+
+    /* Grab a work item, preferably from our own shard. Returns false
+       if all shards are empty. */
+    bool tryPopWork(work_t & w);
+
     void doWork(bool mainThread);
 
     void shutdown();
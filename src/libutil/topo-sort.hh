@@ -4,35 +4,64 @@
 
 namespace nix {
 
+/* Topologically sort 'items' such that every item precedes the items
+   it references (as returned by 'getChildren'). The traversal is
+   depth-first but uses an explicit stack, so dependency chains of
+   arbitrary depth — e.g. the closure of a generated store path chain
+   — cannot exhaust the C stack. */
 template<typename T>
 std::vector<T> topoSort(std::set<T> items,
         std::function<std::set<T>(const T &)> getChildren,
         std::function<Error(const T &, const T &)> makeCycleError)
 {
     std::vector<T> sorted;
+    sorted.reserve(items.size());
     std::set<T> visited, parents;
 
-    std::function<void(const T & path, const T * parent)> dfsVisit;
+    /* One frame per node on the DFS path: the node and its children
+       that are still to be visited, in the order in which the
+       recursive implementation would have visited them. */
+    struct Frame
+    {
+        T node;
+        std::vector<T> children;
+        size_t next = 0;
+    };
 
-    dfsVisit = [&](const T & path, const T * parent) {
-        if (parents.count(path)) throw makeCycleError(path, *parent);
+    auto makeFrame = [&](const T & node)
+    {
+        Frame frame{node};
+        for (auto & child : getChildren(node))
+            /* Don't traverse into items that don't exist in our starting set. */
+            if (child != node && items.count(child))
+                frame.children.push_back(child);
+        return frame;
+    };
 
-        if (!visited.insert(path).second) return;
-        parents.insert(path);
+    for (auto & i : items) {
+        if (!visited.insert(i).second) continue;
+        parents.insert(i);
 
-        std::set<T> references = getChildren(path);
+        std::vector<Frame> stack;
+        stack.push_back(makeFrame(i));
 
-        for (auto & i : references)
-            /* Don't traverse into items that don't exist in our starting set. */
-            if (i != path && items.count(i))
-                dfsVisit(i, &path);
+        while (!stack.empty()) {
+            auto & frame = stack.back();
 
-        sorted.push_back(path);
-        parents.erase(path);
-    };
+            if (frame.next == frame.children.size()) {
+                sorted.push_back(frame.node);
+                parents.erase(frame.node);
+                stack.pop_back();
+                continue;
+            }
 
-    for (auto & i : items)
-        dfsVisit(i, nullptr);
+            auto & child = frame.children[frame.next++];
+            if (parents.count(child)) throw makeCycleError(child, frame.node);
+            if (!visited.insert(child).second) continue;
+            parents.insert(child);
+            stack.push_back(makeFrame(child));
+        }
+    }
 
     std::reverse(sorted.begin(), sorted.end());
 
@@ -0,0 +1,28 @@
+#pragma once
+
+/* Statically defined tracepoints (USDT), for observing a live daemon
+   with bpftrace, systemtap or dtrace without attaching a debugger,
+   e.g.
+
+     bpftrace -e 'usdt:/path/to/nix:nix:sqlite_busy_retry { @[ustack] = count(); }'
+
+   They are compiled out unless './configure --enable-usdt-probes' is
+   given; when disabled the arguments are not evaluated. */
+
+#if HAVE_USDT
+
+#include <sys/sdt.h>
+
+#define NIX_PROBE(name) DTRACE_PROBE(nix, name)
+#define NIX_PROBE1(name, a1) DTRACE_PROBE1(nix, name, a1)
+#define NIX_PROBE2(name, a1, a2) DTRACE_PROBE2(nix, name, a1, a2)
+#define NIX_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(nix, name, a1, a2, a3)
+
+#else
+
+#define NIX_PROBE(name) ((void) 0)
+#define NIX_PROBE1(name, a1) ((void) 0)
+#define NIX_PROBE2(name, a1, a2) ((void) 0)
+#define NIX_PROBE3(name, a1, a2, a3) ((void) 0)
+
+#endif
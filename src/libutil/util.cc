@@ -22,6 +22,7 @@
 #include <pwd.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
+#include <netdb.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <sys/time.h>
@@ -35,6 +36,7 @@
 #ifdef __linux__
 #include <sys/prctl.h>
 #include <sys/resource.h>
+#include <sys/syscall.h>
 #endif
 
 
@@ -290,6 +292,60 @@ DirEntries readDirectory(const Path & path)
 }
 
 
+void forEachDirEntry(const Path & path,
+    std::function<void(const DirEntryView &)> fun)
+{
+#ifdef __linux__
+    /* The layout of the records returned by getdents64(). */
+    struct linux_dirent64 {
+        ino64_t d_ino;
+        off64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+    };
+
+    AutoCloseFD fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (!fd) throw SysError("opening directory '%1%'", path);
+
+    std::vector<char> buf(64 * 1024);
+
+    for (;;) {
+        checkInterrupt();
+        auto nread = syscall(SYS_getdents64, fd.get(), buf.data(), buf.size());
+        if (nread == -1) throw SysError("reading directory '%1%'", path);
+        if (nread == 0) break;
+
+        for (ssize_t pos = 0; pos < nread; ) {
+            auto ent = (struct linux_dirent64 *) (buf.data() + pos);
+            std::string_view name(ent->d_name);
+            if (name != "." && name != "..")
+                fun(DirEntryView { name, (ino_t) ent->d_ino, ent->d_type });
+            pos += ent->d_reclen;
+        }
+    }
+#else
+    AutoCloseDir dir(opendir(path.c_str()));
+    if (!dir) throw SysError("opening directory '%1%'", path);
+
+    struct dirent * dirent;
+    while (errno = 0, dirent = readdir(dir.get())) { /* sic */
+        checkInterrupt();
+        std::string_view name(dirent->d_name);
+        if (name == "." || name == "..") continue;
+        fun(DirEntryView { name, dirent->d_ino,
+#ifdef HAVE_STRUCT_DIRENT_D_TYPE
+            dirent->d_type
+#else
+            DT_UNKNOWN
+#endif
+        });
+    }
+    if (errno) throw SysError("reading directory '%1%'", path);
+#endif
+}
+
+
 unsigned char getFileType(const Path & path)
 {
     struct stat st = lstat(path);
@@ -869,7 +925,7 @@ Pid::operator pid_t()
 }
 
 
-int Pid::kill()
+int Pid::kill(struct rusage * usage)
 {
     assert(pid != -1);
 
@@ -888,16 +944,16 @@ int Pid::kill()
             logError(SysError("killing process %d", pid).info());
     }
 
-    return wait();
+    return wait(usage);
 }
 
 
-int Pid::wait()
+int Pid::wait(struct rusage * usage)
 {
     assert(pid != -1);
     while (1) {
         int status;
-        int res = waitpid(pid, &status, 0);
+        int res = wait4(pid, &status, 0, usage);
         if (res == pid) {
             pid = -1;
             return status;
@@ -1279,16 +1335,44 @@ string replaceStrings(std::string_view s,
 }
 
 
-std::string rewriteStrings(const std::string & _s, const StringMap & rewrites)
+StringRewriter::StringRewriter(const StringMap & rewrites)
 {
-    auto s = _s;
-    for (auto & i : rewrites) {
-        if (i.first == i.second) continue;
-        size_t j = 0;
-        while ((j = s.find(i.first, j)) != string::npos)
-            s.replace(j, i.first.size(), i.second);
+    for (auto & [from, to] : rewrites) {
+        if (from.empty() || from == to) continue;
+        maxPattern = std::max(maxPattern, from.size());
+        byFirstChar[(unsigned char) from[0]].push_back({from, to});
     }
-    return s;
+    for (auto & v : byFirstChar)
+        std::sort(v.begin(), v.end(),
+            [](const Rewrite & a, const Rewrite & b) { return a.from.size() > b.from.size(); });
+}
+
+std::optional<StringRewriter::Match> StringRewriter::findNext(std::string_view s, size_t offset) const
+{
+    for (size_t i = offset; i < s.size(); ++i)
+        for (auto & r : byFirstChar[(unsigned char) s[i]])
+            if (s.compare(i, r.from.size(), r.from) == 0)
+                return Match { i, &r };
+    return std::nullopt;
+}
+
+std::string StringRewriter::operator ()(std::string_view s) const
+{
+    std::string res;
+    size_t p = 0;
+    while (auto m = findNext(s, p)) {
+        res.append(s.substr(p, m->pos - p));
+        res.append(m->rewrite->to);
+        p = m->pos + m->rewrite->from.size();
+    }
+    if (p == 0) return std::string(s);
+    res.append(s.substr(p));
+    return res;
+}
+
+std::string rewriteStrings(const std::string & s, const StringMap & rewrites)
+{
+    return StringRewriter(rewrites)(s);
 }
 
 
@@ -1659,6 +1743,32 @@ void restoreMountNamespace()
 #endif
 }
 
+static std::once_flag dns_resolve_flag;
+
+void preloadNSS() {
+    /* builtin:fetchurl can trigger a DNS lookup, which with glibc can trigger a dynamic library load of
+       one of the glibc NSS libraries in a sandboxed child, which will fail unless the library's already
+       been loaded in the parent. So we force a lookup of an invalid domain to force the NSS machinery to
+       load its lookup libraries in the parent before any child gets a chance to. */
+    std::call_once(dns_resolve_flag, []() {
+        struct addrinfo *res = NULL;
+
+        /* nss will only force the "local" (not through nscd) dns resolution if its on the LOCALDOMAIN.
+           We need the resolution to be done locally, as nscd socket will not be accessible in the
+           sandbox. */
+        char * previous_env = getenv("LOCALDOMAIN");
+        setenv("LOCALDOMAIN", "invalid", 1);
+        if (getaddrinfo("this.pre-initializes.the.dns.resolvers.invalid.", "http", NULL, &res) == 0) {
+            if (res) freeaddrinfo(res);
+        }
+        if (previous_env) {
+             setenv("LOCALDOMAIN", previous_env, 1);
+        } else {
+             unsetenv("LOCALDOMAIN");
+        }
+    });
+}
+
 void restoreProcessContext(bool restoreMounts)
 {
     restoreSignals();
@@ -10,7 +10,9 @@
 #include <dirent.h>
 #include <unistd.h>
 #include <signal.h>
+#include <sys/resource.h>
 
+#include <array>
 #include <functional>
 #include <map>
 #include <sstream>
@@ -98,6 +100,24 @@ typedef vector<DirEntry> DirEntries;
 
 DirEntries readDirectory(const Path & path);
 
+/* A view on a directory entry produced by forEachDirEntry(). 'name'
+   points into a buffer that is reused between entries, so it must be
+   copied if it is kept beyond the callback. */
+struct DirEntryView
+{
+    std::string_view name;
+    ino_t ino;
+    unsigned char type; // one of DT_*, or DT_UNKNOWN
+};
+
+/* Apply 'fun' to every entry of the directory 'path' (excluding '.'
+   and '..'), without allocating a string per entry. On Linux the
+   directory is read with raw getdents64() into a reusable buffer;
+   use this instead of readDirectory() in loops over large
+   directories. */
+void forEachDirEntry(const Path & path,
+    std::function<void(const DirEntryView &)> fun);
+
 unsigned char getFileType(const Path & path);
 
 /* Read the contents of a file into a string. */
@@ -241,8 +261,8 @@ public:
     ~Pid();
     void operator =(pid_t pid);
     operator pid_t();
-    int kill();
-    int wait();
+    int kill(struct rusage * usage = nullptr);
+    int wait(struct rusage * usage = nullptr);
 
     void setSeparatePG(bool separatePG);
     void setKillSignal(int signal);
@@ -310,6 +330,13 @@ void saveMountNamespace();
    if saveMountNamespace() was never called. */
 void restoreMountNamespace();
 
+/* Load the NSS resolver libraries into this process, so that forked
+   children don't have to (which they can't do safely inside a build
+   sandbox). Only does something on the first call; it can block on
+   the resolver, so it should be called right before the first fork
+   that needs it rather than at startup. */
+void preloadNSS();
+
 
 class ExecError : public Error
 {
@@ -399,6 +426,49 @@ string replaceStrings(std::string_view s,
     const std::string & from, const std::string & to);
 
 
+/* A compiled set of string rewrites, applied in a single
+   left-to-right pass over the input: at every position the longest
+   matching pattern wins, and replacements are not themselves
+   rescanned. Patterns that are empty or equal to their replacement
+   are dropped. */
+class StringRewriter
+{
+public:
+
+    struct Rewrite
+    {
+        std::string from, to;
+    };
+
+    struct Match
+    {
+        size_t pos;
+        const Rewrite * rewrite;
+    };
+
+    StringRewriter(const StringMap & rewrites);
+
+    bool empty() const { return maxPattern == 0; }
+
+    /* The length of the longest pattern. An incremental caller has
+       to buffer one byte less than this across chunk boundaries. */
+    size_t maxPatternSize() const { return maxPattern; }
+
+    /* Find the leftmost match starting at or after 'offset'. */
+    std::optional<Match> findNext(std::string_view s, size_t offset) const;
+
+    /* Rewrite 's' in a single pass. */
+    std::string operator ()(std::string_view s) const;
+
+private:
+
+    /* The rewrites whose patterns start with a given byte, longest
+       pattern first so that the longest match wins. */
+    std::array<std::vector<Rewrite>, 256> byFirstChar;
+
+    size_t maxPattern = 0;
+};
+
 std::string rewriteStrings(const std::string & s, const StringMap & rewrites);
 
 
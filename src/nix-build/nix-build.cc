@@ -257,6 +257,28 @@ static void main_nix_build(int argc, char * * argv)
 
     auto autoArgs = myArgs.getAutoArgs(*state);
 
+    /* Warm-start fast path for 'nix-shell -p': the shell derivation
+       is a pure function of the synthesised expression and the
+       <nixpkgs> tree, so when the latter resolves to an immutable
+       store path we can reuse the previously instantiated derivation
+       and interactive shell and skip evaluation entirely. */
+    std::optional<Path> shellCacheFile;
+    std::optional<std::string> cachedShell;
+    if (runEnv && packages && autoArgs->empty() && !readStdin) {
+        try {
+            auto nixpkgs = state->findFile("nixpkgs");
+            if (nixpkgs != "" && store->isInStore(canonPath(nixpkgs, true))) {
+                std::string key = "nix-shell-p";
+                key += ";" + canonPath(nixpkgs, true);
+                key += ";" + settings.thisSystem.get();
+                key += ";" + concatStringsSep(",", attrPaths);
+                for (auto & i : left) key += ";" + i;
+                shellCacheFile = getCacheDir() + "/nix/shell-env-v1/"
+                    + hashString(htSHA256, key).to_string(Base32, false);
+            }
+        } catch (Error &) { }
+    }
+
     if (runEnv) {
         auto newArgs = state->allocBindings(autoArgs->size() + 1);
         auto tru = state->allocValue();
@@ -287,46 +309,66 @@ static void main_nix_build(int argc, char * * argv)
 
     DrvInfos drvs;
 
-    /* Parse the expressions. */
-    std::vector<Expr *> exprs;
-
-    if (readStdin)
-        exprs = {state->parseStdin()};
-    else
-        for (auto i : left) {
-            if (fromArgs)
-                exprs.push_back(state->parseExprFromString(i, absPath(".")));
-            else {
-                auto absolute = i;
-                try {
-                    absolute = canonPath(absPath(i), true);
-                } catch (Error & e) {};
-                auto [path, outputNames] = parsePathWithOutputs(absolute);
-                if (evalStore->isStorePath(path) && hasSuffix(path, ".drv"))
-                    drvs.push_back(DrvInfo(*state, evalStore, absolute));
-                else
-                    /* If we're in a #! script, interpret filenames
-                       relative to the script. */
-                    exprs.push_back(state->parseExprFromFile(resolveExprPath(state->checkSourcePath(lookupFileArg(*state,
-                                        inShebang && !packages ? absPath(i, absPath(dirOf(script))) : i)))));
+    if (shellCacheFile && pathExists(*shellCacheFile)) {
+        try {
+            auto lines = tokenizeString<std::vector<std::string>>(readFile(*shellCacheFile), "\n");
+            if (lines.size() == 2
+                && store->isValidPath(store->parseStorePath(lines[0]))
+                && store->isInStore(lines[1])
+                && store->isValidPath(store->toStorePath(lines[1]).first))
+            {
+                drvs.push_back(DrvInfo(*state, evalStore, lines[0]));
+                cachedShell = lines[1];
             }
+        } catch (Error &) {
+            /* Fall through to a full evaluation. */
+            drvs.clear();
         }
+    }
+
+    if (drvs.empty()) {
 
-    /* Evaluate them into derivations. */
-    if (attrPaths.empty()) attrPaths = {""};
+        /* Parse the expressions. */
+        std::vector<Expr *> exprs;
 
-    for (auto e : exprs) {
-        Value vRoot;
-        state->eval(e, vRoot);
+        if (readStdin)
+            exprs = {state->parseStdin()};
+        else
+            for (auto i : left) {
+                if (fromArgs)
+                    exprs.push_back(state->parseExprFromString(i, absPath(".")));
+                else {
+                    auto absolute = i;
+                    try {
+                        absolute = canonPath(absPath(i), true);
+                    } catch (Error & e) {};
+                    auto [path, outputNames] = parsePathWithOutputs(absolute);
+                    if (evalStore->isStorePath(path) && hasSuffix(path, ".drv"))
+                        drvs.push_back(DrvInfo(*state, evalStore, absolute));
+                    else
+                        /* If we're in a #! script, interpret filenames
+                           relative to the script. */
+                        exprs.push_back(state->parseExprFromFile(resolveExprPath(state->checkSourcePath(lookupFileArg(*state,
+                                            inShebang && !packages ? absPath(i, absPath(dirOf(script))) : i)))));
+                }
+            }
 
-        for (auto & i : attrPaths) {
-            Value & v(*findAlongAttrPath(*state, i, *autoArgs, vRoot).first);
-            state->forceValue(v);
-            getDerivations(*state, v, "", *autoArgs, drvs, false);
+        /* Evaluate them into derivations. */
+        if (attrPaths.empty()) attrPaths = {""};
+
+        for (auto e : exprs) {
+            Value vRoot;
+            state->eval(e, vRoot);
+
+            for (auto & i : attrPaths) {
+                Value & v(*findAlongAttrPath(*state, i, *autoArgs, vRoot).first);
+                state->forceValue(v);
+                getDerivations(*state, v, "", *autoArgs, drvs, false);
+            }
         }
-    }
 
-    state->printStats();
+        state->printStats();
+    }
 
     auto buildPaths = [&](const std::vector<StorePathWithOutputs> & paths0) {
         auto paths = toDerivedPaths(paths0);
@@ -359,7 +401,12 @@ static void main_nix_build(int argc, char * * argv)
            <nixpkgs>. */
         auto shell = getEnv("NIX_BUILD_SHELL");
 
-        if (!shell) {
+        if (!shell && cachedShell) {
+            /* From the shell-environment cache; validated above. */
+            shell = *cachedShell;
+        }
+
+        else if (!shell) {
 
             try {
                 auto expr = state->parseExprFromString("(import <nixpkgs> {}).bashInteractive", absPath("."));
@@ -384,6 +431,18 @@ static void main_nix_build(int argc, char * * argv)
             }
         }
 
+        /* Record the instantiated derivation and shell so the next
+           invocation can skip evaluation. The shell's output path may
+           not exist until the build below has run, but the read side
+           revalidates, so the entry only starts hitting once it does.
+           Don't record the degraded bash fallback. */
+        if (shellCacheFile && !cachedShell && *shell != "bash") {
+            try {
+                createDirs(dirOf(*shellCacheFile));
+                writeFile(*shellCacheFile, drvInfo.queryDrvPath() + "\n" + *shell);
+            } catch (Error &) { }
+        }
+
         // Build or fetch all dependencies of the derivation.
         for (const auto & input : drv.inputDrvs)
             if (std::all_of(envExclude.cbegin(), envExclude.cend(),
@@ -4,6 +4,8 @@
 #include "store-api.hh"
 #include "legacy.hh"
 #include "fetchers.hh"
+#include "nar-chunks.hh"
+#include "compression.hh"
 
 #include <fcntl.h>
 #include <regex>
@@ -69,6 +71,100 @@ static void removeChannel(const string & name)
 
 static Path nixDefExpr;
 
+/* Try to update a channel by fetching only the chunks of the tarball
+   that changed since the previous update. This requires the channel
+   to publish '<url>/nixexprs.tar.chunks' - a chunk manifest (in the
+   same format as the binary cache 'chunked-nars' manifests) over the
+   *uncompressed* nixexprs.tar - with the chunk files stored under
+   '<url>/nar-chunks/'. Unchanged chunks are taken from the previous
+   generation's tarball in the store. Returns the path of the
+   assembled tarball, or std::nullopt if the channel doesn't publish
+   a manifest (in which case the caller falls back to downloading the
+   whole tarball). */
+static std::optional<Path> downloadChannelDelta(
+    ref<Store> store, const string & name, const string & url)
+{
+    auto fileTransfer = getFileTransfer();
+
+    std::string manifestS;
+    try {
+        manifestS = *fileTransfer->download(
+            FileTransferRequest(url + "/nixexprs.tar.chunks")).data;
+    } catch (FileTransferError & e) {
+        debug("channel '%s' does not publish a chunk manifest: %s", name, e.what());
+        return std::nullopt;
+    }
+
+    auto manifest = NarChunkManifest::parse(manifestS);
+
+    auto stateDir = getCacheDir() + "/nix/channel-deltas";
+    auto stateFile = stateDir + "/" + name;
+
+    /* Index the previous generation's chunks by hash, so unchanged
+       stretches of the new tarball can be copied locally. */
+    std::map<Hash, std::pair<uint64_t, uint64_t>> prevChunks; /* hash -> (offset, size) */
+    std::string prevTarball;
+    try {
+        if (pathExists(stateFile)) {
+            auto state = readFile(stateFile);
+            auto eol = state.find('\n');
+            auto prevPath = store->parseStorePath(state.substr(0, eol));
+            if (store->isValidPath(prevPath)) {
+                prevTarball = readFile(store->toRealPath(prevPath));
+                auto prevManifest = NarChunkManifest::parse(state.substr(eol + 1));
+                uint64_t offset = 0;
+                for (auto & [hash, size] : prevManifest.chunks) {
+                    prevChunks.emplace(hash, std::make_pair(offset, size));
+                    offset += size;
+                }
+            }
+        }
+    } catch (Error & e) {
+        debug("ignoring previous state of channel '%s': %s", name, e.what());
+        prevChunks.clear();
+        prevTarball.clear();
+    }
+
+    auto chunkExtension =
+        manifest.compression == "xz" ? ".xz" :
+        manifest.compression == "bzip2" ? ".bz2" :
+        manifest.compression == "zstd" ? ".zst" :
+        manifest.compression == "br" ? ".br" :
+        "";
+
+    std::string tarball;
+    tarball.reserve(manifest.narSize);
+    uint64_t bytesReused = 0, bytesFetched = 0;
+
+    for (auto & [chunkHash, chunkSize] : manifest.chunks) {
+        auto prev = prevChunks.find(chunkHash);
+        if (prev != prevChunks.end()) {
+            tarball.append(prevTarball, prev->second.first, prev->second.second);
+            bytesReused += chunkSize;
+        } else {
+            auto chunkUrl = url + "/nar-chunks/"
+                + chunkHash.to_string(Base32, false) + ".chunk" + chunkExtension;
+            auto res = fileTransfer->download(FileTransferRequest(chunkUrl));
+            auto chunk = decompress(manifest.compression, *res.data);
+            if (chunk->size() != chunkSize || hashString(htSHA256, *chunk) != chunkHash)
+                throw Error("hash mismatch in chunk '%s' of channel '%s'", chunkUrl, name);
+            tarball += *chunk;
+            bytesFetched += res.bodySize;
+        }
+    }
+
+    StringSource source(tarball);
+    auto storePath = store->addToStoreFromDump(source, "nixexprs.tar", FileIngestionMethod::Flat);
+
+    createDirs(stateDir);
+    writeFile(stateFile, store->printStorePath(storePath) + "\n" + manifestS);
+
+    printInfo("channel '%s': downloaded %s, reused %s from the previous generation",
+        name, showBytes(bytesFetched), showBytes(bytesReused));
+
+    return store->toRealPath(storePath);
+}
+
 // Fetch Nix expressions and binary cache URLs from the subscribed channels.
 static void update(const StringSet & channelNames)
 {
@@ -117,8 +213,12 @@ static void update(const StringSet & channelNames)
         }
 
         if (!unpacked) {
-            // Download the channel tarball.
-            try {
+            // Fetch only the changed chunks if the channel publishes
+            // a chunk manifest; otherwise download the whole channel
+            // tarball.
+            if (auto delta = downloadChannelDelta(store, name, url))
+                filename = *delta;
+            else try {
                 filename = store->toRealPath(fetchers::downloadFile(store, url + "/nixexprs.tar.xz", "nixexprs.tar.xz", false).storePath);
             } catch (FileTransferError & e) {
                 filename = store->toRealPath(fetchers::downloadFile(store, url + "/nixexprs.tar.bz2", "nixexprs.tar.bz2", false).storePath);
@@ -13,6 +13,8 @@
 #include "user-env.hh"
 #include "util.hh"
 #include "json.hh"
+#include "json-to-value.hh"
+#include "serialise.hh"
 #include "value-to-json.hh"
 #include "xml-writer.hh"
 #include "legacy.hh"
@@ -172,10 +174,167 @@ static void loadSourceExpr(EvalState & state, const Path & path, Value & v)
 }
 
 
+/* On-disk index of the package set, so that repeated queries
+   (nix-env -qa and friends) don't have to re-evaluate every
+   derivation's name, system, output paths and meta attributes. The
+   index is keyed by the contents of the input Nix expression and is
+   only used when those contents are provably immutable (i.e. resolve
+   to store paths, as channels do). */
+
+/* Bump this when the format changes. */
+static const uint64_t queryIndexVersion = 1;
+
+static Path queryIndexDir()
+{
+    return getCacheDir() + "/nix/env-query-index-v" + std::to_string(queryIndexVersion);
+}
+
+static Path queryIndexFile(const Hash & key)
+{
+    return queryIndexDir() + "/" + key.to_string(Base32, false) + ".index";
+}
+
+/* Compute the index key for 'nixExprPath', or nothing if its
+   contents cannot be identified reliably. Channel directories
+   consist of symlinks into the store, and a store path identifies
+   its own contents; anything living outside the store is mutable,
+   which makes the index unusable. */
+static std::optional<Hash> queryIndexKey(EvalState & state, const Path & nixExprPath,
+    const string & systemFilter, Bindings & autoArgs, const string & pathPrefix)
+{
+    /* Auto-args influence the evaluation result in ways the key
+       cannot capture. */
+    if (autoArgs.size() > 0) return std::nullopt;
+
+    string fingerprint;
+
+    std::function<bool(const Path &)> addPath = [&](const Path & path) -> bool {
+        auto resolved = canonPath(path, true);
+        if (state.store->isInStore(resolved)) {
+            fingerprint += resolved;
+            fingerprint += '\0';
+            return true;
+        }
+        struct stat st;
+        if (stat(resolved.c_str(), &st) == -1)
+            throw SysError("getting information about '%1%'", resolved);
+        if (!S_ISDIR(st.st_mode)) return false;
+        for (auto & entry : readDirectory(resolved)) {
+            fingerprint += entry.name;
+            fingerprint += '=';
+            if (!addPath(resolved + "/" + entry.name)) return false;
+        }
+        return true;
+    };
+
+    try {
+        if (!addPath(nixExprPath)) return std::nullopt;
+    } catch (SysError &) {
+        return std::nullopt;
+    }
+
+    fingerprint += '\0'; fingerprint += systemFilter;
+    fingerprint += '\0'; fingerprint += pathPrefix;
+
+    return hashString(htSHA256, fingerprint);
+}
+
+static bool readQueryIndex(EvalState & state, const Hash & key, DrvInfos & elems)
+{
+    try {
+        auto indexFile = queryIndexFile(key);
+        if (!pathExists(indexFile)) return false;
+        auto s = readFile(indexFile);
+        StringSource source(s);
+        if (readNum<uint64_t>(source) != queryIndexVersion) return false;
+        auto n = readNum<uint64_t>(source);
+        for (uint64_t i = 0; i < n; ++i) {
+            DrvInfo elem(state);
+            elem.attrPath = readString(source);
+            elem.setName(readString(source));
+            elem.setSystem(readString(source));
+            auto outPath = readString(source);
+            if (outPath != "") elem.setOutPath(outPath);
+            elem.setOutputName(readString(source));
+            DrvInfo::Outputs outputs;
+            auto nrOutputs = readNum<uint64_t>(source);
+            for (uint64_t j = 0; j < nrOutputs; ++j) {
+                auto name = readString(source);
+                outputs[name] = readString(source);
+            }
+            elem.setOutputs(outputs);
+            auto metaJson = readString(source);
+            if (metaJson != "") {
+                Value vMeta;
+                parseJSON(state, metaJson, vMeta);
+                for (auto & attr : *vMeta.attrs)
+                    elem.setMeta(attr.name, attr.value);
+            }
+            elems.push_back(elem);
+        }
+        debug("read %d derivations from the query index", n);
+        return true;
+    } catch (Error & e) {
+        debug("ignoring corrupt query index entry: %s", e.what());
+        elems.clear();
+        return false;
+    }
+}
+
+static void writeQueryIndex(EvalState & state, const Hash & key, DrvInfos & elems)
+{
+    try {
+        StringSink sink;
+        sink << queryIndexVersion << (uint64_t) elems.size();
+        for (auto & elem : elems) {
+            /* Serialising the meta attributes forces them, which is
+               exactly the work subsequent queries get to skip. */
+            std::ostringstream metaJson;
+            auto metaNames = elem.queryMetaNames();
+            if (!metaNames.empty()) {
+                JSONObject json(metaJson);
+                for (auto & name : metaNames) {
+                    Value * v = elem.queryMeta(name);
+                    if (!v) continue;
+                    auto placeholder(json.placeholder(name));
+                    PathSet context;
+                    printValueAsJSON(state, true, *v, noPos, placeholder, context);
+                }
+            }
+            auto outputs = elem.queryOutputs();
+            sink << elem.attrPath << elem.queryName() << elem.querySystem()
+                 << elem.queryOutPath() << elem.queryOutputName()
+                 << (uint64_t) outputs.size();
+            for (auto & [name, path] : outputs)
+                sink << name << path;
+            sink << metaJson.str();
+        }
+        createDirs(queryIndexDir());
+        auto indexFile = queryIndexFile(key);
+        /* Write atomically so concurrent invocations never see a
+           partial index. */
+        auto tmpFile = indexFile + "." + std::to_string(getpid());
+        writeFile(tmpFile, *sink.s);
+        if (rename(tmpFile.c_str(), indexFile.c_str()) == -1)
+            throw SysError("renaming '%s' to '%s'", tmpFile, indexFile);
+    } catch (Error & e) {
+        /* The index is strictly an optimisation, but a failed write
+           also costs a full re-evaluation next time. */
+        debug("could not write the package query index: %s", e.what());
+    }
+}
+
+
 static void loadDerivations(EvalState & state, Path nixExprPath,
     string systemFilter, Bindings & autoArgs,
-    const string & pathPrefix, DrvInfos & elems)
+    const string & pathPrefix, DrvInfos & elems, bool useIndex)
 {
+    auto key = useIndex
+        ? queryIndexKey(state, nixExprPath, systemFilter, autoArgs, pathPrefix)
+        : std::nullopt;
+
+    if (key && readQueryIndex(state, *key, elems)) return;
+
     Value vRoot;
     loadSourceExpr(state, nixExprPath, vRoot);
 
@@ -190,6 +349,8 @@ static void loadDerivations(EvalState & state, Path nixExprPath,
         if (systemFilter != "*" && i->querySystem() != systemFilter)
             elems.erase(i);
     }
+
+    if (key) writeQueryIndex(state, *key, elems);
 }
 
 
@@ -274,8 +435,10 @@ static DrvInfos filterBySelector(EvalState & state, const DrvInfos & allElems,
                         k->second.first.querySystem() == settings.thisSystem ? -1 : 0;
                     if (d == 0)
                         d = comparePriorities(state, j.first, k->second.first);
-                    if (d == 0)
-                        d = compareVersions(drvName.version, DrvName(k->second.first.queryName()).version);
+                    if (d == 0) {
+                        DrvName curName(k->second.first.queryName());
+                        d = drvName.versionKey().compare(curName.versionKey());
+                    }
                 }
 
                 if (d > 0) {
@@ -336,7 +499,7 @@ static void queryInstSources(EvalState & state,
                Nix expression. */
             DrvInfos allElems;
             loadDerivations(state, instSource.nixExprPath,
-                instSource.systemFilter, *instSource.autoArgs, "", allElems);
+                instSource.systemFilter, *instSource.autoArgs, "", allElems, true);
 
             elems = filterBySelector(state, allElems, args, newestOnly);
 
@@ -417,6 +580,32 @@ static void queryInstSources(EvalState & state,
 }
 
 
+/* Elements that came out of the query index carry the stored strings
+   but no evaluated attributes or derivation path. Before such an
+   element can be installed, its attribute has to be evaluated for
+   real, which also instantiates the .drv file. Only the selected
+   elements reach this point, so this is the "evaluate on cache miss"
+   part of the index: a handful of attributes instead of the whole
+   package set. */
+static void evalCachedElems(Globals & globals, DrvInfos & elems)
+{
+    Value * vRoot = nullptr;
+    for (auto & i : elems) {
+        if (i.attrPath == "" || i.hasAttrs()) continue;
+        if (!vRoot) {
+            vRoot = globals.state->allocValue();
+            loadSourceExpr(*globals.state, globals.instSource.nixExprPath, *vRoot);
+        }
+        Value & v(*findAlongAttrPath(*globals.state, i.attrPath,
+            *globals.instSource.autoArgs, *vRoot).first);
+        if (auto drv = getDerivation(*globals.state, v, false)) {
+            drv->attrPath = i.attrPath;
+            i = *drv;
+        }
+    }
+}
+
+
 static void printMissing(EvalState & state, DrvInfos & elems)
 {
     std::vector<DerivedPath> targets;
@@ -452,6 +641,8 @@ static void installDerivations(Globals & globals,
         if (!globals.prebuiltOnly || isPrebuilt(*globals.state, i))
             newElems.push_back(i);
 
+    evalCachedElems(globals, newElems);
+
     StringSet newNames;
     for (auto & i : newElems) {
         /* `forceName' is a hack to get package names right in some
@@ -538,6 +729,16 @@ static void upgradeDerivations(Globals & globals,
 
         /* Go through all installed derivations. */
         DrvInfos newElems;
+        /* Parse the available names once up front; the loop below is
+           O(installed × available) and re-tokenising the same names
+           and versions dominated it. */
+        std::vector<DrvName> availNames;
+        availNames.reserve(availElems.size());
+        for (auto & j : availElems) {
+            availNames.emplace_back(j.queryName());
+            availNames.back().versionKey();
+        }
+
         for (auto & i : installedElems) {
             DrvName drvName(i.queryName());
 
@@ -557,12 +758,14 @@ static void upgradeDerivations(Globals & globals,
                    Do not upgrade if it would decrease the priority. */
                 DrvInfos::iterator bestElem = availElems.end();
                 string bestVersion;
-                for (auto j = availElems.begin(); j != availElems.end(); ++j) {
+                VersionKey bestVersionKey;
+                size_t n = 0;
+                for (auto j = availElems.begin(); j != availElems.end(); ++j, ++n) {
                     if (comparePriorities(*globals.state, i, *j) > 0)
                         continue;
-                    DrvName newName(j->queryName());
+                    DrvName & newName(availNames[n]);
                     if (newName.name == drvName.name) {
-                        int d = compareVersions(drvName.version, newName.version);
+                        int d = drvName.versionKey().compare(newName.versionKey());
                         if ((upgradeType == utLt && d < 0) ||
                             (upgradeType == utLeq && d <= 0) ||
                             (upgradeType == utEq && d == 0) ||
@@ -571,11 +774,12 @@ static void upgradeDerivations(Globals & globals,
                             long d2 = -1;
                             if (bestElem != availElems.end()) {
                                 d2 = comparePriorities(*globals.state, *bestElem, *j);
-                                if (d2 == 0) d2 = compareVersions(bestVersion, newName.version);
+                                if (d2 == 0) d2 = bestVersionKey.compare(newName.versionKey());
                             }
                             if (d2 < 0 && (!globals.prebuiltOnly || isPrebuilt(*globals.state, *j))) {
                                 bestElem = j;
                                 bestVersion = newName.version;
+                                bestVersionKey = newName.versionKey();
                             }
                         }
                     }
@@ -585,7 +789,7 @@ static void upgradeDerivations(Globals & globals,
                     i.queryOutPath() !=
                     bestElem->queryOutPath())
                 {
-                    const char * action = compareVersions(drvName.version, bestVersion) <= 0
+                    const char * action = drvName.versionKey().compare(bestVersionKey) <= 0
                         ? "upgrading" : "downgrading";
                     printInfo("%1% '%2%' to '%3%'",
                         action, i.queryName(), bestElem->queryName());
@@ -598,6 +802,8 @@ static void upgradeDerivations(Globals & globals,
             }
         }
 
+        evalCachedElems(globals, newElems);
+
         printMissing(*globals.state, newElems);
 
         if (globals.dryRun) return;
@@ -689,6 +895,8 @@ static void opSet(Globals & globals, Strings opFlags, Strings opArgs)
     if (elems.size() != 1)
         throw Error("--set requires exactly one derivation");
 
+    evalCachedElems(globals, elems);
+
     DrvInfo & drv(elems.front());
 
     if (globals.forceName != "")
@@ -836,7 +1044,7 @@ static VersionDiff compareVersionAgainstSet(
     for (auto & i : elems) {
         DrvName name2(i.queryName());
         if (name.name == name2.name) {
-            int d = compareVersions(name.version, name2.version);
+            int d = name.versionKey().compare(name2.versionKey());
             if (d < 0) {
                 diff = cvGreater;
                 version = name2.version;
@@ -938,9 +1146,12 @@ static void opQuery(Globals & globals, Strings opFlags, Strings opArgs)
         installedElems = queryInstalled(*globals.state, globals.profile);
 
     if (source == sAvailable || compareVersions)
+        /* The index stores no derivation paths (computing them would
+           instantiate every package), so bypass it when they are
+           asked for. */
         loadDerivations(*globals.state, globals.instSource.nixExprPath,
             globals.instSource.systemFilter, *globals.instSource.autoArgs,
-            attrPath, availElems);
+            attrPath, availElems, !printDrvPath);
 
     DrvInfos elems_ = filterBySelector(*globals.state,
         source == sInstalled ? installedElems : availElems,
@@ -49,6 +49,11 @@ void processExpr(EvalState & state, const Strings & attrPaths,
                 vRes = v;
             else
                 state.autoCallFunction(autoArgs, v, vRes);
+            /* The serialisers below force values sequentially while
+               printing; with eval-cores > 1, force the whole value in
+               parallel first. */
+            if (strict && evalSettings.evalCores > 1)
+                state.forceValueDeep(vRes);
             if (output == okXML)
                 printValueAsXML(state, strict, location, vRes, std::cout, context, noPos);
             else if (output == okJSON)
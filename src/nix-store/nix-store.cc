@@ -1,4 +1,5 @@
 #include "archive.hh"
+#include "compression.hh"
 #include "derivations.hh"
 #include "dotgraph.hh"
 #include "globals.hh"
@@ -15,6 +16,7 @@
 #include <iostream>
 #include <algorithm>
 #include <cstdio>
+#include <cstdlib>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -656,8 +658,16 @@ static void opRestore(Strings opFlags, Strings opArgs)
 
 static void opExport(Strings opFlags, Strings opArgs)
 {
-    for (auto & i : opFlags)
-        throw UsageError("unknown flag '%1%'", i);
+    bool v2 = false;
+    size_t jobs = 0;
+    for (auto i = opFlags.begin(); i != opFlags.end(); ++i)
+        if (*i == "--format-v2") v2 = true;
+        else if (*i == "--jobs")
+            jobs = getIntArg<size_t>(*i, i, opFlags.end(), false);
+        else throw UsageError("unknown flag '%1%'", *i);
+
+    if (jobs && !v2)
+        throw UsageError("'--jobs' requires '--format-v2'");
 
     StorePathSet paths;
 
@@ -665,7 +675,10 @@ static void opExport(Strings opFlags, Strings opArgs)
         paths.insert(store->followLinksToStorePath(i));
 
     FdSink sink(STDOUT_FILENO);
-    store->exportPaths(paths, sink);
+    if (v2)
+        store->exportPathsV2(paths, sink, "xz", jobs);
+    else
+        store->exportPaths(paths, sink);
     sink.flush();
 }
 
@@ -856,9 +869,26 @@ static void opServe(Strings opFlags, Strings opArgs)
                 break;
             }
 
-            case cmdDumpStorePath:
-                store->narFromPath(store->parseStorePath(readString(in)), out);
+            case cmdDumpStorePath: {
+                auto path = store->parseStorePath(readString(in));
+                if (GET_PROTOCOL_MINOR(clientVersion) >= 9) {
+                    /* The client picked a compression method for the
+                       NAR; send it as a framed, compressed stream so
+                       that the connection is left in a known state
+                       afterwards. */
+                    auto method = readString(in);
+                    std::exception_ptr ex;
+                    {
+                        FramedSink framedSink(out, ex);
+                        auto compressionSink = makeCompressionSink(method, framedSink);
+                        store->narFromPath(path, *compressionSink);
+                        compressionSink->finish();
+                        framedSink.flush();
+                    }
+                } else
+                    store->narFromPath(path, out);
                 break;
+            }
 
             case cmdImportPaths: {
                 if (!writeAllowed) throw Error("importing paths is not allowed");
@@ -928,6 +958,19 @@ static void opServe(Strings opFlags, Strings opArgs)
                 break;
             }
 
+            case cmdQueryLoad: {
+                /* Report our job capacity and 1-minute load average
+                   (x100), so that clients can dispatch builds to the
+                   least-loaded machine. */
+                out << (uint64_t) settings.maxBuildJobs;
+                double loadavg[1];
+                uint64_t load100 = 0;
+                if (getloadavg(loadavg, 1) == 1 && loadavg[0] > 0)
+                    load100 = (uint64_t) (loadavg[0] * 100);
+                out << load100;
+                break;
+            }
+
             case cmdAddToStoreNar: {
                 if (!writeAllowed) throw Error("importing paths is not allowed");
 
@@ -947,12 +990,25 @@ static void opServe(Strings opFlags, Strings opArgs)
                 if (info.narSize == 0)
                     throw Error("narInfo is too old and missing the narSize field");
 
-                SizedSource sizedSource(in, info.narSize);
-
-                store->addToStore(info, sizedSource, NoRepair, NoCheckSigs);
-
-                // consume all the data that has been sent before continuing.
-                sizedSource.drainAll();
+                if (GET_PROTOCOL_MINOR(clientVersion) >= 9) {
+                    /* The NAR arrives as a framed, compressed stream
+                       (see LegacySSHStore::addToStore()). */
+                    auto method = readString(in);
+                    auto source = sinkToSource([&](Sink & sink) {
+                        auto decompressionSink = makeDecompressionSink(method, sink);
+                        FramedSource framedSource(in);
+                        framedSource.drainInto(*decompressionSink);
+                        decompressionSink->finish();
+                    });
+                    store->addToStore(info, *source, NoRepair, NoCheckSigs);
+                } else {
+                    SizedSource sizedSource(in, info.narSize);
+
+                    store->addToStore(info, sizedSource, NoRepair, NoCheckSigs);
+
+                    // consume all the data that has been sent before continuing.
+                    sizedSource.drainAll();
+                }
 
                 out << 1; // indicate success
 
@@ -1065,7 +1121,7 @@ static int main_nix_store(int argc, char * * argv)
                 noOutput = true;
             else if (*arg != "" && arg->at(0) == '-') {
                 opFlags.push_back(*arg);
-                if (*arg == "--max-freed" || *arg == "--max-links" || *arg == "--max-atime") /* !!! hack */
+                if (*arg == "--max-freed" || *arg == "--max-links" || *arg == "--max-atime" || *arg == "--jobs") /* !!! hack */
                     opFlags.push_back(getArg(*arg, arg, end));
             }
             else
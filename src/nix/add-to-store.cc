@@ -29,34 +29,18 @@ struct CmdAddToStore : MixDryRun, StoreCommand
     {
         if (!namePart) namePart = baseNameOf(path);
 
-        StringSink sink;
-        dumpPath(path, sink);
-
-        auto narHash = hashString(htSHA256, *sink.s);
-
-        Hash hash = narHash;
-        if (ingestionMethod == FileIngestionMethod::Flat) {
-            HashSink hsink(htSHA256);
-            readFile(path, hsink);
-            hash = hsink.finish().first;
-        }
-
-        ValidPathInfo info {
-            store->makeFixedOutputPath(ingestionMethod, hash, *namePart),
-            narHash,
-        };
-        info.narSize = sink.s->size();
-        info.ca = std::optional { FixedOutputHash {
-            .method = ingestionMethod,
-            .hash = hash,
-        } };
-
-        if (!dryRun) {
-            auto source = StringSource { *sink.s };
-            store->addToStore(info, source);
+        if (dryRun) {
+            logger->cout("%s", store->printStorePath(
+                store->computeStorePathForPath(*namePart, path, ingestionMethod, htSHA256).first));
+            return;
         }
 
-        logger->cout("%s", store->printStorePath(info.path));
+        /* Stream the source in a single pass: addToStore() tees one
+           dump into the hash sink and the destination, spilling to a
+           temporary location once it exceeds nar-buffer-size instead
+           of buffering the whole dump in memory. */
+        logger->cout("%s", store->printStorePath(
+            store->addToStore(*namePart, path, ingestionMethod, htSHA256)));
     }
 };
 
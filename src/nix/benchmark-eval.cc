@@ -0,0 +1,131 @@
+#include "command.hh"
+#include "common-args.hh"
+#include "shared.hh"
+#include "store-api.hh"
+#include "eval.hh"
+#include "eval-inline.hh"
+#include "common-eval-args.hh"
+#include "json.hh"
+
+#if HAVE_BOEHMGC
+#include <gc/gc.h>
+#endif
+
+#include <chrono>
+
+#include <sys/resource.h>
+
+using namespace nix;
+
+struct CmdBenchmarkEval : StoreCommand, MixEvalArgs, MixJSON
+{
+    std::vector<std::string> files;
+    size_t rounds = 1;
+
+    CmdBenchmarkEval()
+    {
+        addFlag({
+            .longName = "rounds",
+            .description = "Evaluate each file *n* times and report the fastest round.",
+            .labels = {"n"},
+            .handler = {&rounds},
+        });
+
+        expectArgs({
+            .label = "files",
+            .handler = {&files},
+            .completer = completePath
+        });
+    }
+
+    std::string description() override
+    {
+        return "evaluate a benchmark corpus and report timing and allocation statistics";
+    }
+
+    std::string doc() override
+    {
+        return
+          #include "internal-benchmark-eval.md"
+          ;
+    }
+
+    void run(ref<Store> store) override
+    {
+        if (files.empty())
+            throw UsageError("at least one file to evaluate is required");
+
+#if HAVE_BOEHMGC && defined(GC_VERSION_MAJOR) && GC_VERSION_MAJOR >= 8
+        GC_start_performance_measurement();
+#endif
+
+        std::optional<JSONList> jsonOut;
+        if (json)
+            jsonOut.emplace(std::cout);
+
+        for (auto & file : files) {
+
+            double wallMs = 0;
+            uint64_t gcMs = 0;
+            EvalState::Counters counters{};
+
+            for (size_t round = 0; round < rounds; ++round) {
+
+                /* A fresh evaluator per round, so that the counters
+                   cover exactly one evaluation of the file. */
+                EvalState state(searchPath, store);
+
+                auto path = lookupFileArg(state, file);
+
+#if HAVE_BOEHMGC && defined(GC_VERSION_MAJOR) && GC_VERSION_MAJOR >= 8
+                auto gcBefore = GC_get_full_gc_total_time();
+#endif
+                auto start = std::chrono::steady_clock::now();
+
+                Value v;
+                state.evalFile(path, v);
+                state.forceValueDeep(v);
+
+                auto thisWallMs = std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - start).count();
+
+                if (round == 0 || thisWallMs < wallMs) {
+                    wallMs = thisWallMs;
+                    counters = state.getCounters();
+#if HAVE_BOEHMGC && defined(GC_VERSION_MAJOR) && GC_VERSION_MAJOR >= 8
+                    gcMs = GC_get_full_gc_total_time() - gcBefore;
+#endif
+                }
+            }
+
+            /* Note: ru_maxrss is a process-wide high-water mark, so
+               with multiple files the attribution is approximate. */
+            struct rusage ru;
+            getrusage(RUSAGE_SELF, &ru);
+            uint64_t peakRssKiB = ru.ru_maxrss;
+
+            if (jsonOut) {
+                auto obj = jsonOut->object();
+                obj.attr("file", file);
+                obj.attr("wallMs", wallMs);
+                obj.attr("gcMs", gcMs);
+                obj.attr("peakRssKiB", peakRssKiB);
+                obj.attr("nrValues", counters.nrValues);
+                obj.attr("nrEnvs", counters.nrEnvs);
+                obj.attr("nrAttrsets", counters.nrAttrsets);
+                obj.attr("nrListElems", counters.nrListElems);
+                obj.attr("nrFunctionCalls", counters.nrFunctionCalls);
+                obj.attr("nrOpUpdates", counters.nrOpUpdates);
+            } else
+                logger->cout("%-40s %10.1f ms wall %6d ms gc %10d KiB rss %12d values %12d calls",
+                    file, wallMs, gcMs, peakRssKiB, counters.nrValues, counters.nrFunctionCalls);
+        }
+
+        if (jsonOut) {
+            jsonOut.reset();
+            std::cout << "\n";
+        }
+    }
+};
+
+static auto rCmdBenchmarkEval = registerCommand2<CmdBenchmarkEval>({"internal", "benchmark-eval"});
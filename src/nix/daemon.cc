@@ -14,6 +14,7 @@
 #include <algorithm>
 #include <climits>
 #include <cstring>
+#include <thread>
 
 #include <unistd.h>
 #include <signal.h>
@@ -151,11 +152,20 @@ static ref<Store> openUncachedStore()
 }
 
 
-static void daemonLoop()
+static void daemonLoop(bool threaded)
 {
     if (chdir("/") == -1)
         throw SysError("cannot change current directory");
 
+    /* In threaded mode a single store serves every connection, so
+       all connections share its path info cache, SQLite connection
+       and prepared statements. */
+    std::shared_ptr<Store> sharedStore;
+    if (threaded) {
+        makeLoggerPerThread();
+        sharedStore = openStore(settings.storeUri);
+    }
+
     AutoCloseFD fdSocket;
 
     //  Handle socket-based activation by systemd.
@@ -216,6 +226,26 @@ static void daemonLoop()
                 % (peer.pidKnown ? std::to_string(peer.pid) : "<unknown>")
                 % (peer.uidKnown ? user : "<unknown>"));
 
+            //  In threaded mode, serve the connection on a worker
+            //  thread over the shared store.
+            if (threaded) {
+                std::thread([sharedStore, remote{std::move(remote)}, trusted, user, peer]() mutable {
+                    try {
+                        FdSource from(remote.get());
+                        FdSink to(remote.get());
+                        processConnection(ref<Store>(sharedStore), from, to, trusted, NotRecursive, [&](Store & store) {
+                            store.createUser(user, peer.uid);
+                        });
+                    } catch (Interrupted & e) {
+                    } catch (Error & error) {
+                        ErrorInfo ei = error.info();
+                        ei.msg = hintfmt("error processing connection: %1%", ei.msg.str());
+                        logError(ei);
+                    }
+                }).detach();
+                continue;
+            }
+
             //  Fork a child to handle the connection.
             ProcessOptions options;
             options.errorPrefix = "unexpected Nix daemon error: ";
@@ -265,7 +295,7 @@ static void daemonLoop()
     }
 }
 
-static void runDaemon(bool stdio)
+static void runDaemon(bool stdio, bool threaded)
 {
     if (stdio) {
         if (auto store = openUncachedStore().dynamic_pointer_cast<RemoteStore>()) {
@@ -305,13 +335,14 @@ static void runDaemon(bool stdio)
             processConnection(openUncachedStore(), from, to, Trusted, NotRecursive, [&](Store & _){});
         }
     } else
-        daemonLoop();
+        daemonLoop(threaded);
 }
 
 static int main_nix_daemon(int argc, char * * argv)
 {
     {
         auto stdio = false;
+        auto threaded = false;
 
         parseCmdLine(argc, argv, [&](Strings::iterator & arg, const Strings::iterator & end) {
             if (*arg == "--daemon")
@@ -322,11 +353,13 @@ static int main_nix_daemon(int argc, char * * argv)
                 printVersion("nix-daemon");
             else if (*arg == "--stdio")
                 stdio = true;
+            else if (*arg == "--threaded")
+                threaded = true;
             else return false;
             return true;
         });
 
-        runDaemon(stdio);
+        runDaemon(stdio, threaded);
 
         return 0;
     }
@@ -336,6 +369,17 @@ static RegisterLegacyCommand r_nix_daemon("nix-daemon", main_nix_daemon);
 
 struct CmdDaemon : StoreCommand
 {
+    bool threaded = false;
+
+    CmdDaemon()
+    {
+        addFlag({
+            .longName = "threaded",
+            .description = "Serve each connection on a worker thread over a shared store instead of forking a process per connection.",
+            .handler = {&threaded, true},
+        });
+    }
+
     std::string description() override
     {
         return "daemon to perform store operations on behalf of non-root clients";
@@ -352,7 +396,7 @@ struct CmdDaemon : StoreCommand
 
     void run(ref<Store> store) override
     {
-        runDaemon(false);
+        runDaemon(false, threaded);
     }
 };
 
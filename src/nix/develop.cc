@@ -340,17 +340,51 @@ struct Common : InstallableCommand, MixProfile
         auto path = installable->getStorePath();
         if (path && hasSuffix(path->to_string(), "-env"))
             return *path;
-        else {
-            auto drvs = toDerivations(store, {installable});
 
-            if (drvs.size() != 1)
-                throw Error("'%s' needs to evaluate to a single derivation, but it evaluated to %d derivations",
-                    installable->what(), drvs.size());
+        /* For flakes, the locked flake's fingerprint identifies the
+           evaluation result, so a previously computed environment
+           path can be reused without evaluating or building
+           anything. */
+        std::optional<Path> cacheFile;
+        if (auto flake = std::dynamic_pointer_cast<InstallableFlake>(installable)) {
+            auto fingerprint = flake->getLockedFlake()->getFingerprint();
+            auto key = hashString(htSHA256,
+                fingerprint.to_string(Base16, false) + ";" + installable->what());
+            cacheFile = getCacheDir() + "/nix/develop-v1/" + key.to_string(Base32, false);
+            try {
+                if (pathExists(*cacheFile)) {
+                    auto envPath = store->parseStorePath(trim(readFile(*cacheFile)));
+                    if (store->isValidPath(envPath)) {
+                        debug("reusing cached development environment '%s'",
+                            store->printStorePath(envPath));
+                        return envPath;
+                    }
+                }
+            } catch (Error & e) {
+                debug("ignoring bad development environment cache entry: %s", e.what());
+            }
+        }
+
+        auto drvs = toDerivations(store, {installable});
+
+        if (drvs.size() != 1)
+            throw Error("'%s' needs to evaluate to a single derivation, but it evaluated to %d derivations",
+                installable->what(), drvs.size());
+
+        auto & drvPath = *drvs.begin();
 
-            auto & drvPath = *drvs.begin();
+        auto shellOutPath = getDerivationEnvironment(store, getEvalStore(), drvPath);
 
-            return getDerivationEnvironment(store, getEvalStore(), drvPath);
+        if (cacheFile) {
+            try {
+                createDirs(dirOf(*cacheFile));
+                writeFile(*cacheFile, store->printStorePath(shellOutPath));
+            } catch (Error & e) {
+                debug("ignoring error writing the development environment cache: %s", e.what());
+            }
         }
+
+        return shellOutPath;
     }
 
     std::pair<BuildEnvironment, std::string> getBuildEnvironment(ref<Store> store)
@@ -8,14 +8,6 @@
 
 namespace nix {
 
-struct Info
-{
-    std::string outputName;
-};
-
-// name -> version -> store paths
-typedef std::map<std::string, std::map<std::string, std::map<StorePath, Info>>> GroupedPaths;
-
 GroupedPaths getClosureInfo(ref<Store> store, const StorePath & toplevel)
 {
     StorePathSet closure;
@@ -37,7 +29,7 @@ GroupedPaths getClosureInfo(ref<Store> store, const StorePath & toplevel)
         }
 
         DrvName drvName(name);
-        groupedPaths[drvName.name][drvName.version].emplace(path, Info { .outputName = outputName });
+        groupedPaths[drvName.name][drvName.version].emplace(path, PackageInfo { .outputName = outputName });
     }
 
     return groupedPaths;
@@ -58,18 +50,31 @@ void printClosureDiff(
     const StorePath & afterPath,
     std::string_view indent)
 {
-    auto beforeClosure = getClosureInfo(store, beforePath);
-    auto afterClosure = getClosureInfo(store, afterPath);
+    printClosureDiff(store,
+        getClosureInfo(store, beforePath),
+        getClosureInfo(store, afterPath),
+        indent);
+}
 
+void printClosureDiff(
+    ref<Store> store,
+    const GroupedPaths & beforeClosure,
+    const GroupedPaths & afterClosure,
+    std::string_view indent)
+{
     std::set<std::string> allNames;
     for (auto & [name, _] : beforeClosure) allNames.insert(name);
     for (auto & [name, _] : afterClosure) allNames.insert(name);
 
+    static const std::map<std::string, std::map<StorePath, PackageInfo>> emptyVersions;
+
     for (auto & name : allNames) {
-        auto & beforeVersions = beforeClosure[name];
-        auto & afterVersions = afterClosure[name];
+        auto i = beforeClosure.find(name);
+        auto & beforeVersions = i != beforeClosure.end() ? i->second : emptyVersions;
+        auto j = afterClosure.find(name);
+        auto & afterVersions = j != afterClosure.end() ? j->second : emptyVersions;
 
-        auto totalSize = [&](const std::map<std::string, std::map<StorePath, Info>> & versions)
+        auto totalSize = [&](const std::map<std::string, std::map<StorePath, PackageInfo>> & versions)
         {
             uint64_t sum = 0;
             for (auto & [_, paths] : versions)
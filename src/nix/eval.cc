@@ -6,7 +6,9 @@
 #include "eval-inline.hh"
 #include "json.hh"
 #include "value-to-json.hh"
+#include "value-snapshot.hh"
 #include "progress-bar.hh"
+#include "flake/flake.hh"
 
 using namespace nix;
 
@@ -15,6 +17,7 @@ struct CmdEval : MixJSON, InstallableCommand
     bool raw = false;
     std::optional<std::string> apply;
     std::optional<Path> writeTo;
+    std::optional<Path> writeSnapshot;
 
     CmdEval()
     {
@@ -37,6 +40,13 @@ struct CmdEval : MixJSON, InstallableCommand
             .labels = {"path"},
             .handler = {&writeTo},
         });
+
+        addFlag({
+            .longName = "write-snapshot",
+            .description = "Write the value to *path* as a snapshot readable with `builtins.readSnapshot`.",
+            .labels = {"path"},
+            .handler = {&writeSnapshot},
+        });
     }
 
     std::string description() override
@@ -53,11 +63,50 @@ struct CmdEval : MixJSON, InstallableCommand
 
     Category category() override { return catSecondary; }
 
+    /* Return the file under which the JSON serialisation of this
+       invocation may be cached, or nullopt if the result is not a pure
+       function of a locked flake. The key covers the flake
+       fingerprint, the attribute paths, the system and any --apply
+       expression, so any change to the inputs selects a different
+       file. Finer-grained invalidation would require tracking which
+       parts of the flake each attribute depends on, which the
+       evaluator doesn't record. */
+    std::optional<Path> jsonCacheFile()
+    {
+        if (!json || !evalSettings.pureEval) return std::nullopt;
+        auto flake = std::dynamic_pointer_cast<InstallableFlake>(installable);
+        if (!flake) return std::nullopt;
+        std::string key = "eval-json";
+        key += ";" + flake->getLockedFlake()->getFingerprint().to_string(Base16, false);
+        key += ";" + concatStringsSep(",", flake->attrPaths);
+        key += ";" + settings.thisSystem.get();
+        if (apply) key += ";" + *apply;
+        return getCacheDir() + "/nix/eval-json-v1/"
+            + hashString(htSHA256, key).to_string(Base32, false) + ".json";
+    }
+
     void run(ref<Store> store) override
     {
         if (raw && json)
             throw UsageError("--raw and --json are mutually exclusive");
 
+        /* Warm-start fast path: replay a previously serialised result
+           for the same locked flake without evaluating anything. */
+        std::optional<Path> cacheFile;
+        if (json && !writeTo && !writeSnapshot) {
+            try {
+                cacheFile = jsonCacheFile();
+                if (cacheFile && pathExists(*cacheFile)) {
+                    stopProgressBar();
+                    writeFull(STDOUT_FILENO, readFile(*cacheFile));
+                    return;
+                }
+            } catch (Error &) {
+                /* Fall through to a full evaluation. */
+                cacheFile.reset();
+            }
+        }
+
         auto state = getEvalState();
 
         auto [v, pos] = installable->toValue(*state);
@@ -105,14 +154,38 @@ struct CmdEval : MixJSON, InstallableCommand
             recurse(*v, pos, *writeTo);
         }
 
+        else if (writeSnapshot) {
+            stopProgressBar();
+            writeValueSnapshot(*state, *v, pos, *writeSnapshot);
+        }
+
         else if (raw) {
             stopProgressBar();
             std::cout << state->coerceToString(noPos, *v, context);
         }
 
         else if (json) {
-            JSONPlaceholder jsonOut(std::cout);
-            printValueAsJSON(*state, true, *v, pos, jsonOut, context);
+            /* Serialisation is inherently sequential, so force the
+               whole value first: with eval-cores > 1 this fans out
+               over a thread pool and the serialiser below only sees
+               forced values. */
+            if (evalSettings.evalCores > 1)
+                state->forceValueDeep(*v);
+            stopProgressBar();
+            StringSink sink;
+            printValueAsJSON(*state, true, *v, pos, sink, context);
+            writeFull(STDOUT_FILENO, *sink.s);
+            if (cacheFile) {
+                try {
+                    createDirs(dirOf(*cacheFile));
+                    /* Write atomically so a concurrent invocation
+                       never replays a partial dump. */
+                    auto tmp = *cacheFile + ".tmp." + std::to_string(getpid());
+                    writeFile(tmp, *sink.s);
+                    if (rename(tmp.c_str(), cacheFile->c_str()) == -1)
+                        throw SysError("renaming '%s' to '%s'", tmp, *cacheFile);
+                } catch (Error &) { }
+            }
         }
 
         else {
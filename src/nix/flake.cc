@@ -13,9 +13,13 @@
 #include "registry.hh"
 #include "json.hh"
 #include "eval-cache.hh"
+#include "finally.hh"
+#include "thread-pool.hh"
+#include "sync.hh"
 
 #include <nlohmann/json.hpp>
 #include <queue>
+#include <thread>
 #include <iomanip>
 
 using namespace nix;
@@ -333,7 +337,63 @@ struct CmdFlakeCheck : FlakeCommand
             return std::nullopt;
         };
 
-        std::vector<DerivedPath> drvPaths;
+        /* Run the builds of the checks on a separate thread that is
+           fed drv paths as the walk discovers them, so builds overlap
+           with the (strictly sequential) evaluation instead of
+           starting only after it. */
+        struct BuildState
+        {
+            std::vector<DerivedPath> pending;
+            bool done = false;
+            std::exception_ptr exc;
+        };
+
+        Sync<BuildState> buildState_;
+        std::condition_variable buildWakeup;
+
+        std::thread buildThread;
+
+        if (build)
+            buildThread = std::thread([&]() {
+                while (true) {
+                    std::vector<DerivedPath> batch;
+                    {
+                        auto s(buildState_.lock());
+                        while (s->pending.empty() && !s->done)
+                            s.wait(buildWakeup);
+                        if (s->pending.empty()) return;
+                        std::swap(batch, s->pending);
+                    }
+                    try {
+                        Activity act(*logger, lvlInfo, actUnknown, "running flake checks");
+                        store->buildPaths(batch);
+                    } catch (...) {
+                        auto s(buildState_.lock());
+                        if (!s->exc) s->exc = std::current_exception();
+                    }
+                }
+            });
+
+        auto finishBuilds = [&]() {
+            if (buildThread.joinable()) {
+                {
+                    auto s(buildState_.lock());
+                    s->done = true;
+                }
+                buildWakeup.notify_one();
+                buildThread.join();
+            }
+        };
+
+        Finally joinBuildThread([&]() { finishBuilds(); });
+
+        auto enqueueBuild = [&](DerivedPath p) {
+            {
+                auto s(buildState_.lock());
+                s->pending.push_back(std::move(p));
+            }
+            buildWakeup.notify_one();
+        };
 
         auto checkApp = [&](const std::string & attrPath, Value & v, const Pos & pos) {
             try {
@@ -511,8 +571,8 @@ struct CmdFlakeCheck : FlakeCommand
                                     auto drvPath = checkDerivation(
                                         fmt("%s.%s.%s", name, attr.name, attr2.name),
                                         *attr2.value, *attr2.pos);
-                                    if (drvPath && (std::string) attr.name == settings.thisSystem.get())
-                                        drvPaths.push_back(DerivedPath::Built{*drvPath});
+                                    if (drvPath && (std::string) attr.name == settings.thisSystem.get() && build)
+                                        enqueueBuild(DerivedPath::Built{*drvPath});
                                 }
                             }
                         }
@@ -629,10 +689,11 @@ struct CmdFlakeCheck : FlakeCommand
                 });
         }
 
-        if (build && !drvPaths.empty()) {
-            Activity act(*logger, lvlInfo, actUnknown, "running flake checks");
-            store->buildPaths(drvPaths);
-        }
+        finishBuilds();
+
+        if (auto exc = buildState_.lock()->exc)
+            std::rethrow_exception(exc);
+
         if (hasErrors)
             throw Error("some errors were encountered during the evaluation");
     }
@@ -840,6 +901,65 @@ struct CmdFlakeArchive : FlakeCommand, MixJSON, MixDryRun
     {
         auto flake = lockFlake();
 
+        /* Collect the locked inputs. */
+        std::vector<const LockedNode *> inputNodes;
+        std::function<void(const Node & node)> collect;
+        collect = [&](const Node & node)
+        {
+            for (auto & [inputName, input] : node.inputs)
+                if (auto inputNode = std::get_if<0>(&input)) {
+                    inputNodes.push_back(&**inputNode);
+                    collect(**inputNode);
+                }
+        };
+        collect(*flake.lockFile.root);
+
+        std::map<const LockedNode *, StorePath> storePaths;
+
+        if (dryRun) {
+            for (auto & node : inputNodes)
+                storePaths.emplace(node, node->lockedRef.input.computeStorePath(*store));
+        } else {
+            /* One bulk validity query on the store paths computable
+               from the locked NAR hashes, so inputs already present
+               don't need a fetcher round trip. */
+            StorePathSet expectedPaths;
+            std::map<const LockedNode *, StorePath> expected;
+            for (auto & node : inputNodes)
+                if (!expected.count(node))
+                    try {
+                        auto storePath = node->lockedRef.input.computeStorePath(*store);
+                        expectedPaths.insert(storePath);
+                        expected.emplace(node, storePath);
+                    } catch (Error &) {
+                        /* No NAR hash in the lock entry; fetch below. */
+                    }
+            auto valid = store->queryValidPaths(expectedPaths);
+
+            /* Fetch the missing inputs in parallel; they're
+               independent store paths. */
+            Sync<std::map<const LockedNode *, StorePath>> fetched_;
+            ThreadPool pool;
+            for (auto & node : inputNodes) {
+                auto i = expected.find(node);
+                if (i != expected.end() && valid.count(i->second)) {
+                    storePaths.emplace(node, i->second);
+                    continue;
+                }
+                if (storePaths.count(node)) continue;
+                storePaths.emplace(node, StorePath::dummy); /* placeholder to dedup */
+                pool.enqueue([node, &store, &fetched_]() {
+                    checkInterrupt();
+                    auto storePath = node->lockedRef.input.fetch(store).first.storePath;
+                    fetched_.lock()->emplace(node, storePath);
+                });
+            }
+            pool.process();
+
+            for (auto & [node, storePath] : *fetched_.lock())
+                storePaths.insert_or_assign(node, storePath);
+        }
+
         auto jsonRoot = json ? std::optional<JSONObject>(std::cout) : std::nullopt;
 
         StorePathSet sources;
@@ -856,10 +976,7 @@ struct CmdFlakeArchive : FlakeCommand, MixJSON, MixDryRun
             for (auto & [inputName, input] : node.inputs) {
                 if (auto inputNode = std::get_if<0>(&input)) {
                     auto jsonObj3 = jsonObj2 ? jsonObj2->object(inputName) : std::optional<JSONObject>();
-                    auto storePath =
-                        dryRun
-                        ? (*inputNode)->lockedRef.input.computeStorePath(*store)
-                        : (*inputNode)->lockedRef.input.fetch(store).first.storePath;
+                    auto storePath = storePaths.at(&**inputNode);
                     if (jsonObj3)
                         jsonObj3->attr("path", store->printStorePath(storePath));
                     sources.insert(std::move(storePath));
@@ -909,6 +1026,41 @@ struct CmdFlakeShow : FlakeCommand, MixJSON
         auto state = getEvalState();
         auto flake = std::make_shared<LockedFlake>(lockFlake());
 
+        /* The flake fingerprint covers the entire output tree, so
+           when it matches, a previously recorded rendering can be
+           replayed without any cursor traversal. Only done in pure
+           mode, since the fingerprint doesn't cover impure inputs. */
+        std::optional<Path> renderCachePath;
+        if (evalSettings.useEvalCache && evalSettings.pureEval) {
+            renderCachePath = getCacheDir() + "/nix/flake-show-v1/"
+                + flake->getFingerprint().to_string(Base32, false)
+                + (showLegacy ? "-legacy" : "")
+                + (json ? "-json" : "");
+            if (pathExists(*renderCachePath)) {
+                /* Each recorded line is prefixed with the channel it
+                   was written to ('O' for stdout, 'W' for warnings). */
+                for (auto & line : tokenizeString<Strings>(readFile(*renderCachePath), "\n")) {
+                    if (line[0] == 'W')
+                        logger->warn(line.substr(1));
+                    else
+                        logger->cout("%s", line.substr(1));
+                }
+                return;
+            }
+        }
+
+        std::string recording;
+
+        auto emit = [&](const std::string & s) {
+            recording += "O" + s + "\n";
+            logger->cout("%s", s);
+        };
+
+        auto emitWarning = [&](const std::string & s) {
+            recording += "W" + s + "\n";
+            logger->warn(s);
+        };
+
         std::function<nlohmann::json(
             eval_cache::AttrCursor & visitor,
             const std::vector<Symbol> & attrPath,
@@ -927,10 +1079,15 @@ struct CmdFlakeShow : FlakeCommand, MixJSON
             Activity act(*logger, lvlInfo, actUnknown,
                 fmt("evaluating '%s'", concatStringsSep(".", attrPath)));
             try {
+                /* Load all cached children (e.g. 'type', 'name',
+                   'description') in one query instead of one per
+                   attribute. */
+                visitor.prefetchChildren();
+
                 auto recurse = [&]()
                 {
                     if (!json)
-                        logger->cout("%s", headerPrefix);
+                        emit(headerPrefix);
                     auto attrs = visitor.getAttrs();
                     for (const auto & [i, attr] : enumerate(attrs)) {
                         bool last = i + 1 == attrs.size();
@@ -958,14 +1115,14 @@ struct CmdFlakeShow : FlakeCommand, MixJSON
                         if (description)
                             j.emplace("description", *description);
                     } else {
-                        logger->cout("%s: %s '%s'",
+                        emit(fmt("%s: %s '%s'",
                             headerPrefix,
                             attrPath.size() == 2 && attrPath[0] == "devShell" ? "development environment" :
                             attrPath.size() >= 2 && attrPath[0] == "devShells" ? "development environment" :
                             attrPath.size() == 3 && attrPath[0] == "checks" ? "derivation" :
                             attrPath.size() >= 1 && attrPath[0] == "hydraJobs" ? "derivation" :
                             "package",
-                            name);
+                            name));
                     }
                 };
 
@@ -1010,7 +1167,7 @@ struct CmdFlakeShow : FlakeCommand, MixJSON
                     if (attrPath.size() == 1)
                         recurse();
                     else if (!showLegacy)
-                        logger->warn(fmt("%s: " ANSI_WARNING "omitted" ANSI_NORMAL " (use '--legacy' to show)", headerPrefix));
+                        emitWarning(fmt("%s: " ANSI_WARNING "omitted" ANSI_NORMAL " (use '--legacy' to show)", headerPrefix));
                     else {
                         if (visitor.isDerivation())
                             showDerivation();
@@ -1030,7 +1187,7 @@ struct CmdFlakeShow : FlakeCommand, MixJSON
                     if (json) {
                         j.emplace("type", "app");
                     } else {
-                        logger->cout("%s: app", headerPrefix);
+                        emit(fmt("%s: app", headerPrefix));
                     }
                 }
 
@@ -1043,7 +1200,7 @@ struct CmdFlakeShow : FlakeCommand, MixJSON
                         j.emplace("type", "template");
                         j.emplace("description", description);
                     } else {
-                        logger->cout("%s: template: " ANSI_BOLD "%s" ANSI_NORMAL, headerPrefix, description);
+                        emit(fmt("%s: template: " ANSI_BOLD "%s" ANSI_NORMAL, headerPrefix, description));
                     }
                 }
 
@@ -1058,7 +1215,7 @@ struct CmdFlakeShow : FlakeCommand, MixJSON
                     if (json) {
                         j.emplace("type", type);
                     } else {
-                        logger->cout("%s: " ANSI_WARNING "%s" ANSI_NORMAL, headerPrefix, description);
+                        emit(fmt("%s: " ANSI_WARNING "%s" ANSI_NORMAL, headerPrefix, description));
                     }
                 }
             } catch (EvalError & e) {
@@ -1073,7 +1230,16 @@ struct CmdFlakeShow : FlakeCommand, MixJSON
 
         auto j = visit(*cache->getRoot(), {}, fmt(ANSI_BOLD "%s" ANSI_NORMAL, flake->flake.lockedRef), "");
         if (json)
-            logger->cout("%s", j.dump());
+            emit(j.dump());
+
+        if (renderCachePath) {
+            try {
+                createDirs(dirOf(*renderCachePath));
+                writeFile(*renderCachePath, recording);
+            } catch (...) {
+                ignoreException();
+            }
+        }
     }
 };
 
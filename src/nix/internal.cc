@@ -0,0 +1,26 @@
+#include "command.hh"
+
+using namespace nix;
+
+struct CmdInternal : virtual NixMultiCommand
+{
+    CmdInternal() : MultiCommand(RegisterCommand::getCommandsFor({"internal"}))
+    { }
+
+    std::string description() override
+    {
+        return "commands for Nix developers and CI";
+    }
+
+    Category category() override { return catUtility; }
+
+    void run() override
+    {
+        if (!command)
+            throw UsageError("'nix internal' requires a sub-command.");
+        command->second->prepare();
+        command->second->run();
+    }
+};
+
+static auto rCmdInternal = registerCommand<CmdInternal>("internal");
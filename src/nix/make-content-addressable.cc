@@ -3,6 +3,7 @@
 #include "references.hh"
 #include "common-args.hh"
 #include "json.hh"
+#include "thread-pool.hh"
 
 using namespace nix;
 
@@ -31,70 +32,109 @@ struct CmdMakeContentAddressable : StorePathsCommand, MixJSON
 
         std::reverse(paths.begin(), paths.end());
 
+        StorePathSet pathSet(paths.begin(), paths.end());
+
+        /* Group the paths into layers such that the references of a
+           path always live in a strictly earlier layer. The members of
+           one layer share no rewrite dependencies, so they can be
+           rewritten in parallel. */
+        std::map<StorePath, size_t> layerOf;
+        std::vector<StorePaths> layers;
+        for (auto & path : paths) {
+            size_t layer = 0;
+            for (auto & ref : store->queryPathInfo(path)->references)
+                if (ref != path && pathSet.count(ref))
+                    layer = std::max(layer, layerOf.at(ref) + 1);
+            layerOf.insert_or_assign(path, layer);
+            if (layer >= layers.size()) layers.resize(layer + 1);
+            layers[layer].push_back(path);
+        }
+
         std::map<StorePath, StorePath> remappings;
 
         auto jsonRoot = json ? std::make_unique<JSONObject>(std::cout) : nullptr;
         auto jsonRewrites = json ? std::make_unique<JSONObject>(jsonRoot->object("rewrites")) : nullptr;
 
-        for (auto & path : paths) {
-            auto pathS = store->printStorePath(path);
-            auto oldInfo = store->queryPathInfo(path);
-            std::string oldHashPart(path.hashPart());
-
-            StringSink sink;
-            store->narFromPath(path, sink);
-
-            StringMap rewrites;
-
-            StorePathSet references;
-            bool hasSelfReference = false;
-            for (auto & ref : oldInfo->references) {
-                if (ref == path)
-                    hasSelfReference = true;
-                else {
-                    auto i = remappings.find(ref);
-                    auto replacement = i != remappings.end() ? i->second : ref;
-                    // FIXME: warn about unremapped paths?
-                    if (replacement != ref)
-                        rewrites.insert_or_assign(store->printStorePath(ref), store->printStorePath(replacement));
-                    references.insert(std::move(replacement));
-                }
+        for (auto & layer : layers) {
+            std::vector<std::optional<StorePath>> newPaths(layer.size());
+
+            ThreadPool pool;
+
+            for (size_t n = 0; n < layer.size(); ++n)
+                pool.enqueue([&, n]() {
+                    auto & path = layer[n];
+                    auto pathS = store->printStorePath(path);
+                    auto oldInfo = store->queryPathInfo(path);
+                    std::string oldHashPart(path.hashPart());
+
+                    /* 'remappings' holds only earlier layers and is not
+                       modified while this layer is in flight, so it can
+                       be read without locking. */
+                    StringMap rewrites;
+
+                    StorePathSet references;
+                    bool hasSelfReference = false;
+                    for (auto & ref : oldInfo->references) {
+                        if (ref == path)
+                            hasSelfReference = true;
+                        else {
+                            auto i = remappings.find(ref);
+                            auto replacement = i != remappings.end() ? i->second : ref;
+                            // FIXME: warn about unremapped paths?
+                            if (replacement != ref)
+                                rewrites.insert_or_assign(store->printStorePath(ref), store->printStorePath(replacement));
+                            references.insert(std::move(replacement));
+                        }
+                    }
+
+                    /* First pass: stream the NAR through the reference
+                       rewriter into a hash-modulo sink to learn the new
+                       store path, without materialising the NAR. */
+                    HashModuloSink hashModuloSink(htSHA256, oldHashPart);
+                    RewritingSink refRewriter(rewrites, hashModuloSink);
+                    store->narFromPath(path, refRewriter);
+                    refRewriter.flush();
+
+                    auto [narHash, narSize] = hashModuloSink.finish();
+
+                    ValidPathInfo info {
+                        store->makeFixedOutputPath(FileIngestionMethod::Recursive, narHash, path.name(), references, hasSelfReference),
+                        narHash,
+                    };
+                    info.references = std::move(references);
+                    if (hasSelfReference) info.references.insert(info.path);
+                    info.narSize = narSize;
+                    info.ca = FixedOutputHash {
+                        .method = FileIngestionMethod::Recursive,
+                        .hash = info.narHash,
+                    };
+
+                    if (!json)
+                        notice("rewrote '%s' to '%s'", pathS, store->printStorePath(info.path));
+
+                    /* Second pass: stream the NAR again, this time
+                       rewriting the references and self-references in
+                       one go, straight into the store. */
+                    rewrites.insert_or_assign(oldHashPart, std::string(info.path.hashPart()));
+
+                    auto source = sinkToSource([&](Sink & nextSink) {
+                        RewritingSink rsink(rewrites, nextSink);
+                        store->narFromPath(path, rsink);
+                        rsink.flush();
+                    });
+
+                    store->addToStore(info, *source);
+
+                    newPaths[n] = std::move(info.path);
+                });
+
+            pool.process();
+
+            for (size_t n = 0; n < layer.size(); ++n) {
+                if (json)
+                    jsonRewrites->attr(store->printStorePath(layer[n]), store->printStorePath(*newPaths[n]));
+                remappings.insert_or_assign(layer[n], std::move(*newPaths[n]));
             }
-
-            *sink.s = rewriteStrings(*sink.s, rewrites);
-
-            HashModuloSink hashModuloSink(htSHA256, oldHashPart);
-            hashModuloSink(*sink.s);
-
-            auto narHash = hashModuloSink.finish().first;
-
-            ValidPathInfo info {
-                store->makeFixedOutputPath(FileIngestionMethod::Recursive, narHash, path.name(), references, hasSelfReference),
-                narHash,
-            };
-            info.references = std::move(references);
-            if (hasSelfReference) info.references.insert(info.path);
-            info.narSize = sink.s->size();
-            info.ca = FixedOutputHash {
-                .method = FileIngestionMethod::Recursive,
-                .hash = info.narHash,
-            };
-
-            if (!json)
-                notice("rewrote '%s' to '%s'", pathS, store->printStorePath(info.path));
-
-            auto source = sinkToSource([&](Sink & nextSink) {
-                RewritingSink rsink2(oldHashPart, std::string(info.path.hashPart()), nextSink);
-                rsink2(*sink.s);
-                rsink2.flush();
-            });
-
-            store->addToStore(info, *source);
-
-            if (json)
-                jsonRewrites->attr(store->printStorePath(path), store->printStorePath(info.path));
-
-            remappings.insert_or_assign(std::move(path), std::move(info.path));
         }
     }
 };
@@ -15,6 +15,7 @@ struct CmdPathInfo : StorePathsCommand, MixJSON
     bool showClosureSize = false;
     bool humanReadable = false;
     bool showSigs = false;
+    std::optional<StringSet> fields;
 
     CmdPathInfo()
     {
@@ -44,6 +45,17 @@ struct CmdPathInfo : StorePathsCommand, MixJSON
             .description = "Show signatures.",
             .handler = {&showSigs, true},
         });
+
+        addFlag({
+            .longName = "fields",
+            .description = "With `--json`, only emit the given comma-separated fields "
+                "(e.g. `narHash,references`) and skip the work of computing the rest. "
+                "The `path` field is always emitted.",
+            .labels = {"fields"},
+            .handler = {[&](std::string s) {
+                fields = tokenizeString<StringSet>(s, ",");
+            }},
+        });
     }
 
     std::string description() override
@@ -85,18 +97,28 @@ struct CmdPathInfo : StorePathsCommand, MixJSON
         for (auto & storePath : storePaths)
             pathLen = std::max(pathLen, store->printStorePath(storePath).size());
 
+        /* Fetch all infos in one go, with the lookups in flight
+           concurrently; the loops below then hit the in-memory
+           cache. */
+        auto infos = store->queryPathInfos(StorePathSet(storePaths.begin(), storePaths.end()));
+
         if (json) {
             JSONPlaceholder jsonRoot(std::cout);
             store->pathInfoToJSON(jsonRoot,
                 // FIXME: preserve order?
                 StorePathSet(storePaths.begin(), storePaths.end()),
-                true, showClosureSize, SRI, AllowInvalid);
+                true, showClosureSize, SRI, AllowInvalid,
+                fields ? &*fields : nullptr);
         }
 
         else {
 
             for (auto & storePath : storePaths) {
-                auto info = store->queryPathInfo(storePath);
+                auto i = infos.find(storePath);
+                /* Re-query missing paths one at a time so that the
+                   store's own InvalidPath error is what the user
+                   sees. */
+                auto info = i != infos.end() ? i->second : store->queryPathInfo(storePath);
                 auto storePathS = store->printStorePath(storePath);
 
                 std::cout << storePathS;
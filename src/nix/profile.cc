@@ -392,6 +392,13 @@ struct CmdProfileUpgrade : virtual SourceExprCommand, MixDefaultProfile, MixProf
         // FIXME: code duplication
         std::vector<DerivedPath> pathsToBuild;
 
+        /* Resolve each distinct flake only once, and skip evaluation
+           altogether for elements whose flake resolves to the locked
+           ref already recorded in the manifest: their derivation
+           cannot have changed. Only the remaining candidates are
+           evaluated. */
+        std::map<std::string, FlakeRef> resolvedRefs;
+
         for (size_t i = 0; i < manifest.elements.size(); ++i) {
             auto & element(manifest.elements[i]);
             if (element.source
@@ -401,6 +408,11 @@ struct CmdProfileUpgrade : virtual SourceExprCommand, MixDefaultProfile, MixProf
                 Activity act(*logger, lvlChatty, actUnknown,
                     fmt("checking '%s' for updates", element.source->attrPath));
 
+                auto cached = resolvedRefs.find(element.source->originalRef.to_string());
+                if (cached != resolvedRefs.end()
+                    && cached->second == element.source->resolvedRef)
+                    continue;
+
                 InstallableFlake installable(
                     this,
                     getEvalState(),
@@ -409,9 +421,12 @@ struct CmdProfileUpgrade : virtual SourceExprCommand, MixDefaultProfile, MixProf
                     {},
                     lockFlags);
 
-                auto [attrPath, resolvedRef, drv] = installable.toDerivation();
+                auto lockedRef = installable.getLockedFlake()->flake.lockedRef;
+                resolvedRefs.insert_or_assign(element.source->originalRef.to_string(), lockedRef);
 
-                if (element.source->resolvedRef == resolvedRef) continue;
+                if (element.source->resolvedRef == lockedRef) continue;
+
+                auto [attrPath, resolvedRef, drv] = installable.toDerivation();
 
                 printInfo("upgrading '%s' from flake '%s' to '%s'",
                     element.source->attrPath, element.source->resolvedRef, resolvedRef);
@@ -482,20 +497,23 @@ struct CmdProfileDiffClosures : virtual StoreCommand, MixDefaultProfile
         auto [gens, curGen] = findGenerations(*profile);
 
         std::optional<Generation> prevGen;
+        GroupedPaths prevClosure;
         bool first = true;
 
         for (auto & gen : gens) {
+            /* Index each generation's closure once; the diff against
+               the next generation is then a join of the two indices. */
+            auto curClosure = getClosureInfo(store, store->followLinksToStorePath(gen.path));
+
             if (prevGen) {
                 if (!first) std::cout << "\n";
                 first = false;
                 std::cout << fmt("Version %d -> %d:\n", prevGen->number, gen.number);
-                printClosureDiff(store,
-                    store->followLinksToStorePath(prevGen->path),
-                    store->followLinksToStorePath(gen.path),
-                    "  ");
+                printClosureDiff(store, prevClosure, curClosure, "  ");
             }
 
             prevGen = gen;
+            prevClosure = std::move(curClosure);
         }
     }
 };
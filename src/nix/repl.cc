@@ -41,6 +41,14 @@ extern "C" {
 
 namespace nix {
 
+/* Budgets for printing values: the automatic echo of an evaluation
+   result should stay snappy even on something like 'pkgs', while an
+   explicit ':p' is allowed to spend a lot more. */
+static constexpr uint64_t defaultPrintBytes = 64 * 1024;
+static constexpr uint64_t defaultPrintThunks = 10 * 1024;
+static constexpr uint64_t explicitPrintBytes = 16 * 1024 * 1024;
+static constexpr uint64_t explicitPrintThunks = 1024 * 1024;
+
 struct NixRepl
     #if HAVE_BOEHMGC
     : gc
@@ -58,6 +66,11 @@ struct NixRepl
     int displ;
     StringSet varNames;
 
+    /* Memoised attribute names per completed expression, so a TAB on
+       'pkgs.<prefix>' only pays for evaluating 'pkgs' once. Cleared
+       whenever the scope changes. */
+    std::map<std::string, StringSet> completionCache;
+
     const Path historyFile;
 
     NixRepl(const Strings & searchPath, nix::ref<Store> store);
@@ -77,8 +90,10 @@ struct NixRepl
     void evalString(string s, Value & v);
 
     typedef set<Value *> ValuesSeen;
-    std::ostream &  printValue(std::ostream & str, Value & v, unsigned int maxDepth);
-    std::ostream &  printValue(std::ostream & str, Value & v, unsigned int maxDepth, ValuesSeen & seen);
+    struct PrintState;
+    std::ostream &  printValue(std::ostream & str, Value & v, unsigned int maxDepth,
+        uint64_t maxBytes = defaultPrintBytes, uint64_t maxThunks = defaultPrintThunks);
+    void printValue(Value & v, unsigned int maxDepth, ValuesSeen & seen, PrintState & ps);
 };
 
 
@@ -194,6 +209,9 @@ namespace {
 
     void sigintHandler(int signo) {
         g_signal_received = signo;
+        /* Also abort any evaluation running inside the completion
+           callback at its next checkInterrupt(). */
+        _isInterrupted = true;
     }
 }
 
@@ -285,6 +303,7 @@ bool NixRepl::getLine(string & input, const std::string &prompt)
 
     if (g_signal_received) {
         g_signal_received = 0;
+        _isInterrupted = false;
         input.clear();
         return true;
     }
@@ -339,13 +358,20 @@ StringSet NixRepl::completePrefix(string prefix)
             string expr(cur, 0, dot);
             string cur2 = string(cur, dot + 1);
 
-            Expr * e = parseString(expr);
-            Value v;
-            e->eval(*state, *env, v);
-            state->forceAttrs(v);
+            auto cached = completionCache.find(expr);
+            if (cached == completionCache.end()) {
+                Expr * e = parseString(expr);
+                Value v;
+                e->eval(*state, *env, v);
+                state->forceAttrs(v);
+
+                StringSet names;
+                for (auto & i : *v.attrs)
+                    names.insert(i.name);
+                cached = completionCache.emplace(expr, std::move(names)).first;
+            }
 
-            for (auto & i : *v.attrs) {
-                string name = i.name;
+            for (auto & name : cached->second) {
                 if (string(name, 0, cur2.size()) != cur2) continue;
                 completions.insert(prev + expr + "." + name);
             }
@@ -356,6 +382,10 @@ StringSet NixRepl::completePrefix(string prefix)
             // Quietly ignore evaluation errors.
         } catch (UndefinedVarError & e) {
             // Quietly ignore undefined variable errors.
+        } catch (Interrupted & e) {
+            /* Ctrl-C cancels a completion that is taking too long,
+               instead of killing the REPL. */
+            _isInterrupted = false;
         }
     }
 
@@ -461,7 +491,7 @@ bool NixRepl::processLine(string line)
             auto filename = state->coerceToString(noPos, v, context);
             pos.file = state->symbols.create(filename);
         } else if (v.isLambda()) {
-            pos = v.lambda.fun->pos;
+            pos = *v.lambda.fun->pos;
         } else {
             // assume it's a derivation
             pos = findPackageFilename(*state, v, arg);
@@ -516,7 +546,7 @@ bool NixRepl::processLine(string line)
     else if (command == ":p" || command == ":print") {
         Value v;
         evalString(arg, v);
-        printValue(std::cout, v, 1000000000) << std::endl;
+        printValue(std::cout, v, 1000000000, explicitPrintBytes, explicitPrintThunks) << std::endl;
     }
 
     else if (command == ":q" || command == ":quit")
@@ -609,6 +639,7 @@ void NixRepl::initEnv()
     staticEnv.vars.clear();
 
     varNames.clear();
+    completionCache.clear();
     for (auto & i : state->staticBaseEnv.vars)
         varNames.insert(i.first);
 }
@@ -647,6 +678,7 @@ void NixRepl::addVarToScope(const Symbol & name, Value & v)
     staticEnv.vars.emplace_back(name, displ);
     staticEnv.sort();
     env->values[displ++] = &v;
+    completionCache.clear();
     varNames.insert((string) name);
 }
 
@@ -666,10 +698,61 @@ void NixRepl::evalString(string s, Value & v)
 }
 
 
-std::ostream & NixRepl::printValue(std::ostream & str, Value & v, unsigned int maxDepth)
+/* An output streambuf that counts the bytes written through it. */
+struct CountingStreamBuf : std::streambuf
+{
+    std::streambuf & inner;
+    uint64_t written = 0;
+
+    CountingStreamBuf(std::streambuf & inner) : inner(inner) { }
+
+    int_type overflow(int_type c) override
+    {
+        if (c == traits_type::eof()) return traits_type::not_eof(c);
+        if (inner.sputc(c) == traits_type::eof()) return traits_type::eof();
+        written++;
+        return c;
+    }
+
+    std::streamsize xsputn(const char * s, std::streamsize n) override
+    {
+        auto r = inner.sputn(s, n);
+        written += r;
+        return r;
+    }
+
+    int sync() override { return inner.pubsync(); }
+};
+
+struct NixRepl::PrintState
+{
+    CountingStreamBuf buf;
+    std::ostream str;
+    /* Output bytes / thunk forces we're still willing to spend before
+       eliding the rest. */
+    uint64_t maxBytes;
+    uint64_t thunksLeft;
+    bool truncated = false;
+
+    PrintState(std::ostream & target, uint64_t maxBytes, uint64_t maxThunks)
+        : buf(*target.rdbuf()), str(&buf), maxBytes(maxBytes), thunksLeft(maxThunks) { }
+
+    bool outOfBytes()
+    {
+        return buf.written >= maxBytes;
+    }
+};
+
+std::ostream & NixRepl::printValue(std::ostream & str, Value & v, unsigned int maxDepth,
+    uint64_t maxBytes, uint64_t maxThunks)
 {
     ValuesSeen seen;
-    return printValue(str, v, maxDepth, seen);
+    PrintState ps(str, maxBytes, maxThunks);
+    printValue(v, maxDepth, seen, ps);
+    ps.str.flush();
+    if (ps.truncated)
+        str << "\n«output truncated; print a nested attribute, or use ':p' for a larger budget»";
+    return str;
 }
 
 
@@ -687,11 +770,31 @@ std::ostream & printStringValue(std::ostream & str, const char * string) {
 
 
 // FIXME: lot of cut&paste from Nix's eval.cc.
-std::ostream & NixRepl::printValue(std::ostream & str, Value & v, unsigned int maxDepth, ValuesSeen & seen)
+void NixRepl::printValue(Value & v, unsigned int maxDepth, ValuesSeen & seen, PrintState & ps)
 {
+    std::ostream & str(ps.str);
+
     str.flush();
     checkInterrupt();
 
+    /* Print eagerly what's cheap, but don't force thunks once the
+       thunk budget is gone; the marker tells the user what to print
+       to see more. */
+    if (ps.outOfBytes()) {
+        ps.truncated = true;
+        str << "«…»";
+        return;
+    }
+
+    if (v.isThunk() || v.isApp()) {
+        if (!ps.thunksLeft) {
+            ps.truncated = true;
+            str << "«…»";
+            return;
+        }
+        ps.thunksLeft--;
+    }
+
     state->forceValue(v);
 
     switch (v.type()) {
@@ -739,7 +842,14 @@ std::ostream & NixRepl::printValue(std::ostream & str, Value & v, unsigned int m
             for (auto & i : *v.attrs)
                 sorted[i.name] = i.value;
 
+            size_t shown = 0;
             for (auto & i : sorted) {
+                if (ps.outOfBytes()) {
+                    ps.truncated = true;
+                    str << "«" << (sorted.size() - shown) << " attributes elided» ";
+                    break;
+                }
+                shown++;
                 if (isVarName(i.first))
                     str << i.first;
                 else
@@ -749,7 +859,7 @@ std::ostream & NixRepl::printValue(std::ostream & str, Value & v, unsigned int m
                     str << "«repeated»";
                 else
                     try {
-                        printValue(str, *i.second, maxDepth - 1, seen);
+                        printValue(*i.second, maxDepth - 1, seen, ps);
                     } catch (AssertionError & e) {
                         str << ANSI_RED "«error: " << e.msg() << "»" ANSI_NORMAL;
                     }
@@ -769,11 +879,16 @@ std::ostream & NixRepl::printValue(std::ostream & str, Value & v, unsigned int m
         str << "[ ";
         if (maxDepth > 0)
             for (unsigned int n = 0; n < v.listSize(); ++n) {
+                if (ps.outOfBytes()) {
+                    ps.truncated = true;
+                    str << "«" << (v.listSize() - n) << " elements elided» ";
+                    break;
+                }
                 if (seen.find(v.listElems()[n]) != seen.end())
                     str << "«repeated»";
                 else
                     try {
-                        printValue(str, *v.listElems()[n], maxDepth - 1, seen);
+                        printValue(*v.listElems()[n], maxDepth - 1, seen, ps);
                     } catch (AssertionError & e) {
                         str << ANSI_RED "«error: " << e.msg() << "»" ANSI_NORMAL;
                     }
@@ -787,7 +902,7 @@ std::ostream & NixRepl::printValue(std::ostream & str, Value & v, unsigned int m
     case nFunction:
         if (v.isLambda()) {
             std::ostringstream s;
-            s << v.lambda.fun->pos;
+            s << *v.lambda.fun->pos;
             str << ANSI_BLUE "«lambda @ " << filterANSIEscapes(s.str()) << "»" ANSI_NORMAL;
         } else if (v.isPrimOp()) {
             str << ANSI_MAGENTA "«primop»" ANSI_NORMAL;
@@ -806,8 +921,6 @@ std::ostream & NixRepl::printValue(std::ostream & str, Value & v, unsigned int m
         str << ANSI_RED "«unknown»" ANSI_NORMAL;
         break;
     }
-
-    return str;
 }
 
 struct CmdRepl : StoreCommand, MixEvalArgs
@@ -10,6 +10,7 @@
 #include "progress-bar.hh"
 #include "affinity.hh"
 #include "eval.hh"
+#include "flake/flake.hh"
 
 #if __linux__
 #include <sys/mount.h>
@@ -57,6 +58,26 @@ void runProgramInStore(ref<Store> store,
 
 }
 
+/* Return the file under which the result of resolving 'installables'
+   may be cached, or nullopt if they don't all come from locked flakes.
+   The key covers the fingerprint of each locked flake and the
+   requested attribute paths, so any change to the flake, its lock file
+   or the invocation gets a different file. */
+static std::optional<Path> invocationCacheFile(
+    const std::string & prefix,
+    const std::vector<std::shared_ptr<Installable>> & installables)
+{
+    std::string key = prefix;
+    for (auto & i : installables) {
+        auto flake = std::dynamic_pointer_cast<InstallableFlake>(i);
+        if (!flake) return std::nullopt;
+        key += ";" + flake->getLockedFlake()->getFingerprint().to_string(Base16, false);
+        key += ";" + concatStringsSep(",", flake->attrPaths);
+    }
+    return getCacheDir() + "/nix/resolved-v1/"
+        + hashString(htSHA256, key).to_string(Base32, false);
+}
+
 struct CmdShell : InstallablesCommand, MixEnvironment
 {
 
@@ -90,8 +111,50 @@ struct CmdShell : InstallablesCommand, MixEnvironment
           ;
     }
 
+    void exec(ref<Store> store, const Strings & pathPrefix)
+    {
+        setEnviron();
+
+        auto unixPath = tokenizeString<Strings>(getEnv("PATH").value_or(""), ":");
+        unixPath.insert(unixPath.begin(), pathPrefix.begin(), pathPrefix.end());
+        setenv("PATH", concatStringsSep(":", unixPath).c_str(), 1);
+
+        Strings args;
+        for (auto & arg : command) args.push_back(arg);
+
+        runProgramInStore(store, *command.begin(), args);
+    }
+
     void run(ref<Store> store) override
     {
+        /* Warm-start fast path: if these installables were resolved
+           from the same locked flakes before, reuse the recorded PATH
+           entries after a single validity check. */
+        std::optional<Path> cacheFile;
+        try {
+            cacheFile = invocationCacheFile("shell", installables);
+        } catch (Error &) { }
+
+        if (cacheFile && pathExists(*cacheFile)) {
+            try {
+                auto entries = tokenizeString<Strings>(readFile(*cacheFile), "\n");
+                StorePathSet paths;
+                for (auto & entry : entries)
+                    paths.insert(store->parseStorePath(entry));
+                if (store->queryValidPaths(paths).size() == paths.size()) {
+                    /* Entries are recorded in traversal order; each
+                       was prepended to PATH, so replay them in
+                       reverse. */
+                    Strings pathPrefix;
+                    for (auto i = entries.rbegin(); i != entries.rend(); ++i)
+                        pathPrefix.push_back(*i + "/bin");
+                    exec(store, pathPrefix);
+                }
+            } catch (Error &) {
+                /* Fall through to a full resolve. */
+            }
+        }
+
         auto outPaths = toStorePaths(getEvalStore(), store, Realise::Outputs, OperateOn::Output, installables);
 
         auto accessor = store->getFSAccessor();
@@ -100,17 +163,15 @@ struct CmdShell : InstallablesCommand, MixEnvironment
         std::queue<StorePath> todo;
         for (auto & path : outPaths) todo.push(path);
 
-        setEnviron();
-
-        auto unixPath = tokenizeString<Strings>(getEnv("PATH").value_or(""), ":");
+        /* Store paths whose bin/ goes on PATH, outermost first. */
+        std::vector<std::string> pathEntries;
 
         while (!todo.empty()) {
             auto path = todo.front();
             todo.pop();
             if (!done.insert(path).second) continue;
 
-            if (true)
-                unixPath.push_front(store->printStorePath(path) + "/bin");
+            pathEntries.push_back(store->printStorePath(path));
 
             auto propPath = store->printStorePath(path) + "/nix-support/propagated-user-env-packages";
             if (accessor->stat(propPath).type == FSAccessor::tRegular) {
@@ -119,12 +180,18 @@ struct CmdShell : InstallablesCommand, MixEnvironment
             }
         }
 
-        setenv("PATH", concatStringsSep(":", unixPath).c_str(), 1);
+        if (cacheFile) {
+            try {
+                createDirs(dirOf(*cacheFile));
+                writeFile(*cacheFile, concatStringsSep("\n", pathEntries));
+            } catch (Error &) { }
+        }
 
-        Strings args;
-        for (auto & arg : command) args.push_back(arg);
+        Strings pathPrefix;
+        for (auto i = pathEntries.rbegin(); i != pathEntries.rend(); ++i)
+            pathPrefix.push_back(*i + "/bin");
 
-        runProgramInStore(store, *command.begin(), args);
+        exec(store, pathPrefix);
     }
 };
 
@@ -175,10 +242,41 @@ struct CmdRun : InstallableCommand
 
     void run(ref<Store> store) override
     {
+        /* Warm-start fast path: if this app was resolved from the
+           same locked flake before, one validity check suffices (a
+           valid path implies a valid closure) and we can exec
+           straight away. */
+        std::optional<Path> cacheFile;
+        try {
+            cacheFile = invocationCacheFile("run", {installable});
+        } catch (Error &) { }
+
+        if (cacheFile && pathExists(*cacheFile)) {
+            try {
+                auto program = trim(readFile(*cacheFile));
+                if (store->isInStore(program)
+                    && store->isValidPath(store->toStorePath(program).first))
+                {
+                    Strings allArgs{program};
+                    for (auto & i : args) allArgs.push_back(i);
+                    runProgramInStore(store, program, allArgs);
+                }
+            } catch (Error &) {
+                /* Fall through to a full resolve. */
+            }
+        }
+
         auto state = getEvalState();
 
         auto app = installable->toApp(*state).resolve(getEvalStore(), store);
 
+        if (cacheFile) {
+            try {
+                createDirs(dirOf(*cacheFile));
+                writeFile(*cacheFile, app.program);
+            } catch (Error &) { }
+        }
+
         Strings allArgs{app.program};
         for (auto & i : args) allArgs.push_back(i);
 
@@ -82,6 +82,86 @@ struct CmdSearch : InstallableCommand, MixJSON
 
         uint64_t results = 0;
 
+        /* Match one package against the regexes and print it if all of
+           them hit. Shared between the eval walk and the index fast
+           path. */
+        auto showMatch = [&](const std::string & attrPath2,
+            const std::string & pname, const std::string & version,
+            const std::string & description)
+        {
+            std::smatch attrPathMatch;
+            std::smatch descriptionMatch;
+            std::smatch nameMatch;
+            size_t found = 0;
+
+            for (auto & regex : regexes) {
+                std::regex_search(attrPath2, attrPathMatch, regex);
+                std::regex_search(pname, nameMatch, regex);
+                std::regex_search(description, descriptionMatch, regex);
+                if (!attrPathMatch.empty()
+                    || !nameMatch.empty()
+                    || !descriptionMatch.empty())
+                    found++;
+            }
+
+            if (found == res.size()) {
+                results++;
+                if (json) {
+                    auto jsonElem = jsonOut->object(attrPath2);
+                    jsonElem.attr("pname", pname);
+                    jsonElem.attr("version", version);
+                    jsonElem.attr("description", description);
+                } else {
+                    if (results > 1) logger->cout("");
+                    logger->cout(
+                        "* %s%s",
+                        wrap("\e[0;1m", hilite(attrPath2, attrPathMatch, "\e[0;1m")),
+                        version != "" ? " (" + version + ")" : "");
+                    if (description != "")
+                        logger->cout(
+                            "  %s", hilite(description, descriptionMatch, ANSI_NORMAL));
+                }
+            }
+        };
+
+        /* A persistent index of (attr path, name, version,
+           description) tuples built during the first full traversal,
+           living next to the eval cache and keyed by the same flake
+           fingerprint, so later searches don't have to walk the
+           cursor tree at all. */
+        std::optional<Path> indexFile;
+        if (evalSettings.useEvalCache) {
+            if (auto installable2 = std::dynamic_pointer_cast<InstallableFlake>(installable)) {
+                auto fingerprint = installable2->getLockedFlake()->getFingerprint();
+                indexFile = getCacheDir() + "/nix/search-index-v1/"
+                    + fingerprint.to_string(Base16, false) + ".index";
+            }
+        }
+
+        if (indexFile && pathExists(*indexFile)) {
+            for (auto & line : tokenizeString<Strings>(readFile(*indexFile), "\n")) {
+                /* Fields are tab-separated; the description may be
+                   empty, so split by hand. */
+                std::vector<std::string> fields;
+                size_t pos = 0;
+                while (fields.size() < 3) {
+                    auto tab = line.find('\t', pos);
+                    if (tab == std::string::npos) break;
+                    fields.push_back(line.substr(pos, tab - pos));
+                    pos = tab + 1;
+                }
+                if (fields.size() != 3) continue;
+                fields.push_back(line.substr(pos));
+                showMatch(fields[0], fields[1], fields[2], fields[3]);
+            }
+
+            if (!json && !results)
+                throw Error("no results for the given search term(s)!");
+            return;
+        }
+
+        std::string index;
+
         std::function<void(eval_cache::AttrCursor & cursor, const std::vector<Symbol> & attrPath, bool initialRecurse)> visit;
 
         visit = [&](eval_cache::AttrCursor & cursor, const std::vector<Symbol> & attrPath, bool initialRecurse)
@@ -100,49 +180,19 @@ struct CmdSearch : InstallableCommand, MixJSON
                 };
 
                 if (cursor.isDerivation()) {
-                    size_t found = 0;
-
                     DrvName name(cursor.getAttr("name")->getString());
 
                     auto aMeta = cursor.maybeGetAttr("meta");
                     auto aDescription = aMeta ? aMeta->maybeGetAttr("description") : nullptr;
                     auto description = aDescription ? aDescription->getString() : "";
                     std::replace(description.begin(), description.end(), '\n', ' ');
+                    std::replace(description.begin(), description.end(), '\t', ' ');
                     auto attrPath2 = concatStringsSep(".", attrPath);
 
-                    std::smatch attrPathMatch;
-                    std::smatch descriptionMatch;
-                    std::smatch nameMatch;
-
-                    for (auto & regex : regexes) {
-                        std::regex_search(attrPath2, attrPathMatch, regex);
-                        std::regex_search(name.name, nameMatch, regex);
-                        std::regex_search(description, descriptionMatch, regex);
-                        if (!attrPathMatch.empty()
-                            || !nameMatch.empty()
-                            || !descriptionMatch.empty())
-                            found++;
-                    }
+                    if (indexFile)
+                        index += attrPath2 + '\t' + name.name + '\t' + name.version + '\t' + description + '\n';
 
-                    if (found == res.size()) {
-                        results++;
-                        if (json) {
-                            auto jsonElem = jsonOut->object(attrPath2);
-                            jsonElem.attr("pname", name.name);
-                            jsonElem.attr("version", name.version);
-                            jsonElem.attr("description", description);
-                        } else {
-                            auto name2 = hilite(name.name, nameMatch, "\e[0;2m");
-                            if (results > 1) logger->cout("");
-                            logger->cout(
-                                "* %s%s",
-                                wrap("\e[0;1m", hilite(attrPath2, attrPathMatch, "\e[0;1m")),
-                                name.version != "" ? " (" + name.version + ")" : "");
-                            if (description != "")
-                                logger->cout(
-                                    "  %s", hilite(description, descriptionMatch, ANSI_NORMAL));
-                        }
-                    }
+                    showMatch(attrPath2, name.name, name.version, description);
                 }
 
                 else if (
@@ -169,6 +219,20 @@ struct CmdSearch : InstallableCommand, MixJSON
         for (auto & [cursor, prefix] : installable->getCursors(*state))
             visit(*cursor, parseAttrPath(*state, prefix), true);
 
+        if (indexFile) {
+            try {
+                createDirs(dirOf(*indexFile));
+                /* Write atomically so a concurrent search never sees
+                   a partial index. */
+                auto tmpFile = *indexFile + "." + std::to_string(getpid());
+                writeFile(tmpFile, index);
+                if (rename(tmpFile.c_str(), indexFile->c_str()) == -1)
+                    throw SysError("renaming '%s' to '%s'", tmpFile, *indexFile);
+            } catch (Error & e) {
+                debug("ignoring error writing the search index: %s", e.what());
+            }
+        }
+
         if (!json && !results)
             throw Error("no results for the given search term(s)!");
     }
@@ -0,0 +1,102 @@
+#include "command.hh"
+#include "store-api.hh"
+#include "filetransfer.hh"
+#include "sqlite.hh"
+#include "json.hh"
+
+#include <iostream>
+#include <thread>
+
+using namespace nix;
+
+struct CmdStoreStats : StoreCommand
+{
+    bool watch = false;
+    size_t interval = 2;
+
+    CmdStoreStats()
+    {
+        addFlag({
+            .longName = "watch",
+            .description = "Keep running, printing a fresh snapshot every *interval* seconds.",
+            .handler = {&watch, true},
+        });
+
+        addFlag({
+            .longName = "interval",
+            .description = "Snapshot interval in seconds for `--watch`.",
+            .labels = {"seconds"},
+            .handler = {&interval},
+        });
+    }
+
+    std::string description() override
+    {
+        return "show store I/O and cache statistics";
+    }
+
+    std::string doc() override
+    {
+        return
+          #include "store-stats.md"
+          ;
+    }
+
+    void printSnapshot(ref<Store> store)
+    {
+        auto & stats = store->getStats();
+
+        {
+            JSONObject obj(std::cout);
+            obj.attr("narInfoRead", stats.narInfoRead.load());
+            obj.attr("narInfoReadAverted", stats.narInfoReadAverted.load());
+            obj.attr("narInfoMissing", stats.narInfoMissing.load());
+            obj.attr("narInfoWrite", stats.narInfoWrite.load());
+            obj.attr("pathInfoCacheSize", stats.pathInfoCacheSize.load());
+            obj.attr("pathInfoCacheHits", stats.pathInfoCacheHits.load());
+            obj.attr("pathInfoCacheMisses", stats.pathInfoCacheMisses.load());
+            auto lookups = stats.pathInfoCacheHits + stats.pathInfoCacheMisses;
+            if (lookups)
+                obj.attr("pathInfoCacheHitRate", (double) stats.pathInfoCacheHits / lookups);
+            obj.attr("narRead", stats.narRead.load());
+            obj.attr("narReadBytes", stats.narReadBytes.load());
+            obj.attr("narReadCompressedBytes", stats.narReadCompressedBytes.load());
+            obj.attr("narWrite", stats.narWrite.load());
+            obj.attr("narWriteAverted", stats.narWriteAverted.load());
+            obj.attr("narWriteBytes", stats.narWriteBytes.load());
+            obj.attr("narWriteCompressedBytes", stats.narWriteCompressedBytes.load());
+            obj.attr("narWriteCompressionTimeMs", stats.narWriteCompressionTimeMs.load());
+            obj.attr("sqliteBusyRetries", getSQLiteBusyCount());
+
+            auto hostStats = getFileTransfer()->getHostStats();
+            if (!hostStats.empty()) {
+                auto hosts = obj.object("transfers");
+                for (auto & [host, s] : hostStats) {
+                    auto hostObj = hosts.object(host);
+                    hostObj.attr("requests", s.requests);
+                    hostObj.attr("failed", s.failed);
+                    hostObj.attr("retries", s.retries);
+                    hostObj.attr("bytesReceived", s.bytesReceived);
+                    hostObj.attr("totalSeconds", s.totalTime);
+                }
+            }
+        }
+
+        std::cout << std::endl;
+    }
+
+    void run(ref<Store> store) override
+    {
+        /* Make sure the counters reflect a live connection rather
+           than an unopened store. */
+        store->connect();
+
+        do {
+            printSnapshot(store);
+            if (watch)
+                std::this_thread::sleep_for(std::chrono::seconds(interval));
+        } while (watch);
+    }
+};
+
+static auto rCmdStoreStats = registerCommand2<CmdStoreStats>({"store", "stats"});
@@ -2,8 +2,12 @@
 #include "globals.hh"
 #include "shared.hh"
 #include "store-api.hh"
+#include "finally.hh"
+#include "sync.hh"
+#include "thread-pool.hh"
 #include <sys/utsname.h>
 #include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <fstream>
 #include <sys/mman.h>
@@ -48,10 +52,14 @@ std::set<std::string> runResolver(const Path & filename)
         return {};
     }
 
+    /* Only the header and load command pages are ever dereferenced,
+       so the mapping faults in header bytes, not file bytes. */
     char* obj = (char*) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd.get(), 0);
-    if (!obj)
+    if (obj == MAP_FAILED)
         throw SysError("mmapping '%s'", filename);
 
+    Finally unmap([&]() { munmap(obj, st.st_size); });
+
     ptrdiff_t mach64_offset = 0;
 
     uint32_t magic = ((mach_header_64*) obj)->magic;
@@ -143,7 +151,14 @@ std::set<string> getPath(const Path & path)
     for (auto & t : resolveTree(nextPath, deps))
         paths.insert(t);
 
-    writeFile(cacheFile, concatStringsSep("\n", paths));
+    /* Write the cache file atomically: several workers may resolve
+       shared dependencies concurrently, and a reader must never see
+       a partially written file. */
+    static std::atomic<unsigned int> counter{0};
+    Path tmpFile = fmt("%s.tmp.%d.%d", cacheFile, getpid(), counter++);
+    writeFile(tmpFile, concatStringsSep("\n", paths));
+    if (rename(tmpFile.c_str(), cacheFile.c_str()) == -1)
+        throw SysError("renaming '%s' to '%s'", tmpFile, cacheFile);
 
     return paths;
 }
@@ -180,14 +195,25 @@ int main(int argc, char ** argv)
             impurePaths.insert("/usr/lib/libSystem.dylib");
         }
 
-        std::set<string> allPaths;
+        /* The impure paths are independent roots, so resolve them on
+           a worker pool. */
+        Sync<std::set<string>> allPaths_;
+
+        ThreadPool pool;
 
         for (auto & path : impurePaths)
-            for (auto & p : getPath(path))
-                allPaths.insert(p);
+            pool.enqueue([&, path]() {
+                auto paths = getPath(path);
+                auto allPaths(allPaths_.lock());
+                allPaths->insert(paths.begin(), paths.end());
+            });
+
+        pool.process();
+
+        auto allPaths(allPaths_.lock());
 
         std::cout << "extra-chroot-dirs" << std::endl;
-        for (auto & path : allPaths)
+        for (auto & path : *allPaths)
             std::cout << path << std::endl;
         std::cout << std::endl;
     });
@@ -243,6 +243,34 @@ diff -u \
     <(cat $cacheDir/debuginfo/02623eda209c26a59b1a8638ff7752f6b945c26b.debug | jq -S) \
     <(echo '{"archive":"../nar/100vxs724qr46phz8m24iswmg9p3785hsyagz0kchf6q6gf06sw6.nar","member":"lib/debug/.build-id/02/623eda209c26a59b1a8638ff7752f6b945c26b.debug"}' | jq -S)
 
+# Test content-defined chunked storage.
+clearStore
+clearCache
+clearCacheCache
+
+outPath=$(nix-build dependencies.nix --no-out-link)
+
+nix copy --to "file://$cacheDir?chunked-nars=1" $outPath
+
+# The cache should contain chunks and manifests, but no whole NARs.
+[ -n "$(ls $cacheDir/nar-chunks/*.manifest)" ]
+[ -n "$(ls $cacheDir/nar-chunks/*.chunk*)" ]
+(! ls $cacheDir/nar/* 2> /dev/null)
+
+grep -q ChunksURL $cacheDir/$(basename $outPath | cut -c1-32).narinfo
+
+# Substitution reassembles the NAR from the chunks.
+clearStore
+clearCacheCache
+
+nix-store --substituters "file://$cacheDir" --no-require-sigs -r $outPath
+
+[ -x $outPath/program ]
+
+# Copying again should upload nothing new.
+nix copy --to "file://$cacheDir?chunked-nars=1" $outPath
+
+
 # Test against issue https://github.com/NixOS/nix/issues/3964
 #
 expr='
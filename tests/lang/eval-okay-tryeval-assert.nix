@@ -0,0 +1,11 @@
+with builtins;
+
+{
+  # Chains of assertions are evaluated without exceptions.
+  x = tryEval (assert true; assert 1 == 2; "x");
+  y = tryEval (assert true; if 3 > 2 then (assert true; "y") else throw "dead");
+  # A throwing assertion condition is still caught.
+  z = tryEval (assert throw "bla"; "z");
+  # A failed tryEval leaves the thunk re-forcible.
+  w = let t = assert false; "w"; in [ (tryEval t).success (tryEval t).success ];
+}
@@ -50,6 +50,7 @@ nix_tests = \
   build.sh \
   compute-levels.sh \
   repl.sh ca/repl.sh \
+  startup-time.sh \
   ca/build.sh \
   ca/build-with-garbage-path.sh \
   ca/duplicate-realisation-in-closure.sh \
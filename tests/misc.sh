@@ -24,3 +24,10 @@ eval_stdin_res=$(echo 'let a = {} // a; in a.foo' | nix-instantiate --eval -E -
 echo $eval_stdin_res | grep "at «stdin»:1:15:"
 echo $eval_stdin_res | grep "infinite recursion encountered"
 
+# Memory limit.
+big_eval='builtins.length (builtins.attrNames (builtins.listToAttrs (map (n: { name = toString n; value = n; }) (builtins.genList (x: x) 100000))))'
+eval_mem_res=$(nix-instantiate --eval --option eval-max-memory 1000000 -E "$big_eval" 2>&1 || true)
+echo $eval_mem_res | grep "exceeded the memory limit"
+
+# The same evaluation succeeds without a limit.
+[ "$(nix-instantiate --eval -E "$big_eval")" = 100000 ]
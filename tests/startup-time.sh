@@ -0,0 +1,18 @@
+source common.sh
+
+# Crude guard against startup-time regressions: evaluating a trivial
+# expression should not take noticeably long. The default budget is
+# deliberately generous so that loaded CI machines don't produce false
+# failures; set NIX_TESTS_STARTUP_BUDGET_MS to tighten it locally.
+budget=${NIX_TESTS_STARTUP_BUDGET_MS:-2000}
+
+# Warm up caches (config parsing, dynamic loader, file system).
+expect 0 nix eval --expr '1' > /dev/null
+
+start=$(date +%s%N)
+[[ $(nix eval --expr '1') = 1 ]]
+elapsedMs=$(( ($(date +%s%N) - start) / 1000000 ))
+
+echo "nix eval --expr 1 took ${elapsedMs} ms (budget ${budget} ms)"
+
+(( elapsedMs <= budget ))